@@ -0,0 +1,206 @@
+# Copyright (C) 2014-2016 New York University
+# This file is part of ReproZip which is released under the Revised BSD License
+# See file LICENSE for full license details.
+
+"""Report plugin for reprounzip.
+
+This is not actually an unpacker, it prints the slowest syscalls, directories
+and files of the experiment from the latency histograms collected by the
+reprozip tracer (either from a pack file or the initial .rpz directory).
+
+The tracer measures a syscall from the moment it resumes the process at the
+syscall's entry to the moment it stops at its exit, and keeps histograms with 4
+buckets per power of two (so values are known to within 25%).
+"""
+
+from __future__ import division, print_function, unicode_literals
+
+import argparse
+import logging
+from rpaths import Path
+import sqlite3
+
+from reprounzip.common import RPZPack
+from reprounzip.unpackers.common import COMPAT_OK
+from reprounzip.utils import PY3, iteritems, unicode_
+
+
+def parse_histogram(histogram):
+    """Parses a histogram from the trace database.
+
+    Returns a dict mapping the lower bound of each bucket (in nanoseconds) to
+    its count.
+    """
+    buckets = {}
+    if histogram:
+        for pair in histogram.split(' '):
+            lower, count = pair.split(':')
+            buckets[int(lower)] = int(count)
+    return buckets
+
+
+def bucket_upper(lower):
+    """Gives the upper bound of the bucket with the given lower bound.
+    """
+    if lower < 1024:
+        return 1024
+    return lower + (1 << (lower.bit_length() - 3))
+
+
+def percentile(buckets, fraction):
+    """Gives an upper bound for the given percentile of a histogram.
+    """
+    total = sum(buckets.values())
+    seen = 0
+    for lower in sorted(buckets):
+        seen += buckets[lower]
+        if seen >= total * fraction:
+            return bucket_upper(lower)
+    return 0
+
+
+def format_time(ns):
+    if ns < 1000000:
+        return "%.1fus" % (ns * 1e-3)
+    elif ns < 1000000000:
+        return "%.1fms" % (ns * 1e-6)
+    else:
+        return "%.2fs" % (ns * 1e-9)
+
+
+class Latency(object):
+    """Histograms added up for a syscall or a directory.
+    """
+    def __init__(self, name):
+        self.name = name
+        self.count = 0
+        self.time = 0
+        self.buckets = {}
+
+    def add(self, count, time, histogram):
+        self.count += count
+        self.time += time
+        for lower, n in iteritems(parse_histogram(histogram)):
+            self.buckets[lower] = self.buckets.get(lower, 0) + n
+
+
+def read_latencies(database):
+    """Reads the latencies from a trace database.
+
+    Returns the list of syscalls, the list of directories (both as `Latency`
+    objects, slowest total first), and the list of the slowest individual
+    calls as (time, syscall, path) tuples, slowest first.
+    """
+    if PY3:
+        # On PY3, connect() only accepts unicode
+        conn = sqlite3.connect(str(database))
+    else:
+        conn = sqlite3.connect(database.path)
+    conn.text_factory = lambda x: unicode_(x, 'utf-8', 'replace')
+
+    schema_version, = conn.execute('PRAGMA user_version;').fetchone()
+    if schema_version < 5:
+        logging.warning("Trace has no latency information, it was recorded "
+                        "by an older version of reprozip")
+        conn.close()
+        return [], [], []
+
+    syscalls = {}
+    directories = {}
+    calls = []
+    for r_syscall, r_path, r_count, r_time, r_histogram in conn.execute(
+            '''
+            SELECT syscall, path, count, time, histogram
+            FROM syscall_latencies
+            ORDER BY id;
+            '''):
+        if r_syscall is not None and r_path is not None:
+            calls.append((r_time, r_syscall, r_path))
+            continue
+        elif r_path is None:
+            table, name = syscalls, r_syscall
+        else:
+            table, name = directories, r_path
+        try:
+            latency = table[name]
+        except KeyError:
+            latency = table[name] = Latency(name)
+        latency.add(r_count, r_time, r_histogram)
+    conn.close()
+
+    def by_time(latencies):
+        return sorted(latencies, key=lambda l: (-l.time, l.name))
+
+    return (by_time(syscalls.values()), by_time(directories.values()),
+            sorted(calls, key=lambda c: (-c[0], c[1], c[2])))
+
+
+def print_latencies(title, latencies, limit):
+    print("\n%s:" % title)
+    header = ("+----------+------------+------------+----------+----------+"
+              "----------+")
+    print(header)
+    print("|   calls  |    total   |    mean    |  median  |    99%   |"
+          "    max   |")
+    print(header)
+    for latency in latencies[:limit]:
+        print("| %8d | %10s | %10s | %8s | %8s | %8s | %s" % (
+              latency.count,
+              format_time(latency.time),
+              format_time(latency.time // max(latency.count, 1)),
+              format_time(percentile(latency.buckets, 0.5)),
+              format_time(percentile(latency.buckets, 0.99)),
+              format_time(percentile(latency.buckets, 1.0)),
+              latency.name))
+    print(header)
+
+
+def generate(database, limit=10):
+    """Prints the report for a trace database.
+    """
+    syscalls, directories, calls = read_latencies(database)
+    if not syscalls:
+        print("No latencies were recorded")
+        return
+
+    print_latencies("Slowest syscalls", syscalls, limit)
+    if directories:
+        print_latencies("Slowest directories (file syscalls)",
+                        directories, limit)
+    if calls:
+        print("\nSlowest files:")
+        for r_time, r_syscall, r_path in calls[:limit]:
+            print("    %10s %-12s %s" % (format_time(r_time), r_syscall,
+                                         r_path))
+
+
+def report(args):
+    """report subcommand.
+
+    Reads in the trace sqlite3 database and prints the slowest syscalls and
+    files.
+    """
+    if args.pack is not None:
+        rpz_pack = RPZPack(args.pack)
+        with rpz_pack.with_trace() as trace:
+            generate(trace, args.limit)
+    else:
+        generate(Path(args.dir) / 'trace.sqlite3', args.limit)
+
+
+def setup(parser, **kwargs):
+    """Prints the slowest syscalls and files from the trace data
+    """
+    parser.add_argument('-n', '--limit', type=int, default=10,
+                        help="Number of entries to show in each list "
+                        "(default: 10)")
+    parser.add_argument(
+        '-d', '--dir', default='.reprozip-trace',
+        help="where the database and configuration file are stored (default: "
+        "./.reprozip-trace)")
+    parser.add_argument(
+        'pack', nargs=argparse.OPTIONAL,
+        help="Pack to read (defaults to reading from --dir)")
+    parser.set_defaults(func=report)
+
+    return {'test_compatibility': COMPAT_OK}
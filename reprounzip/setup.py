@@ -26,6 +26,7 @@ setup(name='reprounzip',
               'info = reprounzip.pack_info:setup_info',
               'showfiles = reprounzip.pack_info:setup_showfiles',
               'graph = reprounzip.unpackers.graph:setup',
+              'report = reprounzip.unpackers.report:setup',
               'installpkgs = reprounzip.unpackers.default:setup_installpkgs',
               'directory = reprounzip.unpackers.default:setup_directory',
               'chroot = reprounzip.unpackers.default:setup_chroot']},
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,7 +9,10 @@
 #include <sqlite3.h>
 
 #include "database.h"
+#include "eventlog.h"
 #include "log.h"
+#include "stats.h"
+#include "utils.h"
 
 #define count(x) (sizeof((x))/sizeof(*(x)))
 #define check(r) do { if((r) != SQLITE_OK) { goto sqlerror; } } while(0)
@@ -31,20 +35,1057 @@ static sqlite3_uint64 gettime(void)
     return timestamp;
 }
 
-static sqlite3 *db;
-static sqlite3_stmt *stmt_last_rowid;
-static sqlite3_stmt *stmt_insert_process;
-static sqlite3_stmt *stmt_set_exitcode;
-static sqlite3_stmt *stmt_insert_file;
-static sqlite3_stmt *stmt_insert_exec;
-static sqlite3_stmt *stmt_insert_connection;
+static __thread sqlite3 *db;
 
-static int run_id = -1;
+static __thread int run_id = -1;
 
-int db_init(const char *filename)
+
+/* Rows are written with multi-row INSERT statements, binding up to
+ * BATCH_PARAMS values at a time (SQLite's limit before 3.32, later versions
+ * might be built with a lower one), so the number of rows depends on the
+ * number of columns. Values are bound as events come in, and the statement is
+ * run when all the rows are bound. The statement selects from a VALUES list
+ * (which needs SQLite 3.8.3), filtering on its first column so that unused
+ * rows can be skipped by binding it to NULL. */
+#define BATCH_PARAMS 999
+#define BATCH_MIN_SQLITE 3008003
+
+struct batch {
+    sqlite3_stmt *stmt;
+    int columns;
+    unsigned int rows;
+    unsigned int max_rows;
+};
+
+static __thread struct batch batch_process;
+static __thread struct batch batch_path;
+static __thread struct batch batch_environment;
+static __thread struct batch batch_file;
+static __thread struct batch batch_exec;
+static __thread struct batch batch_connection;
+static __thread struct batch batch_latency;
+
+static int batch_prepare(struct batch *batch, const char *insert,
+                         int columns)
+{
+    int params = sqlite3_limit(db, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+    unsigned int max_rows;
+    size_t len;
+    char *sql, *p;
+    unsigned int row;
+    int col, ret;
+    if(params > BATCH_PARAMS)
+        params = BATCH_PARAMS;
+    max_rows = params / columns;
+    len = strlen(insert) + 64 + max_rows * (columns * 2 + 3);
+    sql = p = malloc(len);
+    p += sprintf(p, "%s SELECT * FROM (VALUES ", insert);
+    for(row = 0; row < max_rows; ++row)
+    {
+        *p++ = row?',':'(';
+        if(row)
+            *p++ = '(';
+        for(col = 0; col < columns; ++col)
+        {
+            *p++ = '?';
+            *p++ = (col + 1 < columns)?',':')';
+        }
+    }
+    strcpy(p, ") WHERE column1 IS NOT NULL;");
+    ret = sqlite3_prepare_v2(db, sql, -1, &batch->stmt, NULL);
+    free(sql);
+    batch->columns = columns;
+    batch->rows = 0;
+    batch->max_rows = max_rows;
+    return ret;
+}
+
+/* Index of the first parameter for the next row */
+#define batch_param(batch) ((int)((batch)->rows * (batch)->columns + 1))
+
+static int batch_flush(struct batch *batch)
+{
+    unsigned int row;
+    if(batch->rows == 0)
+        return SQLITE_OK;
+    for(row = batch->rows; row < batch->max_rows; ++row)
+    {
+        int ret = sqlite3_bind_null(batch->stmt,
+                                    (int)(row * batch->columns + 1));
+        if(ret != SQLITE_OK)
+            return ret;
+    }
+    batch->rows = 0;
+    /* sqlite3_reset() returns the error from sqlite3_step(), if any */
+    sqlite3_step(batch->stmt);
+    return sqlite3_reset(batch->stmt);
+}
+
+static int batch_next_row(struct batch *batch)
+{
+    if(++batch->rows == batch->max_rows)
+        return batch_flush(batch);
+    return SQLITE_OK;
+}
+
+
+/* Processes are kept in memory until db_close(), so that the exit status can
+ * be filled in without an UPDATE; their ids are assigned here rather than by
+ * SQLite. */
+#define DB_NO_PARENT ((unsigned int)-2)
+
+struct db_process {
+    unsigned int parent;
+    int is_thread;
+    sqlite3_uint64 timestamp;
+    int exited;
+    sqlite3_uint64 exit_timestamp;
+    struct db_usage usage;
+    int exitcode;
+};
+
+static __thread struct db_process *processes = NULL;
+static __thread size_t processes_count, processes_size;
+static __thread unsigned int first_process_id;
+
+/* Version 1: paths are interned in the paths table, opened_files is a view
+ * Version 2: environments are interned in the environments table
+ * Version 3: repeated accesses are only stored once, with
+ *            file_accesses.last_timestamp and hits
+ * Version 4: the tracer's own counters are stored in tracer_stats
+ * Version 5: syscall latency histograms are stored in syscall_latencies
+ * Version 6: the resources used by processes are stored in processes
+ * Version 7: the bytes read and written through opened files are stored in
+ *            file_accesses.bytes_read and bytes_written */
+#define DB_SCHEMA_VERSION 7
+#define DB_SET_SCHEMA_VERSION "PRAGMA user_version = 7;"
+
+#define TRACER_STATS_TABLE \
+    "CREATE TABLE tracer_stats(" \
+    "    id INTEGER NOT NULL PRIMARY KEY," \
+    "    run_id INTEGER NOT NULL," \
+    "    name TEXT NOT NULL," \
+    "    syscall TEXT NULL," \
+    "    count INTEGER NOT NULL," \
+    "    time INTEGER NULL" \
+    "    );"
+
+/* Rows with a syscall and no path are the histograms of the syscalls, rows
+ * with a path and no syscall the ones of directories, and rows with both are
+ * the slowest calls, see latency.h */
+#define SYSCALL_LATENCIES_TABLE \
+    "CREATE TABLE syscall_latencies(" \
+    "    id INTEGER NOT NULL PRIMARY KEY," \
+    "    run_id INTEGER NOT NULL," \
+    "    process INTEGER NOT NULL," \
+    "    syscall TEXT NULL," \
+    "    path TEXT NULL," \
+    "    count INTEGER NOT NULL," \
+    "    time INTEGER NOT NULL," \
+    "    histogram TEXT NULL" \
+    "    );"
+
+#define OPENED_FILES_VIEW \
+    "CREATE VIEW opened_files AS " \
+    "SELECT f.id AS id, f.run_id AS run_id, p.name AS name, " \
+    "        f.timestamp AS timestamp, f.mode AS mode, " \
+    "        f.is_directory AS is_directory, f.process AS process, " \
+    "        f.bytes_read AS bytes_read, f.bytes_written AS bytes_written " \
+    "FROM file_accesses f " \
+    "INNER JOIN paths p ON p.id = f.path;"
+
+static const char *indexes[] = {
+    "CREATE INDEX proc_parent_idx ON processes(parent);",
+    "CREATE INDEX open_proc_idx ON file_accesses(process);",
+    "CREATE INDEX exec_proc_idx ON executed_files(process);",
+    "CREATE INDEX connections_proc_idx ON connections(process);",
+    "CREATE INDEX latencies_proc_idx ON syscall_latencies(process);",
+};
+
+/* Paths and environments are stored once, in the paths and environments
+ * tables, and referenced by id. These hash tables map the values we know to
+ * their id. */
+struct intern_entry {
+    char *data;             /* NULL if the slot is empty */
+    size_t len;
+    unsigned int hash;
+    unsigned int id;
+};
+
+struct intern_table {
+    struct intern_entry *entries;
+    size_t size, count;     /* size is a power of two */
+    unsigned int next_id;
+};
+
+static __thread struct intern_table paths;
+static __thread struct intern_table environments;
+
+static unsigned int intern_hash(const char *data, size_t len)
+{
+    /* FNV-1a */
+    unsigned int hash = 2166136261u;
+    const unsigned char *p = (const unsigned char*)data;
+    const unsigned char *end = p + len;
+    for(; p < end; ++p)
+    {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct intern_entry *intern_slot(struct intern_table *table,
+                                        const char *data, size_t len,
+                                        unsigned int hash)
+{
+    size_t mask = table->size - 1;
+    size_t i = hash & mask;
+    struct intern_entry *entries = table->entries;
+    while(entries[i].data != NULL
+     && (entries[i].hash != hash || entries[i].len != len
+      || memcmp(entries[i].data, data, len) != 0))
+        i = (i + 1) & mask;
+    return &entries[i];
+}
+
+static void intern_init(struct intern_table *table, size_t size)
+{
+    table->entries = calloc(size, sizeof(*table->entries));
+    table->size = size;
+    table->count = 0;
+    table->next_id = 1;
+}
+
+/* Adds a value, taking ownership of the data buffer */
+static void intern_add(struct intern_table *table, char *data, size_t len,
+                       unsigned int hash, unsigned int id)
+{
+    struct intern_entry *entry;
+    if((table->count + 1) * 2 > table->size)
+    {
+        struct intern_entry *old = table->entries;
+        size_t i, old_size = table->size;
+        table->size *= 2;
+        table->entries = calloc(table->size, sizeof(*table->entries));
+        for(i = 0; i < old_size; ++i)
+            if(old[i].data != NULL)
+                *intern_slot(table, old[i].data, old[i].len,
+                             old[i].hash) = old[i];
+        free(old);
+    }
+    entry = intern_slot(table, data, len, hash);
+    entry->data = data;
+    entry->len = len;
+    entry->hash = hash;
+    entry->id = id;
+    ++table->count;
+    if(id >= table->next_id)
+        table->next_id = id + 1;
+}
+
+static void intern_free(struct intern_table *table)
+{
+    size_t i;
+    for(i = 0; i < table->size; ++i)
+        free(table->entries[i].data);
+    free(table->entries);
+    table->entries = NULL;
+}
+
+/* Fills a table from the rows (id, value) returned by a query */
+static int intern_load(struct intern_table *table, const char *sql)
+{
+    int ret;
+    sqlite3_stmt *stmt;
+    check(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL));
+    while((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        unsigned int id = sqlite3_column_int(stmt, 0);
+        const char *value = (const char*)sqlite3_column_blob(stmt, 1);
+        size_t len = sqlite3_column_bytes(stmt, 1);
+        char *data = malloc(len + 1);
+        memcpy(data, value, len);
+        data[len] = '\0';
+        intern_add(table, data, len, intern_hash(data, len), id);
+    }
+    sqlite3_finalize(stmt);
+    if(ret != SQLITE_DONE)
+        goto sqlerror;
+    return 0;
+
+sqlerror:
+    return -1;
+}
+
+/* Gets the id for a path, inserting it into the paths table if needed */
+static int intern_path(const char *name, unsigned int *id)
+{
+    size_t len = strlen(name);
+    unsigned int hash = intern_hash(name, len);
+    struct intern_entry *entry = intern_slot(&paths, name, len, hash);
+    if(entry->data == NULL)
+    {
+        sqlite3_stmt *stmt = batch_path.stmt;
+        int p = batch_param(&batch_path);
+        *id = paths.next_id;
+        intern_add(&paths, strdup(name), len, hash, *id);
+        check(sqlite3_bind_int(stmt, p, *id));
+        check(sqlite3_bind_text(stmt, p + 1, name, len, SQLITE_TRANSIENT));
+        check(batch_next_row(&batch_path));
+    }
+    else
+        *id = entry->id;
+    return 0;
+
+sqlerror:
+    return -1;
+}
+
+/* Gets the id for an environment, inserting it into the environments table
+ * if needed. Takes ownership of envp. */
+static int intern_environment(char *envp, size_t envp_len, unsigned int *id)
+{
+    unsigned int hash = intern_hash(envp, envp_len);
+    struct intern_entry *entry = intern_slot(&environments,
+                                             envp, envp_len, hash);
+    if(entry->data == NULL)
+    {
+        sqlite3_stmt *stmt = batch_environment.stmt;
+        int p = batch_param(&batch_environment);
+        *id = environments.next_id;
+        intern_add(&environments, envp, envp_len, hash, *id);
+        /* The table keeps the buffer until after the last flush */
+        check(sqlite3_bind_int(stmt, p, *id));
+        check(sqlite3_bind_text(stmt, p + 1, envp, envp_len, SQLITE_STATIC));
+        check(batch_next_row(&batch_environment));
+    }
+    else
+    {
+        *id = entry->id;
+        free(envp);
+    }
+    return 0;
+
+sqlerror:
+    return -1;
+}
+
+static int write_file_open(unsigned int id, unsigned int process,
+                           const char *name, sqlite3_uint64 timestamp,
+                           unsigned int mode, int is_dir)
+{
+    sqlite3_stmt *stmt = batch_file.stmt;
+    int p = batch_param(&batch_file);
+    unsigned int path;
+    if(intern_path(name, &path) != 0)
+        goto sqlerror;
+    check(sqlite3_bind_int(stmt, p, id));
+    check(sqlite3_bind_int(stmt, p + 1, run_id));
+    check(sqlite3_bind_int(stmt, p + 2, path));
+    /* This assumes that we won't go over 2^32 seconds (~135 years) */
+    check(sqlite3_bind_int64(stmt, p + 3, timestamp));
+    check(sqlite3_bind_int64(stmt, p + 4, timestamp));
+    check(sqlite3_bind_int(stmt, p + 5, 1));
+    check(sqlite3_bind_int(stmt, p + 6, mode));
+    check(sqlite3_bind_int(stmt, p + 7, is_dir));
+    check(sqlite3_bind_int(stmt, p + 8, process));
+
+    check(batch_next_row(&batch_file));
+    return 0;
+
+sqlerror:
+    return -1;
+}
+
+/* Sets the last timestamp and number of hits of a file access that was
+ * repeated */
+static __thread sqlite3_stmt *stmt_set_hits;
+static __thread sqlite3_stmt *stmt_set_io;
+static __thread sqlite3_stmt *stmt_add_stat;
+
+static int write_hits(unsigned int id, sqlite3_uint64 last_timestamp,
+                      unsigned int hits)
+{
+    /* The row might still be in the batch */
+    check(batch_flush(&batch_file));
+    check(sqlite3_bind_int64(stmt_set_hits, 1, last_timestamp));
+    check(sqlite3_bind_int(stmt_set_hits, 2, hits));
+    check(sqlite3_bind_int(stmt_set_hits, 3, id));
+    if(sqlite3_step(stmt_set_hits) != SQLITE_DONE)
+    {
+        sqlite3_reset(stmt_set_hits);
+        goto sqlerror;
+    }
+    check(sqlite3_reset(stmt_set_hits));
+    return 0;
+
+sqlerror:
+    return -1;
+}
+
+/* Sets the bytes read and written through a file access */
+static int write_io(unsigned int id, sqlite3_uint64 read,
+                    sqlite3_uint64 written)
+{
+    check(batch_flush(&batch_file));
+    check(sqlite3_bind_int64(stmt_set_io, 1, read));
+    check(sqlite3_bind_int64(stmt_set_io, 2, written));
+    check(sqlite3_bind_int(stmt_set_io, 3, id));
+    if(sqlite3_step(stmt_set_io) != SQLITE_DONE)
+    {
+        sqlite3_reset(stmt_set_io);
+        goto sqlerror;
+    }
+    check(sqlite3_reset(stmt_set_io));
+    return 0;
+
+sqlerror:
+    return -1;
+}
+
+static int write_exec(unsigned int process, const char *binary,
+                      sqlite3_uint64 timestamp,
+                      char *argv, size_t argv_len,
+                      char *envp, size_t envp_len,
+                      const char *workingdir)
+{
+    sqlite3_stmt *stmt = batch_exec.stmt;
+    int p = batch_param(&batch_exec);
+    unsigned int environment;
+    /* argv is already NUL-separated; SQLite frees it once the batch has been
+     * written (or if binding fails) */
+    if(sqlite3_bind_text(stmt, p + 4, argv, argv_len, free) != SQLITE_OK)
+    {
+        free(envp);
+        goto sqlerror;
+    }
+    if(intern_environment(envp, envp_len, &environment) != 0)
+        goto sqlerror;
+    check(sqlite3_bind_int(stmt, p + 5, environment));
+    check(sqlite3_bind_int(stmt, p, run_id));
+    check(sqlite3_bind_text(stmt, p + 1, binary, -1, SQLITE_TRANSIENT));
+    /* This assumes that we won't go over 2^32 seconds (~135 years) */
+    check(sqlite3_bind_int64(stmt, p + 2, timestamp));
+    check(sqlite3_bind_int(stmt, p + 3, process));
+    check(sqlite3_bind_text(stmt, p + 6, workingdir, -1, SQLITE_TRANSIENT));
+
+    check(batch_next_row(&batch_exec));
+    return 0;
+
+sqlerror:
+    return -1;
+}
+
+static int write_connection(unsigned int process, sqlite3_uint64 timestamp,
+                            int inbound, const char *family,
+                            const char *protocol, const char *address)
+{
+    sqlite3_stmt *stmt = batch_connection.stmt;
+    int p = batch_param(&batch_connection);
+    check(sqlite3_bind_int(stmt, p, run_id));
+    check(sqlite3_bind_int64(stmt, p + 1, timestamp));
+    check(sqlite3_bind_int(stmt, p + 2, process));
+    check(sqlite3_bind_int(stmt, p + 3, inbound?1:0));
+    if(family == NULL)
+        check(sqlite3_bind_null(stmt, p + 4));
+    else
+        check(sqlite3_bind_text(stmt, p + 4, family, -1, SQLITE_TRANSIENT));
+    if(protocol == NULL)
+        check(sqlite3_bind_null(stmt, p + 5));
+    else
+        check(sqlite3_bind_text(stmt, p + 5, protocol, -1, SQLITE_TRANSIENT));
+    if(address == NULL)
+        check(sqlite3_bind_null(stmt, p + 6));
+    else
+        check(sqlite3_bind_text(stmt, p + 6, address, -1, SQLITE_TRANSIENT));
+
+    check(batch_next_row(&batch_connection));
+    return 0;
+
+sqlerror:
+    return -1;
+}
+
+static int write_latency(unsigned int process, const char *syscall,
+                         const char *path, unsigned int count,
+                         sqlite3_uint64 time, const char *histogram)
+{
+    sqlite3_stmt *stmt = batch_latency.stmt;
+    int p = batch_param(&batch_latency);
+    check(sqlite3_bind_int(stmt, p, run_id));
+    check(sqlite3_bind_int(stmt, p + 1, process));
+    if(syscall == NULL)
+        check(sqlite3_bind_null(stmt, p + 2));
+    else
+        check(sqlite3_bind_text(stmt, p + 2, syscall, -1, SQLITE_TRANSIENT));
+    if(path == NULL)
+        check(sqlite3_bind_null(stmt, p + 3));
+    else
+        check(sqlite3_bind_text(stmt, p + 3, path, -1, SQLITE_TRANSIENT));
+    check(sqlite3_bind_int(stmt, p + 4, count));
+    check(sqlite3_bind_int64(stmt, p + 5, time));
+    if(histogram == NULL)
+        check(sqlite3_bind_null(stmt, p + 6));
+    else
+        check(sqlite3_bind_text(stmt, p + 6, histogram, -1,
+                                SQLITE_TRANSIENT));
+
+    check(batch_next_row(&batch_latency));
+    return 0;
+
+sqlerror:
+    return -1;
+}
+
+/* Writes a counter of the tracer, see stats_foreach() */
+static int write_stat(const char *name, const char *syscall,
+                      unsigned long long count, long long time, void *data)
+{
+    (void)data;
+    check(sqlite3_bind_int(stmt_add_stat, 1, run_id));
+    check(sqlite3_bind_text(stmt_add_stat, 2, name, -1, SQLITE_TRANSIENT));
+    if(syscall == NULL)
+        check(sqlite3_bind_null(stmt_add_stat, 3));
+    else
+        check(sqlite3_bind_text(stmt_add_stat, 3, syscall, -1,
+                                SQLITE_TRANSIENT));
+    check(sqlite3_bind_int64(stmt_add_stat, 4, (sqlite3_int64)count));
+    if(time < 0)
+        check(sqlite3_bind_null(stmt_add_stat, 5));
+    else
+        check(sqlite3_bind_int64(stmt_add_stat, 5, time));
+    if(sqlite3_step(stmt_add_stat) != SQLITE_DONE)
+    {
+        sqlite3_reset(stmt_add_stat);
+        goto sqlerror;
+    }
+    check(sqlite3_reset(stmt_add_stat));
+    return 0;
+
+sqlerror:
+    return -1;
+}
+
+
+/* ********************
+ * Writer thread
+ *
+ * When enabled, the db_add_*() functions only append a record to a
+ * single-producer single-consumer ring buffer, and a separate thread does the
+ * SQLite work, so that it doesn't happen while the tracee is stopped. The
+ * producer blocks if the ring is full.
+ */
+
+#define RING_SIZE ((size_t)1 << 20)    /* Power of two */
+
+#define REC_PAD         0   /* Skip to the start of the ring */
+#define REC_FILE        1
+#define REC_EXEC        2
+#define REC_CONNECTION  3
+#define REC_STOP        4
+#define REC_LATENCY     5
+
+#define REC_NULL_STRING ((unsigned int)-1)
+
+/* Records are followed by their strings, and aligned on 8 bytes */
+struct record {
+    unsigned int type;
+    unsigned int size;
+    sqlite3_uint64 timestamp;
+    unsigned int process;
+    unsigned int mode;          /* REC_FILE: mode, REC_CONNECTION: inbound,
+                                 * REC_LATENCY: count (timestamp is the
+                                 * time) */
+    int is_dir;
+    unsigned int id;            /* REC_FILE: id of the row */
+    unsigned int lengths[3];    /* Including the NUL, or REC_NULL_STRING */
+    char *argv, *envp;          /* REC_EXEC: buffers owned by the record */
+    size_t argv_len, envp_len;
+};
+
+/* The state used by the SQLite code is thread-local like the rest; the writer
+ * thread takes it over while it runs, and gives it back when it stops */
+struct sql_state {
+    sqlite3 *db;
+    int run_id;
+    struct batch batch_process, batch_path, batch_environment, batch_file,
+                 batch_exec, batch_connection, batch_latency;
+    sqlite3_stmt *stmt_set_hits, *stmt_set_io;
+    struct intern_table paths, environments;
+};
+
+static void sql_state_save(struct sql_state *state)
+{
+    state->db = db;
+    state->run_id = run_id;
+    state->batch_process = batch_process;
+    state->batch_path = batch_path;
+    state->batch_environment = batch_environment;
+    state->batch_file = batch_file;
+    state->batch_exec = batch_exec;
+    state->batch_connection = batch_connection;
+    state->batch_latency = batch_latency;
+    state->stmt_set_hits = stmt_set_hits;
+    state->stmt_set_io = stmt_set_io;
+    state->paths = paths;
+    state->environments = environments;
+}
+
+static void sql_state_load(const struct sql_state *state)
+{
+    db = state->db;
+    run_id = state->run_id;
+    batch_process = state->batch_process;
+    batch_path = state->batch_path;
+    batch_environment = state->batch_environment;
+    batch_file = state->batch_file;
+    batch_exec = state->batch_exec;
+    batch_connection = state->batch_connection;
+    batch_latency = state->batch_latency;
+    stmt_set_hits = state->stmt_set_hits;
+    stmt_set_io = state->stmt_set_io;
+    paths = state->paths;
+    environments = state->environments;
+}
+
+/* Shared by the tracer thread and its writer */
+struct writer_ring {
+    char *buffer;
+    /* Free-running offsets, each only written by one side */
+    size_t head, tail;
+    int producer_waiting, writer_waiting;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    pthread_t thread;
+    int failed;
+    /* The writer doesn't log, the tracer thread reports this */
+    char error[512];
+    struct sql_state sql;
+};
+
+static __thread struct writer_ring *ring = NULL;
+
+static void writer_free(void);
+
+#define ring_load(v) __atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define ring_store(v, x) __atomic_store_n(&(v), (x), __ATOMIC_SEQ_CST)
+
+static void ring_wake(void)
+{
+    pthread_mutex_lock(&ring->mutex);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+/* Producer side: waits until the ring has `needed` free bytes */
+static void ring_wait_space(size_t needed)
+{
+    while(RING_SIZE - (ring->head - ring_load(ring->tail)) < needed)
+    {
+        pthread_mutex_lock(&ring->mutex);
+        ring_store(ring->producer_waiting, 1);
+        if(RING_SIZE - (ring->head - ring_load(ring->tail)) < needed)
+            pthread_cond_wait(&ring->cond, &ring->mutex);
+        ring_store(ring->producer_waiting, 0);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+}
+
+/* Writer side: waits until the ring is not empty. The producer only wakes us
+ * up once the ring is filling up, so that it doesn't have to signal for every
+ * record; otherwise we poll. */
+#define RING_WAKE_THRESHOLD (RING_SIZE / 4)
+#define RING_POLL_NS 10000000   /* 10ms */
+
+static void ring_wait_data(void)
+{
+    while(ring_load(ring->head) == ring->tail)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += RING_POLL_NS;
+        if(deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&ring->mutex);
+        ring_store(ring->writer_waiting, 1);
+        if(ring_load(ring->head) == ring->tail)
+            pthread_cond_timedwait(&ring->cond, &ring->mutex, &deadline);
+        ring_store(ring->writer_waiting, 0);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+}
+
+static void ring_push(struct record *rec, const char *const strings[3])
+{
+    size_t size = sizeof(*rec);
+    size_t offset = ring->head & (RING_SIZE - 1);
+    size_t pad = 0;
+    char *p;
+    int i;
+    for(i = 0; i < 3; ++i)
+        if(rec->lengths[i] != REC_NULL_STRING)
+            size += rec->lengths[i];
+    size = (size + 7) & ~(size_t)7;
+    rec->size = size;
+    if(offset + size > RING_SIZE)
+        pad = RING_SIZE - offset;
+    ring_wait_space(pad + size);
+    if(pad)
+    {
+        /* Doesn't fit before the end, skip to the start */
+        struct record *pad_rec = (struct record*)(ring->buffer + offset);
+        pad_rec->type = REC_PAD;
+        pad_rec->size = pad;
+        offset = 0;
+    }
+    p = ring->buffer + offset;
+    memcpy(p, rec, sizeof(*rec));
+    p += sizeof(*rec);
+    for(i = 0; i < 3; ++i)
+        if(rec->lengths[i] != REC_NULL_STRING)
+        {
+            memcpy(p, strings[i], rec->lengths[i]);
+            p += rec->lengths[i];
+        }
+    ring_store(ring->head, ring->head + pad + size);
+    if(ring_load(ring->writer_waiting)
+     && (rec->type == REC_STOP
+      || ring->head - ring_load(ring->tail) >= RING_WAKE_THRESHOLD))
+        ring_wake();
+}
+
+static int writer_record(const struct record *rec)
+{
+    const char *strings[3];
+    const char *p = (const char*)(rec + 1);
+    int i;
+    for(i = 0; i < 3; ++i)
+    {
+        if(rec->lengths[i] == REC_NULL_STRING)
+            strings[i] = NULL;
+        else
+        {
+            strings[i] = p;
+            p += rec->lengths[i];
+        }
+    }
+    switch(rec->type)
+    {
+    case REC_FILE:
+        if(write_file_open(rec->id, rec->process, strings[0], rec->timestamp,
+                           rec->mode, rec->is_dir) != 0)
+            return -1;
+        break;
+    case REC_EXEC:
+        if(write_exec(rec->process, strings[0], rec->timestamp,
+                      rec->argv, rec->argv_len, rec->envp, rec->envp_len,
+                      strings[1]) != 0)
+            return -1;
+        break;
+    case REC_CONNECTION:
+        if(write_connection(rec->process, rec->timestamp, rec->mode,
+                            strings[0], strings[1], strings[2]) != 0)
+            return -1;
+        break;
+    case REC_LATENCY:
+        if(write_latency(rec->process, strings[0], strings[1], rec->mode,
+                         rec->timestamp, strings[2]) != 0)
+            return -1;
+        break;
+    }
+    return 0;
+}
+
+static void *writer_main(void *arg)
+{
+    size_t tail;
+    ring = arg;
+    sql_state_load(&ring->sql);
+    tail = ring->tail;
+    for(;;)
+    {
+        const struct record *rec;
+        unsigned int type;
+        ring_wait_data();
+        rec = (const struct record*)(ring->buffer + (tail & (RING_SIZE - 1)));
+        type = rec->type;
+        if(ring->failed)
+        {
+            /* Drain, so the tracer doesn't block */
+            if(type == REC_EXEC)
+            {
+                free(rec->argv);
+                free(rec->envp);
+            }
+        }
+        else if(writer_record(rec) != 0)
+        {
+            /* LCOV_EXCL_START : Insertions shouldn't fail */
+            snprintf(ring->error, sizeof(ring->error),
+                     "sqlite3 error inserting %s: %s",
+                     type == REC_FILE?"file":
+                     type == REC_EXEC?"exec":
+                     type == REC_LATENCY?"latency":"network connection",
+                     sqlite3_errmsg(db));
+            ring_store(ring->failed, 1);
+            /* LCOV_EXCL_END */
+        }
+        tail += rec->size;
+        ring_store(ring->tail, tail);
+        if(ring_load(ring->producer_waiting))
+            ring_wake();
+        if(type == REC_STOP)
+        {
+            sql_state_save(&ring->sql);
+            return NULL;
+        }
+    }
+}
+
+static int writer_start(void)
+{
+    sigset_t all, old;
+    int err;
+    ring = malloc(sizeof(*ring));
+    ring->buffer = malloc(RING_SIZE);
+    ring->head = ring->tail = 0;
+    ring->producer_waiting = ring->writer_waiting = 0;
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+    ring->failed = 0;
+    sql_state_save(&ring->sql);
+    /* Signals are for the tracer thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&ring->thread, NULL, writer_main, ring);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(err != 0)
+    {
+        /* LCOV_EXCL_START */
+        log_critical(0, "couldn't start database writer thread: %s",
+                     strerror(err));
+        writer_free();
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    return 0;
+}
+
+/* Makes the writer drain the ring and exit, and takes the SQLite state back */
+static int writer_stop(void)
+{
+    struct record rec;
+    const char *strings[3] = {NULL, NULL, NULL};
+    rec.type = REC_STOP;
+    rec.lengths[0] = rec.lengths[1] = rec.lengths[2] = REC_NULL_STRING;
+    ring_push(&rec, strings);
+    pthread_join(ring->thread, NULL);
+    sql_state_load(&ring->sql);
+    return ring->failed?-1:0;
+}
+
+static void writer_free(void)
+{
+    pthread_mutex_destroy(&ring->mutex);
+    pthread_cond_destroy(&ring->cond);
+    free(ring->buffer);
+    free(ring);
+    ring = NULL;
+}
+
+static int writer_check(void)
+{
+    if(ring_load(ring->failed))
+    {
+        /* LCOV_EXCL_START : Insertions shouldn't fail */
+        log_critical(0, "%s", ring->error);
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    return 0;
+}
+
+
+/* ********************
+ * Repeated accesses
+ *
+ * Programs often access the same files over and over. Only the first access
+ * in a given mode by a process gets a row; the following ones only update
+ * the last timestamp and number of hits, which are written in db_close().
+ */
+
+struct access_entry {
+    char *name;                 /* NULL if the slot is empty */
+    unsigned int hash;
+    unsigned int process;
+    unsigned int mode;
+    unsigned int row;           /* Numbered from 0 in this run */
+    unsigned int hits;
+    sqlite3_uint64 last_timestamp;
+    long long bytes_read, bytes_written;    /* -1 if not measured */
+};
+
+static __thread struct access_entry *accesses = NULL;
+static __thread size_t accesses_size, accesses_count;
+static __thread unsigned int first_file_id;
+
+static struct access_entry *access_slot(unsigned int process,
+                                        const char *name, unsigned int mode,
+                                        unsigned int hash)
+{
+    size_t mask = accesses_size - 1;
+    size_t i = hash & mask;
+    while(accesses[i].name != NULL
+     && (accesses[i].hash != hash || accesses[i].process != process
+      || accesses[i].mode != mode || strcmp(accesses[i].name, name) != 0))
+        i = (i + 1) & mask;
+    return &accesses[i];
+}
+
+/* Returns 1 if the process already accessed this path in this mode. Else,
+ * remembers it and sets the number of its row. */
+static int access_seen(unsigned int process, const char *name,
+                       unsigned int mode, sqlite3_uint64 timestamp,
+                       unsigned int *row)
+{
+    unsigned int hash = intern_hash(name, strlen(name));
+    struct access_entry *entry;
+    hash = (hash ^ process) * 16777619u;
+    hash = (hash ^ mode) * 16777619u;
+    entry = access_slot(process, name, mode, hash);
+    if(entry->name != NULL)
+    {
+        ++entry->hits;
+        entry->last_timestamp = timestamp;
+        return 1;
+    }
+    if((accesses_count + 1) * 2 > accesses_size)
+    {
+        struct access_entry *old = accesses;
+        size_t i, old_size = accesses_size;
+        accesses_size *= 2;
+        accesses = calloc(accesses_size, sizeof(*accesses));
+        for(i = 0; i < old_size; ++i)
+            if(old[i].name != NULL)
+                *access_slot(old[i].process, old[i].name, old[i].mode,
+                             old[i].hash) = old[i];
+        free(old);
+        entry = access_slot(process, name, mode, hash);
+    }
+    entry->name = strdup(name);
+    entry->hash = hash;
+    entry->process = process;
+    entry->mode = mode;
+    entry->row = *row = accesses_count++;
+    entry->hits = 1;
+    entry->last_timestamp = timestamp;
+    entry->bytes_read = entry->bytes_written = -1;
+    return 0;
+}
+
+/* Finds the entry of a file access, NULL if it wasn't recorded */
+static struct access_entry *access_find(unsigned int process,
+                                        const char *name, unsigned int mode)
+{
+    unsigned int hash = intern_hash(name, strlen(name));
+    struct access_entry *entry;
+    if(accesses == NULL)
+        return NULL;
+    hash = (hash ^ process) * 16777619u;
+    hash = (hash ^ mode) * 16777619u;
+    entry = access_slot(process, name, mode, hash);
+    return entry->name == NULL?NULL:entry;
+}
+
+static void accesses_free(void)
+{
+    size_t i;
+    for(i = 0; i < accesses_size; ++i)
+        free(accesses[i].name);
+    free(accesses);
+    accesses = NULL;
+}
+
+
+/* ********************
+ * Event log
+ *
+ * With DB_EVENT_LOG, the db_add_*() functions append records to a binary log
+ * instead (see eventlog.h), and db_convert_event_log() writes the trace
+ * database from it after the run. Processes are numbered from 0 in the log.
+ */
+
+static __thread int event_log = 0;
+
+static void event_init(struct event *event, uint32_t type,
+                       unsigned int process)
+{
+    size_t i;
+    memset(event, 0, sizeof(*event));
+    event->type = type;
+    event->timestamp = gettime();
+    event->process = process;
+    for(i = 0; i < EV_STRINGS; ++i)
+        event->lengths[i] = EV_NULL_STRING;
+}
+
+static void event_string(struct event *event, const char **strings, int i,
+                         const char *str)
+{
+    strings[i] = str;
+    if(str != NULL)
+        event->lengths[i] = strlen(str) + 1;
+}
+
+/* Logs a counter of the tracer, see stats_foreach() */
+static int event_stat(const char *name, const char *syscall,
+                      unsigned long long count, long long time, void *data)
+{
+    struct event event;
+    const char *strings[EV_STRINGS];
+    (void)data;
+    event_init(&event, EV_STATS, 0);
+    event.timestamp = time < 0?0:(uint64_t)time;
+    event.args[0] = (uint32_t)count;
+    event.args[1] = (uint32_t)(count >> 32);
+    event.args[2] = time >= 0;
+    event_string(&event, strings, 0, name);
+    event_string(&event, strings, 1, syscall);
+    return eventlog_write(&event, strings);
+}
+
+
+int db_init(const char *filename, unsigned int flags)
 {
     int tables_exist;
+    int schema_version = DB_SCHEMA_VERSION;
+    /* The tables tell us the range of possible schema versions */
+    int max_version = DB_SCHEMA_VERSION;
+
+    accesses_count = 0;
+    accesses_size = 1024;
+    accesses = calloc(accesses_size, sizeof(*accesses));
 
+    if(flags & DB_EVENT_LOG)
+    {
+        if(eventlog_open(filename) != 0)
+            return -1;
+        event_log = 1;
+        processes_count = 0;
+        return 0;
+    }
+
+    if(sqlite3_libversion_number() < BATCH_MIN_SQLITE)
+    {
+        log_critical(0, "SQLite %s is too old, 3.8.3 or later is needed",
+                     sqlite3_libversion());
+        return -1;
+    }
     check(sqlite3_open(filename, &db));
     log_debug(0, "database file opened: %s", filename);
 
@@ -70,13 +1111,48 @@ int db_init(const char *filename)
                 found |= 0x04;
             else if(strcmp("connections", colname) == 0)
                 found |= 0x08;
+            else if(strcmp("paths", colname) == 0)
+                found |= 0x10;
+            else if(strcmp("file_accesses", colname) == 0)
+                found |= 0x20;
+            else if(strcmp("environments", colname) == 0)
+                found |= 0x40;
+            else if(strcmp("tracer_stats", colname) == 0)
+                found |= 0x80;
+            else if(strcmp("syscall_latencies", colname) == 0)
+                found |= 0x100;
             else
                 goto wrongschema;
         }
         if(found == 0x00)
             tables_exist = 0;
         else if(found == 0x0F)
+        {
+            /* opened_files is a table, from before paths were interned */
+            tables_exist = 1;
+            schema_version = 0;
+        }
+        else if(found == 0x3D)
+        {
+            tables_exist = 1;
+            schema_version = max_version = 1;
+        }
+        else if(found == 0x7D)
+        {
+            tables_exist = 1;
+            schema_version = 2;
+            max_version = 3;
+        }
+        else if(found == 0xFD)
+        {
             tables_exist = 1;
+            schema_version = max_version = 4;
+        }
+        else if(found == 0x1FD)
+        {
+            tables_exist = 1;
+            schema_version = 5;
+        }
         else
         {
         wrongschema:
@@ -88,6 +1164,27 @@ int db_init(const char *filename)
             goto sqlerror;
     }
 
+    if(tables_exist && schema_version > 0)
+    {
+        int min_version = schema_version;
+        sqlite3_stmt *stmt_get_version;
+        const char *sql = "PRAGMA user_version;";
+        check(sqlite3_prepare_v2(db, sql, -1, &stmt_get_version, NULL));
+        if(sqlite3_step(stmt_get_version) != SQLITE_ROW)
+        {
+            sqlite3_finalize(stmt_get_version);
+            goto sqlerror;
+        }
+        schema_version = sqlite3_column_int(stmt_get_version, 0);
+        sqlite3_finalize(stmt_get_version);
+        if(schema_version < min_version || schema_version > max_version)
+        {
+            log_critical(0, "database schema version %d is not supported",
+                         schema_version);
+            return -1;
+        }
+    }
+
     if(!tables_exist)
     {
         const char *sql[] = {
@@ -99,19 +1196,34 @@ int db_init(const char *filename)
             "    exit_timestamp INTEGER,"
             "    cpu_time INTEGER,"
             "    is_thread BOOLEAN NOT NULL,"
-            "    exitcode INTEGER"
+            "    exitcode INTEGER,"
+            "    system_time INTEGER,"
+            "    max_rss INTEGER,"
+            "    voluntary_switches INTEGER,"
+            "    involuntary_switches INTEGER,"
+            "    block_reads INTEGER,"
+            "    block_writes INTEGER,"
+            "    io_read INTEGER,"
+            "    io_write INTEGER"
             "    );",
-            "CREATE INDEX proc_parent_idx ON processes(parent);",
-            "CREATE TABLE opened_files("
+            "CREATE TABLE paths("
+            "    id INTEGER NOT NULL PRIMARY KEY,"
+            "    name TEXT NOT NULL UNIQUE"
+            "    );",
+            "CREATE TABLE file_accesses("
             "    id INTEGER NOT NULL PRIMARY KEY,"
             "    run_id INTEGER NOT NULL,"
-            "    name TEXT NOT NULL,"
+            "    path INTEGER NOT NULL,"
             "    timestamp INTEGER NOT NULL,"
             "    mode INTEGER NOT NULL,"
             "    is_directory BOOLEAN NOT NULL,"
-            "    process INTEGER NOT NULL"
+            "    process INTEGER NOT NULL,"
+            "    last_timestamp INTEGER,"
+            "    hits INTEGER NOT NULL DEFAULT 1,"
+            "    bytes_read INTEGER,"
+            "    bytes_written INTEGER"
             "    );",
-            "CREATE INDEX open_proc_idx ON opened_files(process);",
+            OPENED_FILES_VIEW,
             "CREATE TABLE executed_files("
             "    id INTEGER NOT NULL PRIMARY KEY,"
             "    name TEXT NOT NULL,"
@@ -119,10 +1231,13 @@ int db_init(const char *filename)
             "    timestamp INTEGER NOT NULL,"
             "    process INTEGER NOT NULL,"
             "    argv TEXT NOT NULL,"
-            "    envp TEXT NOT NULL,"
+            "    environment INTEGER NOT NULL,"
             "    workingdir TEXT NOT NULL"
             "    );",
-            "CREATE INDEX exec_proc_idx ON executed_files(process);",
+            "CREATE TABLE environments("
+            "    id INTEGER NOT NULL PRIMARY KEY,"
+            "    envp TEXT NOT NULL"
+            "    );",
             "CREATE TABLE connections("
             "    id INTEGER NOT NULL PRIMARY KEY,"
             "    run_id INTEGER NOT NULL,"
@@ -133,148 +1248,773 @@ int db_init(const char *filename)
             "    protocol TEXT NULL,"
             "    address TEXT NULL"
             "    );",
-            "CREATE INDEX connections_proc_idx ON connections(process);",
+            TRACER_STATS_TABLE,
+            SYSCALL_LATENCIES_TABLE,
+            DB_SET_SCHEMA_VERSION,
         };
         size_t i;
         for(i = 0; i < count(sql); ++i)
             check(sqlite3_exec(db, sql[i], NULL, NULL, NULL));
     }
-
-    /* Get the first unused run_id */
+    else
+    {
+        if(schema_version < 1)
+        {
+            /* Move the paths out of opened_files, which becomes a view */
+            const char *sql[] = {
+                "CREATE TABLE paths("
+                "    id INTEGER NOT NULL PRIMARY KEY,"
+                "    name TEXT NOT NULL UNIQUE"
+                "    );",
+                "CREATE TABLE file_accesses("
+                "    id INTEGER NOT NULL PRIMARY KEY,"
+                "    run_id INTEGER NOT NULL,"
+                "    path INTEGER NOT NULL,"
+                "    timestamp INTEGER NOT NULL,"
+                "    mode INTEGER NOT NULL,"
+                "    is_directory BOOLEAN NOT NULL,"
+                "    process INTEGER NOT NULL"
+                "    );",
+                "INSERT INTO paths(name) "
+                "SELECT name FROM opened_files "
+                "GROUP BY name ORDER BY min(id);",
+                "INSERT INTO file_accesses(id, run_id, path, timestamp, "
+                "        mode, is_directory, process) "
+                "SELECT o.id, o.run_id, p.id, o.timestamp, "
+                "        o.mode, o.is_directory, o.process "
+                "FROM opened_files o "
+                "INNER JOIN paths p ON p.name = o.name;",
+                "DROP TABLE opened_files;",
+                /* The view is created with the columns of version 7 below */
+            };
+            size_t i;
+            for(i = 0; i < count(sql); ++i)
+                check(sqlite3_exec(db, sql[i], NULL, NULL, NULL));
+        }
+        if(schema_version < 2)
+        {
+            /* Move the environments out of executed_files */
+            const char *sql[] = {
+                "CREATE TABLE environments("
+                "    id INTEGER NOT NULL PRIMARY KEY,"
+                "    envp TEXT NOT NULL"
+                "    );",
+                "INSERT INTO environments(envp) "
+                "SELECT envp FROM executed_files "
+                "GROUP BY envp ORDER BY min(id);",
+                "ALTER TABLE executed_files RENAME TO executed_files_old;",
+                "CREATE TABLE executed_files("
+                "    id INTEGER NOT NULL PRIMARY KEY,"
+                "    name TEXT NOT NULL,"
+                "    run_id INTEGER NOT NULL,"
+                "    timestamp INTEGER NOT NULL,"
+                "    process INTEGER NOT NULL,"
+                "    argv TEXT NOT NULL,"
+                "    environment INTEGER NOT NULL,"
+                "    workingdir TEXT NOT NULL"
+                "    );",
+                "INSERT INTO executed_files(id, name, run_id, timestamp, "
+                "        process, argv, environment, workingdir) "
+                "SELECT e.id, e.name, e.run_id, e.timestamp, "
+                "        e.process, e.argv, v.id, e.workingdir "
+                "FROM executed_files_old e "
+                "INNER JOIN environments v ON v.envp = e.envp;",
+                "DROP TABLE executed_files_old;",
+            };
+            size_t i;
+            for(i = 0; i < count(sql); ++i)
+                check(sqlite3_exec(db, sql[i], NULL, NULL, NULL));
+        }
+        if(schema_version < 3)
+        {
+            /* Add the counts of repeated accesses */
+            const char *sql[] = {
+                "ALTER TABLE file_accesses "
+                "ADD COLUMN last_timestamp INTEGER;",
+                "ALTER TABLE file_accesses "
+                "ADD COLUMN hits INTEGER NOT NULL DEFAULT 1;",
+                "UPDATE file_accesses SET last_timestamp = timestamp;",
+            };
+            size_t i;
+            for(i = 0; i < count(sql); ++i)
+                check(sqlite3_exec(db, sql[i], NULL, NULL, NULL));
+        }
+        if(schema_version < 4)
+            check(sqlite3_exec(db, TRACER_STATS_TABLE, NULL, NULL, NULL));
+        if(schema_version < 5)
+            check(sqlite3_exec(db, SYSCALL_LATENCIES_TABLE,
+                               NULL, NULL, NULL));
+        if(schema_version < 6)
+        {
+            /* Add the resources used by processes */
+            const char *columns[] = {
+                "system_time", "max_rss",
+                "voluntary_switches", "involuntary_switches",
+                "block_reads", "block_writes",
+                "io_read", "io_write",
+            };
+            size_t i;
+            for(i = 0; i < count(columns); ++i)
+            {
+                char sql[64];
+                sprintf(sql, "ALTER TABLE processes ADD COLUMN %s INTEGER;",
+                        columns[i]);
+                check(sqlite3_exec(db, sql, NULL, NULL, NULL));
+            }
+        }
+        if(schema_version < 7)
+        {
+            /* Add the I/O volume of file accesses */
+            const char *sql[] = {
+                "ALTER TABLE file_accesses ADD COLUMN bytes_read INTEGER;",
+                "ALTER TABLE file_accesses ADD COLUMN bytes_written INTEGER;",
+                "DROP VIEW IF EXISTS opened_files;",
+                OPENED_FILES_VIEW,
+            };
+            size_t i;
+            for(i = 0; i < count(sql); ++i)
+                check(sqlite3_exec(db, sql[i], NULL, NULL, NULL));
+        }
+        if(schema_version < DB_SCHEMA_VERSION)
+        {
+            log_info(0, "upgraded trace database from schema version %d "
+                     "to %d", schema_version, DB_SCHEMA_VERSION);
+            check(sqlite3_exec(db, DB_SET_SCHEMA_VERSION, NULL, NULL, NULL));
+        }
+
+        /* Indexes are built once in db_close(), not updated on every insert
+         * (this is all in the same transaction) */
+        {
+            const char *sql[] = {
+                "DROP INDEX IF EXISTS proc_parent_idx;",
+                "DROP INDEX IF EXISTS open_proc_idx;",
+                "DROP INDEX IF EXISTS exec_proc_idx;",
+                "DROP INDEX IF EXISTS connections_proc_idx;",
+                "DROP INDEX IF EXISTS latencies_proc_idx;",
+            };
+            size_t i;
+            for(i = 0; i < count(sql); ++i)
+                check(sqlite3_exec(db, sql[i], NULL, NULL, NULL));
+        }
+    }
+
+    /* Get the first unused run_id */
+    {
+        sqlite3_stmt *stmt_get_run_id;
+        const char *sql = "SELECT max(run_id) + 1 FROM processes;";
+        check(sqlite3_prepare_v2(db, sql, -1, &stmt_get_run_id, NULL));
+        if(sqlite3_step(stmt_get_run_id) != SQLITE_ROW)
+        {
+            sqlite3_finalize(stmt_get_run_id);
+            goto sqlerror;
+        }
+        run_id = sqlite3_column_int(stmt_get_run_id, 0);
+        if(sqlite3_step(stmt_get_run_id) != SQLITE_DONE)
+        {
+            sqlite3_finalize(stmt_get_run_id);
+            goto sqlerror;
+        }
+        sqlite3_finalize(stmt_get_run_id);
+    }
+    log_debug(0, "This is run %d", run_id);
+
+    /* Get the first unused process id */
+    {
+        sqlite3_stmt *stmt_get_id;
+        const char *sql = "SELECT coalesce(max(id), 0) + 1 FROM processes;";
+        check(sqlite3_prepare_v2(db, sql, -1, &stmt_get_id, NULL));
+        if(sqlite3_step(stmt_get_id) != SQLITE_ROW)
+        {
+            sqlite3_finalize(stmt_get_id);
+            goto sqlerror;
+        }
+        first_process_id = sqlite3_column_int(stmt_get_id, 0);
+        sqlite3_finalize(stmt_get_id);
+    }
+    /* Get the first unused file access id */
+    {
+        sqlite3_stmt *stmt_get_id;
+        const char *sql = "SELECT coalesce(max(id), 0) + 1 "
+                          "FROM file_accesses;";
+        check(sqlite3_prepare_v2(db, sql, -1, &stmt_get_id, NULL));
+        if(sqlite3_step(stmt_get_id) != SQLITE_ROW)
+        {
+            sqlite3_finalize(stmt_get_id);
+            goto sqlerror;
+        }
+        first_file_id = sqlite3_column_int(stmt_get_id, 0);
+        sqlite3_finalize(stmt_get_id);
+    }
+    processes_count = 0;
+    processes_size = 64;
+    processes = malloc(processes_size * sizeof(*processes));
+
+    /* Load the paths and environments already in the database */
+    intern_init(&paths, 1024);
+    intern_init(&environments, 16);
+    if(intern_load(&paths, "SELECT id, name FROM paths;") != 0
+     || intern_load(&environments, "SELECT id, envp FROM environments;") != 0)
+        goto sqlerror;
+
+    check(batch_prepare(&batch_process,
+                        "INSERT INTO processes(id, run_id, parent, "
+                        "        timestamp, exit_timestamp, cpu_time, "
+                        "        is_thread, exitcode, system_time, max_rss, "
+                        "        voluntary_switches, involuntary_switches, "
+                        "        block_reads, block_writes, io_read, "
+                        "        io_write)",
+                        16));
+    check(batch_prepare(&batch_path,
+                        "INSERT INTO paths(id, name)",
+                        2));
+    check(batch_prepare(&batch_environment,
+                        "INSERT INTO environments(id, envp)",
+                        2));
+    check(batch_prepare(&batch_file,
+                        "INSERT INTO file_accesses(id, run_id, path, "
+                        "        timestamp, last_timestamp, hits, mode, "
+                        "        is_directory, process)",
+                        9));
+    check(sqlite3_prepare_v2(db,
+                             "UPDATE file_accesses "
+                             "SET last_timestamp = ?, hits = ? "
+                             "WHERE id = ?;",
+                             -1, &stmt_set_hits, NULL));
+    check(sqlite3_prepare_v2(db,
+                             "UPDATE file_accesses "
+                             "SET bytes_read = ?, bytes_written = ? "
+                             "WHERE id = ?;",
+                             -1, &stmt_set_io, NULL));
+    check(sqlite3_prepare_v2(db,
+                             "INSERT INTO tracer_stats(run_id, name, "
+                             "        syscall, count, time) "
+                             "VALUES(?, ?, ?, ?, ?);",
+                             -1, &stmt_add_stat, NULL));
+    check(batch_prepare(&batch_exec,
+                        "INSERT INTO executed_files(run_id, name, timestamp, "
+                        "        process, argv, environment, workingdir)",
+                        7));
+    check(batch_prepare(&batch_connection,
+                        "INSERT INTO connections(run_id, timestamp, process, "
+                        "        inbound, family, protocol, address)",
+                        7));
+    check(batch_prepare(&batch_latency,
+                        "INSERT INTO syscall_latencies(run_id, process, "
+                        "        syscall, path, count, time, histogram)",
+                        7));
+
+    if((flags & DB_WRITER_THREAD) && writer_start() != 0)
+        return -1;
+
+    return 0;
+
+sqlerror:
+    log_critical(0, "sqlite3 error creating database: %s", sqlite3_errmsg(db));
+    return -1;
+}
+
+static int db_write_processes(void)
+{
+    size_t i;
+    for(i = 0; i < processes_count; ++i)
+    {
+        const struct db_process *proc = &processes[i];
+        int p = batch_param(&batch_process);
+        sqlite3_stmt *stmt = batch_process.stmt;
+        check(sqlite3_bind_int(stmt, p, first_process_id + i));
+        check(sqlite3_bind_int(stmt, p + 1, run_id));
+        if(proc->parent == DB_NO_PARENT)
+            check(sqlite3_bind_null(stmt, p + 2));
+        else
+            check(sqlite3_bind_int(stmt, p + 2, proc->parent));
+        /* This assumes that we won't go over 2^32 seconds (~135 years) */
+        check(sqlite3_bind_int64(stmt, p + 3, proc->timestamp));
+        if(proc->exited)
+            check(sqlite3_bind_int64(stmt, p + 4, proc->exit_timestamp));
+        else
+            check(sqlite3_bind_null(stmt, p + 4));
+        check(sqlite3_bind_int(stmt, p + 6, proc->is_thread?1:0));
+        if(proc->exited)
+            check(sqlite3_bind_int(stmt, p + 7, proc->exitcode));
+        else
+            check(sqlite3_bind_null(stmt, p + 7));
+        {
+            const long long *values[9];
+            size_t j;
+            values[0] = &proc->usage.user_time;
+            values[1] = &proc->usage.system_time;
+            values[2] = &proc->usage.max_rss;
+            values[3] = &proc->usage.voluntary_switches;
+            values[4] = &proc->usage.involuntary_switches;
+            values[5] = &proc->usage.block_reads;
+            values[6] = &proc->usage.block_writes;
+            values[7] = &proc->usage.io_read;
+            values[8] = &proc->usage.io_write;
+            for(j = 0; j < count(values); ++j)
+            {
+                /* cpu_time comes before is_thread and exitcode, and is -1
+                 * rather than NULL if unknown, as it always was */
+                int param = (j == 0)?p + 5:p + 7 + (int)j;
+                if(!proc->exited || (j > 0 && *values[j] < 0))
+                    check(sqlite3_bind_null(stmt, param));
+                else
+                    check(sqlite3_bind_int64(stmt, param, *values[j]));
+            }
+        }
+        check(batch_next_row(&batch_process));
+    }
+    return 0;
+
+sqlerror:
+    return -1;
+}
+
+int db_close(int rollback)
+{
+    int failed = 0;
+    if(event_log)
+    {
+        /* The log is kept even on error, it might be salvaged */
+        int ret = 0;
+        size_t i;
+        for(i = 0; i < accesses_size; ++i)
+        {
+            const struct access_entry *entry = &accesses[i];
+            if(entry->name != NULL && entry->hits > 1)
+            {
+                struct event event;
+                event_init(&event, EV_FILE_HITS, entry->process);
+                event.timestamp = entry->last_timestamp;
+                event.args[0] = entry->row;
+                event.args[1] = entry->hits;
+                if(eventlog_write(&event, NULL) != 0)
+                {
+                    ret = -1;
+                    break;
+                }
+            }
+            if(entry->name != NULL && entry->bytes_read >= 0)
+            {
+                struct event event;
+                event_init(&event, EV_FILE_IO, entry->process);
+                event.timestamp = entry->bytes_written;
+                event.args[0] = entry->row;
+                event.args[1] = (uint32_t)entry->bytes_read;
+                event.args[2] = (uint32_t)(entry->bytes_read >> 32);
+                if(eventlog_write(&event, NULL) != 0)
+                {
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+        if(ret == 0 && stats_foreach(event_stat, NULL) != 0)
+            ret = -1;
+        stats_reset();
+        accesses_free();
+        event_log = 0;
+        if(eventlog_close() != 0)
+            ret = -1;
+        return ret;
+    }
+    if(ring != NULL)
+    {
+        if(writer_stop() != 0)
+        {
+            /* LCOV_EXCL_START : Insertions shouldn't fail */
+            log_critical(0, "%s", ring->error);
+            rollback = failed = 1;
+            /* LCOV_EXCL_END */
+        }
+        writer_free();
+    }
+    if(rollback)
+    {
+        check(sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL));
+    }
+    else
     {
-        sqlite3_stmt *stmt_get_run_id;
-        const char *sql = "SELECT max(run_id) + 1 FROM processes;";
-        check(sqlite3_prepare_v2(db, sql, -1, &stmt_get_run_id, NULL));
-        if(sqlite3_step(stmt_get_run_id) != SQLITE_ROW)
-        {
-            sqlite3_finalize(stmt_get_run_id);
+        size_t i;
+        if(db_write_processes() != 0)
             goto sqlerror;
-        }
-        run_id = sqlite3_column_int(stmt_get_run_id, 0);
-        if(sqlite3_step(stmt_get_run_id) != SQLITE_DONE)
+        check(batch_flush(&batch_process));
+        check(batch_flush(&batch_path));
+        check(batch_flush(&batch_environment));
+        check(batch_flush(&batch_file));
+        check(batch_flush(&batch_exec));
+        check(batch_flush(&batch_connection));
+        check(batch_flush(&batch_latency));
+        for(i = 0; i < accesses_size; ++i)
         {
-            sqlite3_finalize(stmt_get_run_id);
-            goto sqlerror;
+            const struct access_entry *entry = &accesses[i];
+            if(entry->name != NULL && entry->hits > 1
+             && write_hits(first_file_id + entry->row,
+                           entry->last_timestamp, entry->hits) != 0)
+                goto sqlerror;
+            if(entry->name != NULL && entry->bytes_read >= 0
+             && write_io(first_file_id + entry->row,
+                         entry->bytes_read, entry->bytes_written) != 0)
+                goto sqlerror;
         }
-        sqlite3_finalize(stmt_get_run_id);
+        if(stats_foreach(write_stat, NULL) != 0)
+            goto sqlerror;
+        for(i = 0; i < count(indexes); ++i)
+            check(sqlite3_exec(db, indexes[i], NULL, NULL, NULL));
+        check(sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL));
     }
-    log_debug(0, "This is run %d", run_id);
+    log_debug(0, "database file closed%s", rollback?" (rolled back)":"");
+    stats_reset();
+    check(sqlite3_finalize(batch_process.stmt));
+    check(sqlite3_finalize(batch_path.stmt));
+    check(sqlite3_finalize(batch_environment.stmt));
+    check(sqlite3_finalize(batch_file.stmt));
+    check(sqlite3_finalize(batch_exec.stmt));
+    check(sqlite3_finalize(batch_connection.stmt));
+    check(sqlite3_finalize(batch_latency.stmt));
+    check(sqlite3_finalize(stmt_set_hits));
+    check(sqlite3_finalize(stmt_set_io));
+    check(sqlite3_finalize(stmt_add_stat));
+    check(sqlite3_close(db));
+    free(processes);
+    processes = NULL;
+    intern_free(&paths);
+    intern_free(&environments);
+    accesses_free();
+    run_id = -1;
+    return failed?-1:0;
 
-    {
-        const char *sql = ""
-                "SELECT last_insert_rowid()";
-        check(sqlite3_prepare_v2(db, sql, -1, &stmt_last_rowid, NULL));
-    }
+sqlerror:
+    log_critical(0, "sqlite3 error on exit: %s", sqlite3_errmsg(db));
+    return -1;
+}
+
+/* ********************
+ * Forwarding
+ *
+ * In sharded mode, several tracer threads trace the same program. They don't
+ * touch the database; their db_add_*() calls are queued, in batches, for the
+ * thread that opened it, which makes them in db_forward_run(). The processes
+ * are numbered by the tracer threads as they are created, and the recording
+ * thread maps those numbers to the identifiers it gives them.
+ */
+
+#define FWD_PROCESS     1
+#define FWD_EXIT        2
+#define FWD_FILE        3
+#define FWD_EXEC        4
+#define FWD_CONNECTION  5
+#define FWD_LATENCY     6
+#define FWD_FILE_IO     7
+
+#define FWD_BATCH 64
 
+/* Allocated with its strings */
+struct forwarded {
+    struct forwarded *next;
+    unsigned int type;
+    unsigned int process;
+    unsigned int parent;        /* FWD_PROCESS */
+    int args[2];                /* FWD_PROCESS: is_thread,
+                                 * FWD_EXIT: exitcode,
+                                 * FWD_FILE: mode and is_dir,
+                                 * FWD_FILE_IO: mode,
+                                 * FWD_CONNECTION: inbound,
+                                 * FWD_LATENCY: count */
+    unsigned long long time;    /* FWD_LATENCY */
+    unsigned long long bytes[2];    /* FWD_FILE_IO: read and written */
+    struct db_usage usage;      /* FWD_EXIT */
+    char *strings[3];
+    char *argv, *envp;          /* FWD_EXEC: buffers owned by the record */
+    size_t argv_len, envp_len;
+};
+
+struct db_forward {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct forwarded *head, **tail;
+    unsigned int senders;
+    int recorder_waiting;
+    int failed;
+    unsigned int next_process;
+    /* Only used by the recording thread */
+    unsigned int *ids;
+    size_t ids_size;
+};
+
+static __thread struct db_forward *forward = NULL;
+static __thread struct forwarded *fwd_head, **fwd_tail;
+static __thread unsigned int fwd_count;
+
+struct db_forward *db_forward_new(unsigned int senders)
+{
+    struct db_forward *fwd = malloc(sizeof(*fwd));
+    pthread_mutex_init(&fwd->mutex, NULL);
+    pthread_cond_init(&fwd->cond, NULL);
+    fwd->head = NULL;
+    fwd->tail = &fwd->head;
+    fwd->senders = senders;
+    fwd->recorder_waiting = 0;
+    fwd->failed = 0;
+    fwd->next_process = 0;
+    fwd->ids_size = 64;
+    fwd->ids = malloc(fwd->ids_size * sizeof(*fwd->ids));
+    return fwd;
+}
+
+static void forwarded_free(struct forwarded *rec)
+{
+    if(rec->type == FWD_EXEC)
     {
-        const char *sql = ""
-                "INSERT INTO processes(run_id, parent, timestamp, is_thread) "
-                "VALUES(?, ?, ?, ?)";
-        check(sqlite3_prepare_v2(db, sql, -1, &stmt_insert_process, NULL));
+        free(rec->argv);
+        free(rec->envp);
     }
+    free(rec);
+}
 
+void db_forward_free(struct db_forward *fwd)
+{
+    while(fwd->head != NULL)
     {
-        const char *sql = ""
-                "UPDATE processes SET exitcode=?, exit_timestamp=?, "
-                "        cpu_time=? "
-                "WHERE id=?";
-        check(sqlite3_prepare_v2(db, sql, -1, &stmt_set_exitcode, NULL));
+        struct forwarded *rec = fwd->head;
+        fwd->head = rec->next;
+        forwarded_free(rec);
     }
+    pthread_mutex_destroy(&fwd->mutex);
+    pthread_cond_destroy(&fwd->cond);
+    free(fwd->ids);
+    free(fwd);
+}
+
+void db_forward_attach(struct db_forward *fwd)
+{
+    forward = fwd;
+    fwd_head = NULL;
+    fwd_tail = &fwd_head;
+    fwd_count = 0;
+}
+
+void db_forward_flush(void)
+{
+    if(forward == NULL || fwd_head == NULL)
+        return;
+    pthread_mutex_lock(&forward->mutex);
+    *forward->tail = fwd_head;
+    forward->tail = fwd_tail;
+    if(forward->recorder_waiting)
+        pthread_cond_signal(&forward->cond);
+    pthread_mutex_unlock(&forward->mutex);
+    fwd_head = NULL;
+    fwd_tail = &fwd_head;
+    fwd_count = 0;
+}
+
+void db_forward_detach(void)
+{
+    db_forward_flush();
+    pthread_mutex_lock(&forward->mutex);
+    forward->senders--;
+    if(forward->recorder_waiting)
+        pthread_cond_signal(&forward->cond);
+    pthread_mutex_unlock(&forward->mutex);
+    forward = NULL;
+}
 
+/* Makes a record with copies of the given strings (which can be NULL), to
+ * be filled then queued. The recording thread failing is reported here, like
+ * writer_check() does. */
+static struct forwarded *forward_new(unsigned int type, unsigned int process,
+                                     const char *s0, const char *s1,
+                                     const char *s2)
+{
+    const char *strings[3];
+    size_t lengths[3], size = sizeof(struct forwarded);
+    struct forwarded *rec;
+    char *p;
+    int i;
+    if(__atomic_load_n(&forward->failed, __ATOMIC_RELAXED))
     {
-        const char *sql = ""
-                "INSERT INTO opened_files(run_id, name, timestamp, "
-                "        mode, is_directory, process) "
-                "VALUES(?, ?, ?, ?, ?, ?)";
-        check(sqlite3_prepare_v2(db, sql, -1, &stmt_insert_file, NULL));
+        log_critical(0, "recording forwarded events failed");
+        return NULL;
     }
-
+    strings[0] = s0;
+    strings[1] = s1;
+    strings[2] = s2;
+    for(i = 0; i < 3; ++i)
     {
-        const char *sql = ""
-                "INSERT INTO executed_files(run_id, name, timestamp, process, "
-                "        argv, envp, workingdir) "
-                "VALUES(?, ?, ?, ?, ?, ?, ?)";
-        check(sqlite3_prepare_v2(db, sql, -1, &stmt_insert_exec, NULL));
+        lengths[i] = strings[i] == NULL?0:strlen(strings[i]) + 1;
+        size += lengths[i];
     }
-
+    rec = malloc(size);
+    p = (char*)(rec + 1);
+    for(i = 0; i < 3; ++i)
     {
-        const char *sql = ""
-                "INSERT INTO connections(run_id, timestamp, process, "
-                "        inbound, family, protocol, address) "
-                "VALUES(?, ?, ?, ?, ?, ?, ?)";
-        check(sqlite3_prepare_v2(db, sql, -1, &stmt_insert_connection, NULL));
+        if(strings[i] == NULL)
+            rec->strings[i] = NULL;
+        else
+        {
+            rec->strings[i] = p;
+            memcpy(p, strings[i], lengths[i]);
+            p += lengths[i];
+        }
     }
+    rec->next = NULL;
+    rec->type = type;
+    rec->process = process;
+    return rec;
+}
 
+static int forward_queue(struct forwarded *rec)
+{
+    *fwd_tail = rec;
+    fwd_tail = &rec->next;
+    if(++fwd_count >= FWD_BATCH)
+        db_forward_flush();
     return 0;
+}
 
-sqlerror:
-    log_critical(0, "sqlite3 error creating database: %s", sqlite3_errmsg(db));
-    return -1;
+static unsigned int forwarded_id(struct db_forward *fwd, unsigned int number)
+{
+    return number == DB_NO_PARENT?DB_NO_PARENT:fwd->ids[number];
 }
 
-int db_close(int rollback)
+static int forwarded_record(struct db_forward *fwd, struct forwarded *rec)
 {
-    if(rollback)
+    unsigned int process = forwarded_id(fwd, rec->process);
+    int ret;
+    switch(rec->type)
     {
-        check(sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL));
+    case FWD_PROCESS:
+        while(rec->process >= fwd->ids_size)
+        {
+            fwd->ids_size *= 2;
+            fwd->ids = realloc(fwd->ids, fwd->ids_size * sizeof(*fwd->ids));
+        }
+        return db_add_process(&fwd->ids[rec->process],
+                              forwarded_id(fwd, rec->parent),
+                              rec->strings[0], rec->args[0]);
+    case FWD_EXIT:
+        return db_add_exit(process, rec->args[0], &rec->usage);
+    case FWD_FILE:
+        /* The tracer threads have their own cache of path types */
+        if(rec->args[0] & (FILE_WRITE | FILE_LINK))
+            forget_path_type(rec->strings[0],
+                             (rec->args[0] & FILE_LINK) != 0);
+        return db_add_file_open(process, rec->strings[0], rec->args[0],
+                                rec->args[1]);
+    case FWD_FILE_IO:
+        return db_add_file_io(process, rec->strings[0], rec->args[0],
+                              rec->bytes[0], rec->bytes[1]);
+    case FWD_EXEC:
+        ret = db_add_exec(process, rec->strings[0],
+                          rec->argv, rec->argv_len, rec->envp, rec->envp_len,
+                          rec->strings[1]);
+        rec->argv = rec->envp = NULL;
+        return ret;
+    case FWD_CONNECTION:
+        return db_add_connection(process, rec->args[0], rec->strings[0],
+                                 rec->strings[1], rec->strings[2]);
+    case FWD_LATENCY:
+        return db_add_latency(process, rec->strings[0], rec->strings[1],
+                              (unsigned int)rec->args[0], rec->time,
+                              rec->strings[2]);
     }
-    else
+    return 0;
+}
+
+int db_forward_run(struct db_forward *fwd)
+{
+    for(;;)
     {
-        check(sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL));
+        struct forwarded *list;
+        pthread_mutex_lock(&fwd->mutex);
+        while(fwd->head == NULL && fwd->senders > 0)
+        {
+            fwd->recorder_waiting = 1;
+            pthread_cond_wait(&fwd->cond, &fwd->mutex);
+            fwd->recorder_waiting = 0;
+        }
+        list = fwd->head;
+        fwd->head = NULL;
+        fwd->tail = &fwd->head;
+        pthread_mutex_unlock(&fwd->mutex);
+        if(list == NULL)
+            return fwd->failed?-1:0;
+        while(list != NULL)
+        {
+            struct forwarded *rec = list;
+            list = rec->next;
+            /* After a failure, only drain, the tracer threads are stopping */
+            if(!fwd->failed && forwarded_record(fwd, rec) != 0)
+                __atomic_store_n(&fwd->failed, 1, __ATOMIC_RELAXED);
+            forwarded_free(rec);
+        }
     }
-    log_debug(0, "database file closed%s", rollback?" (rolled back)":"");
-    check(sqlite3_finalize(stmt_last_rowid));
-    check(sqlite3_finalize(stmt_insert_process));
-    check(sqlite3_finalize(stmt_set_exitcode));
-    check(sqlite3_finalize(stmt_insert_file));
-    check(sqlite3_finalize(stmt_insert_exec));
-    check(sqlite3_finalize(stmt_insert_connection));
-    check(sqlite3_close(db));
-    run_id = -1;
-    return 0;
+}
 
-sqlerror:
-    log_critical(0, "sqlite3 error on exit: %s", sqlite3_errmsg(db));
-    return -1;
+
+static struct db_process *new_process(void)
+{
+    if(processes_count == processes_size)
+    {
+        processes_size *= 2;
+        processes = realloc(processes, processes_size * sizeof(*processes));
+    }
+    return &processes[processes_count++];
 }
 
-#define DB_NO_PARENT ((unsigned int)-2)
+static __thread db_listener_func *listener = NULL;
+static __thread void *listener_data;
 
-int db_add_process(unsigned int *id, unsigned int parent_id,
-                   const char *working_dir, int is_thread)
+void db_set_listener(db_listener_func *func, void *data)
 {
-    check(sqlite3_bind_int(stmt_insert_process, 1, run_id));
-    if(parent_id == DB_NO_PARENT)
+    listener = func;
+    listener_data = data;
+}
+
+static int add_process(unsigned int *id, unsigned int parent_id,
+                       const char *working_dir, int is_thread)
+{
+    if(forward != NULL)
+    {
+        struct forwarded *rec;
+        *id = __atomic_fetch_add(&forward->next_process, 1, __ATOMIC_RELAXED);
+        rec = forward_new(FWD_PROCESS, *id, working_dir, NULL, NULL);
+        if(rec == NULL)
+            return -1;
+        rec->parent = parent_id;
+        rec->args[0] = is_thread;
+        return forward_queue(rec);
+    }
+    else if(event_log)
     {
-        check(sqlite3_bind_null(stmt_insert_process, 2));
+        struct event event;
+        event_init(&event, EV_PROCESS, processes_count);
+        *id = processes_count++;
+        event.args[0] = parent_id == DB_NO_PARENT?EV_NO_PARENT:parent_id;
+        event.args[1] = is_thread;
+        if(eventlog_write(&event, NULL) != 0)
+            return -1;
     }
     else
     {
-        check(sqlite3_bind_int(stmt_insert_process, 2, parent_id));
+        struct db_process *proc = new_process();
+        *id = first_process_id + (proc - processes);
+        proc->parent = parent_id;
+        proc->is_thread = is_thread;
+        proc->timestamp = gettime();
+        proc->exited = 0;
     }
-    /* This assumes that we won't go over 2^32 seconds (~135 years) */
-    check(sqlite3_bind_int64(stmt_insert_process, 3, gettime()));
-    check(sqlite3_bind_int(stmt_insert_process, 4, is_thread?1:0));
-
-    if(sqlite3_step(stmt_insert_process) != SQLITE_DONE)
-        goto sqlerror;
-    sqlite3_reset(stmt_insert_process);
-
-    /* Get id */
-    if(sqlite3_step(stmt_last_rowid) != SQLITE_ROW)
-        goto sqlerror;
-    *id = sqlite3_column_int(stmt_last_rowid, 0);
-    if(sqlite3_step(stmt_last_rowid) != SQLITE_DONE)
-        goto sqlerror;
-    sqlite3_reset(stmt_last_rowid);
 
     return db_add_file_open(*id, working_dir, FILE_WDIR, 1);
+}
 
-sqlerror:
-    /* LCOV_EXCL_START : Insertions shouldn't fail */
-    log_critical(0, "sqlite3 error inserting process: %s", sqlite3_errmsg(db));
-    return -1;
-    /* LCOV_EXCL_END */
+int db_add_process(unsigned int *id, unsigned int parent_id,
+                   const char *working_dir, int is_thread)
+{
+    stats_time start = stats_clock();
+    int ret = add_process(id, parent_id, working_dir, is_thread);
+    stats_timed(STAT_DATABASE, start);
+    return ret;
 }
 
 int db_add_first_process(unsigned int *id, const char *working_dir)
@@ -282,149 +2022,564 @@ int db_add_first_process(unsigned int *id, const char *working_dir)
     return db_add_process(id, DB_NO_PARENT, working_dir, 0);
 }
 
-int db_add_exit(unsigned int id, int exitcode, int cpu_time)
+void db_usage_unknown(struct db_usage *usage)
 {
-    check(sqlite3_bind_int(stmt_set_exitcode, 1, exitcode));
-    check(sqlite3_bind_int64(stmt_set_exitcode, 2, gettime()));
-    check(sqlite3_bind_int(stmt_set_exitcode, 3, cpu_time));
-    check(sqlite3_bind_int(stmt_set_exitcode, 4, id));
+    usage->user_time = usage->system_time = -1;
+    usage->max_rss = -1;
+    usage->voluntary_switches = usage->involuntary_switches = -1;
+    usage->block_reads = usage->block_writes = -1;
+    usage->io_read = usage->io_write = -1;
+}
 
-    if(sqlite3_step(stmt_set_exitcode) != SQLITE_DONE)
-        goto sqlerror;
-    sqlite3_reset(stmt_set_exitcode);
+/* In EV_EXIT records, the usage is stored as this many 64-bit integers, in
+ * the order below, followed by a NUL */
+#define EV_USAGE_FIELDS 9
+#define EV_USAGE_SIZE (EV_USAGE_FIELDS * 8 + 1)
+
+static void usage_to_event(const struct db_usage *usage, char *buffer)
+{
+    int64_t fields[EV_USAGE_FIELDS];
+    fields[0] = usage->user_time;
+    fields[1] = usage->system_time;
+    fields[2] = usage->max_rss;
+    fields[3] = usage->voluntary_switches;
+    fields[4] = usage->involuntary_switches;
+    fields[5] = usage->block_reads;
+    fields[6] = usage->block_writes;
+    fields[7] = usage->io_read;
+    fields[8] = usage->io_write;
+    memcpy(buffer, fields, sizeof(fields));
+    buffer[sizeof(fields)] = '\0';
+}
+
+static void usage_from_event(const char *buffer, struct db_usage *usage)
+{
+    int64_t fields[EV_USAGE_FIELDS];
+    memcpy(fields, buffer, sizeof(fields));
+    usage->user_time = fields[0];
+    usage->system_time = fields[1];
+    usage->max_rss = fields[2];
+    usage->voluntary_switches = fields[3];
+    usage->involuntary_switches = fields[4];
+    usage->block_reads = fields[5];
+    usage->block_writes = fields[6];
+    usage->io_read = fields[7];
+    usage->io_write = fields[8];
+}
 
+static int add_exit(unsigned int id, int exitcode,
+                    const struct db_usage *usage)
+{
+    struct db_process *proc;
+    if(forward != NULL)
+    {
+        struct forwarded *rec = forward_new(FWD_EXIT, id, NULL, NULL, NULL);
+        if(rec == NULL)
+            return -1;
+        rec->args[0] = exitcode;
+        rec->usage = *usage;
+        return forward_queue(rec);
+    }
+    else if(event_log)
+    {
+        struct event event;
+        const char *strings[EV_STRINGS];
+        char buffer[EV_USAGE_SIZE];
+        usage_to_event(usage, buffer);
+        event_init(&event, EV_EXIT, id);
+        event.args[0] = exitcode;
+        event.args[1] = (uint32_t)usage->user_time;
+        strings[0] = buffer;
+        event.lengths[0] = sizeof(buffer);
+        return eventlog_write(&event, strings);
+    }
+    proc = &processes[id - first_process_id];
+    proc->exited = 1;
+    proc->exitcode = exitcode;
+    proc->exit_timestamp = gettime();
+    proc->usage = *usage;
     return 0;
+}
 
-sqlerror:
-    /* LCOV_EXCL_START : Insertions shouldn't fail */
-    log_critical(0, "sqlite3 error setting exitcode: %s", sqlite3_errmsg(db));
-    return -1;
-    /* LCOV_EXCL_END */
+int db_add_exit(unsigned int id, int exitcode, const struct db_usage *usage)
+{
+    stats_time start = stats_clock();
+    struct db_usage unknown;
+    int ret;
+    if(usage == NULL)
+    {
+        db_usage_unknown(&unknown);
+        usage = &unknown;
+    }
+    ret = add_exit(id, exitcode, usage);
+    stats_timed(STAT_DATABASE, start);
+    return ret;
+}
+
+static int add_file_open(unsigned int process, const char *name,
+                         unsigned int mode, int is_dir)
+{
+    sqlite3_uint64 timestamp;
+    unsigned int row;
+    if(forward != NULL)
+    {
+        struct forwarded *rec = forward_new(FWD_FILE, process, name,
+                                            NULL, NULL);
+        if(rec == NULL)
+            return -1;
+        rec->args[0] = mode;
+        rec->args[1] = is_dir;
+        return forward_queue(rec);
+    }
+    if(path_is_ignored(name))
+        return 0;
+    timestamp = gettime();
+    if(access_seen(process, name, mode, timestamp, &row))
+        return 0;
+    if(is_dir == DB_IS_DIR_UNKNOWN)
+        is_dir = path_is_dir(name);
+    if(listener != NULL)
+        listener(listener_data, name, mode, 0);
+
+    if(event_log)
+    {
+        struct event event;
+        const char *strings[EV_STRINGS];
+        event_init(&event, EV_FILE, process);
+        event.timestamp = timestamp;
+        event.args[0] = mode;
+        event.args[1] = is_dir;
+        event.args[2] = row;
+        event_string(&event, strings, 0, name);
+        return eventlog_write(&event, strings);
+    }
+    else if(ring != NULL)
+    {
+        struct record rec;
+        const char *strings[3];
+        if(writer_check() != 0)
+            return -1;
+        rec.type = REC_FILE;
+        rec.timestamp = timestamp;
+        rec.process = process;
+        rec.mode = mode;
+        rec.is_dir = is_dir;
+        rec.id = first_file_id + row;
+        strings[0] = name;
+        rec.lengths[0] = strlen(name) + 1;
+        rec.lengths[1] = rec.lengths[2] = REC_NULL_STRING;
+        ring_push(&rec, strings);
+    }
+    else if(write_file_open(first_file_id + row, process, name, timestamp,
+                            mode, is_dir) != 0)
+    {
+        /* LCOV_EXCL_START : Insertions shouldn't fail */
+        log_critical(0, "sqlite3 error inserting file: %s",
+                     sqlite3_errmsg(db));
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    return 0;
 }
 
 int db_add_file_open(unsigned int process, const char *name,
                      unsigned int mode, int is_dir)
 {
-    check(sqlite3_bind_int(stmt_insert_file, 1, run_id));
-    check(sqlite3_bind_text(stmt_insert_file, 2, name, -1, SQLITE_TRANSIENT));
-    /* This assumes that we won't go over 2^32 seconds (~135 years) */
-    check(sqlite3_bind_int64(stmt_insert_file, 3, gettime()));
-    check(sqlite3_bind_int(stmt_insert_file, 4, mode));
-    check(sqlite3_bind_int(stmt_insert_file, 5, is_dir));
-    check(sqlite3_bind_int(stmt_insert_file, 6, process));
+    stats_time start = stats_clock();
+    int ret = add_file_open(process, name, mode, is_dir);
+    stats_timed(STAT_DATABASE, start);
+    return ret;
+}
 
-    if(sqlite3_step(stmt_insert_file) != SQLITE_DONE)
-        goto sqlerror;
-    sqlite3_reset(stmt_insert_file);
+/* Only updates the entry of the access, it is written in db_close() */
+static int add_file_io(unsigned int process, const char *name,
+                       unsigned int mode, unsigned long long read,
+                       unsigned long long written)
+{
+    struct access_entry *entry;
+    if(forward != NULL)
+    {
+        struct forwarded *rec = forward_new(FWD_FILE_IO, process, name,
+                                            NULL, NULL);
+        if(rec == NULL)
+            return -1;
+        rec->args[0] = mode;
+        rec->bytes[0] = read;
+        rec->bytes[1] = written;
+        return forward_queue(rec);
+    }
+    entry = access_find(process, name, mode);
+    if(entry == NULL)
+        return 0;
+    if(entry->bytes_read < 0)
+        entry->bytes_read = entry->bytes_written = 0;
+    entry->bytes_read += read;
+    entry->bytes_written += written;
     return 0;
+}
 
-sqlerror:
-    /* LCOV_EXCL_START : Insertions shouldn't fail */
-    log_critical(0, "sqlite3 error inserting file: %s", sqlite3_errmsg(db));
-    return -1;
-    /* LCOV_EXCL_END */
+int db_add_file_io(unsigned int process, const char *name,
+                   unsigned int mode, unsigned long long read,
+                   unsigned long long written)
+{
+    stats_time start = stats_clock();
+    int ret = add_file_io(process, name, mode, read, written);
+    stats_timed(STAT_DATABASE, start);
+    return ret;
 }
 
-static char *strarray2nulsep(const char *const *array, size_t *plen)
+static int add_exec(unsigned int process, const char *binary,
+                    char *argv, size_t argv_len,
+                    char *envp, size_t envp_len,
+                    const char *workingdir)
 {
-    char *list;
-    size_t len = 0;
+    if(forward != NULL)
     {
-        const char *const *a = array;
-        while(*a)
+        struct forwarded *rec = forward_new(FWD_EXEC, process, binary,
+                                            workingdir, NULL);
+        if(rec == NULL)
         {
-            len += strlen(*a) + 1;
-            ++a;
+            free(argv);
+            free(envp);
+            return -1;
         }
+        rec->argv = argv;
+        rec->argv_len = argv_len;
+        rec->envp = envp;
+        rec->envp_len = envp_len;
+        return forward_queue(rec);
+    }
+    if(listener != NULL)
+        listener(listener_data, binary, FILE_READ, 1);
+
+    if(event_log)
+    {
+        struct event event;
+        const char *strings[EV_STRINGS];
+        int ret;
+        event_init(&event, EV_EXEC, process);
+        event_string(&event, strings, 0, binary);
+        strings[1] = argv;
+        event.lengths[1] = argv_len;
+        strings[2] = envp;
+        event.lengths[2] = envp_len;
+        event_string(&event, strings, 3, workingdir);
+        ret = eventlog_write(&event, strings);
+        free(argv);
+        free(envp);
+        return ret;
     }
+    else if(ring != NULL)
     {
-        const char *const *a = array;
-        char *p;
-        p = list = malloc(len);
-        while(*a)
+        struct record rec;
+        const char *strings[3];
+        if(writer_check() != 0)
         {
-            const char *s = *a;
-            while(*s)
-                *p++ = *s++;
-            *p++ = '\0';
-            ++a;
+            free(argv);
+            free(envp);
+            return -1;
         }
+        rec.type = REC_EXEC;
+        rec.timestamp = gettime();
+        rec.process = process;
+        rec.argv = argv;
+        rec.argv_len = argv_len;
+        rec.envp = envp;
+        rec.envp_len = envp_len;
+        strings[0] = binary;
+        rec.lengths[0] = strlen(binary) + 1;
+        strings[1] = workingdir;
+        rec.lengths[1] = strlen(workingdir) + 1;
+        rec.lengths[2] = REC_NULL_STRING;
+        ring_push(&rec, strings);
+    }
+    else if(write_exec(process, binary, gettime(), argv, argv_len,
+                       envp, envp_len, workingdir) != 0)
+    {
+        /* LCOV_EXCL_START : Insertions shouldn't fail */
+        log_critical(0, "sqlite3 error inserting exec: %s",
+                     sqlite3_errmsg(db));
+        return -1;
+        /* LCOV_EXCL_END */
     }
-    *plen = len;
-    return list;
+    return 0;
 }
 
 int db_add_exec(unsigned int process, const char *binary,
-                const char *const *argv, const char *const *envp,
+                char *argv, size_t argv_len,
+                char *envp, size_t envp_len,
                 const char *workingdir)
 {
-    check(sqlite3_bind_int(stmt_insert_exec, 1, run_id));
-    check(sqlite3_bind_text(stmt_insert_exec, 2, binary,
-                            -1, SQLITE_TRANSIENT));
-    /* This assumes that we won't go over 2^32 seconds (~135 years) */
-    check(sqlite3_bind_int64(stmt_insert_exec, 3, gettime()));
-    check(sqlite3_bind_int(stmt_insert_exec, 4, process));
+    stats_time start = stats_clock();
+    int ret = add_exec(process, binary, argv, argv_len, envp, envp_len,
+                       workingdir);
+    stats_timed(STAT_DATABASE, start);
+    return ret;
+}
+
+static int add_connection(unsigned int process, int inbound,
+                          const char *family, const char *protocol,
+                          const char *address)
+{
+    if(forward != NULL)
     {
-        size_t len;
-        char *arglist = strarray2nulsep(argv, &len);
-        check(sqlite3_bind_text(stmt_insert_exec, 5, arglist, len,
-                                SQLITE_TRANSIENT));
-        free(arglist);
+        struct forwarded *rec = forward_new(FWD_CONNECTION, process, family,
+                                            protocol, address);
+        if(rec == NULL)
+            return -1;
+        rec->args[0] = inbound;
+        return forward_queue(rec);
     }
+    else if(event_log)
     {
-        size_t len;
-        char *envlist = strarray2nulsep(envp, &len);
-        check(sqlite3_bind_text(stmt_insert_exec, 6, envlist, len,
-                                SQLITE_TRANSIENT));
-        free(envlist);
+        struct event event;
+        const char *strings[EV_STRINGS];
+        event_init(&event, EV_CONNECTION, process);
+        event.args[0] = inbound?1:0;
+        event_string(&event, strings, 0, family);
+        event_string(&event, strings, 1, protocol);
+        event_string(&event, strings, 2, address);
+        return eventlog_write(&event, strings);
+    }
+    else if(ring != NULL)
+    {
+        struct record rec;
+        const char *strings[3];
+        int i;
+        if(writer_check() != 0)
+            return -1;
+        rec.type = REC_CONNECTION;
+        rec.timestamp = gettime();
+        rec.process = process;
+        rec.mode = inbound;
+        strings[0] = family;
+        strings[1] = protocol;
+        strings[2] = address;
+        for(i = 0; i < 3; ++i)
+            rec.lengths[i] = strings[i] == NULL?REC_NULL_STRING:
+                                               strlen(strings[i]) + 1;
+        ring_push(&rec, strings);
+    }
+    else if(write_connection(process, gettime(), inbound,
+                             family, protocol, address) != 0)
+    {
+        /* LCOV_EXCL_START : Insertions shouldn't fail */
+        log_critical(0, "sqlite3 error inserting network connection: %s",
+                     sqlite3_errmsg(db));
+        return -1;
+        /* LCOV_EXCL_END */
     }
-    check(sqlite3_bind_text(stmt_insert_exec, 7, workingdir,
-                            -1, SQLITE_TRANSIENT));
-
-    if(sqlite3_step(stmt_insert_exec) != SQLITE_DONE)
-        goto sqlerror;
-    sqlite3_reset(stmt_insert_exec);
     return 0;
-
-sqlerror:
-    /* LCOV_EXCL_START : Insertions shouldn't fail */
-    log_critical(0, "sqlite3 error inserting exec: %s", sqlite3_errmsg(db));
-    return -1;
-    /* LCOV_EXCL_END */
 }
 
 int db_add_connection(unsigned int process, int inbound, const char *family,
                       const char *protocol, const char *address)
 {
-    check(sqlite3_bind_int(stmt_insert_connection, 1, run_id));
-    check(sqlite3_bind_int64(stmt_insert_connection, 2, gettime()));
-    check(sqlite3_bind_int(stmt_insert_connection, 3, process));
-    check(sqlite3_bind_int(stmt_insert_connection, 4, inbound?1:0));
-    if(family == NULL)
-        check(sqlite3_bind_null(stmt_insert_connection, 5));
-    else
-        check(sqlite3_bind_text(stmt_insert_connection, 5, family,
-                                -1, SQLITE_TRANSIENT));
-    if(protocol == NULL)
-        check(sqlite3_bind_null(stmt_insert_connection, 6));
-    else
-        check(sqlite3_bind_text(stmt_insert_connection, 6, protocol,
-                                -1, SQLITE_TRANSIENT));
-    if(address == NULL)
-        check(sqlite3_bind_null(stmt_insert_connection, 7));
-    else
-        check(sqlite3_bind_text(stmt_insert_connection, 7, address,
-                                -1, SQLITE_TRANSIENT));
+    stats_time start = stats_clock();
+    int ret = add_connection(process, inbound, family, protocol, address);
+    stats_timed(STAT_DATABASE, start);
+    return ret;
+}
 
-    if(sqlite3_step(stmt_insert_connection) != SQLITE_DONE)
-        goto sqlerror;
-    sqlite3_reset(stmt_insert_connection);
+static int add_latency(unsigned int process, const char *syscall,
+                       const char *path, unsigned int count,
+                       unsigned long long time, const char *histogram)
+{
+    if(forward != NULL)
+    {
+        struct forwarded *rec = forward_new(FWD_LATENCY, process, syscall,
+                                            path, histogram);
+        if(rec == NULL)
+            return -1;
+        rec->args[0] = (int)count;
+        rec->time = time;
+        return forward_queue(rec);
+    }
+    else if(event_log)
+    {
+        struct event event;
+        const char *strings[EV_STRINGS];
+        event_init(&event, EV_LATENCY, process);
+        event.timestamp = time;
+        event.args[0] = count;
+        event_string(&event, strings, 0, syscall);
+        event_string(&event, strings, 1, path);
+        event_string(&event, strings, 2, histogram);
+        return eventlog_write(&event, strings);
+    }
+    else if(ring != NULL)
+    {
+        struct record rec;
+        const char *strings[3];
+        int i;
+        if(writer_check() != 0)
+            return -1;
+        rec.type = REC_LATENCY;
+        rec.timestamp = time;
+        rec.process = process;
+        rec.mode = count;
+        strings[0] = syscall;
+        strings[1] = path;
+        strings[2] = histogram;
+        for(i = 0; i < 3; ++i)
+            rec.lengths[i] = strings[i] == NULL?REC_NULL_STRING:
+                                               strlen(strings[i]) + 1;
+        ring_push(&rec, strings);
+    }
+    else if(write_latency(process, syscall, path, count, time,
+                          histogram) != 0)
+    {
+        /* LCOV_EXCL_START : Insertions shouldn't fail */
+        log_critical(0, "sqlite3 error inserting latency: %s",
+                     sqlite3_errmsg(db));
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    return 0;
+}
+
+int db_add_latency(unsigned int process, const char *syscall,
+                   const char *path, unsigned int count,
+                   unsigned long long time, const char *histogram)
+{
+    stats_time start = stats_clock();
+    int ret = add_latency(process, syscall, path, count, time, histogram);
+    stats_timed(STAT_DATABASE, start);
+    return ret;
+}
+
+
+static int replay_event(const struct event *event,
+                        const char *const *strings, void *data)
+{
+    unsigned int process = first_process_id + event->process;
+    (void)data;
+    if(event->type != EV_PROCESS && event->type != EV_STATS
+     && event->process >= processes_count)
+        goto corrupted;
+    switch(event->type)
+    {
+    case EV_PROCESS:
+        {
+            struct db_process *proc;
+            if(event->process != processes_count)
+                goto corrupted;
+            proc = new_process();
+            if(event->args[0] == EV_NO_PARENT)
+                proc->parent = DB_NO_PARENT;
+            else
+                proc->parent = first_process_id + event->args[0];
+            proc->is_thread = event->args[1];
+            proc->timestamp = event->timestamp;
+            proc->exited = 0;
+        }
+        break;
+    case EV_EXIT:
+        {
+            struct db_process *proc = &processes[event->process];
+            proc->exited = 1;
+            proc->exitcode = event->args[0];
+            proc->exit_timestamp = event->timestamp;
+            if(strings[0] == NULL)
+            {
+                db_usage_unknown(&proc->usage);
+                proc->usage.user_time = (int)event->args[1];
+            }
+            else if(event->lengths[0] == EV_USAGE_SIZE)
+                usage_from_event(strings[0], &proc->usage);
+            else
+                goto corrupted;
+        }
+        break;
+    case EV_FILE:
+        if(strings[0] == NULL)
+            goto corrupted;
+        if(write_file_open(first_file_id + event->args[2], process,
+                           strings[0], event->timestamp,
+                           event->args[0], event->args[1]) != 0)
+            goto sqlerror;
+        break;
+    case EV_FILE_HITS:
+        if(write_hits(first_file_id + event->args[0], event->timestamp,
+                      event->args[1]) != 0)
+            goto sqlerror;
+        break;
+    case EV_FILE_IO:
+        {
+            unsigned long long read = event->args[2];
+            read = read << 32 | event->args[1];
+            if(write_io(first_file_id + event->args[0], read,
+                        event->timestamp) != 0)
+                goto sqlerror;
+        }
+        break;
+    case EV_EXEC:
+        {
+            char *argv, *envp;
+            if(strings[0] == NULL || strings[1] == NULL
+             || strings[2] == NULL || strings[3] == NULL)
+                goto corrupted;
+            /* write_exec() takes ownership of these */
+            argv = malloc(event->lengths[1]);
+            memcpy(argv, strings[1], event->lengths[1]);
+            envp = malloc(event->lengths[2]);
+            memcpy(envp, strings[2], event->lengths[2]);
+            if(write_exec(process, strings[0], event->timestamp,
+                          argv, event->lengths[1], envp, event->lengths[2],
+                          strings[3]) != 0)
+                goto sqlerror;
+        }
+        break;
+    case EV_CONNECTION:
+        if(write_connection(process, event->timestamp, event->args[0],
+                            strings[0], strings[1], strings[2]) != 0)
+            goto sqlerror;
+        break;
+    case EV_LATENCY:
+        if(strings[0] == NULL && strings[1] == NULL)
+            goto corrupted;
+        if(write_latency(process, strings[0], strings[1], event->args[0],
+                         event->timestamp, strings[2]) != 0)
+            goto sqlerror;
+        break;
+    case EV_STATS:
+        {
+            unsigned long long count = event->args[1];
+            if(strings[0] == NULL)
+                goto corrupted;
+            count = count << 32 | event->args[0];
+            if(write_stat(strings[0], strings[1], count,
+                          event->args[2]?(long long)event->timestamp:-1,
+                          NULL) != 0)
+                goto sqlerror;
+        }
+        break;
+    default:
+        goto corrupted;
+    }
     return 0;
 
+corrupted:
+    log_critical(0, "event log is corrupted (event type %u, process %u)",
+                 event->type, event->process);
+    return -1;
+
 sqlerror:
     /* LCOV_EXCL_START : Insertions shouldn't fail */
-    log_critical(0, "sqlite3 error inserting network connection: %s",
+    log_critical(0, "sqlite3 error converting event log: %s",
                  sqlite3_errmsg(db));
     return -1;
     /* LCOV_EXCL_END */
 }
+
+int db_convert_event_log(const char *logfile, const char *filename)
+{
+    if(db_init(filename, 0) != 0)
+        return -1;
+    if(eventlog_replay(logfile, replay_event, NULL) != 0)
+    {
+        db_close(1);
+        return -1;
+    }
+    return db_close(0);
+}
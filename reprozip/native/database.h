@@ -7,19 +7,79 @@
 #define FILE_STAT   0x08  /* File is stat()d (only metadata is read) */
 #define FILE_LINK   0x10  /* The link itself is accessed, no dereference */
 
-int db_init(const char *filename);
+/* Flags for db_init() */
+#define DB_WRITER_THREAD    0x01    /* SQLite is driven from a separate
+                                     * thread */
+#define DB_EVENT_LOG        0x02    /* Events are appended to a binary log
+                                     * instead of a SQLite database */
+
+int db_init(const char *filename, unsigned int flags);
 int db_close(int rollback);
 int db_add_process(unsigned int *id, unsigned int parent_id,
                    const char *working_dir, int is_thread);
-int db_add_exit(unsigned int id, int exitcode, int cpu_time);
+/* Resources used by a process, see getrusage(2) and proc(5); -1 if unknown */
+struct db_usage {
+    long long user_time, system_time;   /* Milliseconds */
+    long long max_rss;                  /* Kilobytes */
+    long long voluntary_switches, involuntary_switches;
+    long long block_reads, block_writes;    /* 512-byte blocks */
+    long long io_read, io_write;        /* Bytes, through syscalls (rchar and
+                                         * wchar) */
+};
+void db_usage_unknown(struct db_usage *usage);
+/* usage can be NULL */
+int db_add_exit(unsigned int id, int exitcode, const struct db_usage *usage);
 int db_add_first_process(unsigned int *id, const char *working_dir);
+/* Only the first access to a path in a given mode by a process is recorded,
+ * and accesses to ignored paths (see add_ignored_path()) are dropped.
+ * is_dir can be DB_IS_DIR_UNKNOWN, then path_is_dir() is only called if the
+ * access is recorded. */
+#define DB_IS_DIR_UNKNOWN (-1)
 int db_add_file_open(unsigned int process,
                      const char *name, unsigned int mode,
                      int is_dir);
+/* Adds to the bytes read and written through a file, which was recorded with
+ * db_add_file_open() with the same process, name and mode (nothing happens if
+ * it wasn't, for instance if the path is ignored) */
+int db_add_file_io(unsigned int process,
+                   const char *name, unsigned int mode,
+                   unsigned long long read, unsigned long long written);
+/* Takes ownership of argv and envp, which are NUL-separated */
 int db_add_exec(unsigned int process, const char *binary,
-                const char *const *argv, const char *const *envp,
+                char *argv, size_t argv_len,
+                char *envp, size_t envp_len,
                 const char *workingdir);
 int db_add_connection(unsigned int process, int inbound, const char *family,
                       const char *protocol, const char *address);
+/* Records a latency histogram, see latency_foreach() */
+int db_add_latency(unsigned int process, const char *syscall,
+                   const char *path, unsigned int count,
+                   unsigned long long time, const char *histogram);
+
+/* Called with each file access and execution when they get recorded, in the
+ * order they are recorded, from the tracing thread. Executions are reported
+ * with is_exec set and the binary as name. Set for the trace running in the
+ * calling thread, NULL to unset. */
+typedef void db_listener_func(void *data, const char *name, unsigned int mode,
+                              int is_exec);
+void db_set_listener(db_listener_func *func, void *data);
+
+/* Sharded tracing: the tracer threads forward their db_add_*() calls to the
+ * thread that opened the database, which makes them in db_forward_run() until
+ * the given number of senders have called db_forward_detach(). In a thread
+ * that called db_forward_attach(), the identifiers given by db_add_process()
+ * are only meaningful to the db_add_*() calls of the other senders.
+ * db_forward_flush() hands over the calls made so far, which are otherwise
+ * sent in batches. */
+struct db_forward;
+struct db_forward *db_forward_new(unsigned int senders);
+void db_forward_attach(struct db_forward *fwd);
+void db_forward_flush(void);
+void db_forward_detach(void);
+int db_forward_run(struct db_forward *fwd);
+void db_forward_free(struct db_forward *fwd);
+
+/* Writes the events from a binary log to the trace database */
+int db_convert_event_log(const char *logfile, const char *filename);
 
 #endif
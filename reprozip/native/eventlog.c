@@ -0,0 +1,257 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "eventlog.h"
+#include "log.h"
+
+
+/* The file is mapped through a window that moves forward as records are
+ * appended; the file is extended by at least this much at a time */
+#define EVENTLOG_WINDOW ((size_t)8 << 20)
+
+/* Written pages are flushed to disk this often (in nanoseconds). This is
+ * timed with its own clock, as not all records hold a time in timestamp */
+#define EVENTLOG_SYNC_INTERVAL 1000000000ull
+
+static __thread int log_fd = -1;
+static __thread char *window = NULL;
+static __thread uint64_t window_start;
+static __thread size_t window_size;
+static __thread uint64_t position;
+static __thread uint64_t last_sync;
+
+static uint64_t sync_clock(void)
+{
+    struct timespec now;
+    /* The coarse clock is enough here, and doesn't cost a syscall */
+    if(clock_gettime(CLOCK_MONOTONIC_COARSE, &now) != 0)
+        return 0; /* LCOV_EXCL_LINE : clock_gettime() is unlikely to fail */
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static int map_window(size_t needed)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    if(window != NULL)
+        munmap(window, window_size);
+    window_start = position & ~(uint64_t)(page_size - 1);
+    window_size = EVENTLOG_WINDOW;
+    while(window_size < position - window_start + needed)
+        window_size *= 2;
+    if(ftruncate(log_fd, window_start + window_size) != 0)
+    {
+        log_critical(0, "couldn't extend event log: %s", strerror(errno));
+        window = NULL;
+        return -1;
+    }
+    window = mmap(NULL, window_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  log_fd, window_start);
+    if(window == MAP_FAILED)
+    {
+        log_critical(0, "couldn't map event log: %s", strerror(errno));
+        window = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int eventlog_open(const char *filename)
+{
+    struct eventlog_header *header;
+    log_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(log_fd == -1)
+    {
+        log_critical(0, "couldn't open event log %s: %s",
+                     filename, strerror(errno));
+        return -1;
+    }
+    position = 0;
+    last_sync = sync_clock();
+    if(map_window(sizeof(*header)) != 0)
+    {
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+    }
+    header = (struct eventlog_header*)window;
+    memcpy(header->magic, EVENTLOG_MAGIC, sizeof(header->magic));
+    header->version = EVENTLOG_VERSION;
+    header->event_size = sizeof(struct event);
+    position = sizeof(*header);
+    log_debug(0, "event log opened: %s", filename);
+    return 0;
+}
+
+int eventlog_write(struct event *event, const char *const *strings)
+{
+    size_t size = sizeof(*event);
+    uint32_t type = event->type;
+    char *record;
+    size_t i;
+    uint64_t now;
+    for(i = 0; i < EV_STRINGS; ++i)
+        if(event->lengths[i] != EV_NULL_STRING)
+            size += event->lengths[i];
+    size = (size + 7) & ~(size_t)7;
+    if(position + size > window_start + window_size
+     && map_window(size) != 0)
+        return -1;
+    record = window + (position - window_start);
+
+    event->type = 0;
+    event->size = size;
+    memcpy(record, event, sizeof(*event));
+    event->type = type;
+    {
+        char *p = record + sizeof(*event);
+        for(i = 0; i < EV_STRINGS; ++i)
+            if(event->lengths[i] != EV_NULL_STRING)
+            {
+                memcpy(p, strings[i], event->lengths[i]);
+                p += event->lengths[i];
+            }
+    }
+    /* The type goes last, so a partially-written record is never read */
+    __atomic_store_n(&((struct event*)record)->type, type, __ATOMIC_RELEASE);
+    position += size;
+
+    /* With a shared mapping, fdatasync() also writes out the mapped pages */
+    now = sync_clock();
+    if(now - last_sync >= EVENTLOG_SYNC_INTERVAL)
+    {
+        fdatasync(log_fd);
+        last_sync = now;
+    }
+    return 0;
+}
+
+int eventlog_close(void)
+{
+    int ret = 0;
+    struct event end;
+    memset(&end, 0, sizeof(end));
+    end.type = EV_END;
+    end.lengths[0] = end.lengths[1] = end.lengths[2] = end.lengths[3] =
+            EV_NULL_STRING;
+    if(eventlog_write(&end, NULL) != 0)
+        ret = -1;
+    if(window != NULL)
+        munmap(window, window_size);
+    window = NULL;
+    if(ftruncate(log_fd, position) != 0 || fdatasync(log_fd) != 0)
+    {
+        /* LCOV_EXCL_START : Truncating to a smaller size shouldn't fail */
+        log_critical(0, "couldn't finish event log: %s", strerror(errno));
+        ret = -1;
+        /* LCOV_EXCL_END */
+    }
+    close(log_fd);
+    log_fd = -1;
+    log_debug(0, "event log closed");
+    return ret;
+}
+
+int eventlog_replay(const char *filename, eventlog_callback *callback,
+                    void *data)
+{
+    int fd, ret = 0, complete = 0;
+    struct stat st;
+    const char *map;
+    const struct eventlog_header *header;
+    size_t pos;
+    unsigned long nb_events = 0;
+
+    fd = open(filename, O_RDONLY);
+    if(fd == -1 || fstat(fd, &st) != 0)
+    {
+        log_critical(0, "couldn't open event log %s: %s",
+                     filename, strerror(errno));
+        if(fd != -1)
+            close(fd);
+        return -1;
+    }
+    if((size_t)st.st_size < sizeof(*header))
+    {
+        log_critical(0, "%s is not an event log", filename);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        log_critical(0, "couldn't map event log: %s", strerror(errno));
+        return -1;
+    }
+    header = (const struct eventlog_header*)map;
+    if(memcmp(header->magic, EVENTLOG_MAGIC, sizeof(header->magic)) != 0)
+    {
+        log_critical(0, "%s is not an event log", filename);
+        munmap((void*)map, st.st_size);
+        return -1;
+    }
+    if(header->version != EVENTLOG_VERSION
+     || header->event_size != sizeof(struct event))
+    {
+        log_critical(0, "event log version %u is not supported",
+                     header->version);
+        munmap((void*)map, st.st_size);
+        return -1;
+    }
+
+    pos = sizeof(*header);
+    while(pos + sizeof(struct event) <= (size_t)st.st_size)
+    {
+        const struct event *event = (const struct event*)(map + pos);
+        const char *strings[EV_STRINGS];
+        const char *p = map + pos + sizeof(*event);
+        const char *end = map + pos + event->size;
+        size_t i;
+        if(event->type == 0)
+            break;
+        if(event->size < sizeof(*event) || event->size % 8 != 0
+         || event->size > st.st_size - pos)
+            break;
+        for(i = 0; i < EV_STRINGS; ++i)
+        {
+            uint32_t len = event->lengths[i];
+            if(len == EV_NULL_STRING)
+                strings[i] = NULL;
+            else if(len == 0 || len > (size_t)(end - p) || p[len - 1] != '\0')
+                break;
+            else
+            {
+                strings[i] = p;
+                p += len;
+            }
+        }
+        if(i != EV_STRINGS)
+            break;
+        if(event->type == EV_END)
+        {
+            complete = 1;
+            break;
+        }
+        if(callback(event, strings, data) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        ++nb_events;
+        pos += event->size;
+    }
+    munmap((void*)map, st.st_size);
+
+    if(ret == 0 && !complete)
+        log_warn(0, "event log %s is incomplete (was the tracer killed?), "
+                 "recovered %lu events", filename, nb_events);
+    return ret;
+}
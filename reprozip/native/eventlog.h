@@ -0,0 +1,79 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <stdint.h>
+
+/* Binary event log
+ *
+ * The file starts with a struct eventlog_header, followed by records. Each
+ * record is a struct event, then the strings it references (each with its
+ * length in the lengths array, including NULs), padded to a multiple of 8
+ * bytes. The type of a record is written last, and the file is extended with
+ * zeros, so a log whose writer was killed ends at the first zero type. */
+
+#define EVENTLOG_MAGIC      "RPZEVLOG"
+/* Bumped with every change to the records, as logs of other versions are
+ * rejected rather than misread:
+ *   1: first version
+ *   2: row argument of EV_FILE, EV_FILE_HITS
+ *   3: EV_STATS
+ *   4: EV_LATENCY
+ *   5: resource usage in EV_EXIT
+ *   6: EV_FILE_IO
+ *   7: EV_EXIT usage written field by field */
+#define EVENTLOG_VERSION    7
+
+struct eventlog_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;        /* sizeof(struct event) */
+};
+
+#define EV_PROCESS      1   /* args: parent, is_thread */
+#define EV_EXIT         2   /* args: exitcode, cpu_time; strings: the
+                             * resource usage as 9 int64_t (see
+                             * usage_to_event()) followed by a NUL, or
+                             * none */
+#define EV_FILE         3   /* args: mode, is_dir, row (numbered from 0);
+                             * strings: name */
+#define EV_EXEC         4   /* strings: binary, argv, envp, workingdir */
+#define EV_CONNECTION   5   /* args: inbound; strings: family, protocol,
+                             * address */
+#define EV_END          6   /* Written when the log is closed */
+#define EV_FILE_HITS    7   /* args: row, hits; timestamp is the last one
+                             * (written when the log is closed) */
+#define EV_STATS        8   /* args: count (low and high 32 bits), has_time;
+                             * timestamp is the time; strings: name, syscall
+                             * (written when the log is closed) */
+#define EV_LATENCY      9   /* args: count; timestamp is the total time;
+                             * strings: syscall, path, histogram */
+#define EV_FILE_IO      10  /* args: row, bytes read (low and high 32
+                             * bits); timestamp is the bytes written
+                             * (written when the log is closed) */
+
+#define EV_NULL_STRING  0xFFFFFFFFu
+#define EV_NO_PARENT    0xFFFFFFFFu
+
+#define EV_STRINGS      4
+
+struct event {
+    uint32_t type;
+    uint32_t size;              /* Whole record, multiple of 8 */
+    uint64_t timestamp;
+    uint32_t process;           /* Numbered from 0 in EV_PROCESS order */
+    uint32_t args[3];
+    uint32_t lengths[EV_STRINGS];
+};
+
+int eventlog_open(const char *filename);
+int eventlog_write(struct event *event, const char *const *strings);
+int eventlog_close(void);
+
+/* Calls the callback for each event in the log. strings[i] is NULL if
+ * lengths[i] is EV_NULL_STRING. Stops if the callback returns non-zero. */
+typedef int eventlog_callback(const struct event *event,
+                              const char *const *strings, void *data);
+int eventlog_replay(const char *filename, eventlog_callback *callback,
+                    void *data);
+
+#endif
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE /* O_LARGEFILE */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "database.h"
+#include "fanotify.h"
+#include "log.h"
+#include "syscalls.h"
+#include "tracer.h"
+
+
+#define verbosity trace_verbosity
+
+#ifndef FAN_REPORT_TID
+#define FAN_REPORT_TID 0x00000100
+#endif
+
+
+static __thread int fan_fd = -1;
+
+int fanotify_start(const char *const *paths)
+{
+    const unsigned int flags = FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK
+                             | FAN_UNLIMITED_QUEUE;
+    const char *const *path;
+
+    /* Threads are reported since Linux 4.20, thread groups before that */
+    fan_fd = fanotify_init(flags | FAN_REPORT_TID, O_RDONLY | O_LARGEFILE);
+    if(fan_fd < 0 && errno == EINVAL)
+        fan_fd = fanotify_init(flags, O_RDONLY | O_LARGEFILE);
+    if(fan_fd < 0)
+    {
+        log_critical(0, "couldn't initialize fanotify: %s%s", strerror(errno),
+                     (errno == EPERM)?" (this requires root)":"");
+        return -1;
+    }
+    for(path = paths; *path != NULL; ++path)
+    {
+        if(fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT,
+                         FAN_CLOSE_WRITE | FAN_CLOSE_NOWRITE | FAN_ONDIR,
+                         AT_FDCWD, *path) != 0)
+        {
+            log_critical(0, "couldn't watch the mount of %s with fanotify: %s",
+                         *path, strerror(errno));
+            close(fan_fd);
+            fan_fd = -1;
+            return -1;
+        }
+        if(verbosity >= 2)
+            log_info(0, "watching the mount of %s with fanotify", *path);
+    }
+    return 0;
+}
+
+int fanotify_stop(void)
+{
+    if(fan_fd < 0)
+        return 0;
+    close(fan_fd);
+    fan_fd = -1;
+    return 0;
+}
+
+/* Gets the path of an event's file descriptor */
+static char *fd_path(int fd, const struct stat *st)
+{
+    char link[64];
+    /* PATH_MAX has issues, don't use it */
+    size_t size = 1024;
+    char *path;
+    sprintf(link, "/proc/self/fd/%d", fd);
+    for(;;)
+    {
+        ssize_t len;
+        path = malloc(size);
+        len = readlink(link, path, size);
+        if(len < 0)
+        {
+            /* LCOV_EXCL_START : we own that file descriptor */
+            log_error(0, "couldn't read fanotify file descriptor: %s",
+                      strerror(errno));
+            free(path);
+            return NULL;
+            /* LCOV_EXCL_END */
+        }
+        else if((size_t)len < size)
+        {
+            path[len] = '\0';
+            /* Files removed while open, e.g. temporary files */
+            if(st->st_nlink == 0 && len > 10
+             && strcmp(path + len - 10, " (deleted)") == 0)
+                path[len - 10] = '\0';
+            return path;
+        }
+        free(path);
+        size <<= 1;
+    }
+}
+
+int fanotify_receive(void)
+{
+    /* Aligned for struct fanotify_event_metadata */
+    uint64_t buffer[1024];
+    for(;;)
+    {
+        struct fanotify_event_metadata *event = (void*)buffer;
+        ssize_t len = read(fan_fd, buffer, sizeof(buffer));
+        if(len < 0)
+        {
+            if(errno == EAGAIN)
+                return 0;
+            else if(errno == EINTR)
+                continue;
+            /* LCOV_EXCL_START */
+            log_critical(0, "couldn't read fanotify events: %s",
+                         strerror(errno));
+            return -1;
+            /* LCOV_EXCL_END */
+        }
+        for(; FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len))
+        {
+            struct stat st;
+            char *pathname;
+            unsigned int mode = 0;
+            int ret;
+            if(event->vers != FANOTIFY_METADATA_VERSION)
+            {
+                /* LCOV_EXCL_START */
+                log_critical(0, "unknown fanotify metadata version %u",
+                             (unsigned int)event->vers);
+                return -1;
+                /* LCOV_EXCL_END */
+            }
+            if(event->mask & FAN_Q_OVERFLOW)
+            {
+                /* LCOV_EXCL_START : the queue is unlimited */
+                log_error(0, "fanotify queue overflowed, file accesses were "
+                          "lost");
+                continue;
+                /* LCOV_EXCL_END */
+            }
+            if(event->fd < 0)
+                continue;
+            /* Other processes on the same mounts */
+            if(trace_find_process(event->pid) == NULL)
+            {
+                close(event->fd);
+                continue;
+            }
+            if(event->mask & FAN_CLOSE_NOWRITE)
+                mode |= FILE_READ;
+            if(event->mask & FAN_CLOSE_WRITE)
+                mode |= FILE_WRITE;
+            if(fstat(event->fd, &st) != 0)
+            {
+                /* LCOV_EXCL_START */
+                close(event->fd);
+                continue;
+                /* LCOV_EXCL_END */
+            }
+            pathname = fd_path(event->fd, &st);
+            close(event->fd);
+            if(pathname == NULL)
+                continue;
+            ret = syscall_fanotify_event(event->pid, pathname, mode,
+                                         S_ISDIR(st.st_mode));
+            free(pathname);
+            if(ret != 0)
+                return -1;
+        }
+    }
+}
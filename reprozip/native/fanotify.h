@@ -0,0 +1,21 @@
+#ifndef FANOTIFY_H
+#define FANOTIFY_H
+
+/* Recording file accesses with fanotify
+ *
+ * The mounts holding the given paths are watched for files being closed, which
+ * the kernel reports along with the process that had them open, without
+ * stopping it. Files that were open for writing are recorded as written, the
+ * others as read. This needs CAP_SYS_ADMIN.
+ *
+ * Events are queued by the kernel until fanotify_receive() reads them; the
+ * tracer does that whenever it wakes up, so that the events of a process that
+ * exited are read before it is removed. */
+
+int fanotify_start(const char *const *paths);
+int fanotify_stop(void);
+
+/* Hands the queued events to syscall_fanotify_event() */
+int fanotify_receive(void);
+
+#endif
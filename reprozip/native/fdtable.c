@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "fdtable.h"
+
+
+struct FdEntry {
+    char *path;                 /* NULL if the descriptor isn't known */
+    unsigned int process;
+    unsigned int mode;
+    int cloexec;
+    unsigned long long read, written;
+};
+
+/* Indexed by descriptor, they are small numbers */
+struct FdTable {
+    struct FdEntry *entries;
+    size_t size;
+};
+
+struct FdTable *fdtable_new(void)
+{
+    struct FdTable *table = malloc(sizeof(*table));
+    table->size = 16;
+    table->entries = calloc(table->size, sizeof(*table->entries));
+    return table;
+}
+
+struct FdTable *fdtable_copy(const struct FdTable *table)
+{
+    struct FdTable *copy = malloc(sizeof(*copy));
+    size_t fd;
+    copy->size = table->size;
+    copy->entries = malloc(copy->size * sizeof(*copy->entries));
+    for(fd = 0; fd < table->size; ++fd)
+    {
+        copy->entries[fd] = table->entries[fd];
+        if(table->entries[fd].path != NULL)
+            copy->entries[fd].path = strdup(table->entries[fd].path);
+        copy->entries[fd].read = copy->entries[fd].written = 0;
+    }
+    return copy;
+}
+
+static struct FdEntry *fdtable_get(const struct FdTable *table, int fd)
+{
+    if(fd < 0 || (size_t)fd >= table->size
+     || table->entries[fd].path == NULL)
+        return NULL;
+    return &table->entries[fd];
+}
+
+static struct FdEntry *fdtable_slot(struct FdTable *table, int fd)
+{
+    if((size_t)fd >= table->size)
+    {
+        size_t old_size = table->size;
+        while((size_t)fd >= table->size)
+            table->size *= 2;
+        table->entries = realloc(table->entries,
+                                 table->size * sizeof(*table->entries));
+        memset(table->entries + old_size, 0,
+               (table->size - old_size) * sizeof(*table->entries));
+    }
+    free(table->entries[fd].path);
+    return &table->entries[fd];
+}
+
+void fdtable_open(struct FdTable *table, int fd, unsigned int process,
+                  const char *path, unsigned int mode, int cloexec)
+{
+    struct FdEntry *entry;
+    if(fd < 0)
+        return;
+    entry = fdtable_slot(table, fd);
+    entry->path = strdup(path);
+    entry->process = process;
+    entry->mode = mode;
+    entry->cloexec = cloexec;
+    entry->read = entry->written = 0;
+}
+
+void fdtable_dup(struct FdTable *table, int oldfd, int newfd, int cloexec)
+{
+    const struct FdEntry *old = fdtable_get(table, oldfd);
+    if(old != NULL && oldfd != newfd)
+    {
+        /* The slot might move */
+        struct FdEntry copy = *old;
+        fdtable_open(table, newfd, copy.process, copy.path, copy.mode,
+                     cloexec);
+    }
+}
+
+void fdtable_set_cloexec(struct FdTable *table, int first, int last,
+                         int cloexec)
+{
+    size_t fd;
+    if(first < 0)
+        first = 0;
+    for(fd = first; fd < table->size && fd <= (size_t)last; ++fd)
+        table->entries[fd].cloexec = cloexec;
+}
+
+void fdtable_count(struct FdTable *table, int fd,
+                   unsigned long long read, unsigned long long written)
+{
+    struct FdEntry *entry = fdtable_get(table, fd);
+    if(entry != NULL)
+    {
+        entry->read += read;
+        entry->written += written;
+    }
+}
+
+int fdtable_close(struct FdTable *table, int first, int last, int cloexec,
+                  fdtable_callback *callback, void *data)
+{
+    size_t fd;
+    if(first < 0)
+        first = 0;
+    for(fd = first; fd < table->size && fd <= (size_t)last; ++fd)
+    {
+        struct FdEntry *entry = &table->entries[fd];
+        int ret;
+        if(entry->path == NULL || (cloexec && !entry->cloexec))
+            continue;
+        ret = callback(data, entry->process, entry->path, entry->mode,
+                       entry->read, entry->written);
+        free(entry->path);
+        entry->path = NULL;
+        if(ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+void fdtable_free(struct FdTable *table)
+{
+    size_t fd;
+    if(table == NULL)
+        return;
+    for(fd = 0; fd < table->size; ++fd)
+        free(table->entries[fd].path);
+    free(table->entries);
+    free(table);
+}
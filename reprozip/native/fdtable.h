@@ -0,0 +1,46 @@
+#ifndef FDTABLE_H
+#define FDTABLE_H
+
+/* Files opened by a thread group, for TRACE_OPT_IO_VOLUME
+ *
+ * Each descriptor that the tracer saw being opened on a recorded path has an
+ * entry, with the process and mode the access was recorded with and the bytes
+ * read and written through it so far. The totals are handed to a callback when
+ * the descriptor is closed (including by dup2() over it or by exec if it is
+ * close-on-exec), and when the thread group goes away. A descriptor made with
+ * dup() gets its own entry, with its own totals, that are added to the same
+ * access. A new thread group gets a copy of its parent's table, with the
+ * totals at 0. */
+
+struct FdTable;
+
+struct FdTable *fdtable_new(void);
+struct FdTable *fdtable_copy(const struct FdTable *table);
+
+/* Replaces the entry of fd, which should have been closed */
+void fdtable_open(struct FdTable *table, int fd, unsigned int process,
+                  const char *path, unsigned int mode, int cloexec);
+void fdtable_dup(struct FdTable *table, int oldfd, int newfd, int cloexec);
+void fdtable_set_cloexec(struct FdTable *table, int first, int last,
+                         int cloexec);
+
+/* Does nothing if fd is not in the table */
+void fdtable_count(struct FdTable *table, int fd,
+                   unsigned long long read, unsigned long long written);
+
+/* Called with the access of a descriptor that is closed, and its totals */
+typedef int fdtable_callback(void *data, unsigned int process,
+                             const char *path, unsigned int mode,
+                             unsigned long long read,
+                             unsigned long long written);
+
+/* Closes the descriptors from first to last (included), or only the
+ * close-on-exec ones if cloexec is set. Stops if the callback returns
+ * non-zero. */
+int fdtable_close(struct FdTable *table, int first, int last, int cloexec,
+                  fdtable_callback *callback, void *data);
+
+/* Doesn't call the callback, close everything first */
+void fdtable_free(struct FdTable *table);
+
+#endif
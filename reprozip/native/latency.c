@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency.h"
+#include "stats.h"
+
+
+#define LATENCY_MIN_SHIFT   10  /* Bucket 0 is everything under 2^10ns */
+#define LATENCY_MAX_SHIFT   39  /* The last bucket has everything above */
+#define LATENCY_SUB_BITS    2   /* 4 buckets per power of two */
+#define LATENCY_BUCKETS \
+    (1 + ((LATENCY_MAX_SHIFT - LATENCY_MIN_SHIFT + 1) << LATENCY_SUB_BITS))
+
+#define LATENCY_SLOWEST     4   /* Slowest calls kept in a table of paths */
+
+struct LatencyHistogram {
+    unsigned int count;
+    unsigned long long time;    /* Sum of the values */
+    unsigned int buckets[LATENCY_BUCKETS];
+};
+
+/* A histogram is either for a syscall, or for the paths in a directory */
+struct LatencyEntry {
+    struct LatencyHistogram *histogram;     /* NULL if the slot is empty */
+    unsigned int hash;
+    unsigned int abi;
+    int syscall;
+    const char *name;
+    char *path;
+};
+
+struct LatencySlowest {
+    unsigned long long latency;
+    const char *syscall;
+    char *path;
+};
+
+struct LatencyTable {
+    struct LatencyEntry *entries;
+    size_t size, count;
+    struct LatencySlowest slowest[LATENCY_SLOWEST];
+};
+
+static unsigned int bucket_index(unsigned long long value)
+{
+    unsigned int shift;
+    if(value < (1ULL << LATENCY_MIN_SHIFT))
+        return 0;
+    shift = 63 - __builtin_clzll(value);
+    if(shift > LATENCY_MAX_SHIFT)
+        return LATENCY_BUCKETS - 1;
+    return 1 + ((shift - LATENCY_MIN_SHIFT) << LATENCY_SUB_BITS)
+             + ((value >> (shift - LATENCY_SUB_BITS))
+                & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+static unsigned long long bucket_lower(unsigned int index)
+{
+    unsigned int shift, sub;
+    if(index == 0)
+        return 0;
+    shift = LATENCY_MIN_SHIFT + ((index - 1) >> LATENCY_SUB_BITS);
+    sub = (index - 1) & ((1 << LATENCY_SUB_BITS) - 1);
+    return (unsigned long long)((1 << LATENCY_SUB_BITS) | sub)
+           << (shift - LATENCY_SUB_BITS);
+}
+
+static void histogram_add(struct LatencyHistogram *histogram,
+                          unsigned long long value)
+{
+    histogram->count++;
+    histogram->time += value;
+    histogram->buckets[bucket_index(value)]++;
+}
+
+static char *histogram_format(const struct LatencyHistogram *histogram)
+{
+    char *buffer = malloc(LATENCY_BUCKETS * 32);
+    char *p = buffer;
+    unsigned int i;
+    *p = '\0';
+    for(i = 0; i < LATENCY_BUCKETS; ++i)
+        if(histogram->buckets[i] > 0)
+            p += sprintf(p, "%s%llu:%u", (p == buffer)?"":" ",
+                         bucket_lower(i), histogram->buckets[i]);
+    return buffer;
+}
+
+static unsigned int path_hash(const char *pathname, size_t len)
+{
+    /* FNV-1a */
+    unsigned int hash = 2166136261u;
+    const char *end = pathname + len;
+    for(; pathname < end; ++pathname)
+        hash = (hash ^ (unsigned char)*pathname) * 16777619u;
+    return hash;
+}
+
+static int entry_matches(const struct LatencyEntry *entry, unsigned int hash,
+                         unsigned int abi, int syscall,
+                         const char *path, size_t len)
+{
+    if(entry->hash != hash)
+        return 0;
+    if(path == NULL)
+        return entry->path == NULL
+            && entry->abi == abi && entry->syscall == syscall;
+    return entry->path != NULL
+        && strncmp(entry->path, path, len) == 0 && entry->path[len] == '\0';
+}
+
+static struct LatencyEntry *table_slot(struct LatencyTable *table,
+                                       unsigned int hash,
+                                       unsigned int abi, int syscall,
+                                       const char *path, size_t len)
+{
+    size_t mask = table->size - 1;
+    size_t i = hash & mask;
+    while(table->entries[i].histogram != NULL
+     && !entry_matches(&table->entries[i], hash, abi, syscall, path, len))
+        i = (i + 1) & mask;
+    return &table->entries[i];
+}
+
+/* Finds or creates the histogram of a syscall (path is NULL) or a
+ * directory, whose name is the first len characters of path */
+static struct LatencyHistogram *table_get(struct LatencyTable **p_table,
+                                          unsigned int hash,
+                                          unsigned int abi, int syscall,
+                                          const char *path, size_t len)
+{
+    struct LatencyTable *table = *p_table;
+    struct LatencyEntry *entry;
+    if(table == NULL)
+    {
+        table = *p_table = calloc(1, sizeof(*table));
+        table->size = 16;
+        table->entries = calloc(table->size, sizeof(*table->entries));
+    }
+    entry = table_slot(table, hash, abi, syscall, path, len);
+    if(entry->histogram != NULL)
+        return entry->histogram;
+    if((table->count + 1) * 2 > table->size)
+    {
+        struct LatencyEntry *old = table->entries;
+        size_t i, old_size = table->size;
+        table->size *= 2;
+        table->entries = calloc(table->size, sizeof(*table->entries));
+        for(i = 0; i < old_size; ++i)
+            if(old[i].histogram != NULL)
+                *table_slot(table, old[i].hash, old[i].abi, old[i].syscall,
+                            old[i].path,
+                            old[i].path?strlen(old[i].path):0) = old[i];
+        free(old);
+        entry = table_slot(table, hash, abi, syscall, path, len);
+    }
+    entry->histogram = calloc(1, sizeof(*entry->histogram));
+    entry->hash = hash;
+    entry->abi = abi;
+    entry->syscall = syscall;
+    entry->name = NULL;
+    entry->path = NULL;
+    if(path != NULL)
+    {
+        entry->path = malloc(len + 1);
+        memcpy(entry->path, path, len);
+        entry->path[len] = '\0';
+    }
+    ++table->count;
+    return entry->histogram;
+}
+
+void latency_record_syscall(struct LatencyTable **table, unsigned int abi,
+                            int syscall, const char *name,
+                            unsigned long long latency)
+{
+    struct LatencyHistogram *histogram = table_get(
+            table, abi * 1024 + (unsigned int)syscall, abi, syscall, NULL, 0);
+    if(histogram->count == 0)
+    {
+        /* Only set once, so it doesn't have to be looked up when found */
+        struct LatencyEntry *entry = table_slot(
+                *table, abi * 1024 + (unsigned int)syscall, abi, syscall,
+                NULL, 0);
+        entry->name = name;
+    }
+    histogram_add(histogram, latency);
+}
+
+void latency_record_path(struct LatencyTable **table, const char *syscall,
+                         const char *pathname, unsigned long long latency)
+{
+    const char *slash = strrchr(pathname, '/');
+    size_t len = (slash == NULL || slash == pathname)?1:slash - pathname;
+    struct LatencySlowest *slowest;
+    unsigned int i;
+    histogram_add(table_get(table, path_hash(pathname, len), 0, -1,
+                            pathname, len),
+                  latency);
+
+    /* Replaces the fastest of the slowest calls */
+    slowest = &(*table)->slowest[0];
+    for(i = 1; i < LATENCY_SLOWEST; ++i)
+        if((*table)->slowest[i].latency < slowest->latency)
+            slowest = &(*table)->slowest[i];
+    if(latency > slowest->latency)
+    {
+        free(slowest->path);
+        slowest->latency = latency;
+        slowest->syscall = syscall;
+        slowest->path = strdup(pathname);
+    }
+}
+
+int latency_foreach(const struct LatencyTable *table,
+                    latency_callback *callback, void *data)
+{
+    size_t i;
+    if(table == NULL)
+        return 0;
+    for(i = 0; i < table->size; ++i)
+    {
+        const struct LatencyEntry *entry = &table->entries[i];
+        char syscall[64];
+        char *histogram;
+        int ret;
+        if(entry->histogram == NULL)
+            continue;
+        if(entry->path == NULL)
+            stats_syscall_name(syscall, sizeof(syscall),
+                               entry->abi, entry->syscall, entry->name);
+        histogram = histogram_format(entry->histogram);
+        ret = callback(data, (entry->path == NULL)?syscall:NULL, entry->path,
+                       entry->histogram->count, entry->histogram->time,
+                       histogram);
+        free(histogram);
+        if(ret != 0)
+            return -1;
+    }
+    for(i = 0; i < LATENCY_SLOWEST; ++i)
+    {
+        const struct LatencySlowest *slowest = &table->slowest[i];
+        if(slowest->path != NULL
+         && callback(data, slowest->syscall, slowest->path, 1,
+                     slowest->latency, NULL) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+void latency_free(struct LatencyTable *table)
+{
+    size_t i;
+    if(table == NULL)
+        return;
+    for(i = 0; i < table->size; ++i)
+    {
+        free(table->entries[i].histogram);
+        free(table->entries[i].path);
+    }
+    for(i = 0; i < LATENCY_SLOWEST; ++i)
+        free(table->slowest[i].path);
+    free(table->entries);
+    free(table);
+}
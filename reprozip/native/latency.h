@@ -0,0 +1,40 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+/* Syscall latency histograms
+ *
+ * The time from resuming a process at its syscall-entry stop to its
+ * syscall-exit stop is the latency of the syscall as the program sees it,
+ * plus the cost of a stop. These times (in nanoseconds) are kept in HDR-style
+ * histograms: 4 buckets per power of two from 1us to about 18 minutes, so a
+ * value is known to within 25%, and all the values under 1us are together.
+ *
+ * The histograms are kept in tables, either per syscall or per directory of
+ * the paths the syscalls were given; the latter also keep the slowest calls
+ * and their full paths. */
+
+struct LatencyTable;
+
+void latency_record_syscall(struct LatencyTable **table, unsigned int abi,
+                            int syscall, const char *name,
+                            unsigned long long latency);
+
+/* syscall is static */
+void latency_record_path(struct LatencyTable **table, const char *syscall,
+                         const char *pathname, unsigned long long latency);
+
+/* Calls the callback for each histogram, with the syscall (see
+ * stats_syscall_name()) or the directory, then for each of the slowest calls,
+ * with both the syscall and the path, a count of 1 and a NULL histogram.
+ * The histograms are given as "lower:count" pairs separated by spaces, lower
+ * being the smallest value in the bucket. Stops if the callback returns
+ * non-zero. */
+typedef int latency_callback(void *data, const char *syscall,
+                             const char *path, unsigned int count,
+                             unsigned long long time, const char *histogram);
+int latency_foreach(const struct LatencyTable *table,
+                    latency_callback *callback, void *data);
+
+void latency_free(struct LatencyTable *table);
+
+#endif
@@ -8,10 +8,14 @@
 #include "log.h"
 
 
-extern int trace_verbosity;
+extern __thread int trace_verbosity;
 
 
-static FILE *logfile = NULL;
+static __thread FILE *logfile = NULL;
+
+/* Where this thread formats its messages */
+static __thread char *buffer = NULL;
+static __thread size_t bufsize = 4096;
 
 
 int log_open_file(const char *filename)
@@ -37,19 +41,37 @@ void log_close_file(void)
 }
 
 
+FILE *log_get_file(void)
+{
+    return logfile;
+}
+
+
+void log_free_buffer(void)
+{
+    free(buffer);
+    buffer = NULL;
+}
+
+
+void log_use_file(FILE *file)
+{
+    logfile = file;
+}
+
+
 void log_real_(pid_t tid, const char *tag, int lvl, const char *format, ...)
 {
     va_list args;
     char datestr[13]; /* HH:MM:SS.mmm */
-    static char *buffer = NULL;
-    static size_t bufsize = 4096;
     int length;
     if(buffer == NULL)
         buffer = malloc(bufsize);
     {
         struct timeval tv;
+        struct tm tm;
         gettimeofday(&tv, NULL);
-        strftime(datestr, 13, "%H:%M:%S", localtime(&tv.tv_sec));
+        strftime(datestr, 13, "%H:%M:%S", localtime_r(&tv.tv_sec, &tm));
         sprintf(datestr+8, ".%03u", (unsigned int)(tv.tv_usec / 1000));
     }
     va_start(args, format);
@@ -10,6 +10,13 @@
 
 int log_open_file(const char *filename);
 void log_close_file(void);
+/* The log file is per-thread; a thread can write to the file of another,
+ * which keeps it open */
+FILE *log_get_file(void);
+void log_use_file(FILE *file);
+/* Frees what this thread allocated for logging, before it exits (logging
+ * again allocates it again) */
+void log_free_buffer(void);
 
 
 void log_real_(pid_t tid, const char *tag, int lvl, const char *format, ...);
@@ -0,0 +1,277 @@
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "preload.h"
+#include "syscalls.h"
+#include "tracer.h"
+
+
+#define verbosity trace_verbosity
+
+
+static __thread char *library = NULL;
+static __thread char *ring_path = NULL;
+static __thread struct preload_ring *ring = NULL;
+/* The handler is shared by the traces running in other threads */
+static struct sigaction old_action;
+static unsigned int handler_users = 0;
+static pthread_mutex_t handler_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Only there to interrupt wait3() */
+static void preload_wakeup(int signo)
+{
+    (void)signo;
+}
+
+int preload_open(const char *lib)
+{
+    const char *dir = "/dev/shm";
+    struct stat st;
+    struct sigaction action;
+    void *map;
+    size_t i;
+    int fd;
+
+    if(stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+        dir = "/tmp";
+    ring_path = malloc(strlen(dir) + 32);
+    sprintf(ring_path, "%s/reprozip-preload-XXXXXX", dir);
+    fd = mkstemp(ring_path);
+    if(fd < 0 || ftruncate(fd, sizeof(struct preload_ring)) != 0)
+    {
+        /* LCOV_EXCL_START : shared memory should be available */
+        log_critical(0, "couldn't create event ring %s: %s", ring_path,
+                     strerror(errno));
+        if(fd >= 0)
+        {
+            close(fd);
+            unlink(ring_path);
+        }
+        free(ring_path);
+        ring_path = NULL;
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    map = mmap(NULL, sizeof(struct preload_ring), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        /* LCOV_EXCL_START */
+        log_critical(0, "couldn't map event ring: %s", strerror(errno));
+        unlink(ring_path);
+        free(ring_path);
+        ring_path = NULL;
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    ring = map;
+    ring->header.h.tracer_pid = getpid();
+    ring->header.h.tracer_tid = syscall(SYS_gettid);
+    for(i = 0; i < PRELOAD_RING_SLOTS; ++i)
+        ring->slots[i].sequence = i;
+    library = strdup(lib);
+
+    /* No SA_RESTART: the signal has to interrupt wait3() */
+    pthread_mutex_lock(&handler_mutex);
+    if(handler_users++ == 0)
+    {
+        action.sa_handler = preload_wakeup;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = 0;
+        sigaction(PRELOAD_SIGNAL, &action, &old_action);
+    }
+    pthread_mutex_unlock(&handler_mutex);
+
+    if(verbosity >= 2)
+        log_info(0, "preloading %s, event ring %s", library, ring_path);
+    return 0;
+}
+
+void preload_setup_child(void)
+{
+    const char *previous = getenv("LD_PRELOAD");
+    if(previous != NULL && previous[0] != '\0')
+    {
+        char *value = malloc(strlen(library) + 1 + strlen(previous) + 1);
+        sprintf(value, "%s:%s", library, previous);
+        setenv("LD_PRELOAD", value, 1);
+        free(value);
+    }
+    else
+        setenv("LD_PRELOAD", library, 1);
+    setenv(PRELOAD_RING_ENV, ring_path, 1);
+}
+
+int preload_close(void)
+{
+    if(ring == NULL)
+        return 0;
+    if(ring->header.h.lost > 0)
+        log_error(0, "%u events from the preloaded library were lost",
+                  (unsigned int)ring->header.h.lost);
+    pthread_mutex_lock(&handler_mutex);
+    if(--handler_users == 0)
+        sigaction(PRELOAD_SIGNAL, &old_action, NULL);
+    pthread_mutex_unlock(&handler_mutex);
+    munmap(ring, sizeof(*ring));
+    ring = NULL;
+    unlink(ring_path);
+    free(ring_path);
+    ring_path = NULL;
+    free(library);
+    library = NULL;
+    return 0;
+}
+
+int preload_receive(void)
+{
+    struct preload_ring_header *h = &ring->header.h;
+    uint64_t pos = h->tail;
+    int ret = 0;
+    while(ret == 0)
+    {
+        struct preload_slot *slot =
+                &ring->slots[pos & (PRELOAD_RING_SLOTS - 1)];
+        if(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+        ret = syscall_preload_event(slot);
+        __atomic_store_n(&slot->sequence, pos + PRELOAD_RING_SLOTS,
+                         __ATOMIC_RELEASE);
+        ++pos;
+        __atomic_store_n(&h->tail, pos, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&h->wakeup, 0, __ATOMIC_RELEASE);
+    return ret;
+}
+
+/* Whether a process runs a program with an interpreter (the dynamic loader),
+ * built for our architecture, so that the library can be loaded in it */
+static int program_is_dynamic(pid_t tid)
+{
+#ifdef X86_64
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdr;
+    const unsigned char elf_class = ELFCLASS64;
+    const unsigned int machine = EM_X86_64;
+#else
+    Elf32_Ehdr ehdr;
+    Elf32_Phdr phdr;
+    const unsigned char elf_class = ELFCLASS32;
+    const unsigned int machine = EM_386;
+#endif
+    char path[32];
+    int fd, dynamic = 0;
+    size_t i;
+    sprintf(path, "/proc/%d/exe", tid);
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return 0;
+    if(pread(fd, &ehdr, sizeof(ehdr), 0) == sizeof(ehdr)
+     && memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0
+     && ehdr.e_ident[EI_CLASS] == elf_class
+     && ehdr.e_machine == machine
+     && ehdr.e_phentsize == sizeof(phdr))
+    {
+        for(i = 0; i < ehdr.e_phnum; ++i)
+        {
+            if(pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr))
+             != sizeof(phdr))
+                break;
+            if(phdr.p_type == PT_INTERP)
+            {
+                dynamic = 1;
+                break;
+            }
+        }
+    }
+    close(fd);
+    return dynamic;
+}
+
+/* Copies LD_PRELOAD without our library; entries are separated by colons or
+ * spaces. Returns the length written, 0 if nothing is left */
+static size_t copy_ld_preload(char *out, const char *var, int *found)
+{
+    const char *value = var + 11; /* strlen("LD_PRELOAD=") */
+    size_t length = 0, lib_len = strlen(library);
+    memcpy(out, var, 11);
+    while(*value != '\0')
+    {
+        size_t len = strcspn(value, ": ");
+        if(len == lib_len && memcmp(value, library, len) == 0)
+            *found = 1;
+        else if(len > 0)
+        {
+            if(length > 0)
+                out[11 + length++] = ':';
+            memcpy(out + 11 + length, value, len);
+            length += len;
+        }
+        value += len;
+        if(*value != '\0')
+            ++value;
+    }
+    if(length == 0)
+        return 0;
+    out[11 + length] = '\0';
+    return 11 + length + 1;
+}
+
+int preload_exec(pid_t tid, struct StrArray *envp)
+{
+    const size_t ring_var_len = strlen(PRELOAD_RING_ENV "=");
+    char *data = malloc(envp->length);
+    size_t length = 0, nb = 0, i;
+    int has_ring = 0, has_library = 0;
+
+    /* Rebuilds the environment without our variables */
+    for(i = 0; envp->array[i] != NULL; ++i)
+    {
+        const char *var = envp->array[i];
+        if(strncmp(var, PRELOAD_RING_ENV "=", ring_var_len) == 0)
+            has_ring = strcmp(var + ring_var_len, ring_path) == 0;
+        else if(strncmp(var, "LD_PRELOAD=", 11) == 0)
+        {
+            size_t len = copy_ld_preload(data + length, var, &has_library);
+            if(len > 0)
+            {
+                length += len;
+                ++nb;
+            }
+        }
+        else
+        {
+            size_t len = strlen(var) + 1;
+            memcpy(data + length, var, len);
+            length += len;
+            ++nb;
+        }
+    }
+    free(envp->data);
+    free(envp->array);
+    envp->data = data;
+    envp->length = length;
+    envp->array = malloc((nb + 1) * sizeof(char*));
+    for(i = 0; i < nb; ++i)
+    {
+        envp->array[i] = data;
+        data += strlen(data) + 1;
+    }
+    envp->array[nb] = NULL;
+
+    return has_ring && has_library && program_is_dynamic(tid);
+}
@@ -0,0 +1,86 @@
+#ifndef PRELOAD_H
+#define PRELOAD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Ring of events shared with the preloaded library
+ *
+ * The tracer creates a file holding a struct preload_ring, and passes its
+ * path to the traced programs in PRELOAD_RING_ENV. The library wraps the libc
+ * functions that access files and the network, and appends an event to the
+ * ring when they succeed, so that the program doesn't have to stop for the
+ * tracer to see them.
+ *
+ * Any number of processes and threads write to the ring; the tracer is its
+ * only reader. A slot holds its position in the ring as sequence when it is
+ * free for a writer, and position + 1 once the event in it is complete (this
+ * is Dmitry Vyukov's bounded queue). Writers signal the tracer thread with
+ * PRELOAD_SIGNAL when the ring is getting full. */
+
+#define PRELOAD_RING_ENV    "REPROZIP_PRELOAD_RING"
+#define PRELOAD_SIGNAL      SIGURG
+
+#define PRELOAD_RING_SLOTS  1024    /* Power of 2 */
+#define PRELOAD_SLOT_SIZE   4096
+#define PRELOAD_DATA_SIZE   (PRELOAD_SLOT_SIZE - 24)
+
+#define PRELOAD_OPEN        1   /* arg: open() flags; data: path */
+#define PRELOAD_ACCESS      2   /* data: path */
+#define PRELOAD_STAT        3   /* arg: 1 if the link is not followed;
+                                 * data: path */
+#define PRELOAD_READLINK    4   /* data: path */
+#define PRELOAD_MKDIR       5   /* data: path */
+#define PRELOAD_CONNECT     6   /* arg: 1 if inbound; data: struct sockaddr */
+
+struct preload_slot {
+    uint64_t sequence;
+    uint32_t type;
+    int32_t tid;
+    uint32_t arg;
+    uint32_t length;            /* Of data; paths include the NUL */
+    char data[PRELOAD_DATA_SIZE];
+};
+
+struct preload_ring_header {
+    int32_t tracer_pid;
+    int32_t tracer_tid;         /* Thread to signal */
+    uint32_t wakeup;            /* Set once the tracer has been signaled */
+    uint32_t lost;              /* Events dropped because the ring was full
+                                 * or the path too long */
+    char pad1[48];
+    uint64_t head;              /* Next position for writers */
+    char pad2[56];
+    uint64_t tail;              /* Next position the tracer reads */
+};
+
+struct preload_ring {
+    union {
+        struct preload_ring_header h;
+        char page[PRELOAD_SLOT_SIZE];
+    } header;
+    struct preload_slot slots[PRELOAD_RING_SLOTS];
+};
+
+
+/* Tracer side (preload.c) */
+
+struct StrArray;
+
+/* Creates the ring. The library will be injected in the processes
+ * started after preload_setup_child() */
+int preload_open(const char *library);
+void preload_setup_child(void);
+int preload_close(void);
+
+/* Hands the events in the ring to syscall_preload_event() */
+int preload_receive(void);
+
+/* Called when a process executes a new program: removes the variables that
+ * inject the library from its environment, which is about to be recorded, and
+ * returns 1 if the library will be loaded (they were set and the program is
+ * dynamically linked for our architecture), 0 if the process has to be traced
+ * on every syscall */
+int preload_exec(pid_t tid, struct StrArray *envp);
+
+#endif
@@ -0,0 +1,671 @@
+/* Library injected with LD_PRELOAD in the traced programs
+ *
+ * It wraps the libc functions that access files and the network, and writes
+ * an event to the ring shared with the tracer (see preload.h) when they
+ * succeed. Accesses that don't go through these functions (direct syscalls,
+ * or calls made from inside libc) are not seen; the dynamic loader's are
+ * covered by listing the loaded objects at startup and after dlopen(). */
+
+/* We define the functions, not the inline wrappers or 64-bit aliases from
+ * the headers */
+#undef _FILE_OFFSET_BITS
+#undef _FORTIFY_SOURCE
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "preload.h"
+
+
+#if defined(__x86_64__)
+#define LIBC_VERSION "GLIBC_2.2.5"
+#else
+#define LIBC_VERSION "GLIBC_2.0"
+#endif
+
+/* How long a writer waits for room in the ring before dropping its event */
+#define RING_WAIT_NS    1000000
+#define RING_WAIT_MAX   10000
+
+#define EXPORT __attribute__((visibility("default")))
+
+
+static struct preload_ring *ring = NULL;
+static const char *own_name = NULL;
+static unsigned int reported_objects = 0;
+
+
+/* ********************
+ * Writing to the ring
+ */
+
+static void wake_tracer(int force)
+{
+    struct preload_ring_header *h = &ring->header.h;
+    if(__atomic_exchange_n(&h->wakeup, 1, __ATOMIC_ACQ_REL) == 0 || force)
+        syscall(SYS_tgkill, h->tracer_pid, h->tracer_tid, PRELOAD_SIGNAL);
+}
+
+static struct preload_slot *ring_claim(uint64_t *p_pos)
+{
+    struct preload_ring_header *h = &ring->header.h;
+    uint64_t pos = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+    unsigned int waited = 0;
+    for(;;)
+    {
+        struct preload_slot *slot =
+                &ring->slots[pos & (PRELOAD_RING_SLOTS - 1)];
+        uint64_t sequence = __atomic_load_n(&slot->sequence,
+                                            __ATOMIC_ACQUIRE);
+        if(sequence == pos)
+        {
+            if(__atomic_compare_exchange_n(&h->head, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+            {
+                *p_pos = pos;
+                return slot;
+            }
+        }
+        else if((int64_t)(sequence - pos) < 0)
+        {
+            /* The ring is full, the tracer is behind */
+            struct timespec delay;
+            if(++waited > RING_WAIT_MAX)
+            {
+                __atomic_add_fetch(&h->lost, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            wake_tracer(1);
+            delay.tv_sec = 0;
+            delay.tv_nsec = RING_WAIT_NS;
+            nanosleep(&delay, NULL);
+            pos = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+        }
+        else
+            pos = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+    }
+}
+
+static void ring_write(unsigned int type, unsigned int arg,
+                       const void *data, size_t length)
+{
+    struct preload_ring_header *h = &ring->header.h;
+    struct preload_slot *slot;
+    uint64_t pos;
+    if(length > PRELOAD_DATA_SIZE)
+    {
+        __atomic_add_fetch(&h->lost, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    slot = ring_claim(&pos);
+    if(slot == NULL)
+        return;
+    slot->type = type;
+    slot->tid = syscall(SYS_gettid);
+    slot->arg = arg;
+    slot->length = length;
+    memcpy(slot->data, data, length);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    if(pos + 1 - __atomic_load_n(&h->tail, __ATOMIC_RELAXED)
+     >= PRELOAD_RING_SLOTS / 2)
+        wake_tracer(0);
+}
+
+
+/* ********************
+ * Functions from the next object (libc)
+ */
+
+static void *next_symbol(const char *name)
+{
+    void *symbol = dlsym(RTLD_NEXT, name);
+    /* Some only exist as compatibility symbols, which need a version */
+    if(symbol == NULL)
+        symbol = dlvsym(RTLD_NEXT, name, LIBC_VERSION);
+    if(symbol == NULL)
+    {
+        fprintf(stderr, "reprozip: can't find %s() in libc\n", name);
+        abort();
+    }
+    return symbol;
+}
+
+static void *load_symbol(void **real, const char *name)
+{
+    if(*real == NULL)
+        *real = next_symbol(name);
+    return *real;
+}
+
+#define REAL(name) \
+    ((__typeof__(real_ ## name))load_symbol((void**)&real_ ## name, #name))
+
+static int (*real_open)(const char*, int, ...);
+static int (*real_open64)(const char*, int, ...);
+static int (*real___open_2)(const char*, int);
+static int (*real___open64_2)(const char*, int);
+static int (*real_openat)(int, const char*, int, ...);
+static int (*real_openat64)(int, const char*, int, ...);
+static int (*real___openat_2)(int, const char*, int);
+static int (*real___openat64_2)(int, const char*, int);
+static int (*real_creat)(const char*, mode_t);
+static int (*real_creat64)(const char*, mode_t);
+static FILE *(*real_fopen)(const char*, const char*);
+static FILE *(*real_fopen64)(const char*, const char*);
+static FILE *(*real_freopen)(const char*, const char*, FILE*);
+static FILE *(*real_freopen64)(const char*, const char*, FILE*);
+static DIR *(*real_opendir)(const char*);
+static int (*real_access)(const char*, int);
+static int (*real_faccessat)(int, const char*, int, int);
+static int (*real_stat)(const char*, struct stat*);
+static int (*real_stat64)(const char*, struct stat64*);
+static int (*real_lstat)(const char*, struct stat*);
+static int (*real_lstat64)(const char*, struct stat64*);
+static int (*real_fstatat)(int, const char*, struct stat*, int);
+static int (*real_fstatat64)(int, const char*, struct stat64*, int);
+static int (*real___xstat)(int, const char*, struct stat*);
+static int (*real___xstat64)(int, const char*, struct stat64*);
+static int (*real___lxstat)(int, const char*, struct stat*);
+static int (*real___lxstat64)(int, const char*, struct stat64*);
+static int (*real___fxstatat)(int, int, const char*, struct stat*, int);
+static int (*real___fxstatat64)(int, int, const char*, struct stat64*, int);
+static ssize_t (*real_readlink)(const char*, char*, size_t);
+static ssize_t (*real_readlinkat)(int, const char*, char*, size_t);
+static int (*real_mkdir)(const char*, mode_t);
+static int (*real_mkdirat)(int, const char*, mode_t);
+static int (*real_connect)(int, const struct sockaddr*, socklen_t);
+static int (*real_accept)(int, struct sockaddr*, socklen_t*);
+static int (*real_accept4)(int, struct sockaddr*, socklen_t*, int);
+static void *(*real_dlopen)(const char*, int);
+
+
+/* ********************
+ * Events
+ */
+
+/* Records a path, relative to dirfd unless it is AT_FDCWD. Relative paths
+ * are resolved by the tracer, which knows the working directory (chdir() is
+ * still traced, it is rare and everything else depends on it) */
+static void record_path(unsigned int type, unsigned int arg,
+                        int dirfd, const char *path)
+{
+    char buffer[PRELOAD_DATA_SIZE];
+    size_t length;
+    int saved_errno;
+    if(ring == NULL || path == NULL || path[0] == '\0')
+        return;
+    saved_errno = errno;
+    if(path[0] != '/' && dirfd != AT_FDCWD)
+    {
+        char link[32];
+        ssize_t dirlen;
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+        dirlen = REAL(readlink)(link, buffer, sizeof(buffer));
+        length = strlen(path);
+        if(dirlen > 0 && buffer[0] == '/'
+         && (size_t)dirlen + 1 + length + 1 <= sizeof(buffer))
+        {
+            buffer[dirlen] = '/';
+            memcpy(buffer + dirlen + 1, path, length + 1);
+            ring_write(type, arg, buffer, dirlen + 1 + length + 1);
+        }
+    }
+    else
+        ring_write(type, arg, path, strlen(path) + 1);
+    errno = saved_errno;
+}
+
+static void record_connection(int inbound, const struct sockaddr *address,
+                              socklen_t addrlen)
+{
+    int saved_errno = errno;
+    if(ring != NULL && address != NULL && addrlen >= sizeof(short))
+        ring_write(PRELOAD_CONNECT, inbound, address, addrlen);
+    errno = saved_errno;
+}
+
+static int record_object(struct dl_phdr_info *info, size_t size, void *data)
+{
+    unsigned int *index = data;
+    if((*index)++ < reported_objects)
+        return 0;
+    /* The main program has no name, the vDSO has no path */
+    if(info->dlpi_name[0] == '/'
+     && (own_name == NULL || strcmp(info->dlpi_name, own_name) != 0))
+        record_path(PRELOAD_OPEN, O_RDONLY, AT_FDCWD, info->dlpi_name);
+    return 0;
+}
+
+/* Records the objects loaded since the last call */
+static void record_loaded_objects(void)
+{
+    unsigned int index = 0;
+    dl_iterate_phdr(record_object, &index);
+    reported_objects = index;
+}
+
+static int fopen_flags(const char *mode)
+{
+    int flags;
+    if(mode[0] == 'w')
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    else if(mode[0] == 'a')
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    else
+        flags = O_RDONLY;
+    if(strchr(mode, '+') != NULL)
+        flags = (flags & ~O_WRONLY) | O_RDWR;
+    return flags;
+}
+
+__attribute__((constructor))
+static void preload_init(void)
+{
+    const char *path = getenv(PRELOAD_RING_ENV);
+    Dl_info info;
+    void *map;
+    int fd;
+    if(path == NULL)
+        return;
+    fd = REAL(open)(path, O_RDWR | O_CLOEXEC);
+    if(fd < 0)
+    {
+        fprintf(stderr, "reprozip: can't open event ring %s: %s\n",
+                path, strerror(errno));
+        return;
+    }
+    map = mmap(NULL, sizeof(struct preload_ring), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        fprintf(stderr, "reprozip: can't map event ring %s: %s\n",
+                path, strerror(errno));
+        return;
+    }
+    if(dladdr((void*)preload_init, &info) != 0)
+        own_name = info.dli_fname;
+    ring = map;
+    record_loaded_objects();
+}
+
+
+/* ********************
+ * Wrappers
+ */
+
+/* The mode argument is only there with O_CREAT or O_TMPFILE */
+#ifndef O_TMPFILE
+#define O_TMPFILE 0
+#endif
+#define OPEN_MODE(flags, mode) \
+    do { \
+        if(((flags) & O_CREAT) \
+         || (O_TMPFILE && ((flags) & O_TMPFILE) == O_TMPFILE)) \
+        { \
+            va_list ap; \
+            va_start(ap, flags); \
+            mode = va_arg(ap, int); \
+            va_end(ap); \
+        } \
+    } while(0)
+
+EXPORT int open(const char *path, int flags, ...)
+{
+    int mode = 0, ret;
+    OPEN_MODE(flags, mode);
+    ret = REAL(open)(path, flags, mode);
+    if(ret >= 0)
+        record_path(PRELOAD_OPEN, flags, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int open64(const char *path, int flags, ...)
+{
+    int mode = 0, ret;
+    OPEN_MODE(flags, mode);
+    ret = REAL(open64)(path, flags, mode);
+    if(ret >= 0)
+        record_path(PRELOAD_OPEN, flags, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int __open_2(const char *path, int flags)
+{
+    int ret = REAL(__open_2)(path, flags);
+    if(ret >= 0)
+        record_path(PRELOAD_OPEN, flags, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int __open64_2(const char *path, int flags)
+{
+    int ret = REAL(__open64_2)(path, flags);
+    if(ret >= 0)
+        record_path(PRELOAD_OPEN, flags, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int openat(int dirfd, const char *path, int flags, ...)
+{
+    int mode = 0, ret;
+    OPEN_MODE(flags, mode);
+    ret = REAL(openat)(dirfd, path, flags, mode);
+    if(ret >= 0)
+        record_path(PRELOAD_OPEN, flags, dirfd, path);
+    return ret;
+}
+
+EXPORT int openat64(int dirfd, const char *path, int flags, ...)
+{
+    int mode = 0, ret;
+    OPEN_MODE(flags, mode);
+    ret = REAL(openat64)(dirfd, path, flags, mode);
+    if(ret >= 0)
+        record_path(PRELOAD_OPEN, flags, dirfd, path);
+    return ret;
+}
+
+EXPORT int __openat_2(int dirfd, const char *path, int flags)
+{
+    int ret = REAL(__openat_2)(dirfd, path, flags);
+    if(ret >= 0)
+        record_path(PRELOAD_OPEN, flags, dirfd, path);
+    return ret;
+}
+
+EXPORT int __openat64_2(int dirfd, const char *path, int flags)
+{
+    int ret = REAL(__openat64_2)(dirfd, path, flags);
+    if(ret >= 0)
+        record_path(PRELOAD_OPEN, flags, dirfd, path);
+    return ret;
+}
+
+EXPORT int creat(const char *path, mode_t mode)
+{
+    int ret = REAL(creat)(path, mode);
+    if(ret >= 0)
+        record_path(PRELOAD_OPEN, O_CREAT | O_WRONLY | O_TRUNC,
+                    AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int creat64(const char *path, mode_t mode)
+{
+    int ret = REAL(creat64)(path, mode);
+    if(ret >= 0)
+        record_path(PRELOAD_OPEN, O_CREAT | O_WRONLY | O_TRUNC,
+                    AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT FILE *fopen(const char *path, const char *mode)
+{
+    FILE *ret = REAL(fopen)(path, mode);
+    if(ret != NULL)
+        record_path(PRELOAD_OPEN, fopen_flags(mode), AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT FILE *fopen64(const char *path, const char *mode)
+{
+    FILE *ret = REAL(fopen64)(path, mode);
+    if(ret != NULL)
+        record_path(PRELOAD_OPEN, fopen_flags(mode), AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT FILE *freopen(const char *path, const char *mode, FILE *stream)
+{
+    FILE *ret = REAL(freopen)(path, mode, stream);
+    if(ret != NULL)
+        record_path(PRELOAD_OPEN, fopen_flags(mode), AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT FILE *freopen64(const char *path, const char *mode, FILE *stream)
+{
+    FILE *ret = REAL(freopen64)(path, mode, stream);
+    if(ret != NULL)
+        record_path(PRELOAD_OPEN, fopen_flags(mode), AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT DIR *opendir(const char *path)
+{
+    DIR *ret = REAL(opendir)(path);
+    if(ret != NULL)
+        record_path(PRELOAD_OPEN, O_RDONLY | O_DIRECTORY, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int access(const char *path, int mode)
+{
+    int ret = REAL(access)(path, mode);
+    if(ret == 0)
+        record_path(PRELOAD_ACCESS, 0, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int faccessat(int dirfd, const char *path, int mode, int flags)
+{
+    int ret = REAL(faccessat)(dirfd, path, mode, flags);
+    if(ret == 0)
+        record_path(PRELOAD_ACCESS, 0, dirfd, path);
+    return ret;
+}
+
+EXPORT int stat(const char *path, struct stat *buf)
+{
+    int ret = REAL(stat)(path, buf);
+    if(ret == 0)
+        record_path(PRELOAD_STAT, 0, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int stat64(const char *path, struct stat64 *buf)
+{
+    int ret = REAL(stat64)(path, buf);
+    if(ret == 0)
+        record_path(PRELOAD_STAT, 0, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int lstat(const char *path, struct stat *buf)
+{
+    int ret = REAL(lstat)(path, buf);
+    if(ret == 0)
+        record_path(PRELOAD_STAT, 1, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int lstat64(const char *path, struct stat64 *buf)
+{
+    int ret = REAL(lstat64)(path, buf);
+    if(ret == 0)
+        record_path(PRELOAD_STAT, 1, AT_FDCWD, path);
+    return ret;
+}
+
+/* With AT_EMPTY_PATH and an empty path, this is fstat(), which
+ * record_path() ignores */
+EXPORT int fstatat(int dirfd, const char *path, struct stat *buf, int flags)
+{
+    int ret = REAL(fstatat)(dirfd, path, buf, flags);
+    if(ret == 0)
+        record_path(PRELOAD_STAT, (flags & AT_SYMLINK_NOFOLLOW) != 0,
+                    dirfd, path);
+    return ret;
+}
+
+EXPORT int fstatat64(int dirfd, const char *path, struct stat64 *buf,
+                     int flags)
+{
+    int ret = REAL(fstatat64)(dirfd, path, buf, flags);
+    if(ret == 0)
+        record_path(PRELOAD_STAT, (flags & AT_SYMLINK_NOFOLLOW) != 0,
+                    dirfd, path);
+    return ret;
+}
+
+/* Before glibc 2.33, programs call these instead */
+EXPORT int __xstat(int ver, const char *path, struct stat *buf)
+{
+    int ret = REAL(__xstat)(ver, path, buf);
+    if(ret == 0)
+        record_path(PRELOAD_STAT, 0, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int __xstat64(int ver, const char *path, struct stat64 *buf)
+{
+    int ret = REAL(__xstat64)(ver, path, buf);
+    if(ret == 0)
+        record_path(PRELOAD_STAT, 0, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int __lxstat(int ver, const char *path, struct stat *buf)
+{
+    int ret = REAL(__lxstat)(ver, path, buf);
+    if(ret == 0)
+        record_path(PRELOAD_STAT, 1, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int __lxstat64(int ver, const char *path, struct stat64 *buf)
+{
+    int ret = REAL(__lxstat64)(ver, path, buf);
+    if(ret == 0)
+        record_path(PRELOAD_STAT, 1, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int __fxstatat(int ver, int dirfd, const char *path, struct stat *buf,
+                      int flags)
+{
+    int ret = REAL(__fxstatat)(ver, dirfd, path, buf, flags);
+    if(ret == 0)
+        record_path(PRELOAD_STAT, (flags & AT_SYMLINK_NOFOLLOW) != 0,
+                    dirfd, path);
+    return ret;
+}
+
+EXPORT int __fxstatat64(int ver, int dirfd, const char *path,
+                        struct stat64 *buf, int flags)
+{
+    int ret = REAL(__fxstatat64)(ver, dirfd, path, buf, flags);
+    if(ret == 0)
+        record_path(PRELOAD_STAT, (flags & AT_SYMLINK_NOFOLLOW) != 0,
+                    dirfd, path);
+    return ret;
+}
+
+EXPORT ssize_t readlink(const char *path, char *buf, size_t size)
+{
+    ssize_t ret = REAL(readlink)(path, buf, size);
+    if(ret >= 0)
+        record_path(PRELOAD_READLINK, 0, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT ssize_t readlinkat(int dirfd, const char *path, char *buf, size_t size)
+{
+    ssize_t ret = REAL(readlinkat)(dirfd, path, buf, size);
+    if(ret >= 0)
+        record_path(PRELOAD_READLINK, 0, dirfd, path);
+    return ret;
+}
+
+EXPORT int mkdir(const char *path, mode_t mode)
+{
+    int ret = REAL(mkdir)(path, mode);
+    if(ret == 0)
+        record_path(PRELOAD_MKDIR, 0, AT_FDCWD, path);
+    return ret;
+}
+
+EXPORT int mkdirat(int dirfd, const char *path, mode_t mode)
+{
+    int ret = REAL(mkdirat)(dirfd, path, mode);
+    if(ret == 0)
+        record_path(PRELOAD_MKDIR, 0, dirfd, path);
+    return ret;
+}
+
+EXPORT int connect(int fd, const struct sockaddr *address, socklen_t addrlen)
+{
+    int ret = REAL(connect)(fd, address, addrlen);
+    if(ret == 0)
+        record_connection(0, address, addrlen);
+    return ret;
+}
+
+/* addrlen is updated to the size of the peer's address, which might be more
+ * than the given buffer */
+static void record_accept(int fd, struct sockaddr *address,
+                          socklen_t *addrlen, socklen_t given)
+{
+    if(address != NULL && addrlen != NULL)
+        record_connection(1, address, (*addrlen < given)?*addrlen:given);
+    else
+    {
+        struct sockaddr_storage peer;
+        socklen_t peerlen = sizeof(peer);
+        int saved_errno = errno;
+        if(getpeername(fd, (struct sockaddr*)&peer, &peerlen) == 0)
+            record_connection(1, (struct sockaddr*)&peer, peerlen);
+        errno = saved_errno;
+    }
+}
+
+EXPORT int accept(int fd, struct sockaddr *address, socklen_t *addrlen)
+{
+    socklen_t given = (addrlen != NULL)?*addrlen:0;
+    int ret = REAL(accept)(fd, address, addrlen);
+    if(ret >= 0)
+        record_accept(ret, address, addrlen, given);
+    return ret;
+}
+
+EXPORT int accept4(int fd, struct sockaddr *address, socklen_t *addrlen,
+                   int flags)
+{
+    socklen_t given = (addrlen != NULL)?*addrlen:0;
+    int ret = REAL(accept4)(fd, address, addrlen, flags);
+    if(ret >= 0)
+        record_accept(ret, address, addrlen, given);
+    return ret;
+}
+
+EXPORT void *dlopen(const char *filename, int flags)
+{
+    void *ret = REAL(dlopen)(filename, flags);
+    if(ret != NULL && ring != NULL)
+    {
+        int saved_errno = errno;
+        record_loaded_objects();
+        errno = saved_errno;
+    }
+    return ret;
+}
@@ -1,9 +1,15 @@
+#define _GNU_SOURCE /* process_vm_readv() */
+
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ptrace.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -11,6 +17,9 @@
 #include "ptrace_utils.h"
 #include "tracer.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 static long tracee_getword(pid_t tid, const void *addr)
 {
@@ -75,30 +84,82 @@ size_t tracee_getwordsize(int mode)
         return 8;
 }
 
-size_t tracee_strlen(pid_t tid, const char *str)
+/* How we read tracee memory in bulk. We start with process_vm_readv(), which
+ * copies whole chunks in a single syscall, and fall back to pread() on
+ * /proc/<pid>/mem if it is not available (kernel < 3.2, or denied by a
+ * security module). Anything these fail to read is then fetched one word at a
+ * time with PTRACE_PEEKDATA, which also reports the error. */
+#define READ_VM_READV   0
+#define READ_PROC_MEM   1
+#define READ_PEEKDATA   2
+
+static int read_method = READ_VM_READV;
+
+static size_t page_size = 0;
+
+/* Number of bytes from addr to the end of its page; reads that don't cross a
+ * page boundary can't fail halfway */
+static size_t to_page_end(const char *addr)
 {
-    uintptr_t ptr = (uintptr_t)str;
-    size_t j = ptr % WORD_SIZE;
-    uintptr_t i = ptr - j;
-    size_t size = 0;
-    int done = 0;
-    for(; !done; i += WORD_SIZE)
+    if(page_size == 0)
+        page_size = sysconf(_SC_PAGESIZE);
+    return page_size - ((uintptr_t)addr % page_size);
+}
+
+/* Reads up to size bytes, stopping at the first page that can't be read.
+ * Returns the number of bytes read, possibly 0. */
+static size_t tracee_read_bulk(pid_t tid, char *dst, const char *src,
+                               size_t size)
+{
+    if(read_method == READ_VM_READV)
     {
-        unsigned long data = tracee_getword(tid, (const void*)i);
-        for(; !done && j < WORD_SIZE; ++j)
+        struct iovec local, remote;
+        ssize_t ret;
+        local.iov_base = dst;
+        local.iov_len = size;
+        remote.iov_base = (void*)src;
+        remote.iov_len = size;
+        ret = process_vm_readv(tid, &local, 1, &remote, 1, 0);
+        if(ret >= 0)
+            return ret;
+        else if(errno == ENOSYS || errno == EPERM)
         {
-            unsigned char byte = data >> (8 * j);
-            if(byte == 0)
-                done = 1;
-            else
-                ++size;
+            /* LCOV_EXCL_START : Depends on kernel */
+            log_info(tid, "process_vm_readv() unavailable (%s), "
+                     "using /proc/<pid>/mem", strerror(errno));
+            read_method = READ_PROC_MEM;
+            /* LCOV_EXCL_END */
         }
-        j = 0;
+        else
+            return 0;
     }
-    return size;
+    if(read_method == READ_PROC_MEM)
+    {
+        /* LCOV_EXCL_START : Fallback, depends on kernel */
+        char path[32];
+        int fd;
+        ssize_t ret;
+        snprintf(path, sizeof(path), "/proc/%d/mem", tid);
+        fd = open(path, O_RDONLY);
+        if(fd == -1)
+        {
+            log_info(tid, "can't open %s (%s), using PTRACE_PEEKDATA",
+                     path, strerror(errno));
+            read_method = READ_PEEKDATA;
+            return 0;
+        }
+        ret = pread(fd, dst, size, (off_t)(uintptr_t)src);
+        close(fd);
+        if(ret >= 0)
+            return ret;
+        /* LCOV_EXCL_END */
+    }
+    return 0;
 }
 
-void tracee_read(pid_t tid, char *dst, const char *src, size_t size)
+/* Reads using PTRACE_PEEKDATA */
+static void tracee_read_words(pid_t tid, char *dst, const char *src,
+                              size_t size)
 {
     uintptr_t ptr = (uintptr_t)src;
     size_t j = ptr % WORD_SIZE;
@@ -113,58 +174,258 @@ void tracee_read(pid_t tid, char *dst, const char *src, size_t size)
     }
 }
 
+void tracee_read(pid_t tid, char *dst, const char *src, size_t size)
+{
+    size_t done = tracee_read_bulk(tid, dst, src, size);
+    if(done < size)
+        tracee_read_words(tid, dst + done, src + done, size - done);
+}
+
+/* Reads a NUL-terminated string a page at a time into *buffer at the given
+ * offset, growing it as needed. Returns the length of the string. */
+static size_t tracee_readstr(pid_t tid, const char *str,
+                             char **buffer, size_t *buffer_size, size_t offset)
+{
+    size_t length = 0;
+    for(;;)
+    {
+        size_t chunk = to_page_end(str + length);
+        size_t got;
+        const char *nul;
+        if(offset + length + chunk + 1 > *buffer_size)
+        {
+            *buffer_size = offset + length + chunk + 1;
+            *buffer = realloc(*buffer, *buffer_size);
+        }
+        got = tracee_read_bulk(tid, *buffer + offset + length, str + length,
+                               chunk);
+        if(got == 0)
+        {
+            /* Unreadable page: get the next word through ptrace, which will
+             * report the error */
+            got = WORD_SIZE;
+            tracee_read_words(tid, *buffer + offset + length, str + length,
+                              got);
+        }
+        /* memchr() compares a word or a vector register at a time */
+        nul = memchr(*buffer + offset + length, '\0', got);
+        if(nul != NULL)
+            return nul - (*buffer + offset);
+        length += got;
+    }
+}
+
+size_t tracee_strlen(pid_t tid, const char *str)
+{
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    size_t length = tracee_readstr(tid, str, &buffer, &buffer_size, 0);
+    free(buffer);
+    return length;
+}
+
 char *tracee_strdup(pid_t tid, const char *str)
 {
-    size_t length = tracee_strlen(tid, str);
-    char *res = malloc(length + 1);
-    tracee_read(tid, res, str, length);
+    char *res = NULL;
+    size_t res_size = 0;
+    size_t length = tracee_readstr(tid, str, &res, &res_size, 0);
     res[length] = '\0';
     return res;
 }
 
-char **tracee_strarraydup(int mode, pid_t tid, const char *const *argv)
+/* Reads a NULL-terminated array of pointers, in bulk up to the end of each
+ * page. The terminator is not included in the returned count. */
+static const char **tracee_ptrarray(int mode, pid_t tid,
+                                    const char *const *argv, size_t *nb)
 {
     /* FIXME : This is probably broken on x32 */
-    char **array;
-    /* Reads number of pointers in pointer array */
-    size_t nb_args = 0;
+    const size_t wordsize = tracee_getwordsize(mode);
+    const char **array = NULL;
+    size_t nb_ptrs = 0, array_size = 0;
+    const char *pos = (const char*)argv;
+    for(;;)
+    {
+        char buffer[512];
+        size_t got, i;
+        size_t chunk = to_page_end(pos);
+        if(chunk > sizeof(buffer))
+            chunk = sizeof(buffer);
+        got = tracee_read_bulk(tid, buffer, pos, chunk);
+        got -= got % wordsize;
+        if(got == 0)
+        {
+            /* Go through ptrace for error reporting */
+            tracee_read_words(tid, buffer, pos, wordsize);
+            got = wordsize;
+        }
+        for(i = 0; i < got; i += wordsize)
+        {
+            const char *ptr;
+            if(mode == MODE_I386)
+                ptr = (const char*)(uint64_t)*(uint32_t*)(buffer + i);
+            else /* mode == MODE_X86_64 */
+                ptr = (const char*)*(uint64_t*)(buffer + i);
+            if(ptr == NULL)
+            {
+                *nb = nb_ptrs;
+                return array;
+            }
+            if(nb_ptrs + 1 > array_size)
+            {
+                array_size = array_size?array_size * 2:16;
+                array = realloc(array, array_size * sizeof(*array));
+            }
+            array[nb_ptrs++] = ptr;
+        }
+        pos += got;
+    }
+}
+
+struct string_ref {
+    const char *addr;
+    size_t index;
+};
+
+static int string_ref_cmp(const void *a, const void *b)
+{
+    const char *x = ((const struct string_ref*)a)->addr;
+    const char *y = ((const struct string_ref*)b)->addr;
+    return (x > y) - (x < y);
+}
+
+void tracee_strarrayread(int mode, pid_t tid, const char *const *argv,
+                         struct StrArray *out)
+{
+    size_t nb, i;
+    const char **ptrs = tracee_ptrarray(mode, tid, argv, &nb);
+    struct iovec *local = malloc((nb + 1) * sizeof(*local));
+    struct iovec *remote = malloc((nb + 1) * sizeof(*remote));
+    size_t *valid = calloc(nb + 1, sizeof(*valid));
+    size_t *offsets = malloc((nb + 1) * sizeof(*offsets));
+    char *gathered;
+    size_t total = 0;
+    size_t data_size, length = 0;
+
+    /* Guess each string's length from where the next one starts: execve()
+     * arguments usually come packed, from the caller's stack. Otherwise,
+     * read up to the end of the page. */
+    {
+        struct string_ref *sorted = malloc((nb + 1) * sizeof(*sorted));
+        for(i = 0; i < nb; ++i)
+        {
+            sorted[i].addr = ptrs[i];
+            sorted[i].index = i;
+        }
+        qsort(sorted, nb, sizeof(*sorted), string_ref_cmp);
+        for(i = 0; i < nb; ++i)
+        {
+            const char *addr = sorted[i].addr;
+            size_t bound = to_page_end(addr);
+            size_t j = i + 1;
+            while(j < nb && sorted[j].addr == addr)
+                ++j;
+            if(j < nb && (size_t)(sorted[j].addr - addr) <= page_size)
+                bound = sorted[j].addr - addr;
+            remote[sorted[i].index].iov_base = (void*)addr;
+            remote[sorted[i].index].iov_len = bound;
+            total += bound;
+        }
+        free(sorted);
+    }
+
+    /* Gather all the strings with as few process_vm_readv() calls as
+     * possible. A call stops at the first iovec it can't read; we go on
+     * from the next one. */
+    gathered = malloc(total + 1);
     {
-        const char *const *a = argv;
-        /* xargv = *a */
-        const char *xargv = tracee_getptr(mode, tid, a);
-        while(xargv != NULL)
+        size_t offset = 0;
+        for(i = 0; i < nb; ++i)
         {
-            ++nb_args;
-            ++a;
-            xargv = tracee_getptr(mode, tid, a);
+            local[i].iov_base = gathered + offset;
+            local[i].iov_len = remote[i].iov_len;
+            offset += remote[i].iov_len;
         }
     }
-    /* Allocs pointer array */
-    array = malloc((nb_args + 1) * sizeof(char*));
-    /* Dups array elements */
+    i = 0;
+    while(read_method == READ_VM_READV && i < nb)
     {
-        size_t i = 0;
-        /* xargv = argv[0] */
-        const char *xargv = tracee_getptr(mode, tid, argv);
-        while(xargv != NULL)
+        size_t count = nb - i;
+        ssize_t ret;
+        if(count > IOV_MAX)
+            count = IOV_MAX;
+        ret = process_vm_readv(tid, local + i, count, remote + i, count, 0);
+        if(ret < 0)
+        {
+            if(errno == ENOSYS || errno == EPERM)
+                break; /* tracee_readstr() will switch method */
+            ++i;
+            continue;
+        }
+        while(count > 0 && (size_t)ret >= local[i].iov_len)
         {
-            array[i] = tracee_strdup(tid, xargv);
+            valid[i] = local[i].iov_len;
+            ret -= local[i].iov_len;
+            ++i;
+            --count;
+        }
+        if(count > 0)
+        {
+            valid[i] = ret;
             ++i;
-            /* xargv = argv[i] */
-            xargv = tracee_getptr(mode, tid, argv + i);
         }
-        array[i] = NULL;
     }
-    return array;
-}
 
-void free_strarray(char **array)
-{
-    char **ptr = array;
-    while(*ptr)
+    /* Pack the strings, NUL-separated, completing those that were longer
+     * than guessed */
+    data_size = total + 1;
+    out->data = malloc(data_size);
+    for(i = 0; i < nb; ++i)
     {
-        free(*ptr);
-        ++ptr;
+        const char *str = local[i].iov_base;
+        const char *nul = memchr(str, '\0', valid[i]);
+        size_t len;
+        if(nul != NULL)
+        {
+            len = nul - str;
+            if(length + len + 1 > data_size)
+            {
+                data_size = (length + len + 1) * 2;
+                out->data = realloc(out->data, data_size);
+            }
+            memcpy(out->data + length, str, len + 1);
+        }
+        else
+        {
+            if(length + valid[i] > data_size)
+            {
+                data_size = (length + valid[i]) * 2;
+                out->data = realloc(out->data, data_size);
+            }
+            memcpy(out->data + length, str, valid[i]);
+            len = valid[i] + tracee_readstr(tid, ptrs[i] + valid[i],
+                                            &out->data, &data_size,
+                                            length + valid[i]);
+            out->data[length + len] = '\0';
+        }
+        offsets[i] = length;
+        length += len + 1;
     }
-    free(array);
+    out->length = length;
+    out->array = malloc((nb + 1) * sizeof(char*));
+    for(i = 0; i < nb; ++i)
+        out->array[i] = out->data + offsets[i];
+    out->array[nb] = NULL;
+
+    free(gathered);
+    free(offsets);
+    free(valid);
+    free(remote);
+    free(local);
+    free(ptrs);
+}
+
+void free_strarray(struct StrArray *array)
+{
+    free(array->array);
+    free(array->data);
 }
@@ -1,6 +1,8 @@
 #ifndef PTRACE_UTILS_H
 #define PTRACE_UTILS_H
 
+struct StrArray;
+
 void *tracee_getptr(int mode, pid_t tid, const void *addr);
 uint64_t tracee_getlong(int mode, pid_t tid, const void *addr);
 size_t tracee_getwordsize(int mode);
@@ -11,7 +13,8 @@ void tracee_read(pid_t tid, char *dst, const char *src, size_t size);
 
 char *tracee_strdup(pid_t tid, const char *str);
 
-char **tracee_strarraydup(int mode, pid_t tid, const char *const *argv);
-void free_strarray(char **array);
+void tracee_strarrayread(int mode, pid_t tid, const char *const *argv,
+                         struct StrArray *out);
+void free_strarray(struct StrArray *array);
 
 #endif
@@ -2,10 +2,15 @@
 
 #include "database.h"
 #include "tracer.h"
+#include "utils.h"
 
 
 PyObject *Err_Base;
 
+/* Paths not recorded if ignored_paths isn't given; this is
+ * reprozip.tracer.linux_pkgs.magic_dirs */
+static const char *default_ignored_paths[] = {"/dev", "/proc", "/sys", NULL};
+
 
 /**
  * Makes a C string from a Python unicode or bytes object.
@@ -57,22 +62,140 @@ static char *get_string(PyObject *obj)
 }
 
 
-static PyObject *pytracer_execute(PyObject *self, PyObject *args)
+/* The events are handed to the Python callback in batches, so that the
+ * tracing thread doesn't have to take the GIL for each of them */
+#define EVENTS_BATCH 1024
+
+struct event_batch {
+    PyObject *callback;
+    /* Exception raised by the callback, which isn't called anymore then */
+    PyObject *error_type, *error_value, *error_traceback;
+    size_t count;
+    unsigned int modes[EVENTS_BATCH];
+    int is_exec[EVENTS_BATCH];
+    char *names;    /* Back-to-back, each followed by its NUL */
+    size_t names_len, names_size;
+};
+
+/**
+ * Calls the Python callback with the batched events. Needs the GIL.
+ */
+static void events_flush(struct event_batch *batch)
 {
-    PyObject *ret;
-    int exit_status;
+    PyObject *list, *result;
+    const char *name = batch->names;
+    size_t i;
+    if(batch->count == 0 || batch->error_type != NULL)
+        goto done;
+    list = PyList_New(batch->count);
+    if(list == NULL)
+        goto error;
+    for(i = 0; i < batch->count; ++i)
+    {
+        size_t len = strlen(name);
+        PyObject *event = Py_BuildValue(
+                "(sNI)",
+                batch->is_exec[i]?"exec":"open",
+                PyUnicode_DecodeUTF8(name, len, "replace"),
+                batch->modes[i]);
+        if(event == NULL)
+        {
+            Py_DECREF(list);
+            goto error;
+        }
+        PyList_SET_ITEM(list, i, event);
+        name += len + 1;
+    }
+    result = PyObject_CallFunctionObjArgs(batch->callback, list, NULL);
+    Py_DECREF(list);
+    if(result == NULL)
+        goto error;
+    Py_DECREF(result);
+    goto done;
+
+error:
+    PyErr_Fetch(&batch->error_type, &batch->error_value,
+                &batch->error_traceback);
+done:
+    batch->count = 0;
+    batch->names_len = 0;
+}
+
+/**
+ * Listener given to the database, called from the tracing thread without
+ * the GIL.
+ */
+static void events_listener(void *data, const char *name, unsigned int mode,
+                            int is_exec)
+{
+    struct event_batch *batch = data;
+    size_t len = strlen(name) + 1;
+    if(batch->error_type != NULL)
+        return;
+    if(batch->names_len + len > batch->names_size)
+    {
+        while(batch->names_len + len > batch->names_size)
+            batch->names_size *= 2;
+        batch->names = realloc(batch->names, batch->names_size);
+    }
+    memcpy(batch->names + batch->names_len, name, len);
+    batch->names_len += len;
+    batch->modes[batch->count] = mode;
+    batch->is_exec[batch->count] = is_exec;
+    if(++batch->count == EVENTS_BATCH)
+    {
+        PyGILState_STATE gstate = PyGILState_Ensure();
+        events_flush(batch);
+        PyGILState_Release(gstate);
+    }
+}
+
+
+static PyObject *pytracer_execute(PyObject *self, PyObject *args,
+                                  PyObject *kwargs)
+{
+    PyObject *ret = NULL;
+    int status, exit_status;
 
     /* Reads arguments */
-    const char *binary, *databasepath;
-    char **argv;
-    size_t argv_len;
+    char *binary = NULL, *databasepath = NULL;
+    char **argv = NULL;
+    size_t argv_len = 0;
     int verbosity;
+    int seccomp = 0;
+    int writer_thread = 0;
+    int event_log = 0;
+    int tracer_threads = 1;
+    int io_volume = 0;
+    int early_resume = 0;
     PyObject *py_binary, *py_argv, *py_databasepath;
-    if(!PyArg_ParseTuple(args, "OO!Oi",
-                         &py_binary,
-                         &PyList_Type, &py_argv,
-                         &py_databasepath,
-                         &verbosity))
+    PyObject *py_ignored_paths = Py_None;
+    PyObject *py_preload = Py_None;
+    PyObject *py_fanotify = Py_None;
+    PyObject *py_events = Py_None;
+    char *preload = NULL;
+    char **fanotify = NULL;
+    struct event_batch *events = NULL;
+    static char *kwlist[] = {"binary", "argv", "databasepath", "verbosity",
+                             "seccomp", "writer_thread", "event_log",
+                             "ignored_paths", "early_resume", "preload",
+                             "fanotify", "events", "tracer_threads",
+                             "io_volume", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OO!Oi|iiiOiOOOii", kwlist,
+                                    &py_binary,
+                                    &PyList_Type, &py_argv,
+                                    &py_databasepath,
+                                    &verbosity,
+                                    &seccomp,
+                                    &writer_thread,
+                                    &event_log,
+                                    &py_ignored_paths,
+                                    &early_resume,
+                                    &py_preload,
+                                    &py_fanotify,
+                                    &py_events,
+                                    &tracer_threads,
+                                    &io_volume))
         return NULL;
 
     if(verbosity < 0)
@@ -80,68 +203,358 @@ static PyObject *pytracer_execute(PyObject *self, PyObject *args)
         PyErr_SetString(Err_Base, "verbosity should be >= 0");
         return NULL;
     }
+    if(tracer_threads < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "tracer_threads should be >= 1");
+        return NULL;
+    }
+    if(tracer_threads > 1
+     && (py_preload != Py_None || py_fanotify != Py_None))
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "preload and fanotify only work with one tracer "
+                        "thread");
+        return NULL;
+    }
+    if(io_volume && (py_preload != Py_None || py_fanotify != Py_None))
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "io_volume can't be used with preload or fanotify");
+        return NULL;
+    }
+    if(py_events != Py_None && !PyCallable_Check(py_events))
+    {
+        PyErr_SetString(PyExc_TypeError, "events should be callable");
+        return NULL;
+    }
     trace_verbosity = verbosity;
+    trace_threads = tracer_threads;
+    trace_options = 0;
+    if(seccomp)
+        trace_options |= TRACE_OPT_SECCOMP;
+    if(writer_thread)
+        trace_options |= TRACE_OPT_WRITER_THREAD;
+    if(event_log)
+        trace_options |= TRACE_OPT_EVENT_LOG;
+    if(io_volume)
+        trace_options |= TRACE_OPT_IO_VOLUME;
+    if(early_resume)
+        trace_options |= TRACE_OPT_EARLY_RESUME;
+
+    /* Builds the trie of ignored paths */
+    clear_ignored_paths();
+    if(py_ignored_paths == Py_None)
+    {
+        const char **root;
+        for(root = default_ignored_paths; *root != NULL; ++root)
+            add_ignored_path(*root);
+    }
+    else
+    {
+        Py_ssize_t i;
+        PyObject *seq = PySequence_Fast(py_ignored_paths,
+                                        "ignored_paths should be a sequence");
+        if(seq == NULL)
+            goto done;
+        for(i = 0; i < PySequence_Fast_GET_SIZE(seq); ++i)
+        {
+            char *root = get_string(PySequence_Fast_GET_ITEM(seq, i));
+            int bad = 0;
+            if(root == NULL)
+            {
+                if(!PyErr_Occurred())
+                    PyErr_SetString(PyExc_TypeError,
+                                    "ignored paths should be strings");
+                bad = 1;
+            }
+            else if(add_ignored_path(root) != 0)
+            {
+                PyErr_Format(PyExc_ValueError,
+                             "ignored path %s is not absolute and canonical",
+                             root);
+                bad = 1;
+            }
+            free(root);
+            if(bad)
+            {
+                Py_DECREF(seq);
+                goto done;
+            }
+        }
+        Py_DECREF(seq);
+    }
+
+    if(py_preload != Py_None)
+    {
+        preload = get_string(py_preload);
+        if(preload == NULL)
+        {
+            if(!PyErr_Occurred())
+                PyErr_SetString(PyExc_TypeError,
+                                "preload should be a string");
+            goto done;
+        }
+        /* The loader would only print a warning and carry on */
+        if(access(preload, R_OK) != 0)
+        {
+            PyErr_Format(PyExc_ValueError,
+                         "preload library %s can't be read", preload);
+            goto done;
+        }
+        trace_options |= TRACE_OPT_PRELOAD;
+    }
+    trace_preload_library = preload;
+
+    if(py_fanotify != Py_None)
+    {
+        Py_ssize_t i, nb;
+        PyObject *seq;
+        if(preload != NULL)
+        {
+            PyErr_SetString(PyExc_ValueError,
+                            "preload and fanotify can't be used together");
+            goto done;
+        }
+        seq = PySequence_Fast(py_fanotify, "fanotify should be a sequence");
+        if(seq == NULL)
+            goto done;
+        nb = PySequence_Fast_GET_SIZE(seq);
+        /* NULL-terminated at any point, for the cleanup */
+        fanotify = calloc(nb + 1, sizeof(char*));
+        for(i = 0; i < nb; ++i)
+        {
+            fanotify[i] = get_string(PySequence_Fast_GET_ITEM(seq, i));
+            if(fanotify[i] == NULL)
+            {
+                if(!PyErr_Occurred())
+                    PyErr_SetString(PyExc_TypeError,
+                                    "fanotify paths should be strings");
+                Py_DECREF(seq);
+                goto done;
+            }
+        }
+        Py_DECREF(seq);
+        trace_options |= TRACE_OPT_FANOTIFY;
+    }
+    trace_fanotify_paths = (const char *const *)fanotify;
 
     binary = get_string(py_binary);
-    if(binary == NULL)
-        return NULL;
     databasepath = get_string(py_databasepath);
-    if(databasepath == NULL)
-        return NULL;
+    if(binary == NULL || databasepath == NULL)
+    {
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError,
+                            "binary and databasepath should be strings");
+        goto done;
+    }
 
     /* Converts argv from Python list to char[][] */
     {
         size_t i;
-        int bad = 0;
         argv_len = PyList_Size(py_argv);
-        argv = malloc((argv_len + 1) * sizeof(char*));
+        argv = calloc(argv_len + 1, sizeof(char*));
         for(i = 0; i < argv_len; ++i)
         {
             PyObject *arg = PyList_GetItem(py_argv, i);
-            char *str = get_string(arg);
-            if(str == NULL)
-                break;
-            argv[i] = str;
-        }
-        if(bad)
-        {
-            size_t j;
-            for(j = 0; j < i; ++j)
-                free(argv[j]);
-            free(argv);
-            return NULL;
+            argv[i] = get_string(arg);
+            if(argv[i] == NULL)
+            {
+                if(!PyErr_Occurred())
+                    PyErr_SetString(PyExc_TypeError,
+                                    "argv should be a list of strings");
+                goto done;
+            }
         }
-        argv[argv_len] = NULL;
     }
 
-    if(fork_and_trace(binary, argv_len, argv, databasepath, &exit_status) == 0)
+    if(py_events != Py_None)
     {
-        ret = PyLong_FromLong(exit_status);
+        events = malloc(sizeof(*events));
+        events->callback = py_events;
+        events->error_type = NULL;
+        events->count = 0;
+        events->names_size = 4096;
+        events->names = malloc(events->names_size);
+        events->names_len = 0;
+        db_set_listener(events_listener, events);
     }
-    else
+
+    /* Other threads can run, and trace too */
+    Py_BEGIN_ALLOW_THREADS
+    status = fork_and_trace(binary, argv_len, argv, databasepath,
+                            &exit_status);
+    Py_END_ALLOW_THREADS
+    if(events != NULL)
+    {
+        db_set_listener(NULL, NULL);
+        if(status == 0)
+            events_flush(events);
+    }
+    if(status != 0)
     {
         PyErr_SetString(Err_Base, "Error occurred");
         ret = NULL;
     }
+    else if(events != NULL && events->error_type != NULL)
+    {
+        /* Steals the references */
+        PyErr_Restore(events->error_type, events->error_value,
+                      events->error_traceback);
+        events->error_type = NULL;
+        ret = NULL;
+    }
+    else
+        ret = PyLong_FromLong(exit_status);
+    if(events != NULL)
+    {
+        if(events->error_type != NULL)
+        {
+            Py_DECREF(events->error_type);
+            Py_XDECREF(events->error_value);
+            Py_XDECREF(events->error_traceback);
+        }
+        free(events->names);
+        free(events);
+    }
 
+done:
     /* Deallocs argv */
+    if(argv != NULL)
     {
         size_t i;
         for(i = 0; i < argv_len; ++i)
             free(argv[i]);
         free(argv);
     }
+    free(binary);
+    free(databasepath);
+    trace_options = 0;
+    clear_ignored_paths();
+    free(preload);
+    trace_preload_library = NULL;
+    if(fanotify != NULL)
+    {
+        char **path;
+        for(path = fanotify; *path != NULL; ++path)
+            free(*path);
+        free(fanotify);
+    }
+    trace_fanotify_paths = NULL;
 
     return ret;
 }
 
 
+static PyObject *pytracer_convert_event_log(PyObject *self, PyObject *args)
+{
+    PyObject *ret;
+    char *logpath, *databasepath;
+    int verbosity, status;
+    PyObject *py_logpath, *py_databasepath;
+    if(!PyArg_ParseTuple(args, "OOi", &py_logpath, &py_databasepath,
+                         &verbosity))
+        return NULL;
+
+    if(verbosity < 0)
+    {
+        PyErr_SetString(Err_Base, "verbosity should be >= 0");
+        return NULL;
+    }
+    trace_verbosity = verbosity;
+
+    logpath = get_string(py_logpath);
+    if(logpath == NULL)
+        return NULL;
+    databasepath = get_string(py_databasepath);
+    if(databasepath == NULL)
+    {
+        free(logpath);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    status = db_convert_event_log(logpath, databasepath);
+    Py_END_ALLOW_THREADS
+    if(status == 0)
+    {
+        Py_INCREF(Py_None);
+        ret = Py_None;
+    }
+    else
+    {
+        PyErr_SetString(Err_Base, "Error occurred");
+        ret = NULL;
+    }
+
+    free(logpath);
+    free(databasepath);
+    return ret;
+}
+
+
 static PyMethodDef methods[] = {
-    {"execute", pytracer_execute, METH_VARARGS,
-     "execute(binary, argv, databasepath, verbosity)\n"
+    {"execute", (PyCFunction)pytracer_execute, METH_VARARGS | METH_KEYWORDS,
+     "execute(binary, argv, databasepath, verbosity, seccomp=False,\n"
+     "        writer_thread=False, event_log=False, ignored_paths=None,\n"
+     "        early_resume=False, preload=None, fanotify=None, events=None,\n"
+     "        tracer_threads=1, io_volume=False)\n"
      "\n"
      "Runs the specified binary with the argument list argv under trace and "
-     "writes\nthe captured events to SQLite3 database databasepath."},
+     "writes\nthe captured events to SQLite3 database databasepath.\n"
+     "The GIL is released while it runs, so several programs can be traced "
+     "at once\nfrom different threads.\n"
+     "\n"
+     "If seccomp is true, a seccomp-BPF filter is installed so that the "
+     "program only\nstops on the system calls that are recorded.\n"
+     "\n"
+     "If writer_thread is true, the database is written from a separate "
+     "thread,\nwhile the traced program runs.\n"
+     "\n"
+     "If event_log is true, a binary event log is written to databasepath "
+     "instead of\na database; use convert_event_log() to read it.\n"
+     "\n"
+     "Accesses to the paths in ignored_paths, or under them, are not "
+     "recorded. The\ndefault is /dev, /proc and /sys.\n"
+     "\n"
+     "If early_resume is true, a process is resumed as soon as the arguments "
+     "of its\nsyscall are read, before the access is recorded. Whether a "
+     "path is a\ndirectory is then looked up while the process runs, and "
+     "might see changes it\nmade since. This was only found to help with "
+     "several CPUs.\n"
+     "\n"
+     "If preload is the path to the reprozip._preload library, it is "
+     "injected with\nLD_PRELOAD in the dynamically-linked programs, which "
+     "then report their file\naccesses without stopping. Programs that "
+     "can't load it are traced as usual.\n"
+     "\n"
+     "If fanotify is a list of paths, their mounts are watched with fanotify "
+     "(which\nrequires root), and the files closed by the processes are "
+     "recorded from there\nrather than by stopping them on open(). stat() "
+     "and similar calls are not\nrecorded in this mode.\n"
+     "\n"
+     "If events is a callable, it is called from the tracing thread with "
+     "lists of\nthe recorded events as they happen, which are tuples "
+     "(\"exec\", binary, mode)\nor (\"open\", path, mode). It should "
+     "return quickly, for instance by queuing\nthem for another thread. If "
+     "it raises an exception, it is not called anymore\nand the exception "
+     "is raised once the trace is done.\n"
+     "\n"
+     "If tracer_threads is more than 1, that many threads trace the program, "
+     "and\nprocesses are handed from busy ones to idle ones. This can't be "
+     "used with\npreload or fanotify.\n"
+     "\n"
+     "If io_volume is true, the bytes read and written through each opened "
+     "file are\ncounted, and stored with the file access. With seccomp, "
+     "only the reads and\nwrites of at least 64 KiB are counted, so the "
+     "others don't stop the program.\nThis can't be used with preload or "
+     "fanotify."},
+    {"convert_event_log", pytracer_convert_event_log, METH_VARARGS,
+     "convert_event_log(logpath, databasepath, verbosity)\n"
+     "\n"
+     "Writes the events from the binary event log logpath to SQLite3 "
+     "database\ndatabasepath, appending a run if it already exists. A log "
+     "that was not closed\nbecause the tracer was killed is converted up to "
+     "its last complete event."},
     { NULL, NULL, 0, NULL }
 };
 
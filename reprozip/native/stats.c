@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "stats.h"
+
+
+#define STATS_ABIS      3
+
+struct stats_counter {
+    unsigned long long count;
+    stats_time time;
+};
+
+struct stats_syscall {
+    const char *name;
+    struct stats_counter entry, exit;
+};
+
+/* The syscall arrays are indexed by number, and grown up to the highest one
+ * seen (x32 numbers go over 512) */
+struct stats {
+    struct stats_counter counters[STAT_COUNTERS];
+    struct stats_syscall *syscalls[STATS_ABIS];
+    size_t syscalls_len[STATS_ABIS];
+};
+
+static const char *const counter_names[STAT_COUNTERS] = {
+    "wait",
+    "registers",
+    "database",
+    "path_type_cache_hits",
+    "path_type_cache_misses",
+    "exec_cache_hits",
+    "exec_cache_misses",
+};
+
+#define counter_is_timed(stat) ((stat) <= STAT_DATABASE)
+
+/* Same order as syscall_tables; the syscalls of the tracer's own ABI are not
+ * prefixed */
+static const char *const abi_names[STATS_ABIS] = {"i386", "x86_64", "x32"};
+#if defined(I386)
+#   define NATIVE_ABI 0
+#else
+#   define NATIVE_ABI 1
+#endif
+
+static __thread struct stats *current = NULL;
+
+
+stats_time stats_clock(void)
+{
+    struct timespec now;
+    if(clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+        return 0; /* LCOV_EXCL_LINE : clock_gettime() is unlikely to fail */
+    return (stats_time)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+struct stats *stats_new(void)
+{
+    return calloc(1, sizeof(struct stats));
+}
+
+void stats_free(struct stats *stats)
+{
+    unsigned int abi;
+    if(stats == NULL)
+        return;
+    for(abi = 0; abi < STATS_ABIS; ++abi)
+        free(stats->syscalls[abi]);
+    free(stats);
+}
+
+static struct stats *get_stats(void)
+{
+    if(current == NULL)
+        current = stats_new();
+    return current;
+}
+
+static struct stats_syscall *get_syscall(struct stats *stats,
+                                        unsigned int abi, size_t syscall)
+{
+    if(syscall >= stats->syscalls_len[abi])
+    {
+        size_t len = (syscall + 64) & ~(size_t)63;
+        struct stats_syscall *syscalls = realloc(
+                stats->syscalls[abi], len * sizeof(struct stats_syscall));
+        if(syscalls == NULL)
+            return NULL; /* LCOV_EXCL_LINE */
+        memset(syscalls + stats->syscalls_len[abi], 0,
+               (len - stats->syscalls_len[abi])
+               * sizeof(struct stats_syscall));
+        stats->syscalls[abi] = syscalls;
+        stats->syscalls_len[abi] = len;
+    }
+    return &stats->syscalls[abi][syscall];
+}
+
+void stats_timed(unsigned int stat, stats_time start)
+{
+    struct stats_counter *counter = &get_stats()->counters[stat];
+    ++counter->count;
+    counter->time += stats_clock() - start;
+}
+
+void stats_count(unsigned int stat, unsigned long count)
+{
+    get_stats()->counters[stat].count += count;
+}
+
+void stats_syscall(unsigned int abi, int syscall, const char *name,
+                   int exiting, stats_time start)
+{
+    struct stats_syscall *sc;
+    struct stats_counter *counter;
+    if(abi >= STATS_ABIS || syscall < 0)
+        return;
+    sc = get_syscall(get_stats(), abi, syscall);
+    if(sc == NULL)
+        return; /* LCOV_EXCL_LINE */
+    sc->name = name;
+    counter = exiting?&sc->exit:&sc->entry;
+    ++counter->count;
+    counter->time += stats_clock() - start;
+}
+
+static void add_counter(struct stats_counter *into,
+                        const struct stats_counter *from)
+{
+    into->count += from->count;
+    into->time += from->time;
+}
+
+static void add_stats(struct stats *into, const struct stats *from)
+{
+    unsigned int abi, i;
+    for(i = 0; i < STAT_COUNTERS; ++i)
+        add_counter(&into->counters[i], &from->counters[i]);
+    for(abi = 0; abi < STATS_ABIS; ++abi)
+        for(i = 0; i < from->syscalls_len[abi]; ++i)
+        {
+            struct stats_syscall *sc;
+            const struct stats_syscall *other = &from->syscalls[abi][i];
+            if(other->entry.count == 0 && other->exit.count == 0)
+                continue;
+            sc = get_syscall(into, abi, i);
+            if(sc == NULL)
+                return; /* LCOV_EXCL_LINE */
+            if(other->name != NULL)
+                sc->name = other->name;
+            add_counter(&sc->entry, &other->entry);
+            add_counter(&sc->exit, &other->exit);
+        }
+}
+
+void stats_merge(struct stats *into)
+{
+    if(current == NULL)
+        return;
+    add_stats(into, current);
+    stats_reset();
+}
+
+void stats_add(const struct stats *from)
+{
+    add_stats(get_stats(), from);
+}
+
+void stats_reset(void)
+{
+    stats_free(current);
+    current = NULL;
+}
+
+void stats_syscall_name(char *buffer, size_t size,
+                        unsigned int abi, int syscall, const char *name)
+{
+    const char *abi_name = (abi < STATS_ABIS)?abi_names[abi]:"unknown";
+    if(name == NULL)
+        snprintf(buffer, size, "%s:%d", abi_name, syscall);
+    else if(abi != NATIVE_ABI)
+        snprintf(buffer, size, "%s:%s", abi_name, name);
+    else
+        snprintf(buffer, size, "%s", name);
+}
+
+int stats_foreach(stats_callback *callback, void *data)
+{
+    unsigned int abi, i;
+    if(current == NULL)
+        return 0;
+    for(i = 0; i < STAT_COUNTERS; ++i)
+    {
+        const struct stats_counter *counter = &current->counters[i];
+        if(counter->count > 0
+         && callback(counter_names[i], NULL, counter->count,
+                     counter_is_timed(i)?(long long)counter->time:-1,
+                     data) != 0)
+            return -1;
+    }
+    for(abi = 0; abi < STATS_ABIS; ++abi)
+        for(i = 0; i < current->syscalls_len[abi]; ++i)
+        {
+            const struct stats_syscall *sc = &current->syscalls[abi][i];
+            char syscall[64];
+            if(sc->entry.count == 0 && sc->exit.count == 0)
+                continue;
+            stats_syscall_name(syscall, sizeof(syscall), abi, i, sc->name);
+            if(sc->entry.count > 0
+             && callback("syscall_entry", syscall, sc->entry.count,
+                         (long long)sc->entry.time, data) != 0)
+                return -1;
+            if(sc->exit.count > 0
+             && callback("syscall_exit", syscall, sc->exit.count,
+                         (long long)sc->exit.time, data) != 0)
+                return -1;
+        }
+    return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+/* Self-profiling of the tracer
+ *
+ * Each tracer thread counts what it does and how long it takes (in
+ * nanoseconds, from CLOCK_MONOTONIC), and db_close() writes it to the
+ * tracer_stats table. This is always on; it costs a few clock_gettime() calls
+ * per stop, which don't enter the kernel. */
+
+#define STAT_WAIT           0   /* Waiting for a process to stop */
+#define STAT_REGISTERS      1   /* Reading the registers of a syscall-stop */
+#define STAT_DATABASE       2   /* In db_add_*() */
+/* Counters without a time */
+#define STAT_PATH_TYPE_HITS     3
+#define STAT_PATH_TYPE_MISSES   4
+#define STAT_EXEC_CACHE_HITS    5
+#define STAT_EXEC_CACHE_MISSES  6
+
+#define STAT_COUNTERS       7
+
+typedef unsigned long long stats_time;
+
+stats_time stats_clock(void);
+
+/* Counts an event of the given kind, that started at `start` */
+void stats_timed(unsigned int stat, stats_time start);
+
+void stats_count(unsigned int stat, unsigned long count);
+
+/* Counts a syscall-stop of the given ABI (index in syscall_tables), whose
+ * handler ran from `start`. name is static, or NULL if the syscall isn't
+ * known. */
+void stats_syscall(unsigned int abi, int syscall, const char *name,
+                   int exiting, stats_time start);
+
+/* Name under which a syscall is recorded: the bare name for the tracer's own
+ * ABI, "abi:name" for the others, and "abi:number" if the name is NULL */
+void stats_syscall_name(char *buffer, size_t size,
+                        unsigned int abi, int syscall, const char *name);
+
+/* Calls the callback for each non-zero counter of the calling thread. syscall
+ * is NULL for the counters that are not per-syscall, and time is -1 for the
+ * ones without a time. Stops if the callback returns non-zero. */
+typedef int stats_callback(const char *name, const char *syscall,
+                           unsigned long long count, long long time,
+                           void *data);
+int stats_foreach(stats_callback *callback, void *data);
+
+/* Drops the calling thread's counters */
+void stats_reset(void);
+
+/* Sharded tracing: the tracer threads hand their counters over to the
+ * recording thread. stats_merge() adds the calling thread's counters to
+ * `into`, which has to be locked, and drops them; stats_add() adds `from` to
+ * the calling thread's counters. */
+struct stats;
+struct stats *stats_new(void);
+void stats_merge(struct stats *into);
+void stats_add(const struct stats *from);
+void stats_free(struct stats *stats);
+
+#endif
@@ -1,9 +1,14 @@
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sched.h>
@@ -16,8 +21,12 @@
 
 #include "config.h"
 #include "database.h"
+#include "fdtable.h"
+#include "latency.h"
 #include "log.h"
+#include "preload.h"
 #include "ptrace_utils.h"
+#include "stats.h"
 #include "syscalls.h"
 #include "tracer.h"
 #include "utils.h"
@@ -106,6 +115,287 @@ static void record_connection(struct Process *process, int inbound,
 }
 
 
+/* ********************
+ * Deferred work
+ *
+ * A handler only reads what it needs from the stopped process (its
+ * registers and memory); the rest (lstat(), database) is queued and done
+ * once the process has been resumed, while the tracer would otherwise be
+ * waiting for the next event. If the processes keep the tracer busy, that
+ * might not happen for a while, so at most PENDING_MAX entries are kept: past
+ * that, the work is done before resuming the process.
+ */
+
+#define PENDING_MAX 1024
+
+struct PendingWork {
+    int (*run)(const struct PendingWork *work);
+    unsigned int process;
+    char *paths[2];             /* Owned, can be NULL */
+    unsigned int mode;
+    int is_dir;
+    unsigned long long bytes[2];
+    struct PendingWork *next;
+};
+
+static __thread struct PendingWork *pending_head = NULL, *pending_tail = NULL;
+static __thread unsigned int pending_count = 0;
+
+static struct PendingWork *defer(int (*run)(const struct PendingWork *work),
+                                  const struct Process *process,
+                                  char *path0, char *path1,
+                                  unsigned int mode, int is_dir)
+{
+    struct PendingWork *work = malloc(sizeof(*work));
+    work->run = run;
+    work->process = process->identifier;
+    work->paths[0] = path0;
+    work->paths[1] = path1;
+    work->mode = mode;
+    work->is_dir = is_dir;
+    work->next = NULL;
+    if(pending_tail != NULL)
+        pending_tail->next = work;
+    else
+        pending_head = work;
+    pending_tail = work;
+    ++pending_count;
+    return work;
+}
+
+int syscall_pending_work(void)
+{
+    return pending_head != NULL;
+}
+
+int syscall_process_pending(int all)
+{
+    int ret = 0;
+    while(pending_head != NULL && ret == 0)
+    {
+        struct PendingWork *work = pending_head;
+        pending_head = work->next;
+        if(pending_head == NULL)
+            pending_tail = NULL;
+        --pending_count;
+        ret = work->run(work);
+        free(work->paths[0]);
+        free(work->paths[1]);
+        free(work);
+        if(!all)
+            break;
+    }
+    return ret;
+}
+
+static int record_file_access(unsigned int process, const char *pathname,
+                              unsigned int mode, int is_dir)
+{
+    /* The file might have been created */
+    if(mode & FILE_WRITE)
+        forget_path_type(pathname, 0);
+    return db_add_file_open(process, pathname, mode, is_dir);
+}
+
+/* Records paths[0] */
+static int run_file_access(const struct PendingWork *work)
+{
+    return record_file_access(work->process, work->paths[0],
+                              work->mode, work->is_dir);
+}
+
+static void defer_file_access(const struct Process *process, char *pathname,
+                              unsigned int mode, int is_dir)
+{
+    defer(run_file_access, process, pathname, NULL, mode, is_dir);
+}
+
+
+/* ********************
+ * Latencies, see latency.h
+ */
+
+/* Latency of the syscall whose exit is being handled, 0 if it isn't known */
+static __thread stats_time current_latency = 0;
+
+/* Adds the current syscall to the histogram of the directory of pathname */
+static void record_path_latency(struct Process *process, const char *name,
+                                const char *pathname)
+{
+    if(current_latency > 0 && name != NULL && process->threadgroup != NULL)
+        latency_record_path(&process->threadgroup->latencies, name, pathname,
+                            current_latency);
+}
+
+static int flush_latency(void *data, const char *syscall, const char *path,
+                         unsigned int count, unsigned long long time,
+                         const char *histogram)
+{
+    return db_add_latency(*(const unsigned int*)data, syscall, path,
+                          count, time, histogram);
+}
+
+int syscall_flush_latencies(struct Process *process)
+{
+    if(latency_foreach(process->latencies, flush_latency,
+                       &process->identifier) != 0)
+        return -1;
+    latency_free(process->latencies);
+    process->latencies = NULL;
+    if(process->threadgroup != NULL && process->threadgroup->refs == 1)
+    {
+        struct ThreadGroup *threadgroup = process->threadgroup;
+        if(latency_foreach(threadgroup->latencies, flush_latency,
+                           &process->identifier) != 0)
+            return -1;
+        latency_free(threadgroup->latencies);
+        threadgroup->latencies = NULL;
+    }
+    return 0;
+}
+
+
+/* ********************
+ * I/O volume, see fdtable.h
+ */
+
+/* Records the totals of paths[0] */
+static int run_file_io(const struct PendingWork *work)
+{
+    return db_add_file_io(work->process, work->paths[0], work->mode,
+                          work->bytes[0], work->bytes[1]);
+}
+
+/* Called by fdtable_close(); the totals go after the access itself, which
+ * might still be deferred */
+static int close_file(void *data, unsigned int process, const char *path,
+                      unsigned int mode, unsigned long long read,
+                      unsigned long long written)
+{
+    struct PendingWork *work = defer(run_file_io, data, strdup(path), NULL,
+                                     mode, 0);
+    work->process = process;
+    work->bytes[0] = read;
+    work->bytes[1] = written;
+    return 0;
+}
+
+int syscall_flush_files(struct Process *process)
+{
+    struct ThreadGroup *threadgroup = process->threadgroup;
+    if(threadgroup == NULL || threadgroup->fds == NULL
+     || threadgroup->refs != 1)
+        return 0;
+    if(fdtable_close(threadgroup->fds, 0, INT_MAX, 0,
+                     close_file, process) != 0)
+        return -1;
+    return syscall_process_pending(1);
+}
+
+/* Handles read(), write() and the like, once they returned */
+#define IO_READ         1
+#define IO_WRITE        2
+#define IO_SENDFILE     3   /* Reads argument 1, writes argument 0 */
+#define IO_COPY         4   /* Reads argument 0, writes argument 2 */
+
+static int syscall_io(const char *name, struct Process *process,
+                      unsigned int udata)
+{
+    struct FdTable *fds = process->threadgroup->fds;
+    unsigned long long bytes;
+    if(fds == NULL || process->retvalue.i <= 0)
+        return 0;
+    bytes = process->retvalue.u;
+    switch(udata)
+    {
+    case IO_READ:
+        fdtable_count(fds, process->params[0].i, bytes, 0);
+        break;
+    case IO_WRITE:
+        fdtable_count(fds, process->params[0].i, 0, bytes);
+        break;
+    case IO_SENDFILE:
+        fdtable_count(fds, process->params[1].i, bytes, 0);
+        fdtable_count(fds, process->params[0].i, 0, bytes);
+        break;
+    case IO_COPY:
+        fdtable_count(fds, process->params[0].i, bytes, 0);
+        fdtable_count(fds, process->params[2].i, 0, bytes);
+        break;
+    }
+    return 0;
+}
+
+/* close(), dup(), ... */
+#define FD_CLOSE        1
+#define FD_CLOSE_RANGE  2
+#define FD_DUP          3
+#define FD_DUP2         4
+#define FD_DUP3         5
+#define FD_FCNTL        6
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+static int syscall_fd(const char *name, struct Process *process,
+                      unsigned int udata)
+{
+    struct FdTable *fds = process->threadgroup->fds;
+    int fd = process->params[0].i;
+    if(fds == NULL || process->retvalue.i < 0)
+        return 0;
+    switch(udata)
+    {
+    case FD_CLOSE:
+        return fdtable_close(fds, fd, fd, 0, close_file, process);
+    case FD_CLOSE_RANGE:
+        {
+            unsigned int last = process->params[1].u;
+            if(last > INT_MAX)
+                last = INT_MAX;
+            if(process->params[2].u & CLOSE_RANGE_CLOEXEC)
+            {
+                fdtable_set_cloexec(fds, fd, (int)last, 1);
+                return 0;
+            }
+            return fdtable_close(fds, fd, (int)last, 0, close_file, process);
+        }
+    case FD_DUP:
+    case FD_DUP2:
+    case FD_DUP3:
+        {
+            /* dup2() closes the previous file; for the others, this is in
+             * case we missed it being closed */
+            int newfd = process->retvalue.i;
+            int cloexec = (udata == FD_DUP3
+                           && (process->params[2].u & O_CLOEXEC));
+            if(newfd == fd)
+                return 0;
+            if(fdtable_close(fds, newfd, newfd, 0, close_file, process) != 0)
+                return -1;
+            fdtable_dup(fds, fd, newfd, cloexec);
+            return 0;
+        }
+    case FD_FCNTL:
+        if(process->params[1].i == F_DUPFD
+         || process->params[1].i == F_DUPFD_CLOEXEC)
+        {
+            int newfd = process->retvalue.i;
+            if(fdtable_close(fds, newfd, newfd, 0, close_file, process) != 0)
+                return -1;
+            fdtable_dup(fds, fd, newfd,
+                        process->params[1].i == F_DUPFD_CLOEXEC);
+        }
+        else if(process->params[1].i == F_SETFD)
+            fdtable_set_cloexec(fds, fd, fd,
+                                (process->params[2].i & FD_CLOEXEC) != 0);
+        return 0;
+    }
+    return 0;
+}
+
+
 /* ********************
  * Other syscalls that might be of interest but that we don't handle yet
  */
@@ -189,16 +479,29 @@ static int syscall_fileopening(const char *name, struct Process *process,
                       (process->retvalue.i >= 0)?"success":"failure");
     }
 
+    record_path_latency(process, name, pathname);
     if(process->retvalue.i >= 0)
     {
-        if(db_add_file_open(process->identifier,
-                            pathname,
-                            mode,
-                            path_is_dir(pathname)) != 0)
-            return -1;
+        if(process->threadgroup->fds != NULL
+         && syscall != SYSCALL_OPENING_ACCESS)
+        {
+            int fd = process->retvalue.i;
+            /* In case we missed it being closed */
+            if(fdtable_close(process->threadgroup->fds, fd, fd, 0,
+                             close_file, process) != 0)
+            {
+                free(pathname);
+                return -1;
+            }
+            fdtable_open(process->threadgroup->fds, fd,
+                         process->identifier, pathname, mode,
+                         syscall == SYSCALL_OPENING_OPEN
+                         && (process->params[1].u & O_CLOEXEC));
+        }
+        defer_file_access(process, pathname, mode, DB_IS_DIR_UNKNOWN);
     }
-
-    free(pathname);
+    else
+        free(pathname);
     return 0;
 }
 
@@ -207,30 +510,38 @@ static int syscall_fileopening(const char *name, struct Process *process,
  * rename(), link(), symlink()
  */
 
+/* Records the source paths[0] (if any) and the destination paths[1]. A
+ * rename replaces the destination, and moves the source with everything under
+ * it */
+static int run_file_link(const struct PendingWork *work)
+{
+    const char *read_path = work->paths[0], *written_path = work->paths[1];
+    int is_dir;
+    forget_path_type(written_path, 1);
+    if(read_path != NULL)
+        forget_path_type(read_path, 1);
+    is_dir = path_is_dir(written_path);
+    if(read_path != NULL
+     && db_add_file_open(work->process,
+                         read_path,
+                         FILE_READ | FILE_LINK,
+                         is_dir) != 0)
+        return -1;
+    return db_add_file_open(work->process,
+                            written_path,
+                            FILE_WRITE | FILE_LINK,
+                            is_dir);
+}
+
 static int syscall_filecreating(const char *name, struct Process *process,
                                 unsigned int is_symlink)
 {
     if(process->retvalue.i >= 0)
     {
-        char *written_path = abs_path_arg(process, 1);
-        int is_dir = path_is_dir(written_path);
         /* symlink doesn't actually read the source */
-        if(!is_symlink)
-        {
-            char *read_path = abs_path_arg(process, 0);
-            if(db_add_file_open(process->identifier,
-                                read_path,
-                                FILE_READ | FILE_LINK,
-                                is_dir) != 0)
-                return -1;
-            free(read_path);
-        }
-        if(db_add_file_open(process->identifier,
-                            written_path,
-                            FILE_WRITE | FILE_LINK,
-                            is_dir) != 0)
-            return -1;
-        free(written_path);
+        char *read_path = is_symlink?NULL:abs_path_arg(process, 0);
+        char *written_path = abs_path_arg(process, 1);
+        defer(run_file_link, process, read_path, written_path, 0, 0);
     }
     return 0;
 }
@@ -240,28 +551,13 @@ static int syscall_filecreating_at(const char *name, struct Process *process,
 {
     if(process->retvalue.i >= 0)
     {
-        if( (process->params[0].i == AT_FDCWD)
-         && (process->params[2].i == AT_FDCWD) )
+        if( ((int)process->params[0].i == AT_FDCWD)
+         && ((int)process->params[2].i == AT_FDCWD) )
         {
-            char *written_path = abs_path_arg(process, 3);
-            int is_dir = path_is_dir(written_path);
             /* symlink doesn't actually read the source */
-            if(!is_symlink)
-            {
-                char *read_path = abs_path_arg(process, 1);
-                if(db_add_file_open(process->identifier,
-                                    read_path,
-                                    FILE_READ | FILE_LINK,
-                                    is_dir) != 0)
-                    return -1;
-                free(read_path);
-            }
-            if(db_add_file_open(process->identifier,
-                                written_path,
-                                FILE_WRITE | FILE_LINK,
-                                is_dir) != 0)
-                return -1;
-            free(written_path);
+            char *read_path = is_symlink?NULL:abs_path_arg(process, 1);
+            char *written_path = abs_path_arg(process, 3);
+            defer(run_file_link, process, read_path, written_path, 0, 0);
         }
         else
             return syscall_unhandled_other(name, process, 0);
@@ -280,12 +576,10 @@ static int syscall_filestat(const char *name, struct Process *process,
     if(process->retvalue.i >= 0)
     {
         char *pathname = abs_path_arg(process, 0);
-        if(db_add_file_open(process->identifier,
-                            pathname,
-                            FILE_STAT | (no_deref?FILE_LINK:0),
-                            path_is_dir(pathname)) != 0)
-            return -1;
-        free(pathname);
+        record_path_latency(process, name, pathname);
+        defer_file_access(process, pathname,
+                          FILE_STAT | (no_deref?FILE_LINK:0),
+                          DB_IS_DIR_UNKNOWN);
     }
     return 0;
 }
@@ -301,12 +595,8 @@ static int syscall_readlink(const char *name, struct Process *process,
     if(process->retvalue.i >= 0)
     {
         char *pathname = abs_path_arg(process, 0);
-        if(db_add_file_open(process->identifier,
-                            pathname,
-                            FILE_STAT | FILE_LINK,
-                            0) != 0)
-            return -1;
-        free(pathname);
+        record_path_latency(process, name, pathname);
+        defer_file_access(process, pathname, FILE_STAT | FILE_LINK, 0);
     }
     return 0;
 }
@@ -323,12 +613,7 @@ static int syscall_mkdir(const char *name, struct Process *process,
     {
         char *pathname = abs_path_arg(process, 0);
         log_debug(process->tid, "mkdir(\"%s\")", pathname);
-        if(db_add_file_open(process->identifier,
-                            pathname,
-                            FILE_WRITE,
-                            1) != 0)
-            return -1;
-        free(pathname);
+        defer_file_access(process, pathname, FILE_WRITE, 1);
     }
     return 0;
 }
@@ -346,11 +631,7 @@ static int syscall_chdir(const char *name, struct Process *process,
         char *pathname = abs_path_arg(process, 0);
         free(process->threadgroup->wd);
         process->threadgroup->wd = pathname;
-        if(db_add_file_open(process->identifier,
-                            pathname,
-                            FILE_WDIR,
-                            1) != 0)
-            return -1;
+        defer_file_access(process, strdup(pathname), FILE_WDIR, 1);
     }
     return 0;
 }
@@ -364,14 +645,27 @@ static int syscall_chdir(const char *name, struct Process *process,
  */
 
 #define SHEBANG_MAX_LEN 128 /* = Linux's BINPRM_BUF_SIZE */
+#define SHEBANG_MAX_DEPTH 4
 
-static int record_shebangs(struct Process *process, const char *exec_target)
+/* Lists of paths are stored as consecutive strings, ending with an empty
+ * string */
+static size_t path_list_size(const char *list)
+{
+    const char *p = list;
+    while(*p)
+        p += strlen(p) + 1;
+    return p - list + 1;
+}
+
+/* Reads the chain of interpreters of an executed file into chain, which
+ * should be able to hold SHEBANG_MAX_DEPTH * SHEBANG_MAX_LEN + 1 bytes */
+static void read_shebangs(pid_t tid, const char *exec_target, char *chain)
 {
-    const char *wd = process->threadgroup->wd;
     char buffer[SHEBANG_MAX_LEN];
-    char target_buffer[SHEBANG_MAX_LEN];
+    char *pos = chain;
     int step;
-    for(step = 0; step < 4; ++step)
+    *pos = '\0';
+    for(step = 0; step < SHEBANG_MAX_DEPTH; ++step)
     {
         FILE *execd = fopen(exec_target, "rb");
         size_t ret = 0;
@@ -382,11 +676,11 @@ static int record_shebangs(struct Process *process, const char *exec_target)
         }
         if(ret == 0)
         {
-            log_error(process->tid, "couldn't open executed file %s", exec_target);
-            return 0;
+            log_error(tid, "couldn't open executed file %s", exec_target);
+            return;
         }
         if(buffer[0] != '#' || buffer[1] != '!')
-            return 0;
+            return;
         else
         {
             char *start = buffer + 2;
@@ -395,8 +689,8 @@ static int record_shebangs(struct Process *process, const char *exec_target)
                 ++start;
             if(*start == '\n' || *start == '\0')
             {
-                log_info(process->tid, "empty shebang in %s", exec_target);
-                return 0;
+                log_info(tid, "empty shebang in %s", exec_target);
+                return;
             }
             {
                 char *end = start;
@@ -405,30 +699,179 @@ static int record_shebangs(struct Process *process, const char *exec_target)
                     ++end;
                 *end = '\0';
             }
-            log_info(process->tid, "read shebang: %s -> %s", exec_target, start);
-            if(*start != '/')
+            log_info(tid, "read shebang: %s -> %s", exec_target, start);
+            exec_target = strcpy(pos, start);
+            pos += strlen(pos) + 1;
+            *pos = '\0';
+        }
+    }
+    log_error(tid, "reached maximum shebang depth");
+}
+
+/* Programs get executed over and over; what we learn from a file after it
+ * gets executed, its chain of interpreters and the files that are mapped
+ * when it starts, is kept here. Files are identified by device, inode and
+ * modification time; the interpreters are assumed not to change during the
+ * trace. */
+struct ExecCacheEntry {
+    int used;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long mtime_nsec;
+    char *shebangs;             /* List of paths, as read */
+    char *mapped;               /* List of paths */
+};
+
+static __thread struct ExecCacheEntry *exec_cache = NULL;
+static __thread size_t exec_cache_size, exec_cache_count;
+static __thread unsigned long exec_cache_hits, exec_cache_misses;
+
+static struct ExecCacheEntry *exec_cache_slot(const struct stat *st)
+{
+    size_t mask = exec_cache_size - 1;
+    size_t i = ((size_t)st->st_ino * 31 + (size_t)st->st_dev) & mask;
+    while(exec_cache[i].used
+     && (exec_cache[i].dev != st->st_dev || exec_cache[i].ino != st->st_ino
+      || exec_cache[i].mtime != st->st_mtim.tv_sec
+      || exec_cache[i].mtime_nsec != st->st_mtim.tv_nsec))
+        i = (i + 1) & mask;
+    return &exec_cache[i];
+}
+
+static struct ExecCacheEntry *exec_cache_add(const struct stat *st)
+{
+    struct ExecCacheEntry *entry;
+    if(exec_cache == NULL)
+    {
+        exec_cache_size = 64;
+        exec_cache_count = 0;
+        exec_cache = calloc(exec_cache_size, sizeof(*exec_cache));
+    }
+    else if((exec_cache_count + 1) * 2 > exec_cache_size)
+    {
+        struct ExecCacheEntry *old = exec_cache;
+        size_t i, old_size = exec_cache_size;
+        exec_cache_size *= 2;
+        exec_cache = calloc(exec_cache_size, sizeof(*exec_cache));
+        for(i = 0; i < old_size; ++i)
+            if(old[i].used)
+            {
+                struct stat key;
+                key.st_dev = old[i].dev;
+                key.st_ino = old[i].ino;
+                key.st_mtim.tv_sec = old[i].mtime;
+                key.st_mtim.tv_nsec = old[i].mtime_nsec;
+                *exec_cache_slot(&key) = old[i];
+            }
+        free(old);
+    }
+    entry = exec_cache_slot(st);
+    entry->used = 1;
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->mtime = st->st_mtim.tv_sec;
+    entry->mtime_nsec = st->st_mtim.tv_nsec;
+    ++exec_cache_count;
+    return entry;
+}
+
+void syscall_clear_exec_cache(void)
+{
+    size_t i;
+    if(exec_cache != NULL)
+    {
+        log_info(0, "executed files cache: %lu hits, %lu misses",
+                 exec_cache_hits, exec_cache_misses);
+        stats_count(STAT_EXEC_CACHE_HITS, exec_cache_hits);
+        stats_count(STAT_EXEC_CACHE_MISSES, exec_cache_misses);
+        for(i = 0; i < exec_cache_size; ++i)
+            if(exec_cache[i].used)
             {
-                char *pathname = abspath(wd, start);
-                if(db_add_file_open(process->identifier,
-                                    pathname,
-                                    FILE_READ,
-                                    0) != 0)
-                    return -1;
-                free(pathname);
+                free(exec_cache[i].shebangs);
+                free(exec_cache[i].mapped);
             }
-            else
-                if(db_add_file_open(process->identifier,
-                                    start,
-                                    FILE_READ,
-                                    0) != 0)
-                    return -1;
-            exec_target = strcpy(target_buffer, start);
+        free(exec_cache);
+        exec_cache = NULL;
+    }
+    exec_cache_hits = exec_cache_misses = 0;
+}
+
+static int record_exec_files(struct Process *process, const char *binary,
+                             const char *shebangs, const char *mapped)
+{
+    const char *p;
+    for(p = shebangs; *p; p += strlen(p) + 1)
+    {
+        if(*p != '/')
+        {
+            char *pathname = abspath(process->threadgroup->wd, p);
+            if(db_add_file_open(process->identifier,
+                                pathname,
+                                FILE_READ,
+                                0) != 0)
+                return -1;
+            free(pathname);
         }
+        else
+            if(db_add_file_open(process->identifier,
+                                p,
+                                FILE_READ,
+                                0) != 0)
+                return -1;
+    }
+    for(p = mapped; *p; p += strlen(p) + 1)
+    {
+        if(strcmp(p, binary) != 0
+         && db_add_file_open(process->identifier, p,
+                             FILE_READ, DB_IS_DIR_UNKNOWN) != 0)
+            return -1;
     }
-    log_error(process->tid, "reached maximum shebang depth");
     return 0;
 }
 
+/* Records the interpreters and mapped files of a program that was just
+ * executed */
+static int record_exec(struct Process *process, const char *binary)
+{
+    struct stat st;
+    struct ExecCacheEntry *entry = NULL;
+    char shebangs[SHEBANG_MAX_DEPTH * SHEBANG_MAX_LEN + 1];
+    char *mapped;
+    int ret;
+    int cacheable = stat(binary, &st) == 0;
+    if(cacheable && exec_cache != NULL)
+    {
+        entry = exec_cache_slot(&st);
+        if(!entry->used)
+            entry = NULL;
+    }
+    if(entry != NULL)
+    {
+        ++exec_cache_hits;
+        return record_exec_files(process, binary,
+                                 entry->shebangs, entry->mapped);
+    }
+    ++exec_cache_misses;
+
+    read_shebangs(process->tid, binary, shebangs);
+    mapped = trace_read_mapped_files(process->tid);
+    if(mapped == NULL)
+        return -1;
+    ret = record_exec_files(process, binary, shebangs, mapped);
+    if(cacheable)
+    {
+        size_t size = path_list_size(shebangs);
+        entry = exec_cache_add(&st);
+        entry->shebangs = malloc(size);
+        memcpy(entry->shebangs, shebangs, size);
+        entry->mapped = mapped;
+    }
+    else
+        free(mapped);
+    return ret;
+}
+
 static int syscall_execve_in(const char *name, struct Process *process,
                              unsigned int udata)
 {
@@ -437,10 +880,10 @@ static int syscall_execve_in(const char *name, struct Process *process,
      *            char *const envp[]); */
     struct ExecveInfo *execi = malloc(sizeof(struct ExecveInfo));
     execi->binary = abs_path_arg(process, 0);
-    execi->argv = tracee_strarraydup(process->mode, process->tid,
-                                     process->params[1].p);
-    execi->envp = tracee_strarraydup(process->mode, process->tid,
-                                     process->params[2].p);
+    tracee_strarrayread(process->mode, process->tid, process->params[1].p,
+                        &execi->argv);
+    tracee_strarrayread(process->mode, process->tid, process->params[2].p,
+                        &execi->envp);
     if(verbosity >= 3)
     {
         log_debug(process->tid, "execve called:\n  binary=%s\n  argv:",
@@ -448,7 +891,7 @@ static int syscall_execve_in(const char *name, struct Process *process,
         {
             /* Note: this conversion is correct and shouldn't need a
              * cast */
-            const char *const *v = (const char* const*)execi->argv;
+            const char *const *v = (const char* const*)execi->argv.array;
             while(*v)
             {
                 log_debug(process->tid, "    %s", *v);
@@ -457,7 +900,7 @@ static int syscall_execve_in(const char *name, struct Process *process,
         }
         {
             size_t nb = 0;
-            while(execi->envp[nb] != NULL)
+            while(execi->envp.array[nb] != NULL)
                 ++nb;
             log_debug(process->tid, "  envp: (%u entries)", (unsigned int)nb);
         }
@@ -476,18 +919,19 @@ int syscall_execve_event(struct Process *process)
          * matter which thread made the call. This means that the process
          * that just returned from execve might not be the one which
          * called.
-         * So we start by finding the one which called execve.
+         * So we start by finding the one which called execve, among the
+         * members of the thread group.
          * No possible confusion here since all other threads will have been
          * terminated by the kernel. */
-        size_t i;
-        for(i = 0; i < processes_size; ++i)
+        struct Process *member = process->threadgroup->members;
+        exec_process = NULL;
+        for(; member != NULL; member = member->tg_next)
         {
-            if(processes[i]->status == PROCSTAT_ATTACHED
-             && processes[i]->threadgroup == process->threadgroup
-             && processes[i]->in_syscall
-             && processes[i]->execve_info != NULL)
+            if(member->status == PROCSTAT_ATTACHED
+             && member->in_syscall
+             && member->execve_info != NULL)
             {
-                exec_process = processes[i];
+                exec_process = member;
                 break;
             }
         }
@@ -502,7 +946,7 @@ int syscall_execve_event(struct Process *process)
         execi = exec_process->execve_info;
 
         /* The process that called execve() disappears without any trace */
-        if(db_add_exit(exec_process->identifier, 0, -1) != 0)
+        if(db_add_exit(exec_process->identifier, 0, NULL) != 0)
             return -1;
         if(verbosity >= 3)
             log_debug(exec_process->tid,
@@ -515,28 +959,38 @@ int syscall_execve_event(struct Process *process)
         exec_process->execve_info = NULL;
 
     process->flags = PROCFLAG_EXECD;
-
-    /* Note: execi->argv needs a cast to suppress a bogus warning
-     * While conversion from char** to const char** is invalid, conversion from
-     * char** to const char*const* is, in fact, safe.
-     * G++ accepts it, GCC issues a warning. */
-    if(db_add_exec(process->identifier, execi->binary,
-                   (const char *const*)execi->argv,
-                   (const char *const*)execi->envp,
-                   process->threadgroup->wd) != 0)
+    if(process->threadgroup->fds != NULL
+     && fdtable_close(process->threadgroup->fds, 0, INT_MAX, 1,
+                      close_file, process) != 0)
         return -1;
+    if( (trace_options & TRACE_OPT_PRELOAD)
+     && !preload_exec(process->tid, &execi->envp) )
+    {
+        process->flags |= PROCFLAG_FULLTRACE;
+        if(verbosity >= 2)
+            log_info(process->tid, "library won't be preloaded, stopping on "
+                     "every syscall");
+    }
+
+    {
+        /* The database takes the buffers */
+        int ret = db_add_exec(process->identifier, execi->binary,
+                              execi->argv.data, execi->argv.length,
+                              execi->envp.data, execi->envp.length,
+                              process->threadgroup->wd);
+        execi->argv.data = NULL;
+        execi->envp.data = NULL;
+        if(ret != 0)
+            return -1;
+    }
     /* Note that here, the database records that the thread leader called
      * execve, instead of thread exec_process->tid. */
     if(verbosity >= 2)
         log_info(process->tid, "successfully exec'd %s",
                  execi->binary);
 
-    /* Follow shebangs */
-    if(record_shebangs(process, execi->binary) != 0)
-        return -1;
-
-    if(trace_add_files_from_proc(process->identifier, process->tid,
-                                 execi->binary) != 0)
+    /* Follow shebangs, and add the files mapped by the loader */
+    if(record_exec(process, execi->binary) != 0)
         return -1;
 
     free_execve_info(execi);
@@ -574,6 +1028,20 @@ static int syscall_fork_out(const char *name, struct Process *process,
     return 0;
 }
 
+/* clone3() takes a struct clone_args, whose first field is the flags (64 bits
+ * on every architecture); they are put where clone() has them, for
+ * syscall_fork_event(). glibc 2.34 creates its threads with it */
+static int syscall_clone3_in(const char *name, struct Process *process,
+                             unsigned int udata)
+{
+    uint64_t flags = 0;
+    tracee_read(process->tid, (char*)&flags, process->params[0].p,
+                sizeof(flags));
+    process->params[0].u = (unsigned long)flags;
+    process->flags |= PROCFLAG_FORKING;
+    return 0;
+}
+
 int syscall_fork_event(struct Process *process, unsigned int event)
 {
 #ifndef CLONE_THREAD
@@ -581,6 +1049,7 @@ int syscall_fork_event(struct Process *process, unsigned int event)
 #endif
 
     int is_thread = 0;
+    int attached = 0;
     struct Process *new_process;
     unsigned long new_tid;
 
@@ -624,8 +1093,10 @@ int syscall_fork_event(struct Process *process, unsigned int event)
             return -1;
             /* LCOV_EXCL_END */
         }
-        new_process->status = PROCSTAT_ATTACHED;
-        ptrace(PTRACE_SYSCALL, new_process->tid, NULL, NULL);
+        trace_set_status(new_process, PROCSTAT_ATTACHED);
+        new_process->flags = process->flags & PROCFLAG_FULLTRACE;
+        /* Resumed below, once it is recorded */
+        attached = 1;
         if(verbosity >= 2)
         {
             unsigned int nproc, unknown;
@@ -637,26 +1108,34 @@ int syscall_fork_event(struct Process *process, unsigned int event)
     else
     {
         /* Process hasn't been seen before (event happened first) */
-        new_process = trace_get_empty_process();
-        new_process->status = PROCSTAT_ALLOCATED;
-        new_process->flags = 0;
+        new_process = trace_get_empty_process(new_tid);
+        trace_set_status(new_process, PROCSTAT_ALLOCATED);
+        new_process->flags = process->flags & PROCFLAG_FULLTRACE;
         /* New process gets a SIGSTOP, but we resume on attach */
-        new_process->tid = new_tid;
         new_process->in_syscall = 0;
     }
 
     if(is_thread)
     {
-        new_process->threadgroup = process->threadgroup;
-        process->threadgroup->refs++;
+        trace_set_threadgroup(new_process, process->threadgroup);
         if(verbosity >= 3)
             log_debug(process->threadgroup->tgid, "threadgroup refs=%d",
                       process->threadgroup->refs);
     }
     else
-        new_process->threadgroup = trace_new_threadgroup(
-                new_process->tid,
-                strdup(process->threadgroup->wd));
+    {
+        trace_set_threadgroup(new_process,
+                              trace_new_threadgroup(
+                                      new_process->tid,
+                                      strdup(process->threadgroup->wd)));
+        /* Even with CLONE_FILES, which is rare without CLONE_THREAD */
+        if(process->threadgroup->fds != NULL)
+        {
+            fdtable_free(new_process->threadgroup->fds);
+            new_process->threadgroup->fds =
+                    fdtable_copy(process->threadgroup->fds);
+        }
+    }
 
     /* Parent will also get a SIGTRAP with PTRACE_EVENT_FORK */
 
@@ -665,6 +1144,8 @@ int syscall_fork_event(struct Process *process, unsigned int event)
                       process->threadgroup->wd, is_thread) != 0)
         return -1;
 
+    if(attached)
+        return trace_continue(new_process);
     return 0;
 }
 
@@ -747,6 +1228,101 @@ static int syscall_connect(const char *name, struct Process *process,
 }
 
 
+/* ********************
+ * Events from the preloaded library
+ *
+ * They are the same as the syscalls of the same name, see preload_lib.c
+ */
+
+int syscall_preload_event(const struct preload_slot *slot)
+{
+    struct Process *process = trace_find_process(slot->tid);
+    char *pathname;
+    int ret = 0;
+    if(process == NULL)
+    {
+        /* LCOV_EXCL_START : the ring is emptied before processes are
+         * removed */
+        log_error(slot->tid, "event from unknown process");
+        return 0;
+        /* LCOV_EXCL_END */
+    }
+    if(slot->type == PRELOAD_CONNECT)
+    {
+        record_connection(process, slot->arg, (void*)slot->data,
+                          slot->length);
+        return 0;
+    }
+
+    if(slot->length == 0 || slot->data[slot->length - 1] != '\0')
+    {
+        /* LCOV_EXCL_START : the library only sends NUL-terminated paths */
+        log_error(process->tid, "invalid event from preloaded library");
+        return 0;
+        /* LCOV_EXCL_END */
+    }
+    if(slot->data[0] == '/')
+        pathname = strdup(slot->data);
+    else
+        pathname = abspath(process->threadgroup->wd, slot->data);
+    if(verbosity >= 3)
+        log_debug(process->tid, "preloaded library: event %u, %s",
+                  (unsigned int)slot->type, pathname);
+
+    switch(slot->type)
+    {
+    case PRELOAD_OPEN:
+        ret = record_file_access(process->identifier, pathname,
+                                 flags2mode(slot->arg), DB_IS_DIR_UNKNOWN);
+        break;
+    case PRELOAD_ACCESS:
+        ret = record_file_access(process->identifier, pathname,
+                                 FILE_STAT, DB_IS_DIR_UNKNOWN);
+        break;
+    case PRELOAD_STAT:
+        ret = record_file_access(process->identifier, pathname,
+                                 FILE_STAT | (slot->arg?FILE_LINK:0),
+                                 DB_IS_DIR_UNKNOWN);
+        break;
+    case PRELOAD_READLINK:
+        ret = record_file_access(process->identifier, pathname,
+                                 FILE_STAT | FILE_LINK, 0);
+        break;
+    case PRELOAD_MKDIR:
+        ret = record_file_access(process->identifier, pathname,
+                                 FILE_WRITE, 1);
+        break;
+    default:
+        /* LCOV_EXCL_START */
+        log_error(process->tid, "unknown event %u from preloaded library",
+                  (unsigned int)slot->type);
+        break;
+        /* LCOV_EXCL_END */
+    }
+    free(pathname);
+    return ret;
+}
+
+
+/* ********************
+ * Events from fanotify
+ *
+ * Events are for whole thread groups unless the kernel could report threads,
+ * and for every process on the mounts; only ours are recorded
+ */
+
+int syscall_fanotify_event(pid_t tid, const char *pathname, unsigned int mode,
+                           int is_dir)
+{
+    struct Process *process = trace_find_process(tid);
+    if(process == NULL)
+        return 0;
+    if(verbosity >= 3)
+        log_debug(process->tid, "fanotify: %s, mode %u", pathname, mode);
+    return record_file_access(process->identifier, pathname, mode, is_dir);
+}
+
+
 /* ********************
  * *at variants, handled if dirfd is AT_FDCWD
  */
@@ -754,8 +1330,9 @@ static int syscall_xxx_at(const char *name, struct Process *process,
                           unsigned int real_syscall)
 {
     /* Argument 0 is a file descriptor, we assume that the rest of them match
-     * the non-at variant of the syscall */
-    if(process->params[0].i == AT_FDCWD)
+     * the non-at variant of the syscall. It is an int, that the C library
+     * doesn't necessarily sign-extend */
+    if((int)process->params[0].i == AT_FDCWD)
     {
         struct syscall_table_entry *entry = NULL;
         struct syscall_table *tbl;
@@ -896,6 +1473,7 @@ void syscall_build_table(void)
             {  2, "fork", syscall_fork_in, syscall_fork_out, 0},
             {190, "vfork", syscall_fork_in, syscall_fork_out, 0},
             {120, "clone", syscall_fork_in, syscall_fork_out, 0},
+            {435, "clone3", syscall_clone3_in, syscall_fork_out, 0},
 
             {102, "socketcall", NULL, syscall_socketcall, 0},
 
@@ -941,6 +1519,28 @@ void syscall_build_table(void)
             { 26, "ptrace", NULL, syscall_unhandled_other, 0},
             {341, "name_to_handle_at", NULL, syscall_unhandled_other, 0},
 
+            /* I/O volume, with TRACE_OPT_IO_VOLUME */
+            {  3, "read", NULL, syscall_io, IO_READ},
+            {180, "pread64", NULL, syscall_io, IO_READ},
+            {145, "readv", NULL, syscall_io, IO_READ},
+            {333, "preadv", NULL, syscall_io, IO_READ},
+            {378, "preadv2", NULL, syscall_io, IO_READ},
+            {  4, "write", NULL, syscall_io, IO_WRITE},
+            {181, "pwrite64", NULL, syscall_io, IO_WRITE},
+            {146, "writev", NULL, syscall_io, IO_WRITE},
+            {334, "pwritev", NULL, syscall_io, IO_WRITE},
+            {379, "pwritev2", NULL, syscall_io, IO_WRITE},
+            {187, "sendfile", NULL, syscall_io, IO_SENDFILE},
+            {239, "sendfile64", NULL, syscall_io, IO_SENDFILE},
+            {377, "copy_file_range", NULL, syscall_io, IO_COPY},
+            {  6, "close", NULL, syscall_fd, FD_CLOSE},
+            {436, "close_range", NULL, syscall_fd, FD_CLOSE_RANGE},
+            { 41, "dup", NULL, syscall_fd, FD_DUP},
+            { 63, "dup2", NULL, syscall_fd, FD_DUP2},
+            {330, "dup3", NULL, syscall_fd, FD_DUP3},
+            { 55, "fcntl", NULL, syscall_fd, FD_FCNTL},
+            {221, "fcntl64", NULL, syscall_fd, FD_FCNTL},
+
             /* Sentinel */
             {0, NULL, NULL, NULL, 0}
         };
@@ -969,6 +1569,7 @@ void syscall_build_table(void)
             { 57, "fork", syscall_fork_in, syscall_fork_out, 0},
             { 58, "vfork", syscall_fork_in, syscall_fork_out, 0},
             { 56, "clone", syscall_fork_in, syscall_fork_out, 0},
+            {435, "clone3", syscall_clone3_in, syscall_fork_out, 0},
 
             { 43, "accept", NULL, syscall_accept, 0},
             {288, "accept4", NULL, syscall_accept, 0},
@@ -1013,6 +1614,26 @@ void syscall_build_table(void)
             {101, "ptrace", NULL, syscall_unhandled_other, 0},
             {303, "name_to_handle_at", NULL, syscall_unhandled_other, 0},
 
+            /* I/O volume, with TRACE_OPT_IO_VOLUME */
+            {  0, "read", NULL, syscall_io, IO_READ},
+            { 17, "pread64", NULL, syscall_io, IO_READ},
+            { 19, "readv", NULL, syscall_io, IO_READ},
+            {295, "preadv", NULL, syscall_io, IO_READ},
+            {327, "preadv2", NULL, syscall_io, IO_READ},
+            {  1, "write", NULL, syscall_io, IO_WRITE},
+            { 18, "pwrite64", NULL, syscall_io, IO_WRITE},
+            { 20, "writev", NULL, syscall_io, IO_WRITE},
+            {296, "pwritev", NULL, syscall_io, IO_WRITE},
+            {328, "pwritev2", NULL, syscall_io, IO_WRITE},
+            { 40, "sendfile", NULL, syscall_io, IO_SENDFILE},
+            {326, "copy_file_range", NULL, syscall_io, IO_COPY},
+            {  3, "close", NULL, syscall_fd, FD_CLOSE},
+            {436, "close_range", NULL, syscall_fd, FD_CLOSE_RANGE},
+            { 32, "dup", NULL, syscall_fd, FD_DUP},
+            { 33, "dup2", NULL, syscall_fd, FD_DUP2},
+            {292, "dup3", NULL, syscall_fd, FD_DUP3},
+            { 72, "fcntl", NULL, syscall_fd, FD_FCNTL},
+
             /* Sentinel */
             {0, NULL, NULL, NULL, 0}
         };
@@ -1041,6 +1662,7 @@ void syscall_build_table(void)
             { 57, "fork", syscall_fork_in, syscall_fork_out, 0},
             { 58, "vfork", syscall_fork_in, syscall_fork_out, 0},
             { 56, "clone", syscall_fork_in, syscall_fork_out, 0},
+            {435, "clone3", syscall_clone3_in, syscall_fork_out, 0},
 
             { 43, "accept", NULL, syscall_accept, 0},
             {288, "accept4", NULL, syscall_accept, 0},
@@ -1085,6 +1707,26 @@ void syscall_build_table(void)
             {521, "ptrace", NULL, syscall_unhandled_other, 0},
             {303, "name_to_handle_at", NULL, syscall_unhandled_other, 0},
 
+            /* I/O volume, with TRACE_OPT_IO_VOLUME */
+            {  0, "read", NULL, syscall_io, IO_READ},
+            { 17, "pread64", NULL, syscall_io, IO_READ},
+            {515, "readv", NULL, syscall_io, IO_READ},
+            {534, "preadv", NULL, syscall_io, IO_READ},
+            {546, "preadv2", NULL, syscall_io, IO_READ},
+            {  1, "write", NULL, syscall_io, IO_WRITE},
+            { 18, "pwrite64", NULL, syscall_io, IO_WRITE},
+            {516, "writev", NULL, syscall_io, IO_WRITE},
+            {535, "pwritev", NULL, syscall_io, IO_WRITE},
+            {547, "pwritev2", NULL, syscall_io, IO_WRITE},
+            { 40, "sendfile", NULL, syscall_io, IO_SENDFILE},
+            {326, "copy_file_range", NULL, syscall_io, IO_COPY},
+            {  3, "close", NULL, syscall_fd, FD_CLOSE},
+            {436, "close_range", NULL, syscall_fd, FD_CLOSE_RANGE},
+            { 32, "dup", NULL, syscall_fd, FD_DUP},
+            { 33, "dup2", NULL, syscall_fd, FD_DUP2},
+            {292, "dup3", NULL, syscall_fd, FD_DUP3},
+            { 72, "fcntl", NULL, syscall_fd, FD_FCNTL},
+
             /* Sentinel */
             {0, NULL, NULL, NULL, 0}
         };
@@ -1094,16 +1736,274 @@ void syscall_build_table(void)
 }
 
 
+/* ********************
+ * Building the seccomp-BPF filter
+ *
+ * The filter returns SECCOMP_RET_TRACE for every syscall that has a handler in
+ * the tables, so that the tracee only stops on those when it is resumed with
+ * PTRACE_CONT, and SECCOMP_RET_ALLOW for everything else.
+ *
+ * In preload mode, the native syscalls that the library reports are allowed
+ * as well. Processes that don't have the library are resumed with
+ * PTRACE_SYSCALL instead, so the filter doesn't hide anything from them.
+ *
+ * In fanotify mode, the syscalls that open or only look at files are allowed
+ * on every architecture; opens are reported by fanotify.
+ *
+ * The syscalls used to count the I/O volume are allowed unless
+ * TRACE_OPT_IO_VOLUME is set. Even then, reads and writes only stop if they
+ * are for IO_VOLUME_MIN_SIZE bytes or more, the vectored ones never do, and
+ * fcntl() only does for the commands that change descriptors.
+ */
+
+static const char *const preloaded_syscalls[] = {
+    "open", "creat", "access", "stat", "lstat", "stat64", "lstat64",
+    "oldstat", "oldlstat", "readlink", "mkdir", "openat",
+    "faccessat", "readlinkat", "newfstatat", "fstatat64", "mkdirat",
+    "accept", "accept4", "connect", "socketcall", NULL};
+
+static const char *const fanotify_syscalls[] = {
+    "open", "creat", "access", "stat", "lstat", "stat64", "lstat64",
+    "oldstat", "oldlstat", "readlink", "openat", "faccessat", "readlinkat",
+    "newfstatat", "fstatat64", NULL};
+
+#define IO_FILTER_NEVER     0
+#define IO_FILTER_ALWAYS    1
+#define IO_FILTER_SIZE      2   /* If the argument is IO_VOLUME_MIN_SIZE or
+                                 * more */
+#define IO_FILTER_FCNTL     3   /* If the argument is a command we handle */
+
+struct io_filter {
+    const char *name;
+    unsigned int type;
+    unsigned int arg;
+};
+
+static const struct io_filter io_filters[] = {
+    {"read", IO_FILTER_SIZE, 2}, {"pread64", IO_FILTER_SIZE, 2},
+    {"write", IO_FILTER_SIZE, 2}, {"pwrite64", IO_FILTER_SIZE, 2},
+    {"sendfile", IO_FILTER_SIZE, 3}, {"sendfile64", IO_FILTER_SIZE, 3},
+    {"copy_file_range", IO_FILTER_SIZE, 4},
+    {"readv", IO_FILTER_NEVER, 0}, {"preadv", IO_FILTER_NEVER, 0},
+    {"preadv2", IO_FILTER_NEVER, 0}, {"writev", IO_FILTER_NEVER, 0},
+    {"pwritev", IO_FILTER_NEVER, 0}, {"pwritev2", IO_FILTER_NEVER, 0},
+    {"close", IO_FILTER_ALWAYS, 0}, {"close_range", IO_FILTER_ALWAYS, 0},
+    {"dup", IO_FILTER_ALWAYS, 0}, {"dup2", IO_FILTER_ALWAYS, 0},
+    {"dup3", IO_FILTER_ALWAYS, 0},
+    {"fcntl", IO_FILTER_FCNTL, 1}, {"fcntl64", IO_FILTER_FCNTL, 1},
+    {NULL, 0, 0}};
+
+/* Returns 0 if the syscall is allowed, 1 if it stops, 2 if that depends on
+ * its arguments, which *io then describes */
+static int filter_traces(const struct syscall_table_entry *entry,
+                         const char *const *skipped,
+                         const struct io_filter **io)
+{
+    const char *const *name;
+    const struct io_filter *filter;
+    if(!entry->proc_entry && !entry->proc_exit)
+        return 0;
+    if(skipped != NULL && entry->name != NULL)
+        for(name = skipped; *name != NULL; ++name)
+            if(strcmp(entry->name, *name) == 0)
+                return 0;
+    if(entry->name != NULL)
+        for(filter = io_filters; filter->name != NULL; ++filter)
+            if(strcmp(entry->name, filter->name) == 0)
+            {
+                if(!(trace_options & TRACE_OPT_IO_VOLUME)
+                 || filter->type == IO_FILTER_NEVER)
+                    return 0;
+                else if(filter->type == IO_FILTER_ALWAYS)
+                    return 1;
+                *io = filter;
+                return 2;
+            }
+    return 1;
+}
+
+struct filter_buffer {
+    size_t length;
+    size_t size;
+    struct sock_filter *insns;
+};
+
+static size_t filter_add(struct filter_buffer *buf, unsigned short code,
+                         unsigned int k, unsigned char jt, unsigned char jf)
+{
+    if(buf->length == buf->size)
+    {
+        buf->size *= 2;
+        buf->insns = realloc(buf->insns, buf->size * sizeof(*buf->insns));
+    }
+    buf->insns[buf->length].code = code;
+    buf->insns[buf->length].jt = jt;
+    buf->insns[buf->length].jf = jf;
+    buf->insns[buf->length].k = k;
+    return buf->length++;
+}
+
+/* Sets the target of a BPF_JA instruction to the next instruction added */
+static void filter_patch_jump(struct filter_buffer *buf, size_t insn)
+{
+    buf->insns[insn].k = buf->length - insn - 1;
+}
+
+/* Length of the code checking the arguments, see filter_add_arguments() */
+static size_t filter_arguments_length(const struct io_filter *io)
+{
+    return io->type == IO_FILTER_SIZE?7:6;
+}
+
+/* Returns RET_TRACE or RET_ALLOW depending on the arguments */
+static void filter_add_arguments(struct filter_buffer *buf,
+                                 const struct io_filter *io)
+{
+    /* x86 is little-endian, the high half of an argument comes second */
+    unsigned int low = offsetof(struct seccomp_data, args) + 8 * io->arg;
+    if(io->type == IO_FILTER_SIZE)
+    {
+        filter_add(buf, BPF_LD | BPF_W | BPF_ABS, low + 4, 0, 0);
+        filter_add(buf, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0);
+        filter_add(buf, BPF_RET | BPF_K, SECCOMP_RET_TRACE, 0, 0);
+        filter_add(buf, BPF_LD | BPF_W | BPF_ABS, low, 0, 0);
+        filter_add(buf, BPF_JMP | BPF_JGE | BPF_K, IO_VOLUME_MIN_SIZE, 0, 1);
+    }
+    else /* io->type == IO_FILTER_FCNTL */
+    {
+        filter_add(buf, BPF_LD | BPF_W | BPF_ABS, low, 0, 0);
+        filter_add(buf, BPF_JMP | BPF_JEQ | BPF_K, F_DUPFD, 2, 0);
+        filter_add(buf, BPF_JMP | BPF_JEQ | BPF_K, F_DUPFD_CLOEXEC, 1, 0);
+        filter_add(buf, BPF_JMP | BPF_JEQ | BPF_K, F_SETFD, 0, 1);
+    }
+    filter_add(buf, BPF_RET | BPF_K, SECCOMP_RET_TRACE, 0, 0);
+    filter_add(buf, BPF_RET | BPF_K, SECCOMP_RET_ALLOW, 0, 0);
+}
+
+/* Matches the syscall number (already loaded) against a table */
+static int filter_add_table(struct filter_buffer *buf,
+                            const struct syscall_table *tbl,
+                            unsigned int nr_offset,
+                            const char *const *skipped)
+{
+    const struct io_filter *io;
+    size_t i, nb = 0, pos = 0, arguments = 0;
+    for(i = 0; i < tbl->length; ++i)
+        if(filter_traces(&tbl->entries[i], skipped, &io))
+            ++nb;
+    for(i = 0; i < tbl->length; ++i)
+    {
+        int traces = filter_traces(&tbl->entries[i], skipped, &io);
+        /* Skip the remaining tests and the RET_ALLOW, to the RET_TRACE or
+         * the code checking the arguments, which follows it */
+        size_t jump = nb - pos + (traces == 2?1 + arguments:0);
+        if(!traces)
+            continue;
+        /* Conditional jumps are limited to 255 instructions forward */
+        if(jump > 255)
+        {
+            /* LCOV_EXCL_START : our tables are much smaller than this */
+            log_critical(0, "too many syscalls to build seccomp filter");
+            return -1;
+            /* LCOV_EXCL_END */
+        }
+        filter_add(buf, BPF_JMP | BPF_JEQ | BPF_K, nr_offset + i, jump, 0);
+        if(traces == 2)
+            arguments += filter_arguments_length(io);
+        ++pos;
+    }
+    filter_add(buf, BPF_RET | BPF_K, SECCOMP_RET_ALLOW, 0, 0);
+    filter_add(buf, BPF_RET | BPF_K, SECCOMP_RET_TRACE, 0, 0);
+    for(i = 0; i < tbl->length; ++i)
+        if(filter_traces(&tbl->entries[i], skipped, &io) == 2)
+            filter_add_arguments(buf, io);
+    return 0;
+}
+
+int syscall_build_filter(struct sock_fprog *prog)
+{
+    /* The library is only built for the native architecture */
+    const char *const *native_skipped = NULL, *const *all_skipped = NULL;
+    struct filter_buffer buf;
+    size_t jump_i386;
+#ifdef X86_64
+    size_t jump_x86_64, jump_x32;
+#endif
+
+    if(trace_options & TRACE_OPT_FANOTIFY)
+        native_skipped = all_skipped = fanotify_syscalls;
+    else if(trace_options & TRACE_OPT_PRELOAD)
+        native_skipped = preloaded_syscalls;
+
+    buf.length = 0;
+    buf.size = 128;
+    buf.insns = malloc(buf.size * sizeof(*buf.insns));
+
+    /* Dispatch on architecture */
+    filter_add(&buf, BPF_LD | BPF_W | BPF_ABS,
+               offsetof(struct seccomp_data, arch), 0, 0);
+#ifdef X86_64
+    filter_add(&buf, BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 0, 1);
+    jump_x86_64 = filter_add(&buf, BPF_JMP | BPF_JA, 0, 0, 0);
+#endif
+    filter_add(&buf, BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_I386, 0, 1);
+    jump_i386 = filter_add(&buf, BPF_JMP | BPF_JA, 0, 0, 0);
+    filter_add(&buf, BPF_RET | BPF_K, SECCOMP_RET_ALLOW, 0, 0);
+
+    /* i386 */
+    filter_patch_jump(&buf, jump_i386);
+    filter_add(&buf, BPF_LD | BPF_W | BPF_ABS,
+               offsetof(struct seccomp_data, nr), 0, 0);
+#ifdef I386
+    if(filter_add_table(&buf, &syscall_tables[SYSCALL_I386], 0,
+                        native_skipped) != 0)
+#else
+    if(filter_add_table(&buf, &syscall_tables[SYSCALL_I386], 0,
+                        all_skipped) != 0)
+#endif
+        goto error;
+
+#ifdef X86_64
+    /* x64, unless the x32 bit is set */
+    filter_patch_jump(&buf, jump_x86_64);
+    filter_add(&buf, BPF_LD | BPF_W | BPF_ABS,
+               offsetof(struct seccomp_data, nr), 0, 0);
+    filter_add(&buf, BPF_JMP | BPF_JGE | BPF_K, __X32_SYSCALL_BIT, 0, 1);
+    jump_x32 = filter_add(&buf, BPF_JMP | BPF_JA, 0, 0, 0);
+    if(filter_add_table(&buf, &syscall_tables[SYSCALL_X86_64], 0,
+                        native_skipped) != 0)
+        goto error;
+
+    /* x32 */
+    filter_patch_jump(&buf, jump_x32);
+    if(filter_add_table(&buf, &syscall_tables[SYSCALL_X86_64_x32],
+                        __X32_SYSCALL_BIT, all_skipped) != 0)
+        goto error;
+#endif
+
+    prog->len = buf.length;
+    prog->filter = buf.insns;
+    if(verbosity >= 3)
+        log_debug(0, "built seccomp filter, %u instructions",
+                  (unsigned int)buf.length);
+    return 0;
+
+error:
+    free(buf.insns);
+    return -1;
+}
+
+
 /* ********************
  * Handle a syscall via the table
  */
 
 int syscall_handle(struct Process *process)
 {
-    pid_t tid = process->tid;
     const int syscall = process->current_syscall & ~__X32_SYSCALL_BIT;
     size_t syscall_type;
     const char *inout = process->in_syscall?"out":"in";
+    const stats_time now = stats_clock();
     if(process->mode == MODE_I386)
     {
         syscall_type = SYSCALL_I386;
@@ -1147,18 +2047,32 @@ int syscall_handle(struct Process *process)
             log_error(process->tid, "INVALID SYSCALL %d", syscall);
         if(entry == NULL && syscall >= 0 && (size_t)syscall < tbl->length)
             entry = &tbl->entries[syscall];
+        if(process->in_syscall && process->syscall_start != 0)
+        {
+            current_latency = now - process->syscall_start;
+            latency_record_syscall(&process->latencies, syscall_type, syscall,
+                                   (entry != NULL)?entry->name:NULL,
+                                   current_latency);
+        }
         if(entry != NULL)
         {
             int ret = 0;
+            stats_time start = stats_clock();
             if(entry->name && verbosity >= 3)
                 log_debug(process->tid, "%s()", entry->name);
             if(!process->in_syscall && entry->proc_entry)
                 ret = entry->proc_entry(entry->name, process, entry->udata);
             else if(process->in_syscall && entry->proc_exit)
                 ret = entry->proc_exit(entry->name, process, entry->udata);
+            stats_syscall(syscall_type, syscall, entry->name,
+                          process->in_syscall, start);
             if(ret != 0)
+            {
+                current_latency = 0;
                 return -1;
+            }
         }
+        current_latency = 0;
     }
 
     /* Run to next syscall */
@@ -1171,10 +2085,16 @@ int syscall_handle(struct Process *process)
             return -1;
         }
         process->current_syscall = -1;
+        process->syscall_start = 0;
     }
     else
         process->in_syscall = 1;
-    ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
-
-    return 0;
+    if((!(trace_options & TRACE_OPT_EARLY_RESUME)
+      || pending_count > PENDING_MAX)
+     && syscall_process_pending(1) != 0)
+        return -1;
+    /* Not counting the time spent here in the latency */
+    if(process->in_syscall)
+        process->syscall_start = stats_clock();
+    return trace_continue(process);
 }
@@ -1,13 +1,44 @@
 #ifndef SYSCALL_H
 #define SYSCALL_H
 
+#include <linux/filter.h>
+
 #include "tracer.h"
 
 void syscall_build_table(void);
 
+int syscall_build_filter(struct sock_fprog *prog);
+
 int syscall_handle(struct Process *process);
 
+/* Work deferred by syscall_handle() until after the process is resumed */
+int syscall_pending_work(void);
+int syscall_process_pending(int all);
+
 int syscall_execve_event(struct Process *process);
 int syscall_fork_event(struct Process *process, unsigned int event);
 
+void syscall_clear_exec_cache(void);
+
+/* Writes the latency histograms of a process that is going away, and the ones
+ * of its thread group if it is the last member */
+int syscall_flush_latencies(struct Process *process);
+
+/* With TRACE_OPT_IO_VOLUME, writes the totals of the files still open in the
+ * thread group of a process that is going away, if it is the last member */
+int syscall_flush_files(struct Process *process);
+
+/* With TRACE_OPT_SECCOMP, the seccomp filter only stops on the reads and
+ * writes of at least that many bytes (the others are not counted), and not on
+ * the vectored ones */
+#define IO_VOLUME_MIN_SIZE  65536
+
+/* Records an event written by the preloaded library */
+struct preload_slot;
+int syscall_preload_event(const struct preload_slot *slot);
+
+/* Records a file closed by a process, reported by fanotify */
+int syscall_fanotify_event(pid_t tid, const char *pathname, unsigned int mode,
+                           int is_dir);
+
 #endif
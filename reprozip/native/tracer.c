@@ -1,24 +1,37 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/prctl.h>
 #include <sys/ptrace.h>
 #include <sys/reg.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/user.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
 #include "config.h"
 #include "database.h"
+#include "fanotify.h"
+#include "fdtable.h"
+#include "latency.h"
 #include "log.h"
+#include "preload.h"
 #include "ptrace_utils.h"
+#include "stats.h"
 #include "syscalls.h"
 #include "tracer.h"
 #include "utils.h"
@@ -28,6 +41,16 @@
 #define NT_PRSTATUS 1
 #endif
 
+#ifndef PTRACE_EVENT_SECCOMP
+#define PTRACE_EVENT_SECCOMP 7
+#endif
+#ifndef PTRACE_O_TRACESECCOMP
+#define PTRACE_O_TRACESECCOMP (1 << PTRACE_EVENT_SECCOMP)
+#endif
+#ifndef PR_SET_NO_NEW_PRIVS
+#define PR_SET_NO_NEW_PRIVS 38
+#endif
+
 
 struct i386_regs {
     int32_t ebx;
@@ -81,6 +104,49 @@ struct x86_64_regs {
 };
 
 
+#ifndef PTRACE_GET_SYSCALL_INFO
+#define PTRACE_GET_SYSCALL_INFO 0x420e
+#endif
+#ifndef AUDIT_ARCH_I386
+#define AUDIT_ARCH_I386 0x40000003
+#endif
+#ifndef AUDIT_ARCH_X86_64
+#define AUDIT_ARCH_X86_64 0xC000003E
+#endif
+
+#define SYSCALL_INFO_NONE       0
+#define SYSCALL_INFO_ENTRY      1
+#define SYSCALL_INFO_EXIT       2
+#define SYSCALL_INFO_SECCOMP    3
+
+/* Same as the kernel's struct ptrace_syscall_info, which older headers
+ * don't have */
+struct syscall_info {
+    uint8_t op;
+    uint8_t pad[3];
+    uint32_t arch;
+    uint64_t instruction_pointer;
+    uint64_t stack_pointer;
+    union {
+        struct {
+            uint64_t nr;
+            uint64_t args[6];
+        } entry;
+        struct {
+            int64_t rval;
+            uint8_t is_error;
+        } exit;
+        struct {
+            uint64_t nr;
+            uint64_t args[6];
+            uint32_t ret_data;
+        } seccomp;
+    } u;
+};
+
+static int syscall_info_supported = 1;
+
+
 static void get_i386_reg(register_type *reg, uint32_t value)
 {
     reg->i = (int32_t)value;
@@ -96,90 +162,309 @@ static void get_x86_64_reg(register_type *reg, uint64_t value)
 }
 
 
-int trace_verbosity = 0;
+__thread int trace_verbosity = 0;
 #define verbosity trace_verbosity
 
+__thread unsigned int trace_options = 0;
+__thread unsigned int trace_threads = 1;
+__thread const char *trace_preload_library = NULL;
+__thread const char *const *trace_fanotify_paths = NULL;
+
 
 void free_execve_info(struct ExecveInfo *execi)
 {
-    free_strarray(execi->argv);
-    free_strarray(execi->envp);
+    free_strarray(&execi->argv);
+    free_strarray(&execi->envp);
     free(execi->binary);
     free(execi);
 }
 
 
-struct Process **processes = NULL;
-size_t processes_size;
+/* Processes are allocated from fixed-size pools, each with its own free list.
+ * Pools with free entries are kept on a list so that allocation is O(1), and
+ * pools that become empty are given back once the table is mostly unused. */
+#define PROCESS_POOL_SIZE 64
 
-struct Process *trace_find_process(pid_t tid)
+struct ProcessPool {
+    struct ProcessPool *prev, *next;    /* In the list of non-full pools */
+    struct Process *free;
+    unsigned int used;
+    struct Process entries[PROCESS_POOL_SIZE];
+};
+
+static __thread struct ProcessPool *pools_available = NULL;
+static __thread size_t pools_count = 0;
+
+/* Number of processes in each PROCSTAT_* state */
+static __thread unsigned int processes_count[4];
+
+/* Index of the processes by tid, using open addressing with linear probing.
+ * Only processes that are not PROCSTAT_FREE are in there. The size is a power
+ * of two, kept at least twice the number of entries. */
+static __thread struct Process **process_index = NULL;
+static __thread size_t process_index_size;
+static __thread size_t process_index_count;
+
+static size_t index_hash(pid_t tid)
 {
-    size_t i;
-    for(i = 0; i < processes_size; ++i)
+    /* Fibonacci hashing, tids are mostly sequential */
+    return ((uint32_t)tid * 2654435761u) & (process_index_size - 1);
+}
+
+static void index_insert_slot(struct Process *process)
+{
+    size_t i = index_hash(process->tid);
+    while(process_index[i] != NULL)
+        i = (i + 1) & (process_index_size - 1);
+    process_index[i] = process;
+}
+
+static void index_insert(struct Process *process)
+{
+    if((process_index_count + 1) * 2 > process_index_size)
     {
-        if(processes[i]->status != PROCSTAT_FREE && processes[i]->tid == tid)
-            return processes[i];
+        struct Process **old_index = process_index;
+        size_t i, old_size = process_index_size;
+        process_index_size *= 2;
+        process_index = calloc(process_index_size, sizeof(*process_index));
+        for(i = 0; i < old_size; ++i)
+            if(old_index[i] != NULL)
+                index_insert_slot(old_index[i]);
+        free(old_index);
+        if(verbosity >= 3)
+            log_debug(0, "process index resized (%u)",
+                      (unsigned int)process_index_size);
     }
-    return NULL;
+    index_insert_slot(process);
+    ++process_index_count;
 }
 
-struct Process *trace_get_empty_process(void)
+static void index_remove(struct Process *process)
 {
-    size_t i;
-    for(i = 0; i < processes_size; ++i)
+    const size_t mask = process_index_size - 1;
+    size_t i = index_hash(process->tid), j;
+    while(process_index[i] != process)
+    {
+        if(process_index[i] == NULL)
+        {
+            /* LCOV_EXCL_START : internal error */
+            log_critical(process->tid, "process missing from index");
+            return;
+            /* LCOV_EXCL_END */
+        }
+        i = (i + 1) & mask;
+    }
+    /* Backward-shift deletion: move up the entries of the cluster that
+     * wouldn't be reachable anymore, so no tombstones are needed */
+    j = i;
+    for(;;)
     {
-        if(processes[i]->status == PROCSTAT_FREE)
-            return processes[i];
+        size_t k;
+        j = (j + 1) & mask;
+        if(process_index[j] == NULL)
+            break;
+        k = index_hash(process_index[j]->tid);
+        /* Entry stays if its home slot k is cyclically in ]i, j] */
+        if( (i <= j)?(i < k && k <= j):(i < k || k <= j) )
+            continue;
+        process_index[i] = process_index[j];
+        i = j;
     }
+    process_index[i] = NULL;
+    --process_index_count;
 
-    /* Count unknown processes */
-    if(verbosity >= 3)
+    /* Shrink back after a fork storm */
+    if(process_index_size > 64
+     && process_index_count * 8 < process_index_size)
     {
-        size_t unknown = 0;
-        for(i = 0; i < processes_size; ++i)
-            if(processes[i]->status == PROCSTAT_UNKNOWN)
-                ++unknown;
-        log_debug(0, "there are %u/%u UNKNOWN processes",
-                  (unsigned int)unknown, (unsigned int)processes_size);
+        struct Process **old_index = process_index;
+        size_t old_size = process_index_size;
+        process_index_size /= 2;
+        process_index = calloc(process_index_size, sizeof(*process_index));
+        for(i = 0; i < old_size; ++i)
+            if(old_index[i] != NULL)
+                index_insert_slot(old_index[i]);
+        free(old_index);
+        if(verbosity >= 3)
+            log_debug(0, "process index resized (%u)",
+                      (unsigned int)process_index_size);
     }
+}
+
+static void pool_list_remove(struct ProcessPool *pool)
+{
+    if(pool->prev != NULL)
+        pool->prev->next = pool->next;
+    else
+        pools_available = pool->next;
+    if(pool->next != NULL)
+        pool->next->prev = pool->prev;
+}
+
+static void pool_list_add(struct ProcessPool *pool)
+{
+    pool->prev = NULL;
+    pool->next = pools_available;
+    if(pools_available != NULL)
+        pools_available->prev = pool;
+    pools_available = pool;
+}
 
-    /* Allocate more! */
+static struct ProcessPool *pool_new(void)
+{
+    size_t i;
+    struct ProcessPool *pool = malloc(sizeof(*pool));
+    pool->used = 0;
+    pool->free = NULL;
+    for(i = PROCESS_POOL_SIZE; i > 0; --i)
+    {
+        struct Process *process = &pool->entries[i - 1];
+        process->status = PROCSTAT_FREE;
+        process->threadgroup = NULL;
+        process->execve_info = NULL;
+        process->latencies = NULL;
+        process->pool = pool;
+        process->next_free = pool->free;
+        pool->free = process;
+    }
+    pool_list_add(pool);
+    ++pools_count;
+    processes_count[PROCSTAT_FREE] += PROCESS_POOL_SIZE;
     if(verbosity >= 3)
-        log_debug(0, "process table full (%d), reallocating",
-                  (int)processes_size);
-    {
-        struct Process *pool;
-        size_t prev_size = processes_size;
-        processes_size *= 2;
-        pool = malloc((processes_size - prev_size) * sizeof(*pool));
-        processes = realloc(processes, processes_size * sizeof(*processes));
-        for(; i < processes_size; ++i)
+        log_debug(0, "process table full, allocated pool (%u entries)",
+                  (unsigned int)(pools_count * PROCESS_POOL_SIZE));
+    return pool;
+}
+
+static void pool_release(struct Process *process)
+{
+    struct ProcessPool *pool = process->pool;
+    if(pool->free == NULL)
+        pool_list_add(pool);
+    process->next_free = pool->free;
+    pool->free = process;
+    pool->used--;
+
+    /* Give the pool back if we have more than twice the room we need */
+    if(pool->used == 0 && pools_count > 1)
+    {
+        unsigned int live = processes_count[PROCSTAT_ALLOCATED] +
+                            processes_count[PROCSTAT_ATTACHED] +
+                            processes_count[PROCSTAT_UNKNOWN];
+        if((pools_count - 1) * PROCESS_POOL_SIZE > live * 2)
         {
-            processes[i] = pool++;
-            processes[i]->status = PROCSTAT_FREE;
-            processes[i]->threadgroup = NULL;
-            processes[i]->execve_info = NULL;
+            pool_list_remove(pool);
+            free(pool);
+            --pools_count;
+            processes_count[PROCSTAT_FREE] -= PROCESS_POOL_SIZE;
+            if(verbosity >= 3)
+                log_debug(0, "released process pool (%u entries remain)",
+                          (unsigned int)(pools_count * PROCESS_POOL_SIZE));
         }
-        return processes[prev_size];
     }
 }
 
+
+void trace_resume(const struct Process *process, int signum)
+{
+    /* In seccomp mode, the filter will stop the process on the next syscall
+     * we are interested in; we only need a syscall-stop to see it return */
+    if( (trace_options & TRACE_OPT_SECCOMP)
+     && !process->in_syscall
+     && !(process->flags & (PROCFLAG_EXECD | PROCFLAG_FULLTRACE)) )
+        ptrace(PTRACE_CONT, process->tid, NULL, signum);
+    else
+        ptrace(PTRACE_SYSCALL, process->tid, NULL, signum);
+}
+
+struct Process *trace_find_process(pid_t tid)
+{
+    size_t i = index_hash(tid);
+    while(process_index[i] != NULL)
+    {
+        if(process_index[i]->tid == tid)
+            return process_index[i];
+        i = (i + 1) & (process_index_size - 1);
+    }
+    return NULL;
+}
+
+/* Gets a free entry from the table and indexes it under the given tid. The
+ * caller is expected to set its status with trace_set_status(). */
+struct Process *trace_get_empty_process(pid_t tid)
+{
+    struct ProcessPool *pool = pools_available;
+    struct Process *process;
+    if(pool == NULL)
+    {
+        if(verbosity >= 3)
+            log_debug(0, "there are %u UNKNOWN processes",
+                      processes_count[PROCSTAT_UNKNOWN]);
+        pool = pool_new();
+    }
+    process = pool->free;
+    pool->free = process->next_free;
+    if(pool->free == NULL)
+        pool_list_remove(pool);
+    pool->used++;
+
+    process->tid = tid;
+    process->syscall_start = 0;
+    process->io_read = process->io_write = -1;
+    index_insert(process);
+    return process;
+}
+
+void trace_set_status(struct Process *process, int status)
+{
+    processes_count[process->status]--;
+    processes_count[status]++;
+    process->status = status;
+}
+
 struct ThreadGroup *trace_new_threadgroup(pid_t tgid, char *wd)
 {
     struct ThreadGroup *threadgroup = malloc(sizeof(struct ThreadGroup));
     threadgroup->tgid = tgid;
     threadgroup->wd = wd;
-    threadgroup->refs = 1;
+    threadgroup->refs = 0;
+    threadgroup->members = NULL;
+    threadgroup->latencies = NULL;
+    if(trace_options & TRACE_OPT_IO_VOLUME)
+        threadgroup->fds = fdtable_new();
+    else
+        threadgroup->fds = NULL;
     if(verbosity >= 3)
         log_debug(tgid, "threadgroup (= process) created");
     return threadgroup;
 }
 
+void trace_set_threadgroup(struct Process *process,
+                           struct ThreadGroup *threadgroup)
+{
+    process->threadgroup = threadgroup;
+    threadgroup->refs++;
+    process->tg_prev = NULL;
+    process->tg_next = threadgroup->members;
+    if(threadgroup->members != NULL)
+        threadgroup->members->tg_prev = process;
+    threadgroup->members = process;
+}
+
 void trace_free_process(struct Process *process)
 {
-    process->status = PROCSTAT_FREE;
+    if(process->status == PROCSTAT_FREE)
+        return;
+    index_remove(process);
+    trace_set_status(process, PROCSTAT_FREE);
     if(process->threadgroup != NULL)
     {
+        if(process->tg_prev != NULL)
+            process->tg_prev->tg_next = process->tg_next;
+        else
+            process->threadgroup->members = process->tg_next;
+        if(process->tg_next != NULL)
+            process->tg_next->tg_prev = process->tg_prev;
         process->threadgroup->refs--;
         if(verbosity >= 3)
             log_debug(process->tid,
@@ -192,6 +477,8 @@ void trace_free_process(struct Process *process)
                           "deallocating threadgroup");
             if(process->threadgroup->wd != NULL)
                 free(process->threadgroup->wd);
+            latency_free(process->threadgroup->latencies);
+            fdtable_free(process->threadgroup->fds);
             free(process->threadgroup);
         }
         process->threadgroup = NULL;
@@ -203,49 +490,76 @@ void trace_free_process(struct Process *process)
         free_execve_info(process->execve_info);
         process->execve_info = NULL;
     }
+    latency_free(process->latencies);
+    process->latencies = NULL;
+    pool_release(process);
 }
 
 void trace_count_processes(unsigned int *p_nproc, unsigned int *p_unknown)
 {
-    unsigned int nproc = 0, unknown = 0;
-    size_t i;
-    for(i = 0; i < processes_size; ++i)
-    {
-        switch(processes[i]->status)
-        {
-        case PROCSTAT_FREE:
-            break;
-        case PROCSTAT_UNKNOWN:
-            /* Exists but no corresponding syscall has returned yet */
-            ++unknown;
-        case PROCSTAT_ALLOCATED:
-            /* Not yet attached but it will show up eventually */
-        case PROCSTAT_ATTACHED:
-            /* Running */
-            ++nproc;
-            break;
-        }
-    }
     if(p_nproc != NULL)
-        *p_nproc = nproc;
+        *p_nproc =
+                /* Exists but no corresponding syscall has returned yet */
+                processes_count[PROCSTAT_UNKNOWN] +
+                /* Not yet attached but it will show up eventually */
+                processes_count[PROCSTAT_ALLOCATED] +
+                /* Running */
+                processes_count[PROCSTAT_ATTACHED];
     if(p_unknown != NULL)
-        *p_unknown = unknown;
+        *p_unknown = processes_count[PROCSTAT_UNKNOWN];
 }
 
-int trace_add_files_from_proc(unsigned int process, pid_t tid,
-                              const char *binary)
+char *trace_read_mapped_files(pid_t tid)
 {
-    FILE *fp;
-    char dummy;
-    char *line = NULL;
-    size_t length = 0;
-    char previous_path[4096] = "";
+    int fd;
+    char *buffer, *list, *line, *end;
+    size_t size = 16384, length = 0, list_length = 0;
+    const char *previous = NULL;
+    size_t previous_len = 0;
 
     const char *const fmt = "/proc/%d/maps";
+    char dummy;
     int len = snprintf(&dummy, 1, fmt, tid);
     char *procfile = malloc(len + 1);
     snprintf(procfile, len + 1, fmt, tid);
 
+#ifdef DEBUG_PROC_PARSER
+    log_info(tid, "parsing %s", procfile);
+#endif
+    fd = open(procfile, O_RDONLY);
+    if(fd == -1)
+    {
+        /* LCOV_EXCL_START : the process is stopped, it can't be gone */
+        log_critical(tid, "couldn't open %s: %s", procfile, strerror(errno));
+        free(procfile);
+        return NULL;
+        /* LCOV_EXCL_END */
+    }
+    free(procfile);
+
+    /* Reads the whole file */
+    buffer = malloc(size);
+    for(;;)
+    {
+        ssize_t ret;
+        if(length == size)
+        {
+            size *= 2;
+            buffer = realloc(buffer, size);
+        }
+        ret = read(fd, buffer + length, size - length);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            break;
+        length += ret;
+    }
+    close(fd);
+
+    /* The list of paths can't be longer than the file, plus the NUL of a
+     * last line without a newline and the final empty string */
+    list = malloc(length + 2);
+
     /* Loops on lines
      * Format:
      * 08134000-0813a000 rw-p 000eb000 fe:00 868355     /bin/bash
@@ -253,71 +567,57 @@ int trace_add_files_from_proc(unsigned int process, pid_t tid,
      * b7721000-b7740000 r-xp 00000000 fe:00 901950     /lib/ld-2.18.so
      * bfe44000-bfe65000 rw-p 00000000 00:00 0          [stack]
      */
-
-#ifdef DEBUG_PROC_PARSER
-    log_info(tid, "parsing %s", procfile);
-#endif
-    fp = fopen(procfile, "r");
-    free(procfile);
-
-    while((line = read_line(line, &length, fp)) != NULL)
+    end = buffer + length;
+    for(line = buffer; line < end; )
     {
-        unsigned long int addr_start, addr_end;
-        char perms[5];
-        unsigned long int offset;
-        unsigned int dev_major, dev_minor;
+        char *eol = memchr(line, '\n', end - line);
+        char *p = line;
         unsigned long int inode;
-        char pathname[4096];
-        sscanf(line,
-               "%lx-%lx %4s %lx %x:%x %lu %s",
-               &addr_start, &addr_end,
-               perms,
-               &offset,
-               &dev_major, &dev_minor,
-               &inode,
-               pathname);
-
-#ifdef DEBUG_PROC_PARSER
-        log_info(tid,
-                 "proc line:\n"
-                 "    addr_start: %lx\n"
-                 "    addr_end: %lx\n"
-                 "    perms: %s\n"
-                 "    offset: %lx\n"
-                 "    dev_major: %x\n"
-                 "    dev_minor: %x\n"
-                 "    inode: %lu\n"
-                 "    pathname: %s",
-                 addr_start, addr_end,
-                 perms,
-                 offset,
-                 dev_major, dev_minor,
-                 inode,
-                 pathname);
-#endif
-        if(inode > 0)
+        int field;
+        if(eol == NULL)
+            eol = end;
+        /* Skips address range, permissions, offset and device */
+        for(field = 0; field < 4; ++field)
+        {
+            while(p < eol && *p != ' ')
+                ++p;
+            while(p < eol && *p == ' ')
+                ++p;
+        }
+        inode = strtoul(p, &p, 10);
+        while(p < eol && *p == ' ')
+            ++p;
+        if(inode > 0 && p < eol)
         {
-            if(strncmp(pathname, binary, 4096) != 0
-             && strncmp(previous_path, pathname, 4096) != 0)
+            size_t path_len = eol - p;
+            static const char deleted[] = " (deleted)";
+            if(path_len > sizeof(deleted) - 1
+             && memcmp(eol - (sizeof(deleted) - 1), deleted,
+                       sizeof(deleted) - 1) == 0)
+                path_len -= sizeof(deleted) - 1;
+            if(previous == NULL || previous_len != path_len
+             || memcmp(previous, p, path_len) != 0)
             {
 #ifdef DEBUG_PROC_PARSER
-                log_info(tid, "    adding to database");
+                log_info(tid, "    mapped: %.*s", (int)path_len, p);
 #endif
-                if(db_add_file_open(process, pathname,
-                                    FILE_READ, path_is_dir(pathname)) != 0)
-                    return -1;
-                strncpy(previous_path, pathname, 4096);
+                memcpy(list + list_length, p, path_len);
+                list[list_length + path_len] = '\0';
+                list_length += path_len + 1;
+                previous = p;
+                previous_len = path_len;
             }
         }
+        line = eol + 1;
     }
-    fclose(fp);
-    return 0;
+    list[list_length] = '\0';
+    free(buffer);
+    return list;
 }
 
-static void trace_set_options(pid_t tid)
+static long trace_ptrace_options(void)
 {
-    ptrace(PTRACE_SETOPTIONS, tid, 0,
-           PTRACE_O_TRACESYSGOOD |  /* Adds 0x80 bit to SIGTRAP signals
+    return PTRACE_O_TRACESYSGOOD |  /* Adds 0x80 bit to SIGTRAP signals
                                      * if paused because of syscall */
 #ifdef PTRACE_O_EXITKILL
            PTRACE_O_EXITKILL |
@@ -325,30 +625,524 @@ static void trace_set_options(pid_t tid)
            PTRACE_O_TRACECLONE |
            PTRACE_O_TRACEFORK |
            PTRACE_O_TRACEVFORK |
-           PTRACE_O_TRACEEXEC);
+           PTRACE_O_TRACEEXEC |
+           PTRACE_O_TRACEEXIT |
+           ((trace_options & TRACE_OPT_SECCOMP)?PTRACE_O_TRACESECCOMP:0);
+}
+
+static void trace_set_options(pid_t tid)
+{
+    ptrace(PTRACE_SETOPTIONS, tid, 0, trace_ptrace_options());
+}
+
+/* Before Linux 4.8, the seccomp stop happened before the syscall-entry stop,
+ * which is not the order trace() expects */
+static int trace_seccomp_supported(void)
+{
+    struct utsname name;
+    int major, minor;
+    if(uname(&name) != 0
+     || sscanf(name.release, "%d.%d", &major, &minor) != 2)
+        return 0;
+    return major > 4 || (major == 4 && minor >= 8);
+}
+
+/* Reads the syscall number and arguments (on syscall entry) or return value
+ * (on syscall exit) from the registers */
+static void trace_get_registers(struct Process *process)
+{
+    pid_t tid = process->tid;
+    size_t len = 0;
+#ifdef I386
+    struct i386_regs regs;
+#else /* def X86_64 */
+    struct x86_64_regs regs;
+#endif
+    /* Try to use GETREGSET first, since iov_len allows us to know if
+     * 32bit or 64bit mode was used */
+#ifdef PTRACE_GETREGSET
+#ifndef NT_PRSTATUS
+#define NT_PRSTATUS  1
+#endif
+    {
+        struct iovec iov;
+        iov.iov_base = &regs;
+        iov.iov_len = sizeof(regs);
+        if(ptrace(PTRACE_GETREGSET, tid, NT_PRSTATUS, &iov) == 0)
+            len = iov.iov_len;
+    }
+    if(len == 0)
+#endif
+    /* GETREGSET undefined or call failed, fallback on GETREGS */
+    {
+        /* LCOV_EXCL_START : GETREGSET was added by Linux 2.6.34 in
+         * May 2010 (2225a122) */
+        ptrace(PTRACE_GETREGS, tid, NULL, &regs);
+        /* LCOV_EXCL_END */
+    }
+#if defined(I386)
+    if(!process->in_syscall)
+        process->current_syscall = regs.orig_eax;
+    if(process->in_syscall)
+        get_i386_reg(&process->retvalue, regs.eax);
+    else
+    {
+        get_i386_reg(&process->params[0], regs.ebx);
+        get_i386_reg(&process->params[1], regs.ecx);
+        get_i386_reg(&process->params[2], regs.edx);
+        get_i386_reg(&process->params[3], regs.esi);
+        get_i386_reg(&process->params[4], regs.edi);
+        get_i386_reg(&process->params[5], regs.ebp);
+    }
+    process->mode = MODE_I386;
+#elif defined(X86_64)
+    /* On x86_64, process might be 32 or 64 bits */
+    /* If len is known (not 0) and not that of x86_64 registers,
+     * or if len is not known (0) and CS is 0x23 (not as reliable) */
+    if( (len != 0 && len != sizeof(regs))
+     || (len == 0 && regs.cs == 0x23) )
+    {
+        /* 32 bit mode */
+        struct i386_regs *x86regs = (struct i386_regs*)&regs;
+        if(!process->in_syscall)
+            process->current_syscall = x86regs->orig_eax;
+        if(process->in_syscall)
+            get_i386_reg(&process->retvalue, x86regs->eax);
+        else
+        {
+            get_i386_reg(&process->params[0], x86regs->ebx);
+            get_i386_reg(&process->params[1], x86regs->ecx);
+            get_i386_reg(&process->params[2], x86regs->edx);
+            get_i386_reg(&process->params[3], x86regs->esi);
+            get_i386_reg(&process->params[4], x86regs->edi);
+            get_i386_reg(&process->params[5], x86regs->ebp);
+        }
+        process->mode = MODE_I386;
+    }
+    else
+    {
+        /* 64 bit mode */
+        if(!process->in_syscall)
+            process->current_syscall = regs.orig_rax;
+        if(process->in_syscall)
+            get_x86_64_reg(&process->retvalue, regs.rax);
+        else
+        {
+            get_x86_64_reg(&process->params[0], regs.rdi);
+            get_x86_64_reg(&process->params[1], regs.rsi);
+            get_x86_64_reg(&process->params[2], regs.rdx);
+            get_x86_64_reg(&process->params[3], regs.r10);
+            get_x86_64_reg(&process->params[4], regs.r8);
+            get_x86_64_reg(&process->params[5], regs.r9);
+        }
+        /* Might still be either native x64 or Linux's x32 layer */
+        process->mode = MODE_X86_64;
+    }
+#endif
+}
+
+/* Reads the same information with PTRACE_GET_SYSCALL_INFO (Linux 5.3),
+ * which doesn't need to copy all the registers, and knows the architecture
+ * of the syscall. Returns -1 if the registers have to be read instead. */
+static int trace_get_syscall_info(struct Process *process)
+{
+    struct syscall_info info;
+    size_t i;
+    if(!syscall_info_supported)
+        return -1;
+    if(ptrace(PTRACE_GET_SYSCALL_INFO, process->tid,
+              (void*)sizeof(info), &info) <= 0)
+    {
+        if(errno == EIO || errno == EINVAL)
+        {
+            log_info(0, "PTRACE_GET_SYSCALL_INFO is not available, reading "
+                     "registers");
+            syscall_info_supported = 0;
+        }
+        return -1;
+    }
+    if(info.arch == AUDIT_ARCH_I386)
+        process->mode = MODE_I386;
+    else if(info.arch == AUDIT_ARCH_X86_64)
+        process->mode = MODE_X86_64;
+    else
+        return -1; /* LCOV_EXCL_LINE : not a syscall stop */
+
+    /* The kind of stop is checked against our own state, on which
+     * syscall_handle() relies; if they disagree, the registers decide as
+     * before */
+    if(!process->in_syscall
+     && (info.op == SYSCALL_INFO_ENTRY || info.op == SYSCALL_INFO_SECCOMP))
+    {
+        /* seccomp and entry have the same layout */
+        process->current_syscall = info.u.entry.nr;
+        for(i = 0; i < PROCESS_ARGS; ++i)
+        {
+            if(process->mode == MODE_I386)
+                get_i386_reg(&process->params[i], info.u.entry.args[i]);
+            else
+                get_x86_64_reg(&process->params[i], info.u.entry.args[i]);
+        }
+        return 0;
+    }
+    else if(process->in_syscall && info.op == SYSCALL_INFO_EXIT)
+    {
+        if(process->mode == MODE_I386)
+            get_i386_reg(&process->retvalue, info.u.exit.rval);
+        else
+            get_x86_64_reg(&process->retvalue, info.u.exit.rval);
+        return 0;
+    }
+    return -1;
+}
+
+
+/* ********************
+ * Sharded tracing
+ *
+ * With trace_threads > 1, several threads trace the program, each the
+ * processes it is the tracer of, with the usual thread-local state. Each
+ * new process starts in the thread of its parent. When a thread has nothing
+ * left to trace, it waits; the next process that gets to a clean point (its
+ * first stop or the exit of a syscall) in a thread that traces others is then
+ * handed to it: the owner detaches it with a SIGSTOP pending, and the idle
+ * thread attaches with PTRACE_SEIZE and resumes it from that stop. Only
+ * single-threaded processes are handed over, the threads of a process stay
+ * with its tracer.
+ *
+ * The database belongs to the thread that called fork_and_trace(), which
+ * records the events forwarded by the tracer threads (see db_forward_run()).
+ * The trace ends when all the tracer threads are waiting.
+ */
+
+struct Handoff {
+    pid_t tid;
+    unsigned int identifier;
+    char *wd;
+    struct FdTable *fds;
+};
+
+struct ShardSet;
+
+struct Shard {
+    struct ShardSet *set;
+    unsigned int index;
+    pthread_t thread;
+    int waiting;                /* Can be handed a process */
+    int has_work;               /* Was handed one */
+    struct Handoff handoff;
+};
+
+struct ShardSet {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct Shard *shards;
+    unsigned int count;
+    unsigned int idle;          /* Waiting or stopped on error */
+    unsigned int waiting;
+    int done, failed;
+    pid_t first_proc;
+    struct stats *stats;        /* Counters of the tracer threads that are
+                                 * done */
+
+    /* Copied to the tracer threads */
+    const char *binary;
+    int argc;
+    char **argv;
+    struct sock_fprog *filter;
+    int *exit_status;
+    int verbosity;
+    unsigned int options;
+    FILE *logfile;
+    struct db_forward *forward;
+};
+
+static __thread struct Shard *shard = NULL;
+
+static unsigned int trace_live_processes(void)
+{
+    unsigned int nprocs;
+    trace_count_processes(&nprocs, NULL);
+    return nprocs;
+}
+
+/* Marks this thread idle; the trace is done when all of them are. Called
+ * with the mutex held */
+static void shard_set_idle(struct ShardSet *set)
+{
+    if(++set->idle == set->count)
+    {
+        set->done = 1;
+        pthread_cond_broadcast(&set->cond);
+    }
+}
+
+/* Gives a process, stopped at a clean point, to an idle tracer thread, or
+ * resumes it if there is none anymore */
+static int shard_handoff(struct Process *process)
+{
+    struct ShardSet *set = shard->set;
+    struct Shard *target = NULL;
+    unsigned int i;
+    /* The events of the process recorded so far go first */
+    if(syscall_process_pending(1) != 0)
+        return -1;
+    db_forward_flush();
+
+    pthread_mutex_lock(&set->mutex);
+    for(i = 0; i < set->count && target == NULL; ++i)
+        if(set->shards[i].waiting)
+            target = &set->shards[i];
+    if(target == NULL)
+    {
+        pthread_mutex_unlock(&set->mutex);
+        trace_resume(process, 0);
+        return 0;
+    }
+    /* It stops again as soon as it's detached, the other thread resumes it
+     * from there */
+    if(syscall(SYS_tgkill, process->tid, process->tid, SIGSTOP) != 0
+     || ptrace(PTRACE_DETACH, process->tid, NULL, 0) != 0)
+    {
+        /* LCOV_EXCL_START : the process is stopped, it can't be gone */
+        pthread_mutex_unlock(&set->mutex);
+        log_critical(process->tid, "couldn't detach process: %s",
+                     strerror(errno));
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    target->handoff.tid = process->tid;
+    target->handoff.identifier = process->identifier;
+    target->handoff.wd = process->threadgroup->wd;
+    target->handoff.fds = process->threadgroup->fds;
+    target->has_work = 1;
+    target->waiting = 0;
+    set->waiting--;
+    set->idle--;
+    pthread_cond_broadcast(&set->cond);
+    pthread_mutex_unlock(&set->mutex);
+
+    if(verbosity >= 2)
+        log_info(process->tid, "handed to tracer thread %u", target->index);
+    process->threadgroup->wd = NULL;
+    process->threadgroup->fds = NULL;
+    if(syscall_flush_latencies(process) != 0)
+        return -1;
+    trace_free_process(process);
+    return 0;
+}
+
+/* Attaches to a process that was handed to this thread. Returns 1 if it can
+ * be traced, 0 if it is gone */
+static int shard_adopt(const struct Handoff *handoff)
+{
+    struct Process *process;
+    if(__atomic_load_n(&shard->set->failed, __ATOMIC_RELAXED))
+    {
+        kill(handoff->tid, SIGKILL);
+        free(handoff->wd);
+        fdtable_free(handoff->fds);
+        return 0;
+    }
+    if(ptrace(PTRACE_SEIZE, handoff->tid, NULL, trace_ptrace_options()) != 0)
+    {
+        free(handoff->wd);
+        fdtable_free(handoff->fds);
+        if(errno == ESRCH)
+        {
+            /* LCOV_EXCL_START : it was killed while nobody traced it */
+            log_warn(handoff->tid, "process exited while changing tracer "
+                     "thread");
+            return db_add_exit(handoff->identifier, 0x0100 | SIGKILL,
+                               NULL);
+            /* LCOV_EXCL_END */
+        }
+        /* LCOV_EXCL_START : the owner could attach to it */
+        log_critical(handoff->tid, "couldn't attach to process: %s",
+                     strerror(errno));
+        kill(handoff->tid, SIGKILL);
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    /* The process is stopped, or about to stop on the SIGSTOP of
+     * shard_handoff() (which might also find it stopped since an earlier
+     * handoff, with the SIGSTOP still pending). SIGCONT discards that SIGSTOP
+     * and ends the stop; until it is delivered, the stops this causes are
+     * not passed on to the process, see trace() */
+    if(syscall(SYS_tgkill, handoff->tid, handoff->tid, SIGCONT) != 0)
+    {
+        /* LCOV_EXCL_START : we are tracing it, it can't be gone */
+        log_critical(handoff->tid, "couldn't continue process: %s",
+                     strerror(errno));
+        free(handoff->wd);
+        fdtable_free(handoff->fds);
+        kill(handoff->tid, SIGKILL);
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    if(verbosity >= 3)
+        log_debug(handoff->tid, "process attached by tracer thread %u",
+                  shard->index);
+    process = trace_get_empty_process(handoff->tid);
+    trace_set_status(process, PROCSTAT_ATTACHED);
+    process->flags = PROCFLAG_SEIZED;
+    process->in_syscall = 0;
+    process->identifier = handoff->identifier;
+    trace_set_threadgroup(process,
+                          trace_new_threadgroup(handoff->tid, handoff->wd));
+    fdtable_free(process->threadgroup->fds);
+    process->threadgroup->fds = handoff->fds;
+    return 1;
+}
+
+/* Waits until this thread is handed a process (returns 1) or all the threads
+ * are waiting (returns 0) */
+static int shard_wait(void)
+{
+    struct ShardSet *set = shard->set;
+    for(;;)
+    {
+        struct Handoff handoff;
+        int ret;
+        db_forward_flush();
+        pthread_mutex_lock(&set->mutex);
+        shard->waiting = 1;
+        set->waiting++;
+        shard_set_idle(set);
+        while(!shard->has_work && !set->done)
+            pthread_cond_wait(&set->cond, &set->mutex);
+        if(!shard->has_work)
+        {
+            pthread_mutex_unlock(&set->mutex);
+            return 0;
+        }
+        shard->has_work = 0;
+        handoff = shard->handoff;
+        pthread_mutex_unlock(&set->mutex);
+        ret = shard_adopt(&handoff);
+        if(ret != 0)
+            return ret;
+    }
+}
+
+int trace_continue(struct Process *process)
+{
+    if(shard != NULL
+     && __atomic_load_n(&shard->set->waiting, __ATOMIC_RELAXED) > 0
+     && !process->in_syscall
+     && process->flags == 0
+     && process->execve_info == NULL
+     && process->threadgroup != NULL
+     && process->threadgroup->tgid == process->tid
+     && process->threadgroup->refs == 1
+     && process->tid != shard->set->first_proc
+     && trace_live_processes() > 1)
+        return shard_handoff(process);
+    trace_resume(process, 0);
+    return 0;
+}
+
+/* Reads the I/O counters of a thread group from /proc/<tid>/io, which needs
+ * the kernel to have CONFIG_TASK_IO_ACCOUNTING */
+static void trace_read_io(struct Process *process)
+{
+    char procfile[32], name[32];
+    long long value;
+    FILE *fp;
+    sprintf(procfile, "/proc/%d/io", process->tid);
+    fp = fopen(procfile, "r");
+    if(fp == NULL)
+    {
+        if(verbosity >= 3)
+            log_debug(process->tid, "couldn't open %s: %s", procfile,
+                      strerror(errno));
+        return;
+    }
+    while(fscanf(fp, "%31[^:]: %lld\n", name, &value) == 2)
+    {
+        if(strcmp(name, "rchar") == 0)
+            process->io_read = value;
+        else if(strcmp(name, "wchar") == 0)
+            process->io_write = value;
+    }
+    fclose(fp);
 }
 
+/* Fills in the resources used by the thread group of an exited leader. The
+ * rusage from wait3() covers the children it waited for as well. */
+static void trace_get_usage(struct db_usage *usage, const struct rusage *res,
+                            const struct Process *process)
+{
+    if(res != NULL)
+    {
+        usage->user_time = res->ru_utime.tv_sec * 1000LL
+                         + res->ru_utime.tv_usec / 1000;
+        usage->system_time = res->ru_stime.tv_sec * 1000LL
+                           + res->ru_stime.tv_usec / 1000;
+        usage->max_rss = res->ru_maxrss;
+        usage->voluntary_switches = res->ru_nvcsw;
+        usage->involuntary_switches = res->ru_nivcsw;
+        usage->block_reads = res->ru_inblock;
+        usage->block_writes = res->ru_oublock;
+    }
+    usage->io_read = process->io_read;
+    usage->io_write = process->io_write;
+}
+
+static int trace_check_sigint(void);
+
 static int trace(pid_t first_proc, int *first_exit_code)
 {
     for(;;)
     {
         int status;
         pid_t tid;
-        int cpu_time;
+        struct rusage res;
+        int has_rusage;
         struct Process *process;
 
-        /* Wait for a process */
+        /* Another tracer thread failed */
+        if(shard != NULL
+         && __atomic_load_n(&shard->set->failed, __ATOMIC_RELAXED))
+            return -1;
+        if(trace_check_sigint() != 0)
+            return -1;
+
+        /* Wait for a process; while there is none, do the work that
+         * syscall_handle() deferred. Other threads might be tracing too, only
+         * wait for the processes of this one */
+        for(;;)
+        {
+            int options = __WALL | __WNOTHREAD;
+            stats_time start;
+            if(syscall_pending_work())
+                options |= WNOHANG;
+            else
+                db_forward_flush();
+            start = stats_clock();
 #if NO_WAIT3
-        tid = waitpid(-1, &status, __WALL);
-        cpu_time = -1;
+            tid = waitpid(-1, &status, options);
+            has_rusage = 0;
 #else
-        {
-            struct rusage res;
-            tid = wait3(&status, __WALL, &res);
-            cpu_time = (res.ru_utime.tv_sec * 1000 +
-                        res.ru_utime.tv_usec / 1000);
-        }
+            tid = wait3(&status, options, &res);
+            has_rusage = 1;
 #endif
+            stats_timed(STAT_WAIT, start);
+            if(tid == -1 && errno == EINTR)
+            {
+                /* The preloaded library wants room in the ring, or SIGINT */
+                if((trace_options & TRACE_OPT_PRELOAD)
+                 && preload_receive() != 0)
+                    return -1;
+                if(trace_check_sigint() != 0)
+                    return -1;
+                continue;
+            }
+            if(tid != 0)
+                break;
+            if(syscall_process_pending(0) != 0)
+                return -1;
+        }
         if(tid == -1)
         {
             /* LCOV_EXCL_START : internal error: waitpid() won't fail unless we
@@ -357,10 +1151,27 @@ static int trace(pid_t first_proc, int *first_exit_code)
             return -1;
             /* LCOV_EXCL_END */
         }
+        /* The library wrote its events before the process got to this stop,
+         * or exited */
+        if((trace_options & TRACE_OPT_PRELOAD) && preload_receive() != 0)
+            return -1;
+        /* Same for files closed by the process, or by its exit */
+        if((trace_options & TRACE_OPT_FANOTIFY) && fanotify_receive() != 0)
+            return -1;
+        /* Events other than syscalls are handled in order with the deferred
+         * work */
+        if(!(WIFSTOPPED(status)
+           && ( (WSTOPSIG(status) & 0x80)
+             || (WSTOPSIG(status) == SIGTRAP
+               && status >> 16 == PTRACE_EVENT_SECCOMP) ))
+         && syscall_process_pending(1) != 0)
+            return -1;
+
         if(WIFEXITED(status) || WIFSIGNALED(status))
         {
             unsigned int nprocs, unknown;
             int exitcode;
+            struct db_usage usage;
             if(WIFSIGNALED(status))
                 /* exit codes are 8 bits */
                 exitcode = 0x0100 | WTERMSIG(status);
@@ -370,13 +1181,16 @@ static int trace(pid_t first_proc, int *first_exit_code)
             if(tid == first_proc && first_exit_code != NULL)
                 *first_exit_code = exitcode;
             process = trace_find_process(tid);
+            db_usage_unknown(&usage);
             if(process != NULL)
             {
-                int cpu_time_val = -1;
+                /* The rusage is the whole thread group's, and the leader is
+                 * reaped last */
                 if(process->tid == process->threadgroup->tgid)
-                    cpu_time_val = cpu_time;
-                if(db_add_exit(process->identifier, exitcode,
-                               cpu_time_val) != 0)
+                    trace_get_usage(&usage, has_rusage?&res:NULL, process);
+                if(db_add_exit(process->identifier, exitcode, &usage) != 0
+                 || syscall_flush_latencies(process) != 0
+                 || syscall_flush_files(process) != 0)
                     return -1;
                 trace_free_process(process);
             }
@@ -385,9 +1199,21 @@ static int trace(pid_t first_proc, int *first_exit_code)
                 log_info(tid, "process exited (%s %d), CPU time %.2f, "
                          "%d processes remain",
                          (exitcode & 0x0100)?"signal":"code", exitcode & 0xFF,
-                         cpu_time * 0.001f, (unsigned int)nprocs);
+                         usage.user_time * 0.001f, (unsigned int)nprocs);
             if(nprocs <= 0)
-                break;
+            {
+                if(shard == NULL)
+                    break;
+                switch(shard_wait())
+                {
+                case 0:
+                    return 0;
+                case 1:
+                    continue;
+                default:
+                    return -1; /* LCOV_EXCL_LINE */
+                }
+            }
             if(unknown >= nprocs)
             {
                 /* LCOV_EXCL_START : This can't happen because UNKNOWN
@@ -407,10 +1233,9 @@ static int trace(pid_t first_proc, int *first_exit_code)
         {
             if(verbosity >= 3)
                 log_debug(tid, "process appeared");
-            process = trace_get_empty_process();
-            process->status = PROCSTAT_UNKNOWN;
+            process = trace_get_empty_process(tid);
+            trace_set_status(process, PROCSTAT_UNKNOWN);
             process->flags = 0;
-            process->tid = tid;
             process->threadgroup = NULL;
             process->in_syscall = 0;
             trace_set_options(tid);
@@ -420,12 +1245,13 @@ static int trace(pid_t first_proc, int *first_exit_code)
         }
         else if(process->status == PROCSTAT_ALLOCATED)
         {
-            process->status = PROCSTAT_ATTACHED;
+            trace_set_status(process, PROCSTAT_ATTACHED);
 
             if(verbosity >= 3)
                 log_debug(tid, "process attached");
             trace_set_options(tid);
-            ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
+            if(trace_continue(process) != 0)
+                return -1;
             if(verbosity >= 2)
             {
                 unsigned int nproc, unknown;
@@ -436,105 +1262,58 @@ static int trace(pid_t first_proc, int *first_exit_code)
             continue;
         }
 
-        if(WIFSTOPPED(status) && WSTOPSIG(status) & 0x80)
+        /* Syscall-stop, or seccomp stop which is a syscall entry */
+        if(WIFSTOPPED(status)
+         && ( (WSTOPSIG(status) & 0x80)
+           || (WSTOPSIG(status) == SIGTRAP
+             && status >> 16 == PTRACE_EVENT_SECCOMP) ))
         {
-            size_t len = 0;
-#ifdef I386
-            struct i386_regs regs;
-#else /* def X86_64 */
-            struct x86_64_regs regs;
-#endif
-            /* Try to use GETREGSET first, since iov_len allows us to know if
-             * 32bit or 64bit mode was used */
-#ifdef PTRACE_GETREGSET
-#ifndef NT_PRSTATUS
-#define NT_PRSTATUS  1
-#endif
-            {
-                struct iovec iov;
-                iov.iov_base = &regs;
-                iov.iov_len = sizeof(regs);
-                if(ptrace(PTRACE_GETREGSET, tid, NT_PRSTATUS, &iov) == 0)
-                    len = iov.iov_len;
-            }
-            if(len == 0)
-#endif
-            /* GETREGSET undefined or call failed, fallback on GETREGS */
-            {
-                /* LCOV_EXCL_START : GETREGSET was added by Linux 2.6.34 in
-                 * May 2010 (2225a122) */
-                ptrace(PTRACE_GETREGS, tid, NULL, &regs);
-                /* LCOV_EXCL_END */
-            }
-#if defined(I386)
-            if(!process->in_syscall)
-                process->current_syscall = regs.orig_eax;
-            if(process->in_syscall)
-                get_i386_reg(&process->retvalue, regs.eax);
+            /* The process handles its pending signals before it gets here,
+             * so if the SIGCONT of shard_adopt() is still pending, the
+             * process blocks it; it will be passed on */
+            process->flags &= ~PROCFLAG_SEIZED;
+            /* Without the library, the process stops on every syscall, and
+             * the seccomp stop comes after the syscall-entry stop */
+            if(!(WSTOPSIG(status) & 0x80)
+             && (process->flags & PROCFLAG_FULLTRACE))
+                trace_resume(process, 0);
             else
             {
-                get_i386_reg(&process->params[0], regs.ebx);
-                get_i386_reg(&process->params[1], regs.ecx);
-                get_i386_reg(&process->params[2], regs.edx);
-                get_i386_reg(&process->params[3], regs.esi);
-                get_i386_reg(&process->params[4], regs.edi);
-                get_i386_reg(&process->params[5], regs.ebp);
-            }
-            process->mode = MODE_I386;
-#elif defined(X86_64)
-            /* On x86_64, process might be 32 or 64 bits */
-            /* If len is known (not 0) and not that of x86_64 registers,
-             * or if len is not known (0) and CS is 0x23 (not as reliable) */
-            if( (len != 0 && len != sizeof(regs))
-             || (len == 0 && regs.cs == 0x23) )
-            {
-                /* 32 bit mode */
-                struct i386_regs *x86regs = (struct i386_regs*)&regs;
-                if(!process->in_syscall)
-                    process->current_syscall = x86regs->orig_eax;
-                if(process->in_syscall)
-                    get_i386_reg(&process->retvalue, x86regs->eax);
-                else
-                {
-                    get_i386_reg(&process->params[0], x86regs->ebx);
-                    get_i386_reg(&process->params[1], x86regs->ecx);
-                    get_i386_reg(&process->params[2], x86regs->edx);
-                    get_i386_reg(&process->params[3], x86regs->esi);
-                    get_i386_reg(&process->params[4], x86regs->edi);
-                    get_i386_reg(&process->params[5], x86regs->ebp);
-                }
-                process->mode = MODE_I386;
-            }
-            else
-            {
-                /* 64 bit mode */
-                if(!process->in_syscall)
-                    process->current_syscall = regs.orig_rax;
-                if(process->in_syscall)
-                    get_x86_64_reg(&process->retvalue, regs.rax);
-                else
-                {
-                    get_x86_64_reg(&process->params[0], regs.rdi);
-                    get_x86_64_reg(&process->params[1], regs.rsi);
-                    get_x86_64_reg(&process->params[2], regs.rdx);
-                    get_x86_64_reg(&process->params[3], regs.r10);
-                    get_x86_64_reg(&process->params[4], regs.r8);
-                    get_x86_64_reg(&process->params[5], regs.r9);
-                }
-                /* Might still be either native x64 or Linux's x32 layer */
-                process->mode = MODE_X86_64;
+                stats_time start = stats_clock();
+                if(trace_get_syscall_info(process) != 0)
+                    trace_get_registers(process);
+                stats_timed(STAT_REGISTERS, start);
+                if(syscall_handle(process) != 0)
+                    return -1;
             }
-#endif
-            if(syscall_handle(process) != 0)
-                return -1;
         }
         /* Handle signals */
         else if(WIFSTOPPED(status))
         {
             int signum = WSTOPSIG(status) & 0x7F;
 
+            /* A process being handed over, see shard_adopt(): the SIGSTOP
+             * of shard_handoff(), the group-stop it caused (reported after
+             * PTRACE_SEIZE, and again when SIGCONT ends it), and that SIGCONT,
+             * which comes last. None of them goes to the process */
+            if((process->flags & PROCFLAG_SEIZED)
+             && (signum == SIGSTOP || signum == SIGCONT
+              || status >> 16 == PTRACE_EVENT_STOP))
+            {
+                if(signum == SIGCONT && status >> 16 == 0)
+                    process->flags &= ~PROCFLAG_SEIZED;
+                trace_resume(process, 0);
+            }
+            /* Group-stop of a process attached with PTRACE_SEIZE (or a child
+             * of one): it stays stopped until it gets SIGCONT. PTRACE_LISTEN
+             * fails if the group-stop is already over */
+            else if(status >> 16 == PTRACE_EVENT_STOP)
+            {
+                if(ptrace(PTRACE_LISTEN, tid, NULL, 0) != 0)
+                    trace_resume(process, 0);
+            }
             /* Synthetic signal for ptrace event: resume */
-            if(signum == SIGTRAP && status & 0xFF0000)
+            else if(signum == SIGTRAP && status & 0xFF0000)
             {
                 int event = status >> 16;
                 if(event == PTRACE_EVENT_EXEC)
@@ -552,7 +1331,13 @@ static int trace(pid_t first_proc, int *first_exit_code)
                     if(syscall_fork_event(process, event) != 0)
                         return -1;
                 }
-                ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
+                /* Last chance to read /proc; the counters of the thread
+                 * group include the threads that are gone */
+                else if(event == PTRACE_EVENT_EXIT
+                      && process->threadgroup != NULL
+                      && process->tid == process->threadgroup->tgid)
+                    trace_read_io(process);
+                trace_resume(process, 0);
             }
             else if(signum == SIGTRAP)
             {
@@ -560,7 +1345,7 @@ static int trace(pid_t first_proc, int *first_exit_code)
                 log_error(0,
                           "NOT delivering SIGTRAP to %d\n"
                           "    waitstatus=0x%X", tid, status);
-                ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
+                trace_resume(process, 0);
                 /* LCOV_EXCL_END */
             }
             /* Other signal, let the process handle it */
@@ -570,14 +1355,14 @@ static int trace(pid_t first_proc, int *first_exit_code)
                 if(verbosity >= 2)
                     log_info(tid, "caught signal %d", signum);
                 if(ptrace(PTRACE_GETSIGINFO, tid, 0, (long)&si) >= 0)
-                    ptrace(PTRACE_SYSCALL, tid, NULL, signum);
+                    trace_resume(process, signum);
                 else
                 {
                     /* LCOV_EXCL_START : Not sure what this is for... doesn't
                      * seem to happen in practice */
                     log_error(tid, "    NOT delivering: %s", strerror(errno));
                     if(signum != SIGSTOP)
-                        ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
+                        trace_resume(process, 0);
                     /* LCOV_EXCL_END */
                 }
             }
@@ -587,10 +1372,48 @@ static int trace(pid_t first_proc, int *first_exit_code)
     return 0;
 }
 
+/* Traces running in this process, one per thread. The first one to start
+ * installs our signal handlers and the last one to finish restores Python's.
+ *
+ * The SIGINT handler doesn't touch the traces, which other threads are
+ * changing; it only counts the signals, and each tracer thread acts on them in
+ * its loop, see trace_check_sigint(). Two of them in a row abort the traces;
+ * if a tracer thread doesn't get to it (its processes are not stopping), a
+ * third one exits, which kills all the traced processes (PTRACE_O_EXITKILL) */
+static unsigned int running_traces = 0;
+static pthread_mutex_t running_traces_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile sig_atomic_t sigint_count = 0;
+static volatile sig_atomic_t sigint_abort = 0;
+static __thread sig_atomic_t sigint_seen = 0;
+
 static void (*python_sigchld_handler)(int) = NULL;
 static void (*python_sigint_handler)(int) = NULL;
 
-static void restore_signals(void)
+static void sigint_handler(int signo);
+
+static void install_signals(void)
+{
+    pthread_mutex_lock(&running_traces_mutex);
+    if(running_traces++ == 0)
+    {
+        /* No SA_RESTART: the signal has to interrupt wait3() */
+        struct sigaction action, old_action;
+        action.sa_handler = sigint_handler;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = 0;
+        sigint_count = 0;
+        sigint_abort = 0;
+        /* Store Python's handlers for restore_signals() */
+        python_sigchld_handler = signal(SIGCHLD, SIG_DFL);
+        sigaction(SIGINT, &action, &old_action);
+        python_sigint_handler = old_action.sa_handler;
+    }
+    sigint_seen = sigint_count;
+    pthread_mutex_unlock(&running_traces_mutex);
+}
+
+static void restore_python_signals(void)
 {
     if(python_sigchld_handler != NULL)
     {
@@ -604,26 +1427,34 @@ static void restore_signals(void)
     }
 }
 
+static void restore_signals(void)
+{
+    pthread_mutex_lock(&running_traces_mutex);
+    if(--running_traces == 0)
+        restore_python_signals();
+    pthread_mutex_unlock(&running_traces_mutex);
+    /* Also gives back the signal the preloaded library wakes us with */
+    preload_close();
+    fanotify_stop();
+}
+
 static void cleanup(void)
 {
-    size_t i;
-    {
-        size_t nb = 0;
-        for(i = 0; i < processes_size; ++i)
-            if(processes[i]->status != PROCSTAT_FREE)
-                ++nb;
-        /* size_t size is implementation dependent; %u for size_t can trigger
-         * a warning */
-        log_error(0, "cleaning up, %u processes to kill...", (unsigned int)nb);
-    }
-    for(i = 0; i < processes_size; ++i)
+    size_t i, nb = 0;
+    struct Process **live = malloc(process_index_count * sizeof(*live));
+    /* Copy the list first, freeing processes changes the index */
+    for(i = 0; i < process_index_size; ++i)
+        if(process_index[i] != NULL)
+            live[nb++] = process_index[i];
+    /* size_t size is implementation dependent; %u for size_t can trigger
+     * a warning */
+    log_error(0, "cleaning up, %u processes to kill...", (unsigned int)nb);
+    for(i = 0; i < nb; ++i)
     {
-        if(processes[i]->status != PROCSTAT_FREE)
-        {
-            kill(processes[i]->tid, SIGKILL);
-            trace_free_process(processes[i]);
-        }
+        kill(live[i]->tid, SIGKILL);
+        trace_free_process(live[i]);
     }
+    free(live);
 }
 
 static time_t last_int = 0;
@@ -632,109 +1463,377 @@ static void sigint_handler(int signo)
 {
     time_t now = time(NULL);
     (void)signo;
-    if(now - last_int < 2)
+    if(sigint_abort)
+        _exit(1);
+    else if(now - last_int < 2)
+        sigint_abort = 1;
+    else
+        ++sigint_count;
+    last_int = now;
+}
+
+/* Acts on the SIGINTs received since the last call from this thread */
+static int trace_check_sigint(void)
+{
+    if(sigint_abort)
     {
         if(verbosity >= 1)
             log_error(0, "cleaning up on SIGINT");
-        cleanup();
-        restore_signals();
+        return -1;
+    }
+    if(sigint_seen != sigint_count)
+    {
+        sigint_seen = sigint_count;
+        if(verbosity >= 1)
+            log_error(0, "Got SIGINT, press twice to abort...");
+    }
+    return 0;
+}
+
+/* Runs in the forked child: asks to be traced and executes the program */
+static void trace_child(const char *binary, int argc, char **argv,
+                        struct sock_fprog *filter)
+{
+    char **args = malloc((argc + 1) * sizeof(char*));
+    memcpy(args, argv, argc * sizeof(char*));
+    args[argc] = NULL;
+    /* Trace this process */
+    if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+    {
+        log_critical(
+            0,
+            "couldn't use ptrace: %s\n"
+            "This could be caused by a security policy or isolation "
+            "mechanism (such as\n Docker), see http://bit.ly/2bZd8Fa",
+            strerror(errno));
         exit(1);
     }
-    else if(verbosity >= 1)
-        log_error(0, "Got SIGINT, press twice to abort...");
-    last_int = now;
+    /* Stop this once so tracer can set options */
+    kill(getpid(), SIGSTOP);
+    /* Only stop on the syscalls we handle from now on. NO_NEW_PRIVS is
+     * required to install a filter without CAP_SYS_ADMIN; setuid bits
+     * are ignored under ptrace anyway */
+    if(trace_options & TRACE_OPT_SECCOMP)
+    {
+        if(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0
+         || prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, filter) != 0)
+        {
+            log_critical(0, "couldn't install seccomp filter: %s",
+                         strerror(errno));
+            exit(1);
+        }
+    }
+    if(trace_options & TRACE_OPT_PRELOAD)
+        preload_setup_child();
+    /* Execute the target */
+    execvp(binary, args);
+    log_critical(0, "couldn't execute the target command (execvp "
+                 "returned): %s", strerror(errno));
+    exit(1);
 }
 
+static pthread_once_t syscall_table_once = PTHREAD_ONCE_INIT;
+
 static void trace_init(void)
 {
-    /* Store Python's handlers for restore_signals() */
-    python_sigchld_handler = signal(SIGCHLD, SIG_DFL);
-    python_sigint_handler = signal(SIGINT, sigint_handler);
+    install_signals();
 
-    if(processes == NULL)
+    if(pools_available == NULL)
+        pool_new();
+
+    if(process_index == NULL)
     {
-        size_t i;
-        struct Process *pool;
-        processes_size = 16;
-        processes = malloc(processes_size * sizeof(*processes));
-        pool = malloc(processes_size * sizeof(*pool));
-        for(i = 0; i < processes_size; ++i)
-        {
-            processes[i] = pool++;
-            processes[i]->status = PROCSTAT_FREE;
-            processes[i]->threadgroup = NULL;
-            processes[i]->execve_info = NULL;
-        }
+        process_index_size = 64;
+        process_index = calloc(process_index_size, sizeof(*process_index));
+        process_index_count = 0;
     }
 
-    syscall_build_table();
+    pthread_once(&syscall_table_once, syscall_build_table);
 }
 
-int fork_and_trace(const char *binary, int argc, char **argv,
-                   const char *database_path, int *exit_status)
+/* Undoes trace_init(), once this thread is done tracing. All the processes
+ * are free by then (cleanup() frees them if the trace failed), so all the
+ * pools are in pools_available */
+static void trace_fini(void)
 {
-    pid_t child;
+    while(pools_available != NULL)
+    {
+        struct ProcessPool *pool = pools_available;
+        pools_available = pool->next;
+        free(pool);
+    }
+    pools_count = 0;
+    processes_count[PROCSTAT_FREE] = 0;
+    free(process_index);
+    process_index = NULL;
 
-    trace_init();
+    restore_signals();
+    log_free_buffer();
+}
 
-    child = fork();
+/* Opens the log file and the database, before the program is traced */
+static int trace_open_output(const char *database_path)
+{
+    char logfilename[1024];
+    strcpy(logfilename, getenv("HOME"));
+    strcat(logfilename, "/.reprozip/log");
+    if(log_open_file(logfilename) != 0)
+        return -1;
+    if(db_init(database_path,
+               ((trace_options & TRACE_OPT_WRITER_THREAD)?DB_WRITER_THREAD:0)
+             | ((trace_options & TRACE_OPT_EVENT_LOG)?DB_EVENT_LOG:0)) != 0)
+    {
+        log_close_file();
+        return -1;
+    }
+    return 0;
+}
 
-    if(child != 0 && verbosity >= 2)
-        log_info(0, "child created, pid=%d", child);
+/* Closes them once the trace is over; the run is discarded if failed */
+static int trace_close_output(int failed)
+{
+    unsigned long hits, misses;
+    int ret = 0;
+    path_type_cache_stats(&hits, &misses);
+    log_info(0, "file type cache: %lu hits, %lu misses", hits, misses);
+    clear_path_type_cache();
+    syscall_clear_exec_cache();
+    if(db_close(failed) != 0)
+        ret = -1;
+    log_close_file();
+    return ret;
+}
 
+/* Forks the program from tracer thread 0, and creates its entry */
+static int shard_fork(struct ShardSet *set)
+{
+    struct Process *process;
+    pid_t child = fork();
     if(child == 0)
+        trace_child(set->binary, set->argc, set->argv, set->filter);
+    else if(child < 0)
     {
-        char **args = malloc((argc + 1) * sizeof(char*));
-        memcpy(args, argv, argc * sizeof(char*));
-        args[argc] = NULL;
-        /* Trace this process */
-        if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+        /* LCOV_EXCL_START */
+        log_critical(0, "couldn't fork: %s", strerror(errno));
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    if(verbosity >= 2)
+        log_info(0, "child created, pid=%d", child);
+    set->first_proc = child;
+
+    process = trace_get_empty_process(child);
+    trace_set_status(process, PROCSTAT_ALLOCATED);
+    process->flags = 0;
+    trace_set_threadgroup(process, trace_new_threadgroup(child, get_wd()));
+    process->in_syscall = 0;
+    if( (db_add_first_process(&process->identifier,
+                              process->threadgroup->wd) != 0)
+     || (db_add_file_open(process->identifier, process->threadgroup->wd,
+                          FILE_WDIR, 1) != 0) )
+        return -1; /* LCOV_EXCL_LINE */
+    return 1;
+}
+
+static void *shard_main(void *arg)
+{
+    struct ShardSet *set;
+    int ret;
+    shard = arg;
+    set = shard->set;
+    trace_verbosity = set->verbosity;
+    trace_options = set->options;
+    log_use_file(set->logfile);
+    db_forward_attach(set->forward);
+    trace_init();
+
+    if(shard->index == 0)
+        ret = shard_fork(set);
+    else
+        ret = shard_wait();
+    if(ret > 0)
+        ret = trace(set->first_proc,
+                    (shard->index == 0)?set->exit_status:NULL);
+
+    if(ret != 0)
+    {
+        /* The others stop as well */
+        pthread_mutex_lock(&set->mutex);
+        __atomic_store_n(&set->failed, 1, __ATOMIC_RELAXED);
+        shard_set_idle(set);
+        pthread_mutex_unlock(&set->mutex);
+        cleanup();
+    }
+    syscall_clear_exec_cache();
+    clear_path_type_cache();
+    pthread_mutex_lock(&set->mutex);
+    stats_merge(set->stats);
+    pthread_mutex_unlock(&set->mutex);
+    db_forward_detach();
+    log_use_file(NULL);
+    trace_fini();
+    shard = NULL;
+    return NULL;
+}
+
+/* Runs the tracer threads, recording their events from this one */
+static int trace_sharded(const char *binary, int argc, char **argv,
+                         const char *database_path, int *exit_status,
+                         struct sock_fprog *filter)
+{
+    struct ShardSet set;
+    unsigned int i, started;
+    int ret;
+
+    if(trace_open_output(database_path) != 0)
+        return -1;
+
+    pthread_mutex_init(&set.mutex, NULL);
+    pthread_cond_init(&set.cond, NULL);
+    set.count = trace_threads;
+    set.shards = calloc(set.count, sizeof(*set.shards));
+    set.idle = set.waiting = 0;
+    set.done = set.failed = 0;
+    set.first_proc = 0;
+    set.binary = binary;
+    set.argc = argc;
+    set.argv = argv;
+    set.filter = filter;
+    set.exit_status = exit_status;
+    set.verbosity = trace_verbosity;
+    set.options = trace_options;
+    set.logfile = log_get_file();
+    set.forward = db_forward_new(set.count);
+    set.stats = stats_new();
+    if(verbosity >= 2)
+        log_info(0, "tracing with %u threads", set.count);
+
+    for(started = 0; started < set.count; ++started)
+    {
+        int err;
+        set.shards[started].set = &set;
+        set.shards[started].index = started;
+        err = pthread_create(&set.shards[started].thread, NULL,
+                             shard_main, &set.shards[started]);
+        if(err != 0)
         {
-            log_critical(
-                0,
-                "couldn't use ptrace: %s\n"
-                "This could be caused by a security policy or isolation "
-                "mechanism (such as\n Docker), see http://bit.ly/2bZd8Fa",
-                strerror(errno));
-            exit(1);
+            /* LCOV_EXCL_START */
+            log_critical(0, "couldn't start tracer thread: %s",
+                         strerror(err));
+            pthread_mutex_lock(&set.mutex);
+            set.failed = 1;
+            set.count = started;
+            if(set.idle >= set.count)
+            {
+                set.done = 1;
+                pthread_cond_broadcast(&set.cond);
+            }
+            pthread_mutex_unlock(&set.mutex);
+            /* Stands in for the missing senders */
+            for(i = started; i < trace_threads; ++i)
+            {
+                db_forward_attach(set.forward);
+                db_forward_detach();
+            }
+            break;
+            /* LCOV_EXCL_END */
         }
-        /* Stop this once so tracer can set options */
-        kill(getpid(), SIGSTOP);
-        /* Execute the target */
-        execvp(binary, args);
-        log_critical(0, "couldn't execute the target command (execvp "
-                     "returned): %s", strerror(errno));
-        exit(1);
     }
 
-    /* Open log file */
+    ret = db_forward_run(set.forward);
+    for(i = 0; i < started; ++i)
+        pthread_join(set.shards[i].thread, NULL);
+    if(set.failed)
+        ret = -1;
+    db_forward_free(set.forward);
+    stats_add(set.stats);
+    stats_free(set.stats);
+    pthread_mutex_destroy(&set.mutex);
+    pthread_cond_destroy(&set.cond);
+    free(set.shards);
+
+    if(trace_close_output(ret != 0) != 0)
+        ret = -1;
+    return ret;
+}
+
+int fork_and_trace(const char *binary, int argc, char **argv,
+                   const char *database_path, int *exit_status)
+{
+    pid_t child;
+    struct sock_fprog filter;
+
+    trace_init();
+    stats_reset();
+
+    if(trace_options & (TRACE_OPT_PRELOAD | TRACE_OPT_FANOTIFY))
+        trace_options |= TRACE_OPT_SECCOMP;
+    if(trace_options & TRACE_OPT_SECCOMP)
     {
-        char logfilename[1024];
-        strcpy(logfilename, getenv("HOME"));
-        strcat(logfilename, "/.reprozip/log");
-        if(log_open_file(logfilename) != 0)
+        if(!trace_seccomp_supported())
+        {
+            log_warn(0, "seccomp tracing requires Linux 4.8, falling back on "
+                     "stopping on every syscall");
+            trace_options &= ~(TRACE_OPT_SECCOMP | TRACE_OPT_PRELOAD
+                               | TRACE_OPT_FANOTIFY);
+        }
+        else if(syscall_build_filter(&filter) != 0)
         {
-            restore_signals();
+            trace_fini();
             return 1;
         }
     }
+    if( (trace_options & TRACE_OPT_PRELOAD)
+     && preload_open(trace_preload_library) != 0)
+    {
+        free(filter.filter);
+        trace_fini();
+        return 1;
+    }
+    if( (trace_options & TRACE_OPT_FANOTIFY)
+     && fanotify_start(trace_fanotify_paths) != 0)
+    {
+        free(filter.filter);
+        trace_fini();
+        return 1;
+    }
+
+    if(trace_threads > 1)
+    {
+        int ret = trace_sharded(binary, argc, argv, database_path,
+                                exit_status, &filter);
+        if(trace_options & TRACE_OPT_SECCOMP)
+            free(filter.filter);
+        trace_fini();
+        return ret == 0?0:1;
+    }
 
-    if(db_init(database_path) != 0)
+    child = fork();
+
+    if(child != 0 && verbosity >= 2)
+        log_info(0, "child created, pid=%d", child);
+
+    if(child == 0)
+        trace_child(binary, argc, argv, &filter);
+
+    if(trace_options & TRACE_OPT_SECCOMP)
+        free(filter.filter);
+
+    if(trace_open_output(database_path) != 0)
     {
         kill(child, SIGKILL);
-        log_close_file();
-        restore_signals();
+        trace_fini();
         return 1;
     }
 
     /* Creates entry for first process */
     {
-        struct Process *process = trace_get_empty_process();
-        process->status = PROCSTAT_ALLOCATED; /* Not yet attached... */
+        struct Process *process = trace_get_empty_process(child);
+        /* Not yet attached... */
+        trace_set_status(process, PROCSTAT_ALLOCATED);
         process->flags = 0;
         /* We sent a SIGSTOP, but we resume on attach */
-        process->tid = child;
-        process->threadgroup = trace_new_threadgroup(child, get_wd());
+        trace_set_threadgroup(process, trace_new_threadgroup(child, get_wd()));
         process->in_syscall = 0;
 
         if(verbosity >= 2)
@@ -745,10 +1844,9 @@ int fork_and_trace(const char *binary, int argc, char **argv,
                               FILE_WDIR, 1) != 0) )
         {
             /* LCOV_EXCL_START : Database insertion shouldn't fail */
-            db_close(1);
             cleanup();
-            log_close_file();
-            restore_signals();
+            trace_close_output(1);
+            trace_fini();
             return 1;
             /* LCOV_EXCL_END */
         }
@@ -757,20 +1855,17 @@ int fork_and_trace(const char *binary, int argc, char **argv,
     if(trace(child, exit_status) != 0)
     {
         cleanup();
-        db_close(1);
-        log_close_file();
-        restore_signals();
+        trace_close_output(1);
+        trace_fini();
         return 1;
     }
 
-    if(db_close(0) != 0)
+    if(trace_close_output(0) != 0)
     {
-        log_close_file();
-        restore_signals();
+        trace_fini();
         return 1;
     }
 
-    log_close_file();
-    restore_signals();
+    trace_fini();
     return 0;
 }
@@ -4,11 +4,43 @@
 #include "config.h"
 
 
+/* Several programs can be traced at once, from different threads. The state
+ * of a trace (these options, the process table, caches, database...) is
+ * thread-local, so the options have to be set from the thread that calls
+ * fork_and_trace(). */
 int fork_and_trace(const char *binary, int argc, char **argv,
                    const char *database_path, int *exit_status);
 
 
-extern int trace_verbosity;
+extern __thread int trace_verbosity;
+
+#define TRACE_OPT_SECCOMP   0x01    /* Only stop on syscalls that have a
+                                     * handler, using a seccomp-BPF filter */
+#define TRACE_OPT_WRITER_THREAD 0x02 /* Write the database from a separate
+                                      * thread */
+#define TRACE_OPT_EVENT_LOG 0x04    /* Write a binary event log instead of
+                                     * the database */
+#define TRACE_OPT_EARLY_RESUME 0x08 /* Resume processes before recording
+                                     * their syscalls */
+#define TRACE_OPT_PRELOAD   0x10    /* Inject trace_preload_library in the
+                                     * dynamically-linked programs, which
+                                     * then only stop on the syscalls it
+                                     * doesn't report (implies SECCOMP) */
+#define TRACE_OPT_FANOTIFY  0x20    /* Get opened files from fanotify on the
+                                     * mounts of trace_fanotify_paths rather
+                                     * than stopping (implies SECCOMP) */
+#define TRACE_OPT_IO_VOLUME 0x40    /* Count the bytes read and written
+                                     * through the opened files (with
+                                     * SECCOMP, only calls of at least
+                                     * IO_VOLUME_MIN_SIZE bytes); can't be
+                                     * used with PRELOAD or FANOTIFY */
+
+extern __thread unsigned int trace_options;
+/* Number of threads tracing the program, see "Sharded tracing" in tracer.c;
+ * can't be used with TRACE_OPT_PRELOAD or TRACE_OPT_FANOTIFY */
+extern __thread unsigned int trace_threads;
+extern __thread const char *trace_preload_library;
+extern __thread const char *const *trace_fanotify_paths;
 
 
 /* This is NOT a union because sign-extension rules depend on actual register
@@ -22,32 +54,58 @@ typedef struct S_register_type {
 
 #define PROCESS_ARGS 6
 
+/* A string array read from the tracee. The strings are stored back-to-back in
+ * a single buffer, each followed by its NUL, which is also the form stored in
+ * the database. */
+struct StrArray {
+    char **array;   /* NULL-terminated, points into data */
+    char *data;
+    size_t length;  /* Size of data, including the NULs */
+};
+
 struct ExecveInfo {
     char *binary;
-    char **argv;
-    char **envp;
+    struct StrArray argv;
+    struct StrArray envp;
 };
 
 void free_execve_info(struct ExecveInfo *execi);
 
+struct Process;
+struct ProcessPool;
+struct LatencyTable;
+struct FdTable;
+
 struct ThreadGroup {
     pid_t tgid;
     char *wd;
     unsigned int refs;
+    struct Process *members;    /* Linked through Process::tg_next */
+    struct LatencyTable *latencies; /* Per directory, see latency.h */
+    struct FdTable *fds;        /* With TRACE_OPT_IO_VOLUME, see fdtable.h */
 };
 
 struct Process {
     unsigned int identifier;
     unsigned int mode;
     struct ThreadGroup *threadgroup;
+    struct Process *tg_prev, *tg_next;
     pid_t tid;
     int status;
     unsigned int flags;
     int in_syscall;
     int current_syscall;
+    unsigned long long syscall_start;   /* When it was resumed at syscall
+                                         * entry, or 0 */
+    struct LatencyTable *latencies;     /* Per syscall, see latency.h */
+    long long io_read, io_write;        /* From /proc/<tid>/io at the exit
+                                         * stop of a thread-group leader, or
+                                         * -1 */
     register_type retvalue;
     register_type params[PROCESS_ARGS];
     struct ExecveInfo *execve_info;
+    struct ProcessPool *pool;
+    struct Process *next_free;  /* In the pool's free list */
 };
 
 #define PROCSTAT_FREE       0   /* unallocated entry in table */
@@ -63,23 +121,38 @@ struct Process {
 #define PROCFLAG_EXECD      1   /* Process is coming out of execve */
 #define PROCFLAG_FORKING    2   /* Process is spawning another with
                                  * fork/vfork/clone */
+#define PROCFLAG_FULLTRACE  4   /* In preload mode, process doesn't have the
+                                 * library and stops on every syscall */
+#define PROCFLAG_SEIZED     8   /* Was handed to this tracer thread, and
+                                 * has yet to get the SIGCONT sent by
+                                 * shard_adopt() */
 
-/* FIXME : This is only exposed because of execve() workaround */
-extern struct Process **processes;
-extern size_t processes_size;
 
+void trace_resume(const struct Process *process, int signum);
+
+/* Resumes a process that just got attached, or that is coming out of a
+ * syscall. In sharded mode, it might be handed to another tracer thread
+ * instead, and freed. */
+int trace_continue(struct Process *process);
 
 struct Process *trace_find_process(pid_t tid);
 
-struct Process *trace_get_empty_process(void);
+struct Process *trace_get_empty_process(pid_t tid);
+
+void trace_set_status(struct Process *process, int status);
 
 struct ThreadGroup *trace_new_threadgroup(pid_t tgid, char *wd);
 
+void trace_set_threadgroup(struct Process *process,
+                           struct ThreadGroup *threadgroup);
+
 void trace_free_process(struct Process *process);
 
 void trace_count_processes(unsigned int *p_nproc, unsigned int *p_unknown);
 
-int trace_add_files_from_proc(unsigned int process, pid_t tid,
-                              const char *binary);
+/* Reads the paths of the files mapped in a process from /proc/<tid>/maps,
+ * skipping consecutive duplicates. Returns them as consecutive strings
+ * followed by an empty string, to be free()d, or NULL on error. */
+char *trace_read_mapped_files(pid_t tid);
 
 #endif
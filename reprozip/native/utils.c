@@ -11,9 +11,10 @@
 #include "config.h"
 #include "database.h"
 #include "log.h"
+#include "stats.h"
 
 
-extern int trace_verbosity;
+extern __thread int trace_verbosity;
 
 
 unsigned int flags2mode(int flags)
@@ -101,56 +102,269 @@ char *get_wd(void)
     }
 }
 
-char *read_line(char *buffer, size_t *size, FILE *fp)
+struct PathType {
+    char *name;                 /* NULL if the slot is empty */
+    unsigned int hash;
+    int is_dir;                 /* -1 if forgotten */
+};
+
+static __thread struct PathType *path_types = NULL;
+static __thread size_t path_types_size, path_types_count;
+static __thread unsigned long path_types_hits, path_types_misses;
+
+static unsigned int path_hash(const char *pathname)
+{
+    /* FNV-1a */
+    unsigned int hash = 2166136261u;
+    for(; *pathname; ++pathname)
+        hash = (hash ^ (unsigned char)*pathname) * 16777619u;
+    return hash;
+}
+
+static struct PathType *path_type_slot(const char *pathname,
+                                       unsigned int hash)
 {
-    size_t pos = 0;
-    if(buffer == NULL)
+    size_t mask = path_types_size - 1;
+    size_t i = hash & mask;
+    while(path_types[i].name != NULL
+     && (path_types[i].hash != hash
+      || strcmp(path_types[i].name, pathname) != 0))
+        i = (i + 1) & mask;
+    return &path_types[i];
+}
+
+static int lstat_is_dir(const char *pathname)
+{
+    struct stat buf;
+    if(lstat(pathname, &buf) != 0)
     {
-        *size = 4096;
-        buffer = malloc(*size);
+        if(trace_verbosity >= 1)
+        {
+            /* LCOV_EXCL_START : shouldn't happen because a tracer process just
+             * accessed it */
+            log_error(0, "error stat()ing %s: %s", pathname, strerror(errno));
+            /* LCOV_EXCL_END */
+        }
+        return -1;
     }
-    for(;;)
+    return S_ISDIR(buf.st_mode)?1:0;
+}
+
+int path_is_dir(const char *pathname)
+{
+    unsigned int hash = path_hash(pathname);
+    struct PathType *entry;
+    int is_dir;
+    if(path_types == NULL)
+    {
+        path_types_size = 1024;
+        path_types_count = 0;
+        path_types = calloc(path_types_size, sizeof(*path_types));
+    }
+    entry = path_type_slot(pathname, hash);
+    if(entry->name != NULL && entry->is_dir != -1)
     {
-        char c;
+        ++path_types_hits;
+        return entry->is_dir;
+    }
+    ++path_types_misses;
+    is_dir = lstat_is_dir(pathname);
+    if(is_dir == -1)
+        return 0; /* Don't cache failures, the path might get created */
+    if(entry->name == NULL)
+    {
+        if((path_types_count + 1) * 2 > path_types_size)
         {
-            int t = getc(fp);
-            if(t == EOF)
-            {
-                free(buffer);
-                return NULL;
-            }
-            c = t;
+            struct PathType *old = path_types;
+            size_t i, old_size = path_types_size;
+            path_types_size *= 2;
+            path_types = calloc(path_types_size, sizeof(*path_types));
+            for(i = 0; i < old_size; ++i)
+                if(old[i].name != NULL)
+                    *path_type_slot(old[i].name, old[i].hash) = old[i];
+            free(old);
+            entry = path_type_slot(pathname, hash);
         }
-        if(c == '\n')
+        entry->name = strdup(pathname);
+        entry->hash = hash;
+        ++path_types_count;
+    }
+    entry->is_dir = is_dir;
+    return is_dir;
+}
+
+void forget_path_type(const char *pathname, int subtree)
+{
+    if(path_types == NULL)
+        return;
+    /* Entries are never removed, so the probe sequences stay intact */
+    if(!subtree)
+    {
+        struct PathType *entry = path_type_slot(pathname,
+                                                path_hash(pathname));
+        if(entry->name != NULL)
+            entry->is_dir = -1;
+    }
+    else
+    {
+        size_t i, len = strlen(pathname);
+        for(i = 0; i < path_types_size; ++i)
         {
-            buffer[pos] = '\0';
-            return buffer;
+            const char *name = path_types[i].name;
+            if(name != NULL && strncmp(name, pathname, len) == 0
+             && (name[len] == '\0' || name[len] == '/'))
+                path_types[i].is_dir = -1;
         }
-        else
+    }
+}
+
+void path_type_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = path_types_hits;
+    *misses = path_types_misses;
+}
+
+void clear_path_type_cache(void)
+{
+    size_t i;
+    if(path_types != NULL)
+    {
+        for(i = 0; i < path_types_size; ++i)
+            free(path_types[i].name);
+        free(path_types);
+        path_types = NULL;
+    }
+    stats_count(STAT_PATH_TYPE_HITS, path_types_hits);
+    stats_count(STAT_PATH_TYPE_MISSES, path_types_misses);
+    path_types_hits = path_types_misses = 0;
+}
+
+struct PathTrie {
+    const char *component;      /* Not NUL-terminated */
+    size_t len;
+    int ignored;
+    struct PathTrie *children;
+    struct PathTrie *next;      /* Next sibling */
+    char *root;                 /* The string component points into */
+};
+
+static __thread struct PathTrie *ignored_paths = NULL;
+
+/* Skips slashes, then returns the length of the next path component */
+static const char *path_component(const char *pathname, size_t *len)
+{
+    while(*pathname == '/')
+        ++pathname;
+    *len = strcspn(pathname, "/");
+    return pathname;
+}
+
+static struct PathTrie *new_trie_node(const char *component, size_t len)
+{
+    struct PathTrie *node = malloc(sizeof(*node));
+    node->component = component;
+    node->len = len;
+    node->ignored = 0;
+    node->children = NULL;
+    node->next = NULL;
+    node->root = NULL;
+    return node;
+}
+
+int add_ignored_path(const char *root)
+{
+    struct PathTrie *node;
+    const char *component;
+    size_t len;
+    char *copy;
+    if(root[0] != '/')
+        return -1;
+    if(ignored_paths == NULL)
+        ignored_paths = new_trie_node(NULL, 0);
+    node = ignored_paths;
+    copy = strdup(root);
+    component = path_component(copy, &len);
+    while(len > 0)
+    {
+        struct PathTrie *child;
+        if(len == 2 && component[0] == '.' && component[1] == '.')
+        {
+            free(copy);
+            return -1;
+        }
+        if(len != 1 || component[0] != '.')
         {
-            if(pos + 1 >= *size)
+            for(child = node->children; child != NULL; child = child->next)
+                if(child->len == len
+                 && memcmp(child->component, component, len) == 0)
+                    break;
+            if(child == NULL)
             {
-                *size <<= 2;
-                buffer = realloc(buffer, *size);
+                child = new_trie_node(component, len);
+                /* The first node created for a root owns the copy */
+                if(copy != NULL)
+                {
+                    child->root = copy;
+                    copy = NULL;
+                }
+                child->next = node->children;
+                node->children = child;
             }
-            buffer[pos++] = c;
+            node = child;
         }
+        component = path_component(component + len, &len);
     }
+    node->ignored = 1;
+    free(copy);
+    return 0;
 }
 
-int path_is_dir(const char *pathname)
+static void free_trie(struct PathTrie *node)
 {
-    struct stat buf;
-    if(lstat(pathname, &buf) != 0)
+    while(node != NULL)
     {
-        if(trace_verbosity >= 1)
+        struct PathTrie *next = node->next;
+        free_trie(node->children);
+        free(node->root);
+        free(node);
+        node = next;
+    }
+}
+
+void clear_ignored_paths(void)
+{
+    free_trie(ignored_paths);
+    ignored_paths = NULL;
+}
+
+int path_is_ignored(const char *pathname)
+{
+    const struct PathTrie *node = ignored_paths;
+    const char *component, *p;
+    size_t len;
+    if(node == NULL || pathname[0] != '/')
+        return 0;
+    /* Recorded paths are not canonical; don't try to resolve ".." */
+    for(p = pathname; (p = strstr(p, "..")) != NULL; p += 2)
+        if(p[-1] == '/' && (p[2] == '/' || p[2] == '\0'))
+            return 0;
+    component = path_component(pathname, &len);
+    while(!node->ignored)
+    {
+        const struct PathTrie *child;
+        if(len == 0)
+            return 0;
+        if(len != 1 || component[0] != '.')
         {
-            /* LCOV_EXCL_START : shouldn't happen because a tracer process just
-             * accessed it */
-            log_error(0, "error stat()ing %s: %s", pathname, strerror(errno));
-            /* LCOV_EXCL_END */
+            for(child = node->children; child != NULL; child = child->next)
+                if(child->len == len
+                 && memcmp(child->component, component, len) == 0)
+                    break;
+            if(child == NULL)
+                return 0;
+            node = child;
         }
-        return 0;
+        component = path_component(component + len, &len);
     }
-    return S_ISDIR(buf.st_mode)?1:0;
+    return 1;
 }
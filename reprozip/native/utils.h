@@ -15,8 +15,25 @@ char *abspath(const char *wd, const char *path);
 
 char *get_wd(void);
 
-char *read_line(char *buffer, size_t *size, FILE *fp);
-
+/* The results of path_is_dir() are cached. The cache only knows about the
+ * changes that the tracer sees, so forget_path_type() should be called
+ * whenever a path might have been created, replaced or renamed; if subtree is
+ * set, the paths under it are forgotten as well. */
 int path_is_dir(const char *pathname);
 
+void forget_path_type(const char *pathname, int subtree);
+
+void path_type_cache_stats(unsigned long *hits, unsigned long *misses);
+
+void clear_path_type_cache(void);
+
+/* Ignored path roots: accesses to these paths, or paths under them, are not
+ * recorded. They are kept in a trie with one node per path component.
+ * add_ignored_path() fails if root is not absolute or contains "..". */
+int add_ignored_path(const char *root);
+
+void clear_ignored_paths(void);
+
+int path_is_ignored(const char *pathname);
+
 #endif
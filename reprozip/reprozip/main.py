@@ -21,6 +21,7 @@ import locale
 import logging
 import os
 from rpaths import Path
+import shlex
 import sqlite3
 import string
 import sys
@@ -175,6 +176,76 @@ def print_db(database):
     conn.close()
 
 
+def print_tracer_stats(database):
+    """Prints out the tracer's own counters for the last run in a trace.
+    """
+    if PY3:
+        # On PY3, connect() only accepts unicode
+        conn = sqlite3.connect(str(database))
+    else:
+        conn = sqlite3.connect(database.path)
+    conn.text_factory = lambda x: unicode_(x, 'utf-8', 'replace')
+
+    schema_version, = conn.execute('PRAGMA user_version;').fetchone()
+    run_id = None
+    if schema_version >= 4:
+        run_id, = conn.execute(
+            '''
+            SELECT max(run_id) FROM tracer_stats;
+            ''').fetchone()
+    if run_id is None:
+        print("\nNo tracer statistics in %s" % database)
+        conn.close()
+        return
+
+    counters = {}
+    for r_name, r_count, r_time in conn.execute(
+            '''
+            SELECT name, count, time
+            FROM tracer_stats
+            WHERE run_id = ? AND syscall IS NULL;
+            ''',
+            (run_id,)):
+        counters[r_name] = r_count, r_time or 0
+    print("\nTracer statistics (run %d):" % run_id)
+    for name, label in [('wait', "waiting for processes"),
+                        ('registers', "reading registers"),
+                        ('database', "recording events")]:
+        count, time = counters.get(name, (0, 0))
+        print("    %-24s %10d calls %10.2fms" % (label, count, time * 1e-6))
+    for name, label in [('path_type_cache', "file type cache"),
+                        ('exec_cache', "executed files cache")]:
+        hits = counters.get(name + '_hits', (0, 0))[0]
+        misses = counters.get(name + '_misses', (0, 0))[0]
+        print("    %-24s %10d hits  %10d misses" % (label, hits, misses))
+
+    syscalls = conn.execute(
+        '''
+        SELECT syscall,
+               sum(CASE WHEN name = 'syscall_entry' THEN count ELSE 0 END),
+               sum(CASE WHEN name = 'syscall_exit' THEN count ELSE 0 END),
+               sum(time)
+        FROM tracer_stats
+        WHERE run_id = ? AND syscall IS NOT NULL
+        GROUP BY syscall
+        ORDER BY sum(time) DESC, syscall;
+        ''',
+        (run_id,))
+    print("\nSyscall stops (time in the handlers, including recording):")
+    header = "+------------------------+------------+------------+------------+"
+    print(header)
+    print("| syscall                |   entries  |    exits   |    time    |")
+    print(header)
+    for r_syscall, r_entries, r_exits, r_time in syscalls:
+        f_syscall = " {0: <22s} ".format(r_syscall)
+        f_entries = "{0: 11d} ".format(r_entries)
+        f_exits = "{0: 11d} ".format(r_exits)
+        f_time = "{0: 9.2f}ms ".format(r_time * 1e-6)
+        print('|'.join(('', f_syscall, f_entries, f_exits, f_time, '')))
+    print(header)
+    conn.close()
+
+
 def testrun(args):
     """testrun subcommand.
 
@@ -192,8 +263,30 @@ def testrun(args):
             argv = args.cmdline
         logging.debug("Starting tracer, binary=%r, argv=%r",
                       args.cmdline[0], argv)
-        c = _pytracer.execute(args.cmdline[0], argv, database.path,
-                              args.verbosity)
+        options = dict(seccomp=args.seccomp)
+        if args.preload:
+            options['preload'] = reprozip.tracer.trace.preload_library()
+        if args.fanotify:
+            options['fanotify'] = args.fanotify
+        if args.tracer_threads > 1:
+            options['tracer_threads'] = args.tracer_threads
+        if args.io_volume:
+            options['io_volume'] = True
+        if args.event_log:
+            fd, eventlog = Path.tempfile(prefix='reprozip_',
+                                         suffix='.eventlog')
+            os.close(fd)
+            try:
+                c = _pytracer.execute(args.cmdline[0], argv, eventlog.path,
+                                      args.verbosity, event_log=True,
+                                      **options)
+                _pytracer.convert_event_log(eventlog.path, database.path,
+                                            args.verbosity)
+            finally:
+                eventlog.remove()
+        else:
+            c = _pytracer.execute(args.cmdline[0], argv, database.path,
+                                  args.verbosity, **options)
         print("\n\n-----------------------------------------------------------"
               "--------------------")
         print_db(database)
@@ -225,15 +318,80 @@ def trace(args):
         append = False
     else:
         append = None
-    reprozip.tracer.trace.trace(args.cmdline[0],
-                                argv,
-                                Path(args.dir),
-                                append,
-                                args.verbosity)
+    if args.tracer_threads > 1 and (args.preload or args.fanotify):
+        logging.critical("You can't use --tracer-threads with --preload or "
+                         "--fanotify")
+        sys.exit(2)
+    if args.io_volume and (args.preload or args.fanotify):
+        logging.critical("You can't use --io-volume with --preload or "
+                         "--fanotify")
+        sys.exit(2)
+    if args.parallel is not None:
+        trace_parallel(args, append)
+        return
+    traced = reprozip.tracer.trace.trace(
+        args.cmdline[0],
+        argv,
+        Path(args.dir),
+        append,
+        args.verbosity,
+        seccomp=args.seccomp,
+        event_log=args.event_log,
+        preload=args.preload,
+        fanotify=args.fanotify,
+        live_processing=args.live_processing,
+        sort_packages=args.identify_packages,
+        tracer_threads=args.tracer_threads,
+        io_volume=args.io_volume)
     reprozip.tracer.trace.write_configuration(Path(args.dir),
                                               args.identify_packages,
                                               args.find_inputs_outputs,
-                                              overwrite=False)
+                                              overwrite=False,
+                                              traced=traced)
+    if args.stats:
+        print_tracer_stats(Path(args.dir) / 'trace.sqlite3')
+
+
+def trace_parallel(args, append):
+    """trace --parallel.
+
+    Reads the command-lines from the file, one per line, and traces them at
+    the same time into numbered subdirectories of the trace directory.
+    """
+    if args.cmdline:
+        logging.critical("You can't give a command-line with --parallel")
+        sys.exit(2)
+    if args.live_processing:
+        logging.critical("You can't use --live-processing with --parallel")
+        sys.exit(2)
+    commands = []
+    with open(args.parallel, 'rb') as fp:
+        for line in fp:
+            line = line.decode('utf-8').strip()
+            if line and not line.startswith('#'):
+                commands.append(shlex.split(line))
+    if not commands:
+        logging.critical("No command-line in %s", args.parallel)
+        sys.exit(2)
+    directories = reprozip.tracer.trace.trace_parallel(
+        commands,
+        Path(args.dir),
+        append,
+        args.verbosity,
+        jobs=args.jobs,
+        seccomp=args.seccomp,
+        event_log=args.event_log,
+        preload=args.preload,
+        fanotify=args.fanotify,
+        tracer_threads=args.tracer_threads,
+        io_volume=args.io_volume)
+    for directory in directories:
+        reprozip.tracer.trace.write_configuration(directory,
+                                                  args.identify_packages,
+                                                  args.find_inputs_outputs,
+                                                  overwrite=False)
+        if args.stats:
+            print_tracer_stats(directory / 'trace.sqlite3')
 
 
 def reset(args):
@@ -310,6 +468,35 @@ def main():
 
     # Parses command-line
 
+    # Tracing options
+    def add_trace_options(opt):
+        opt.add_argument(
+            '--seccomp', action='store_true', default=False,
+            help="only stop the program on the system calls that are "
+            "recorded, using a seccomp-BPF filter (faster, needs Linux 4.8)")
+        opt.add_argument(
+            '--event-log', action='store_true', default=False,
+            help="record to a binary log file while the program runs, and "
+            "only write the database once it is done (faster)")
+        opt.add_argument(
+            '--preload', action='store_true', default=False,
+            help="inject a library in dynamically-linked programs that "
+            "reports file accesses without stopping them (fastest, might "
+            "miss accesses not made through the C library)")
+        opt.add_argument(
+            '--fanotify', action='append', metavar='PATH',
+            help="record the files opened on the mount holding PATH using "
+            "fanotify rather than by stopping the program (needs root, can be "
+            "repeated)")
+        opt.add_argument(
+            '--tracer-threads', type=int, default=1, metavar='N',
+            help="trace the program from N threads, which helps with "
+            "programs running many processes at once (default: 1)")
+        opt.add_argument(
+            '--io-volume', action='store_true', default=False,
+            help="count the bytes read and written through each opened file "
+            "(with --seccomp, only the calls of at least 64 KiB are counted)")
+
     # General options
     def add_options(opt):
         opt.add_argument('--version', action='version',
@@ -361,6 +548,24 @@ def main():
     parser_trace.add_argument(
         '-w', '--overwrite', action='store_true', dest='overwrite',
         help="overwrite the previous trace, don't add to it")
+    add_trace_options(parser_trace)
+    parser_trace.add_argument(
+        '--parallel', metavar='FILE',
+        help="trace the command-lines listed in FILE, one per line, at the "
+        "same time, each into its own numbered subdirectory of the trace "
+        "directory")
+    parser_trace.add_argument(
+        '--live-processing', action='store_true', default=False,
+        help="sort out the files and their packages while the program runs, "
+        "so the configuration is written sooner after it exits (uses another "
+        "CPU)")
+    parser_trace.add_argument(
+        '--stats', action='store_true', default=False,
+        help="print where the tracer spent its time once the program is done")
+    parser_trace.add_argument(
+        '-j', '--jobs', type=int, default=None,
+        help="number of programs traced at once with --parallel (default: "
+        "number of CPUs)")
     parser_trace.add_argument('cmdline', nargs=argparse.REMAINDER,
                               help="command-line to run under trace")
     parser_trace.set_defaults(func=trace)
@@ -374,6 +579,7 @@ def main():
         '-a',
         dest='arg0',
         help="argument 0 to program, if different from program path")
+    add_trace_options(parser_testrun)
     parser_testrun.add_argument('cmdline', nargs=argparse.REMAINDER)
     parser_testrun.set_defaults(func=testrun)
 
@@ -408,7 +614,8 @@ def main():
         parser.print_help(sys.stderr)
         sys.exit(2)
     setup_usage_report('reprozip', reprozip_version)
-    if 'cmdline' in args and not args.cmdline:
+    if ('cmdline' in args and not args.cmdline and
+            getattr(args, 'parallel', None) is None):
         parser.error("missing command-line")
     record_usage(command=args.selected_command)
     try:
@@ -31,14 +31,43 @@ system_dirs = ('/bin', '/etc', '/lib', '/sbin', '/usr', '/var')
 class PkgManager(object):
     """Base class for package identifiers.
 
-    Subclasses should provide either `search_for_files` or `search_for_file`
-    which actually identifies the package for a file.
+    Subclasses should provide `_get_packages_for_file` which actually
+    identifies the package for a file, and `_create_package`.
     """
     def __init__(self):
         # Files that were not part of a package
         self.unknown_files = set()
         # All the packages identified, with their `files` attribute set
         self.packages = {}
+        # Results of the lookups, which can be made ahead of time
+        self._file_packages = {}
+        self._package_info = {}
+
+    def prefetch(self, paths):
+        """Looks up the packages of these files ahead of time.
+
+        This can be called from another thread while the experiment runs;
+        `search_for_files` then uses the results.
+        """
+        for path in paths:
+            if self._is_system_file(path):
+                for pkgname in self._lookup_file(path) or ():
+                    self._lookup_package(pkgname)
+
+    def _lookup_file(self, path):
+        try:
+            return self._file_packages[path]
+        except KeyError:
+            pkgnames = self._file_packages[path] = \
+                self._get_packages_for_file(path)
+            return pkgnames
+
+    def _lookup_package(self, pkgname):
+        try:
+            return self._package_info[pkgname]
+        except KeyError:
+            pkg = self._package_info[pkgname] = self._create_package(pkgname)
+            return pkg
 
     def filter_files(self, files):
         seen_files = set()
@@ -52,7 +81,7 @@ class PkgManager(object):
         nb_pkg_files = 0
 
         for f in self.filter_files(files):
-            pkgnames = self._get_packages_for_file(f.path)
+            pkgnames = self._lookup_file(f.path)
 
             # Stores the file
             if not pkgnames:
@@ -63,7 +92,7 @@ class PkgManager(object):
                     if pkgname in self.packages:
                         pkgs.append(self.packages[pkgname])
                     else:
-                        pkg = self._create_package(pkgname)
+                        pkg = self._lookup_package(pkgname)
                         if pkg is not None:
                             self.packages[pkgname] = pkg
                             pkgs.append(self.packages[pkgname])
@@ -89,13 +118,17 @@ class PkgManager(object):
             return True
 
         # If it's not in a system directory, no need to look for it
-        if (f.path.lies_under('/usr/local') or
-                not any(f.path.lies_under(c) for c in system_dirs)):
+        if not self._is_system_file(f.path):
             self.unknown_files.add(f)
             return True
 
         return False
 
+    @staticmethod
+    def _is_system_file(path):
+        return (not path.lies_under('/usr/local') and
+                any(path.lies_under(c) for c in system_dirs))
+
     def _get_packages_for_file(self, filename):
         raise NotImplementedError
 
@@ -106,10 +139,19 @@ class PkgManager(object):
 class DpkgManager(PkgManager):
     """Package identifier for deb-based systems (Debian, Ubuntu).
     """
-    def search_for_files(self, files):
-        # Make a set of all the requested files
-        requested = dict((f.path, f) for f in self.filter_files(files))
-        found = {}  # {path: pkgname}
+    description = "Debian packages"
+
+    def __init__(self):
+        PkgManager.__init__(self)
+        self._index = None
+
+    def _load_index(self):
+        """Reads the files of all the packages.
+
+        Instead of querying each file using `dpkg -S`, we read all the list
+        files once ourselves since it is faster.
+        """
+        index = {}  # {path: pkgname, or None if in several packages}
 
         # Process /var/lib/dpkg/info/*.list
         for listfile in Path('/var/lib/dpkg/info').listdir():
@@ -126,44 +168,22 @@ class DpkgManager(PkgManager):
                     if l[-1:] == b'\n':
                         l = l[:-1]
                     path = Path(l)
-                    # If it's one of the requested paths
-                    if path in requested:
-                        # If we had assigned it to a package already, undo
-                        if path in found:
-                            found[path] = None
-                        # Else assign to the package
-                        else:
-                            found[path] = pkgname
+                    # If we had assigned it to a package already, undo
+                    if path in index:
+                        index[path] = None
+                    # Else assign to the package
+                    else:
+                        index[path] = pkgname
                     l = fp.readline()
-
-        # Remaining files are not from packages
-        self.unknown_files.update(
-            f for f in files
-            if f.path in requested and found.get(f.path) is None)
-
-        nb_pkg_files = 0
-
-        for path, pkgname in iteritems(found):
-            if pkgname is None:
-                continue
-            if pkgname in self.packages:
-                package = self.packages[pkgname]
-            else:
-                package = self._create_package(pkgname)
-                self.packages[pkgname] = package
-            package.add_file(requested.pop(path))
-            nb_pkg_files += 1
-
-        logging.info("%d packages with %d files, and %d other files",
-                     len(self.packages),
-                     nb_pkg_files,
-                     len(self.unknown_files))
+        return index
 
     def _get_packages_for_file(self, filename):
-        # This method is no longer used for dpkg: instead of querying each file
-        # using `dpkg -S`, we read all the list files once ourselves since it
-        # is faster
-        assert False
+        if self._index is None:
+            self._index = self._load_index()
+        pkgname = self._index.get(filename)
+        if pkgname is None:
+            return None
+        return [pkgname]
 
     def _create_package(self, pkgname):
         p = subprocess.Popen(['dpkg-query',
@@ -198,6 +218,8 @@ class DpkgManager(PkgManager):
 class RpmManager(PkgManager):
     """Package identifier for rpm-based systems (Fedora, CentOS).
     """
+    description = "RPM packages"
+
     def _get_packages_for_file(self, filename):
         p = subprocess.Popen(['rpm', '-qf', filename.path,
                               '--qf', '%{NAME}'],
@@ -226,21 +248,34 @@ class RpmManager(PkgManager):
             return None
 
 
-def identify_packages(files):
-    """Organizes the files, using the distribution's package manager.
+def get_package_manager():
+    """Returns the package identifier for this distribution, or None.
     """
     distribution = platform.linux_distribution()[0].lower()
     if distribution in ('debian', 'ubuntu'):
-        logging.info("Identifying Debian packages for %d files...", len(files))
-        manager = DpkgManager()
+        return DpkgManager()
     elif (distribution in ('centos', 'centos linux',
                            'fedora', 'scientific linux') or
             distribution.startswith('red hat')):
-        logging.info("Identifying RPM packages for %d files...", len(files))
-        manager = RpmManager()
+        return RpmManager()
     else:
+        return None
+
+
+def identify_packages(files, manager=None):
+    """Organizes the files, using the distribution's package manager.
+
+    :param manager: The package identifier to use, which might have looked up
+        some of the files already (see :meth:`PkgManager.prefetch`). By
+        default, a new one is created for this distribution.
+    """
+    if manager is None:
+        manager = get_package_manager()
+    if manager is None:
         logging.info("Unknown distribution, can't identify packages")
         return files, []
+    logging.info("Identifying %s for %d files...", manager.description,
+                 len(files))
 
     begin = time.time()
     manager.search_for_files(files)
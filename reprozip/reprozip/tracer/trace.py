@@ -14,23 +14,33 @@ from __future__ import division, print_function, unicode_literals
 from collections import defaultdict
 from itertools import count
 import logging
+import multiprocessing
+from multiprocessing.pool import ThreadPool
 import os
 from pkg_resources import iter_entry_points
 import platform
 from rpaths import Path
 import sqlite3
 import sys
+import threading
+import time
 
 from reprozip import __version__ as reprozip_version
 from reprozip import _pytracer
 from reprozip.common import File, InputOutputFile, load_config, save_config, \
     FILE_READ, FILE_WRITE, FILE_LINK
 from reprozip.tracer.linux_pkgs import magic_dirs, system_dirs, \
-    identify_packages
+    get_package_manager, identify_packages
 from reprozip.utils import PY3, izip, iteritems, itervalues, \
     unicode_, flatten, UniqueNames, hsize, normalize_path, find_all_links
 
 
+if PY3:
+    import queue
+else:
+    import Queue as queue
+
+
 class TracedFile(File):
     """Override of `~reprozip.common.File` that reads stats from filesystem.
 
@@ -57,18 +67,24 @@ class TracedFile(File):
 
     def __init__(self, path):
         path = Path(path)
-        size = None
+        self.what = None
+        self.runs = defaultdict(lambda: None)
+        File.__init__(self, path, None)
+        self.update_size()
+
+    def update_size(self):
+        """Reads the size of the file, or what it is, from the filesystem.
+        """
+        path = self.path
+        self.size = self.comment = None
         if path.exists():
             if path.is_link():
                 self.comment = "Link to %s" % path.read_link(absolute=True)
             elif path.is_dir():
                 self.comment = "Directory"
             else:
-                size = path.size()
-                self.comment = hsize(size)
-        self.what = None
-        self.runs = defaultdict(lambda: None)
-        File.__init__(self, path, size)
+                self.size = path.size()
+                self.comment = hsize(self.size)
 
     def read(self, run):
         if self.what is None:
@@ -100,146 +116,310 @@ def run_filter_plugins(files, input_files):
         func(files=files, input_files=input_files)
 
 
-def get_files(conn):
-    """Find all the files used by the experiment by reading the trace.
+class TracedFiles(object):
+    """Builds the list of files used by the experiment from its events.
+
+    The events can come from the trace database (see :func:`get_files`) or
+    from the tracer while it runs (see :class:`EventProcessor`).
+
+    :param live: Whether the events are received while the experiment runs;
+        the size of the files is then read again once it is done.
     """
-    files = {}
-    access_files = [set()]
-
-    # Finds run timestamps, so we can sort input/output files by run
-    proc_cursor = conn.cursor()
-    executions = proc_cursor.execute(
-        '''
-        SELECT timestamp
-        FROM processes
-        WHERE parent ISNULL
-        ORDER BY id;
-        ''')
-    run_timestamps = [r_timestamp for r_timestamp, in executions][1:]
-    proc_cursor.close()
-
-    # Adds dynamic linkers
-    for libdir in (Path('/lib'), Path('/lib64')):
-        if libdir.exists():
-            for linker in libdir.listdir('*ld-linux*'):
-                for filename in find_all_links(linker, True):
-                    if filename not in files:
-                        f = TracedFile(filename)
-                        f.read(None)
-                        files[f.path] = f
-
-    # Loops on executed files, and opened files, at the same time
-    cur = conn.cursor()
-    rows = cur.execute(
-        '''
-        SELECT 'exec' AS event_type, name, NULL AS mode, timestamp
-        FROM executed_files
-        UNION ALL
-        SELECT 'open' AS event_type, name, mode, timestamp
-        FROM opened_files
-        ORDER BY timestamp;
-        ''')
-    executed = set()
-    run = 0
-    for event_type, r_name, r_mode, r_timestamp in rows:
+    def __init__(self, live=False):
+        self.live = live
+        self.files = {}
+        self.access_files = [set()]
+        self.executed = set()
+        self.run = 0
+        # Paths of the TracedFile objects as they get created
+        self.created = []
+
+        # Adds dynamic linkers
+        for libdir in (Path('/lib'), Path('/lib64')):
+            if libdir.exists():
+                for linker in libdir.listdir('*ld-linux*'):
+                    for filename in find_all_links(linker, True):
+                        if filename not in self.files:
+                            self._new_file(filename).read(None)
+
+    def _new_file(self, path):
+        f = TracedFile(path)
+        self.files[f.path] = f
+        self.created.append(f.path)
+        return f
+
+    def new_run(self):
+        """Starts recording the events of the next run.
+        """
+        self.access_files.append(set())
+        self.run += 1
+
+    def add(self, event_type, r_name, r_mode):
+        """Records an event.
+
+        :param event_type: Either ``'exec'`` or ``'open'``.
+        :param r_name: The :class:`~rpaths.Path` of the file.
+        :param r_mode: The mode of the access (``FILE_READ``, ...)
+        """
         if event_type == 'exec':
             r_mode = FILE_READ
-        r_name = Path(normalize_path(r_name))
-
-        # Stays on the current run
-        while run_timestamps and r_timestamp > run_timestamps[0]:
-            del run_timestamps[0]
-            access_files.append(set())
-            run += 1
+        files = self.files
+        run = self.run
 
         # Adds symbolic links as read files
         for filename in find_all_links(r_name.parent if r_mode & FILE_LINK
                                        else r_name, False):
             if filename not in files:
-                f = TracedFile(filename)
-                f.read(run)
-                files[f.path] = f
+                self._new_file(filename).read(run)
         # Go to final target
         if not r_mode & FILE_LINK:
             r_name = r_name.resolve()
         if event_type == 'exec':
-            executed.add(r_name)
+            self.executed.add(r_name)
         if r_name not in files:
-            f = TracedFile(r_name)
-            files[f.path] = f
+            f = self._new_file(r_name)
         else:
             f = files[r_name]
         if r_mode & FILE_WRITE:
             f.write(run)
             # Mark the parent directory as read
             if r_name.parent not in files:
-                fp = TracedFile(r_name.parent)
-                fp.read(run)
-                files[fp.path] = fp
+                self._new_file(r_name.parent).read(run)
         elif r_mode & FILE_READ:
             f.read(run)
 
         # Identifies input files
-        if r_name.is_file() and r_name not in executed:
-            access_files[-1].add(f)
-    cur.close()
+        if r_name.is_file() and r_name not in self.executed:
+            self.access_files[-1].add(f)
+
+    def load(self, conn):
+        """Records the events from a trace database, one run after the other.
+        """
+        # Finds run timestamps, so we can sort input/output files by run
+        proc_cursor = conn.cursor()
+        executions = proc_cursor.execute(
+            '''
+            SELECT timestamp
+            FROM processes
+            WHERE parent ISNULL
+            ORDER BY id;
+            ''')
+        run_timestamps = [r_timestamp for r_timestamp, in executions][1:]
+        proc_cursor.close()
+
+        # Loops on executed files, and opened files, at the same time
+        cur = conn.cursor()
+        schema_version, = cur.execute('PRAGMA user_version;').fetchone()
+        if schema_version >= 1:
+            # Paths are interned; decode each of them only once
+            paths = dict((r_id, Path(normalize_path(r_name)))
+                         for r_id, r_name in cur.execute(
+                             'SELECT id, name FROM paths;'))
+            rows = cur.execute(
+                '''
+                SELECT 'exec' AS event_type, name, NULL AS path, NULL AS mode,
+                       timestamp
+                FROM executed_files
+                UNION ALL
+                SELECT 'open' AS event_type, NULL AS name, path, mode,
+                       timestamp
+                FROM file_accesses
+                ORDER BY timestamp;
+                ''')
+        else:
+            paths = {}
+            rows = cur.execute(
+                '''
+                SELECT 'exec' AS event_type, name, NULL AS path, NULL AS mode,
+                       timestamp
+                FROM executed_files
+                UNION ALL
+                SELECT 'open' AS event_type, name, NULL AS path, mode,
+                       timestamp
+                FROM opened_files
+                ORDER BY timestamp;
+                ''')
+        for event_type, r_name, r_path, r_mode, r_timestamp in rows:
+            if r_path is not None:
+                r_name = paths[r_path]
+            else:
+                r_name = Path(normalize_path(r_name))
+
+            # Stays on the current run
+            while run_timestamps and r_timestamp > run_timestamps[0]:
+                del run_timestamps[0]
+                self.new_run()
+
+            self.add(event_type, r_name, r_mode)
+        cur.close()
+
+    def finish(self):
+        """Sorts out the files once all the events have been recorded.
+
+        :returns: The set of files to pack, the list of input files and the
+            list of output files for each run.
+        """
+        files = self.files
+        access_files = self.access_files
+        executed = self.executed
+
+        if self.live:
+            # Files may have changed since they were first seen
+            for fi in itervalues(files):
+                fi.update_size()
+
+        # Further filters input files
+        inputs = [[fi.path
+                   for fi in lst
+                   # Input files are regular files,
+                   if fi.path.is_file() and
+                   # ONLY_READ,
+                   fi.runs[r] == TracedFile.ONLY_READ and
+                   # not executable,
+                   # FIXME : currently disabled; only remove executed files
+                   # not fi.path.stat().st_mode & 0b111 and
+                   fi.path not in executed and
+                   # not in a system directory
+                   not any(fi.path.lies_under(m)
+                           for m in magic_dirs + system_dirs)]
+                  for r, lst in enumerate(access_files)]
+
+        # Identify output files
+        outputs = [[fi.path
+                    for fi in lst
+                    # Output files are regular files,
+                    if fi.path.is_file() and
+                    # WRITTEN
+                    fi.runs[r] == TracedFile.WRITTEN and
+                    # not in a system directory
+                    not any(fi.path.lies_under(m)
+                            for m in magic_dirs + system_dirs)]
+                   for r, lst in enumerate(access_files)]
+
+        # Run the list of files through the filter plugins
+        run_filter_plugins(files, inputs)
+
+        # Files removed from plugins should be removed from inputs as well
+        inputs = [[path for path in lst if path in files]
+                  for lst in inputs]
+
+        # Displays a warning for READ_THEN_WRITTEN files
+        read_then_written_files = [
+            fi
+            for fi in itervalues(files)
+            if fi.what == TracedFile.READ_THEN_WRITTEN and
+            not any(fi.path.lies_under(m) for m in magic_dirs)]
+        if read_then_written_files:
+            logging.warning(
+                "Some files were read and then written. We will only pack the "
+                "final version of the file; reproducible experiments "
+                "shouldn't change their input files")
+            logging.info("Paths:\n%s",
+                         ", ".join(unicode_(fi.path)
+                                   for fi in read_then_written_files))
+
+        files = set(
+            fi
+            for fi in itervalues(files)
+            if fi.what != TracedFile.WRITTEN and
+            not any(fi.path.lies_under(m) for m in magic_dirs))
+        return files, inputs, outputs
+
+
+def get_files(conn):
+    """Find all the files used by the experiment by reading the trace.
+    """
+    files = TracedFiles()
+    files.load(conn)
+    return files.finish()
 
-    # Further filters input files
-    inputs = [[fi.path
-               for fi in lst
-               # Input files are regular files,
-               if fi.path.is_file() and
-               # ONLY_READ,
-               fi.runs[r] == TracedFile.ONLY_READ and
-               # not executable,
-               # FIXME : currently disabled; only remove executed files
-               # not fi.path.stat().st_mode & 0b111 and
-               fi.path not in executed and
-               # not in a system directory
-               not any(fi.path.lies_under(m)
-                       for m in magic_dirs + system_dirs)]
-              for r, lst in enumerate(access_files)]
-
-    # Identify output files
-    outputs = [[fi.path
-                for fi in lst
-                # Output files are regular files,
-                if fi.path.is_file() and
-                # WRITTEN
-                fi.runs[r] == TracedFile.WRITTEN and
-                # not in a system directory
-                not any(fi.path.lies_under(m)
-                        for m in magic_dirs + system_dirs)]
-               for r, lst in enumerate(access_files)]
-
-    # Run the list of files through the filter plugins
-    run_filter_plugins(files, inputs)
-
-    # Files removed from plugins should be removed from inputs as well
-    inputs = [[path for path in lst if path in files]
-              for lst in inputs]
-
-    # Displays a warning for READ_THEN_WRITTEN files
-    read_then_written_files = [
-        fi
-        for fi in itervalues(files)
-        if fi.what == TracedFile.READ_THEN_WRITTEN and
-        not any(fi.path.lies_under(m) for m in magic_dirs)]
-    if read_then_written_files:
-        logging.warning(
-            "Some files were read and then written. We will only pack the "
-            "final version of the file; reproducible experiments shouldn't "
-            "change their input files")
-        logging.info("Paths:\n%s",
-                     ", ".join(unicode_(fi.path)
-                               for fi in read_then_written_files))
 
-    files = set(
-        fi
-        for fi in itervalues(files)
-        if fi.what != TracedFile.WRITTEN and not any(fi.path.lies_under(m)
-                                                     for m in magic_dirs))
-    return files, inputs, outputs
+class EventProcessor(object):
+    """Processes the events of a trace while the experiment runs.
+
+    This is given to :func:`_pytracer.execute` as the `events` callback. The
+    events are queued and aggregated from another thread, which also looks
+    up the packages of the files as they show up, so that little is left to
+    do once the experiment is done.
+
+    :param database: Trace database the run is being added to; the previous
+        runs it contains are read first.
+    :param sort_packages: Whether to identify the packages of the files.
+    """
+    def __init__(self, database, sort_packages):
+        self.files = TracedFiles(live=True)
+        self.manager = get_package_manager() if sort_packages else None
+        self.queue = queue.Queue()
+        self.error = None
+        if database.exists():
+            if PY3:
+                # On PY3, connect() only accepts unicode
+                conn = sqlite3.connect(str(database))
+            else:
+                conn = sqlite3.connect(database.path)
+            try:
+                nb_runs, = conn.execute(
+                    '''
+                    SELECT count(*) FROM processes WHERE parent ISNULL;
+                    ''').fetchone()
+                if nb_runs:
+                    self.files.load(conn)
+                    # Some of the runs might not have had events
+                    while self.files.run < nb_runs:
+                        self.files.new_run()
+            finally:
+                conn.close()
+        self.thread = threading.Thread(target=self._process)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def __call__(self, events):
+        self.queue.put(events)
+
+    def _process(self):
+        files = self.files
+        try:
+            while True:
+                self._prefetch()
+                events = self.queue.get()
+                if events is None:
+                    break
+                for event_type, r_name, r_mode in events:
+                    files.add(event_type, Path(normalize_path(r_name)),
+                              r_mode)
+        except Exception as e:
+            logging.debug("Error processing trace events", exc_info=True)
+            self.error = e
+            # Keep the tracer from filling the queue
+            while self.queue.get() is not None:
+                pass
+
+    def _prefetch(self):
+        if self.manager is not None and self.files.created:
+            created, self.files.created = self.files.created, []
+            self.manager.prefetch(created)
+
+    def stop(self):
+        """Waits for the queued events to be processed.
+        """
+        self.queue.put(None)
+        self.thread.join()
+
+    def finish(self):
+        """Waits for the queued events, and sorts out the files.
+
+        :returns: The files to pack, the packages, the list of input files
+            and the list of output files for each run.
+        """
+        self.stop()
+        if self.error is not None:
+            raise self.error
+        files, inputs, outputs = self.files.finish()
+        if self.manager is not None:
+            files, packages = identify_packages(files, self.manager)
+        else:
+            packages = []
+        return files, packages, inputs, outputs
 
 
 def tty_prompt(prompt, chars):
@@ -289,9 +469,108 @@ def tty_prompt(prompt, chars):
             stream.flush()
 
 
-def trace(binary, argv, directory, append, verbosity=1):
+def preload_library():
+    """Returns the path of the library injected by the preload backend.
+
+    It is built alongside the _pytracer extension.
+    """
+    path = os.path.abspath(_pytracer.__file__)
+    dirname, filename = os.path.split(path)
+    return os.path.join(dirname, filename.replace('_pytracer', '_preload', 1))
+
+
+def trace(binary, argv, directory, append, verbosity=1, seccomp=False,
+          event_log=False, preload=False, fanotify=None,
+          live_processing=False, sort_packages=True, tracer_threads=1,
+          io_volume=False):
     """Main function for the trace subcommand.
+
+    :param seccomp: Install a seccomp-BPF filter so that the program only stops
+        on the system calls that get recorded.
+    :param event_log: Record to a binary event log during the run, and only
+        write it to the database afterwards.
+    :param preload: Inject a library in dynamically-linked programs that
+        reports file accesses without stopping them.
+    :param fanotify: List of paths whose mounts are watched with fanotify to
+        record the files the program opens, instead of stopping it.
+    :param live_processing: Sort out the files used by the experiment (and
+        their packages, if `sort_packages` is set) while it runs, see
+        :class:`EventProcessor`. The result is returned, to be passed to
+        :func:`write_configuration`.
+    :param tracer_threads: Number of threads tracing the program, which helps
+        with programs that run many processes at once. Can't be used with
+        `preload` or `fanotify`.
+    :param io_volume: Count the bytes read and written through each opened
+        file. With `seccomp`, only the reads and writes of at least 64 KiB are
+        counted. Can't be used with `preload` or `fanotify`.
+    """
+    warn_system_directory()
+    prepare_directory(directory, append)
+    processor = None
+    if live_processing:
+        processor = EventProcessor(directory / 'trace.sqlite3',
+                                   sort_packages)
+    try:
+        run_trace(binary, argv, directory, verbosity, seccomp=seccomp,
+                  event_log=event_log, preload=preload, fanotify=fanotify,
+                  events=processor, tracer_threads=tracer_threads,
+                  io_volume=io_volume)
+    except Exception:
+        if processor is not None:
+            processor.stop()
+        raise
+    if processor is not None:
+        begin = time.time()
+        traced = processor.finish()
+        logging.debug("Sorting out the files after the run took %f seconds",
+                      time.time() - begin)
+        return traced
+
+
+def trace_parallel(commands, directory, append, verbosity=1, jobs=None,
+                   **options):
+    """Traces several programs at once, each into its own trace.
+
+    The programs are scheduled over `jobs` threads (default: the number of
+    CPUs); the tracer doesn't hold the GIL while it runs. The command at
+    index ``n`` in `commands` is traced into the directory ``directory/n``,
+    where the run is appended if `append` is True (or if the user chooses to
+    when prompted).
+
+    :param commands: List of command-lines (lists of arguments) to trace.
+    :param options: Tracing options, see :func:`trace`.
+    :returns: The list of the trace directories.
     """
+    if jobs is None:
+        jobs = multiprocessing.cpu_count()
+    warn_system_directory()
+    append = prepare_directory(directory, append)
+    directories = []
+    for i in range(len(commands)):
+        subdir = directory / ('%d' % i)
+        if not subdir.exists():
+            subdir.mkdir()
+        elif not append:
+            subdir.rmtree()
+            subdir.mkdir()
+        directories.append(subdir)
+
+    def run(i):
+        logging.info("Running program %d: %s", i, ' '.join(commands[i]))
+        run_trace(commands[i][0], commands[i], directories[i], verbosity,
+                  **options)
+
+    pool = ThreadPool(min(jobs, len(commands)))
+    try:
+        # Using map_async() so that KeyboardInterrupt can get through
+        pool.map_async(run, range(len(commands))).get(1 << 31)
+    finally:
+        pool.close()
+        pool.join()
+    return directories
+
+
+def warn_system_directory():
     cwd = Path.cwd()
     if (any(cwd.lies_under(c) for c in magic_dirs + system_dirs) and
             not cwd.lies_under('/usr/local')):
@@ -300,7 +579,14 @@ def trace(binary, argv, directory, append, verbosity=1):
             "Autodetection of non-system files will probably not work as "
             "intended")
 
-    # Trace directory
+
+def prepare_directory(directory, append):
+    """Creates the trace directory, or handles the existing one.
+
+    :returns: True if the run is to be appended to the existing trace, False if
+        the directory is new or was emptied (`append` might be None, in which
+        case the user is asked).
+    """
     if directory.exists():
         if append is None:
             r = tty_prompt(
@@ -322,20 +608,48 @@ def trace(binary, argv, directory, append, verbosity=1):
             logging.warning(
                 "You can use --overwrite to replace the existing trace "
                 "(or --continue to append\nwithout prompt)")
+            return r in 'aA'
         elif append is False:
             logging.info("Removing existing trace directory %s", directory)
             directory.rmtree()
             directory.mkdir(parents=True)
+        return append
     else:
         if append is True:
             logging.warning("--continue was set but trace doesn't exist yet")
         directory.mkdir()
+        return False
+
 
-    # Runs the trace
+def run_trace(binary, argv, directory, verbosity=1, seccomp=False,
+              event_log=False, preload=False, fanotify=None, events=None,
+              tracer_threads=1, io_volume=False):
+    """Runs the program under trace, writing to the given trace directory.
+    """
     database = directory / 'trace.sqlite3'
     logging.info("Running program")
+    options = dict(seccomp=seccomp, ignored_paths=magic_dirs)
+    if preload:
+        options['preload'] = preload_library()
+    if fanotify:
+        options['fanotify'] = fanotify
+    if events is not None:
+        options['events'] = events
+    if tracer_threads > 1:
+        options['tracer_threads'] = tracer_threads
+    if io_volume:
+        options['io_volume'] = True
     # Might raise _pytracer.Error
-    c = _pytracer.execute(binary, argv, database.path, verbosity)
+    if event_log:
+        eventlog = directory / 'trace.eventlog'
+        c = _pytracer.execute(binary, argv, eventlog.path, verbosity,
+                              event_log=True, **options)
+        logging.info("Writing database from event log")
+        _pytracer.convert_event_log(eventlog.path, database.path, verbosity)
+        eventlog.remove()
+    else:
+        c = _pytracer.execute(binary, argv, database.path, verbosity,
+                              **options)
     if c != 0:
         if c & 0x0100:
             logging.warning("Program appears to have been terminated by "
@@ -346,8 +660,12 @@ def trace(binary, argv, directory, append, verbosity=1):
 
 
 def write_configuration(directory, sort_packages, find_inputs_outputs,
-                        overwrite=False):
+                        overwrite=False, traced=None):
     """Writes the canonical YAML configuration file.
+
+    :param traced: The files, packages, input and output files, if they were
+        already sorted out during the run (see :func:`trace`); else they are
+        read from the database.
     """
     database = directory / 'trace.sqlite3'
 
@@ -358,19 +676,28 @@ def write_configuration(directory, sort_packages, find_inputs_outputs,
         conn = sqlite3.connect(database.path)
     conn.row_factory = sqlite3.Row
 
-    # Reads info from database
-    files, inputs, outputs = get_files(conn)
-
-    # Identifies which file comes from which package
-    if sort_packages:
-        files, packages = identify_packages(files)
+    if traced is not None:
+        files, packages, inputs, outputs = traced
     else:
-        packages = []
+        # Reads info from database
+        files, inputs, outputs = get_files(conn)
+
+        # Identifies which file comes from which package
+        if sort_packages:
+            files, packages = identify_packages(files)
+        else:
+            packages = []
 
     # Writes configuration file
     config = directory / 'config.yml'
     distribution = platform.linux_distribution()[0:2]
     cur = conn.cursor()
+    schema_version, = cur.execute('PRAGMA user_version;').fetchone()
+    if schema_version >= 2:
+        # Environments are stored once, in their own table
+        envp_sql = ('v.envp', 'JOIN environments v ON v.id=e.environment')
+    else:
+        envp_sql = ('e.envp', '')
     if overwrite or not config.exists():
         runs = []
         # This gets all the top-level processes (p.parent ISNULL) and the first
@@ -378,7 +705,7 @@ def write_configuration(directory, sort_packages, find_inputs_outputs,
         # chronological)
         executions = cur.execute(
             '''
-            SELECT e.name, e.argv, e.envp, e.workingdir,
+            SELECT e.name, e.argv, {0}, e.workingdir,
                    p.timestamp, p.exit_timestamp, p.exitcode
             FROM processes p
             JOIN executed_files e ON e.id=(
@@ -387,8 +714,9 @@ def write_configuration(directory, sort_packages, find_inputs_outputs,
                 ORDER BY e2.id
                 LIMIT 1
             )
+            {1}
             WHERE p.parent ISNULL;
-            ''')
+            '''.format(*envp_sql))
     else:
         # Loads in previous config
         runs, oldpkgs, oldfiles = load_config(config,
@@ -398,7 +726,7 @@ def write_configuration(directory, sort_packages, find_inputs_outputs,
         # Same query as previous block but only gets last process
         executions = cur.execute(
             '''
-            SELECT e.name, e.argv, e.envp, e.workingdir,
+            SELECT e.name, e.argv, {0}, e.workingdir,
                    p.timestamp, p.exit_timestamp, p.exitcode
             FROM processes p
             JOIN executed_files e ON e.id=(
@@ -407,10 +735,11 @@ def write_configuration(directory, sort_packages, find_inputs_outputs,
                 ORDER BY e2.id
                 LIMIT 1
             )
+            {1}
             WHERE p.parent ISNULL
             ORDER BY p.id DESC
             LIMIT 1;
-            ''')
+            '''.format(*envp_sql))
     for (r_name, r_argv, r_envp, r_workingdir,
          r_start, r_end, r_exitcode) in executions:
         # Decodes command-line
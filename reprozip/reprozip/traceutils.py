@@ -19,6 +19,32 @@ from reprozip.tracer.trace import TracedFile
 from reprozip.utils import PY3, listvalues
 
 
+# Trace database schema versions (stored as the SQLite user_version):
+# 0: original schema, opened_files is a table
+# 1: paths are stored once in the paths table; file_accesses references them
+#    and opened_files is a view joining the two
+# 2: environments are stored once in the environments table;
+#    executed_files.environment references them instead of an envp column
+# 3: repeated accesses by a process are only stored once, in
+#    file_accesses.last_timestamp and hits
+# 4: the tracer's own counters and timings are stored in tracer_stats
+# 5: syscall latency histograms are stored in syscall_latencies
+# 6: the resources used by processes (getrusage(2) and /proc/<pid>/io) are
+#    stored in processes
+# 7: the bytes read and written through opened files are stored in
+#    file_accesses.bytes_read and bytes_written
+SCHEMA_VERSION = 7
+
+# Columns of processes that are not in all the traces, copied when present
+PROCESS_USAGE_COLUMNS = ['exit_timestamp', 'cpu_time', 'system_time',
+                         'max_rss', 'voluntary_switches',
+                         'involuntary_switches', 'block_reads',
+                         'block_writes', 'io_read', 'io_write']
+
+# Columns of opened_files that are not in all the traces, copied when present
+FILE_IO_COLUMNS = ['bytes_read', 'bytes_written']
+
+
 def create_schema(conn):
     """Create the trace database schema on a given SQLite3 connection.
     """
@@ -29,26 +55,55 @@ def create_schema(conn):
             run_id INTEGER NOT NULL,
             parent INTEGER,
             timestamp INTEGER NOT NULL,
+            exit_timestamp INTEGER,
+            cpu_time INTEGER,
             is_thread BOOLEAN NOT NULL,
-            exitcode INTEGER
+            exitcode INTEGER,
+            system_time INTEGER,
+            max_rss INTEGER,
+            voluntary_switches INTEGER,
+            involuntary_switches INTEGER,
+            block_reads INTEGER,
+            block_writes INTEGER,
+            io_read INTEGER,
+            io_write INTEGER
             );
         ''',
         '''
         CREATE INDEX proc_parent_idx ON processes(parent);
         ''',
         '''
-        CREATE TABLE opened_files(
+        CREATE TABLE paths(
+            id INTEGER NOT NULL PRIMARY KEY,
+            name TEXT NOT NULL UNIQUE
+            );
+        ''',
+        '''
+        CREATE TABLE file_accesses(
             id INTEGER NOT NULL PRIMARY KEY,
             run_id INTEGER NOT NULL,
-            name TEXT NOT NULL,
+            path INTEGER NOT NULL,
             timestamp INTEGER NOT NULL,
             mode INTEGER NOT NULL,
             is_directory BOOLEAN NOT NULL,
-            process INTEGER NOT NULL
+            process INTEGER NOT NULL,
+            last_timestamp INTEGER,
+            hits INTEGER NOT NULL DEFAULT 1,
+            bytes_read INTEGER,
+            bytes_written INTEGER
             );
         ''',
         '''
-        CREATE INDEX open_proc_idx ON opened_files(process);
+        CREATE INDEX open_proc_idx ON file_accesses(process);
+        ''',
+        '''
+        CREATE VIEW opened_files AS
+        SELECT f.id AS id, f.run_id AS run_id, p.name AS name,
+               f.timestamp AS timestamp, f.mode AS mode,
+               f.is_directory AS is_directory, f.process AS process,
+               f.bytes_read AS bytes_read, f.bytes_written AS bytes_written
+        FROM file_accesses f
+        INNER JOIN paths p ON p.id = f.path;
         ''',
         '''
         CREATE TABLE executed_files(
@@ -58,13 +113,47 @@ def create_schema(conn):
             timestamp INTEGER NOT NULL,
             process INTEGER NOT NULL,
             argv TEXT NOT NULL,
-            envp TEXT NOT NULL,
+            environment INTEGER NOT NULL,
             workingdir TEXT NOT NULL
             );
         ''',
         '''
         CREATE INDEX exec_proc_idx ON executed_files(process);
         ''',
+        '''
+        CREATE TABLE environments(
+            id INTEGER NOT NULL PRIMARY KEY,
+            envp TEXT NOT NULL
+            );
+        ''',
+        '''
+        CREATE TABLE tracer_stats(
+            id INTEGER NOT NULL PRIMARY KEY,
+            run_id INTEGER NOT NULL,
+            name TEXT NOT NULL,
+            syscall TEXT NULL,
+            count INTEGER NOT NULL,
+            time INTEGER NULL
+            );
+        ''',
+        '''
+        CREATE TABLE syscall_latencies(
+            id INTEGER NOT NULL PRIMARY KEY,
+            run_id INTEGER NOT NULL,
+            process INTEGER NOT NULL,
+            syscall TEXT NULL,
+            path TEXT NULL,
+            count INTEGER NOT NULL,
+            time INTEGER NOT NULL,
+            histogram TEXT NULL
+            );
+        ''',
+        '''
+        CREATE INDEX latencies_proc_idx ON syscall_latencies(process);
+        ''',
+        '''
+        PRAGMA user_version = %d;
+        ''' % SCHEMA_VERSION,
     ]
     for stmt in sql:
         conn.execute(stmt)
@@ -180,45 +269,125 @@ def combine_traces(traces, target):
 
         # processes
         logging.info("Insert processes...")
+        columns = set(row[1] for row in conn.execute(
+            'PRAGMA trace.table_info(processes);'))
+        usage = ', '.join(c if c in columns else 'NULL AS %s' % c
+                          for c in PROCESS_USAGE_COLUMNS)
         conn.execute(
             '''
             INSERT INTO processes(id, run_id, parent,
-                                       timestamp, is_thread, exitcode)
+                                       timestamp, is_thread, exitcode, %s)
             SELECT p.new AS id, r.new AS run_id, parent,
-                   timestamp, is_thread, exitcode
+                   timestamp, is_thread, exitcode, %s
             FROM trace.processes t
             INNER JOIN maps.map_runs r ON t.run_id = r.old
             INNER JOIN maps.map_processes p ON t.id = p.old
             ORDER BY t.id;
-            ''')
+            ''' % (', '.join(PROCESS_USAGE_COLUMNS), usage))
+
+        version, = conn.execute('PRAGMA trace.user_version;').fetchone()
 
-        # opened_files
+        # opened_files (read through the view if the trace has one)
         logging.info("Insert opened_files...")
         conn.execute(
             '''
-            INSERT INTO opened_files(run_id, name, timestamp,
-                                     mode, is_directory, process)
-            SELECT r.new AS run_id, name, timestamp,
-                   mode, is_directory, p.new AS process
-            FROM trace.opened_files t
+            INSERT INTO paths(name)
+            SELECT name
+            FROM trace.opened_files
+            WHERE name NOT IN (SELECT name FROM paths)
+            GROUP BY name
+            ORDER BY min(id);
+            ''')
+        if version >= 3:
+            opened_files = '''
+                (SELECT o.*, f.last_timestamp AS last_timestamp,
+                        f.hits AS hits
+                 FROM trace.opened_files o
+                 INNER JOIN trace.file_accesses f ON f.id = o.id)
+                '''
+        else:
+            opened_files = '''
+                (SELECT *, timestamp AS last_timestamp, 1 AS hits
+                 FROM trace.opened_files)
+                '''
+        columns = set(row[1] for row in conn.execute(
+            'PRAGMA trace.table_info(opened_files);'))
+        io = ', '.join(c if c in columns else 'NULL AS %s' % c
+                       for c in FILE_IO_COLUMNS)
+        conn.execute(
+            '''
+            INSERT INTO file_accesses(run_id, path, timestamp,
+                                      mode, is_directory, process,
+                                      last_timestamp, hits, {1})
+            SELECT r.new AS run_id, n.id AS path, timestamp,
+                   mode, is_directory, p.new AS process,
+                   last_timestamp, hits, {2}
+            FROM {0} t
+            INNER JOIN paths n ON t.name = n.name
             INNER JOIN maps.map_runs r ON t.run_id = r.old
             INNER JOIN maps.map_processes p ON t.process = p.old
             ORDER BY t.id;
-            ''')
+            '''.format(opened_files, ', '.join(FILE_IO_COLUMNS), io))
 
         # executed_files
         logging.info("Insert executed_files...")
+        if version >= 2:
+            executed_files = '''
+                (SELECT e.id AS id, name, run_id, timestamp, process,
+                        argv, v.envp AS envp, workingdir
+                 FROM trace.executed_files e
+                 INNER JOIN trace.environments v ON v.id = e.environment)
+                '''
+        else:
+            executed_files = 'trace.executed_files'
+        conn.execute(
+            '''
+            INSERT INTO environments(envp)
+            SELECT envp
+            FROM {0}
+            WHERE envp NOT IN (SELECT envp FROM environments)
+            GROUP BY envp
+            ORDER BY min(id);
+            '''.format(executed_files))
         conn.execute(
             '''
             INSERT INTO executed_files(name, run_id, timestamp, process,
-                                       argv, envp, workingdir)
+                                       argv, environment, workingdir)
             SELECT name, r.new AS run_id, timestamp, p.new AS process,
-                   argv, envp, workingdir
-            FROM trace.executed_files t
+                   argv, v.id AS environment, workingdir
+            FROM {0} t
+            INNER JOIN environments v ON t.envp = v.envp
             INNER JOIN maps.map_runs r ON t.run_id = r.old
             INNER JOIN maps.map_processes p ON t.process = p.old
             ORDER BY t.id;
-            ''')
+            '''.format(executed_files))
+
+        # tracer_stats
+        if version >= 4:
+            logging.info("Insert tracer_stats...")
+            conn.execute(
+                '''
+                INSERT INTO tracer_stats(run_id, name, syscall, count, time)
+                SELECT r.new AS run_id, name, syscall, count, time
+                FROM trace.tracer_stats t
+                INNER JOIN maps.map_runs r ON t.run_id = r.old
+                ORDER BY t.id;
+                ''')
+
+        # syscall_latencies
+        if version >= 5:
+            logging.info("Insert syscall_latencies...")
+            conn.execute(
+                '''
+                INSERT INTO syscall_latencies(run_id, process, syscall, path,
+                                              count, time, histogram)
+                SELECT r.new AS run_id, p.new AS process, syscall, path,
+                       count, time, histogram
+                FROM trace.syscall_latencies t
+                INNER JOIN maps.map_runs r ON t.run_id = r.old
+                INNER JOIN maps.map_processes p ON t.process = p.old
+                ORDER BY t.id;
+                ''')
 
         # Flush maps
         conn.execute(
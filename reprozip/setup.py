@@ -19,13 +19,14 @@ if platform.system().lower() != 'linux':
 
 # List the source files
 sources = ['pytracer.c', 'tracer.c', 'syscalls.c', 'database.c',
-           'ptrace_utils.c', 'utils.c', 'log.c']
+           'eventlog.c', 'fanotify.c', 'fdtable.c', 'latency.c',
+           'preload.c', 'ptrace_utils.c', 'stats.c', 'utils.c', 'log.c']
 # They can be found under native/
 sources = [os.path.join('native', n) for n in sources]
 
 
 # Setup the libraries
-libraries = ['sqlite3', 'rt']
+libraries = ['sqlite3', 'rt', 'pthread']
 
 
 # Build the C module
@@ -33,6 +34,12 @@ pytracer = Extension('reprozip._pytracer',
                      sources=sources,
                      libraries=libraries)
 
+# Build the library injected with LD_PRELOAD in the traced programs; it is
+# not a Python module, but this puts it next to the tracer
+preload = Extension('reprozip._preload',
+                    sources=[os.path.join('native', 'preload_lib.c')],
+                    libraries=['dl'])
+
 # Need to specify encoding for PY3, which has the worst unicode handling ever
 with io.open('README.rst', encoding='utf-8') as fp:
     description = fp.read()
@@ -43,7 +50,7 @@ req = [
     'requests']
 setup(name='reprozip',
       version='1.1.0',
-      ext_modules=[pytracer],
+      ext_modules=[pytracer, preload],
       packages=['reprozip', 'reprozip.tracer'],
       entry_points={
           'console_scripts': [
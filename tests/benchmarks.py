@@ -0,0 +1,274 @@
+#!/usr/bin/env python
+
+# Copyright (C) 2014-2016 New York University
+# This file is part of ReproZip which is released under the Revised BSD License
+# See file LICENSE for full license details.
+
+"""Benchmarks for the tracer.
+
+These are not part of the test suite. Run them with::
+
+    python tests/benchmarks.py [name ...]
+
+Each benchmark runs a program natively and under the different tracer
+configurations, and reports the best wall time out of a few runs.
+"""
+
+from __future__ import division, print_function, unicode_literals
+
+import multiprocessing
+import os
+import shutil
+import sqlite3
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from reprozip import _pytracer
+
+
+tests = os.path.dirname(os.path.abspath(__file__))
+
+
+def build(target, sources, args=[]):
+    subprocess.check_call(['/usr/bin/env', 'CFLAGS=', 'cc', '-O2',
+                           '-o', target] +
+                          [os.path.join(tests, s) for s in sources] +
+                          args)
+
+
+def timed(func, repeat=3):
+    """Returns the best wall time of `repeat` calls to `func`.
+    """
+    best = None
+    for i in range(repeat):
+        start = time.time()
+        func()
+        elapsed = time.time() - start
+        if best is None or elapsed < best:
+            best = elapsed
+    return best
+
+
+def run(argv):
+    with open(os.devnull, 'wb') as devnull:
+        subprocess.check_call(argv, stdout=devnull)
+
+
+def trace(argv, filename='bench.sqlite3', **kwargs):
+    database = os.path.abspath(filename)
+    if os.path.exists(database):
+        os.remove(database)
+    r = _pytracer.execute(argv[0], argv, database, 0, **kwargs)
+    if r != 0:
+        raise RuntimeError("Traced program exited with code %d" % r)
+
+
+def report(name, results):
+    print("\n%s" % name)
+    baseline = results[0][1]
+    for label, elapsed in results:
+        print("    %-24s %8.3fs  x%.2f" % (label, elapsed, elapsed / baseline))
+
+
+def bench_seccomp():
+    """Stopping on every syscall vs. seccomp-BPF prefilter.
+    """
+    build('iostorm', ['iostorm.c'])
+    argv = ['./iostorm', '200000']
+    report("seccomp: 200k pipe round-trips, 200 opens", [
+        ("native", timed(lambda: run(argv))),
+        ("ptrace", timed(lambda: trace(argv))),
+        ("ptrace + seccomp", timed(lambda: trace(argv, seccomp=True)))])
+
+
+def bench_writer():
+    """Writing the database from the tracer thread vs. a writer thread.
+    """
+    build('openstorm', ['openstorm.c'])
+    argv = ['./openstorm', '50000']
+    report("writer: 50k recorded opens", [
+        ("native", timed(lambda: run(argv))),
+        ("no writer thread", timed(lambda: trace(argv,
+                                                 writer_thread=False))),
+        ("writer thread", timed(lambda: trace(argv, writer_thread=True)))])
+
+
+def trace_event_log(argv, convert=True):
+    trace(argv, 'bench.eventlog', event_log=True)
+    if convert:
+        database = os.path.abspath('bench.sqlite3')
+        if os.path.exists(database):
+            os.remove(database)
+        _pytracer.convert_event_log(os.path.abspath('bench.eventlog'),
+                                    database, 0)
+
+
+def bench_event_log():
+    """Writing the database during the run vs. converting an event log.
+    """
+    build('openstorm', ['openstorm.c'])
+    argv = ['./openstorm', '50000']
+    report("event log: 50k recorded opens", [
+        ("native", timed(lambda: run(argv))),
+        ("database", timed(lambda: trace(argv, writer_thread=False))),
+        ("event log (run only)", timed(lambda: trace_event_log(argv,
+                                                               False))),
+        ("event log + convert", timed(lambda: trace_event_log(argv)))])
+
+
+def bench_early_resume():
+    """Recording a syscall before resuming the process vs. after.
+
+    With early resume, the lstat() and database work happens while the
+    program runs, so this only pays off if there is a CPU for each.
+    """
+    build('statstorm', ['statstorm.c'])
+    nb_files = 20000
+    argv = ['./statstorm', str(nb_files)]
+    native = timed(lambda: run(argv))
+    results = [
+        ("native", native),
+        ("record, then resume", timed(lambda: trace(argv,
+                                                    early_resume=False))),
+        ("resume, then record", timed(lambda: trace(argv,
+                                                    early_resume=True)))]
+    report("early resume: %d recorded stats" % nb_files, results)
+    for label, elapsed in results[1:]:
+        print("    %-24s %8.1fus per recorded syscall" % (
+              label, (elapsed - native) * 1e6 / nb_files))
+
+
+def bench_preload():
+    """Stopping on the recorded syscalls vs. reporting them from a library.
+
+    The programs go through the C library here, since the library can only
+    see calls made through it.
+    """
+    library = os.path.join(
+        os.path.dirname(os.path.abspath(_pytracer.__file__)),
+        os.path.basename(_pytracer.__file__).replace('_pytracer', '_preload'))
+    build('openstorm_libc', ['openstorm.c'], ['-DUSE_LIBC'])
+    build('statstorm_libc', ['statstorm.c'], ['-DUSE_LIBC'])
+    for argv, name in [(['./openstorm_libc', '50000'], "50k opens"),
+                       (['./statstorm_libc', '20000'], "20k stats")]:
+        report("preload: %s" % name, [
+            ("native", timed(lambda: run(argv))),
+            ("ptrace", timed(lambda: trace(argv))),
+            ("ptrace + seccomp", timed(lambda: trace(argv, seccomp=True))),
+            ("preload", timed(lambda: trace(argv, preload=library)))])
+
+
+def trace_threads(argvs, **kwargs):
+    """Traces the programs at the same time, from one thread each.
+    """
+    threads = [threading.Thread(target=trace, args=(argv,),
+                                kwargs=dict(kwargs,
+                                            filename='bench%d.sqlite3' % i))
+               for i, argv in enumerate(argvs)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+
+def bench_parallel():
+    """Tracing programs one after the other vs. from concurrent threads.
+
+    The concurrent traces can only use as many CPUs as there are.
+    """
+    build('openstorm', ['openstorm.c'])
+    jobs = 4
+    argvs = [['./openstorm', '20000']] * jobs
+    report("parallel: %d programs, 20k recorded opens each (%d CPUs)" % (
+           jobs, multiprocessing.cpu_count()), [
+        ("sequential", timed(lambda: [trace(argv) for argv in argvs])),
+        ("threads", timed(lambda: trace_threads(argvs))),
+        ("threads + seccomp", timed(lambda: trace_threads(argvs,
+                                                          seccomp=True)))])
+
+
+def bench_live_processing():
+    """Reading the trace after the run vs. processing events during it.
+
+    The events are processed from another thread, so this only pays off if
+    there is a CPU for it.
+    """
+    from rpaths import Path
+    from reprozip.tracer.trace import EventProcessor, get_files
+
+    build('statstorm', ['statstorm.c'])
+    argv = ['./statstorm', '20000']
+
+    def after():
+        trace(argv)
+        conn = sqlite3.connect(os.path.abspath('bench.sqlite3'))
+        get_files(conn)
+        conn.close()
+
+    def during():
+        database = os.path.abspath('bench.sqlite3')
+        if os.path.exists(database):
+            os.remove(database)
+        processor = EventProcessor(Path(database), False)
+        trace(argv, events=processor)
+        processor.finish()
+
+    report("live processing: 20k recorded stats", [
+        ("trace only", timed(lambda: trace(argv))),
+        ("trace, then read", timed(after)),
+        ("trace and process", timed(during))])
+
+
+def bench_tracer_threads():
+    """Tracing a wide process tree from one thread vs. several.
+
+    The tracer threads can only use as many CPUs as there are.
+    """
+    build('forkstorm', ['forkstorm.c'])
+    argv = ['./forkstorm', '8', '3', '200']
+    threads = max(multiprocessing.cpu_count(), 2)
+    report("tracer threads: 585 processes, 200 opens each (%d CPUs)" % (
+           multiprocessing.cpu_count()), [
+        ("native", timed(lambda: run(argv))),
+        ("1 thread", timed(lambda: trace(argv))),
+        ("%d threads" % threads, timed(lambda: trace(
+            argv, tracer_threads=threads))),
+        ("1 thread + seccomp", timed(lambda: trace(argv, seccomp=True))),
+        ("%d threads + seccomp" % threads, timed(lambda: trace(
+            argv, seccomp=True, tracer_threads=threads)))])
+
+
+benchmarks = [
+    ('seccomp', bench_seccomp),
+    ('writer', bench_writer),
+    ('event_log', bench_event_log),
+    ('early_resume', bench_early_resume),
+    ('preload', bench_preload),
+    ('parallel', bench_parallel),
+    ('live_processing', bench_live_processing),
+    ('tracer_threads', bench_tracer_threads),
+]
+
+
+def main(names):
+    unknown = set(names) - set(n for n, f in benchmarks)
+    if unknown:
+        sys.stderr.write("Unknown benchmarks: %s\n" % ", ".join(unknown))
+        sys.exit(2)
+    tmp = tempfile.mkdtemp(prefix='reprozip_bench_')
+    cwd = os.getcwd()
+    try:
+        os.chdir(tmp)
+        for name, func in benchmarks:
+            if not names or name in names:
+                func()
+    finally:
+        os.chdir(cwd)
+        shutil.rmtree(tmp, ignore_errors=True)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
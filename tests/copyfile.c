@@ -0,0 +1,54 @@
+/* copyfile.c
+ *
+ * This copies a file with read() and write() calls of a fixed size, so that
+ * the I/O volume recorded by the tracer doesn't depend on what a C library or
+ * coreutils would do.
+ *
+ * usage: ./copyfile <input> <output> [chunk size]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+int main(int argc, char **argv)
+{
+    int in, out;
+    size_t chunk = 131072;
+    char *buffer;
+    ssize_t len;
+    if(argc != 3 && argc != 4)
+    {
+        fprintf(stderr, "usage: %s <input> <output> [chunk size]\n", argv[0]);
+        return 2;
+    }
+    if(argc == 4)
+        chunk = atol(argv[3]);
+    buffer = malloc(chunk);
+    in = open(argv[1], O_RDONLY);
+    out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(in == -1 || out == -1)
+    {
+        perror("open");
+        return 1;
+    }
+    while((len = read(in, buffer, chunk)) > 0)
+    {
+        if(write(out, buffer, len) != len)
+        {
+            perror("write");
+            return 1;
+        }
+    }
+    if(len < 0)
+    {
+        perror("read");
+        return 1;
+    }
+    close(in);
+    close(out);
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,65 @@
+/* forkstorm.c
+ *
+ * This builds a wide tree of processes: every process forks `width` children
+ * until `depth` levels, and each one opens its own binary a number of times
+ * before waiting for its children. Like openstorm, it uses open() directly.
+ *
+ * usage: ./forkstorm [width] [depth] [opens]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+static void work(const char *binary, long opens)
+{
+    long i;
+    for(i = 0; i < opens; ++i)
+    {
+        int fd = syscall(SYS_open, binary, O_RDONLY);
+        if(fd < 0)
+        {
+            perror("open");
+            exit(1);
+        }
+        close(fd);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int width = 8, depth = 3, level = 0, i;
+    long opens = 200;
+    int status, failed = 0;
+    if(argc >= 2)
+        width = atoi(argv[1]);
+    if(argc >= 3)
+        depth = atoi(argv[2]);
+    if(argc >= 4)
+        opens = atol(argv[3]);
+
+    for(i = 0; level < depth && i < width; ++i)
+    {
+        pid_t child = fork();
+        if(child < 0)
+        {
+            perror("fork");
+            return 1;
+        }
+        else if(child == 0)
+        {
+            /* Start over one level down */
+            ++level;
+            i = -1;
+        }
+    }
+    work(argv[0], opens);
+    while(wait(&status) > 0)
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = 1;
+    return failed;
+}
@@ -13,8 +13,10 @@ from rpaths import Path, unicode
 import sqlite3
 import subprocess
 import sys
+import time
 import yaml
 
+from reprounzip.common import FILE_READ, FILE_WRITE, FILE_WDIR
 from reprounzip.unpackers.common import join_root
 from reprounzip.utils import PY3, stderr_bytes, stderr, download_file
 
@@ -58,6 +60,23 @@ def check_call(args):
     return subprocess.check_call(args)
 
 
+@print_arg_list
+def check_call_timeout(args, timeout):
+    """Like check_call(), but kills the command if it runs too long.
+    """
+    p = subprocess.Popen(args)
+    deadline = time.time() + timeout
+    while p.poll() is None:
+        if time.time() > deadline:
+            p.kill()
+            p.wait()
+            raise AssertionError("Command timed out after %d seconds" %
+                                 timeout)
+        time.sleep(0.1)
+    if p.returncode != 0:
+        raise subprocess.CalledProcessError(p.returncode, args)
+
+
 @print_arg_list
 def check_output(args, stream='out'):
     if stream == 'out':
@@ -91,6 +110,17 @@ def build(target, sources, args=[]):
                args)
 
 
+def open_trace(directory):
+    """Opens the database of the trace in the given directory.
+    """
+    database = Path.cwd() / directory / 'trace.sqlite3'
+    if PY3:
+        # On PY3, connect() only accepts unicode
+        return sqlite3.connect(str(database))
+    else:
+        return sqlite3.connect(database.path)
+
+
 def same_files(file1, file2, CHUNK_SIZE=4096):
     """Compare two files.
     """
@@ -525,6 +555,30 @@ def functional_tests(raise_warnings, interactive, run_vagrant, run_docker):
     assert any(b'successfully exec\'d /bin/echo' in l
                for l in output.splitlines())
 
+    # ########################################
+    # 'manythreads' program: trace
+    # Stresses the process table with 10k live threads
+    #
+
+    # Build
+    build('manythreads', ['manythreads.c'], ['-lpthread'])
+    # Trace
+    check_call(rpz + ['trace', '--overwrite', '-d', 'manythreads-trace',
+                      '--dont-identify-packages',
+                      './manythreads', '10000'])
+    conn = open_trace('manythreads-trace')
+    nb_threads, = next(conn.execute(
+        '''
+        SELECT COUNT(*) FROM processes WHERE is_thread;
+        '''))
+    assert nb_threads == 10001
+    executed = [r[0] for r in conn.execute(
+        '''
+        SELECT name FROM executed_files ORDER BY id;
+        ''')]
+    assert executed[-1] == '/bin/echo'
+    conn.close()
+
     # ########################################
     # 'segv' program: testrun
     #
@@ -622,19 +676,15 @@ def functional_tests(raise_warnings, interactive, run_vagrant, run_docker):
     with Path('rename-trace/config.yml').open(encoding='utf-8') as fp:
         config = yaml.safe_load(fp)
     # Check that written files were logged
-    database = Path.cwd() / 'rename-trace/trace.sqlite3'
-    if PY3:
-        # On PY3, connect() only accepts unicode
-        conn = sqlite3.connect(str(database))
-    else:
-        conn = sqlite3.connect(database.path)
+    conn = open_trace('rename-trace')
     conn.row_factory = sqlite3.Row
     rows = conn.execute(
         '''
         SELECT name FROM opened_files
         ''')
     files = set(Path(r[0]) for r in rows)
-    for n in ('dir1/file', 'dir2/file', 'dir2/brokensymlink', 'dir2/symlink'):
+    for n in ('dir1/file', 'dir2/file', 'dir2/brokensymlink', 'dir2/symlink',
+              'dir1/atfile', 'dir2/atlink'):
         if (Path.cwd() / n) not in files:
             raise AssertionError("Missing file: %s" % (Path.cwd() / n))
     conn.close()
@@ -644,6 +694,301 @@ def functional_tests(raise_warnings, interactive, run_vagrant, run_docker):
             raise AssertionError("Created file shouldn't be packed: %s" %
                                  Path(f))
 
+    # ########################################
+    # 'exec_echo' program: trace with seccomp filter
+    #
+
+    def traced_events(directory):
+        conn = open_trace(directory)
+        events = set(conn.execute(
+            '''
+            SELECT 'open', name, mode FROM opened_files
+            UNION ALL
+            SELECT 'exec', name, argv FROM executed_files;
+            '''))
+        conn.close()
+        return events
+
+    check_call(rpz + ['trace', '--overwrite', '-d', 'ptrace-trace',
+                      '--dont-identify-packages',
+                      './exec_echo', 'seccomptest'])
+    check_call(rpz + ['trace', '--overwrite', '-d', 'seccomp-trace',
+                      '--dont-identify-packages', '--seccomp',
+                      './exec_echo', 'seccomptest'])
+    assert traced_events('seccomp-trace') == traced_events('ptrace-trace')
+
+    # ########################################
+    # 'exec_echo' program: trace to binary event log
+    #
+
+    check_call(rpz + ['trace', '--overwrite', '-d', 'eventlog-trace',
+                      '--dont-identify-packages', '--event-log',
+                      './exec_echo', 'seccomptest'])
+    assert not Path('eventlog-trace/trace.eventlog').exists()
+    assert traced_events('eventlog-trace') == traced_events('ptrace-trace')
+
+    # Both executions have the same environment, which is only stored once
+    conn = open_trace('ptrace-trace')
+    environments = list(conn.execute(
+        '''
+        SELECT environment FROM executed_files ORDER BY id;
+        '''))
+    nb_environments, = next(conn.execute(
+        '''
+        SELECT COUNT(*) FROM environments;
+        '''))
+    # Repeated accesses are only stored once, e.g. the working directory,
+    # which is recorded when the process starts and again on execve
+    repeated = list(conn.execute(
+        '''
+        SELECT COUNT(*) FROM file_accesses
+        GROUP BY process, path, mode
+        HAVING COUNT(*) > 1;
+        '''))
+    wd_hits, = next(conn.execute(
+        '''
+        SELECT hits FROM opened_files o
+        INNER JOIN file_accesses f ON f.id = o.id
+        WHERE o.name = ? AND o.mode = ?;
+        ''',
+        ('%s' % Path.cwd(), FILE_WDIR)))
+    conn.close()
+    assert len(environments) == 2
+    assert environments[0] == environments[1]
+    assert nb_environments == 1
+    assert not repeated
+    assert wd_hits >= 2
+
+    # ########################################
+    # 'simple' program: trace with the preloaded library
+    #
+
+    def traced_files(directory):
+        conn = open_trace(directory)
+        files = set(conn.execute(
+            '''
+            SELECT name, mode FROM opened_files;
+            '''))
+        executed = set(name for name, in conn.execute(
+            '''
+            SELECT name FROM executed_files;
+            '''))
+        conn.close()
+        return files, executed
+
+    # Dynamically-linked: accesses are reported by the library
+    build('preload_simple', ['simple.c'])
+    for directory, flags in [('ptrace-trace', []),
+                             ('preload-trace', ['--preload'])]:
+        check_call(rpz + ['trace', '--overwrite', '-d', directory,
+                          '--dont-identify-packages'] + flags +
+                   ['./preload_simple', (tests / 'simple_input.txt').path,
+                    'preload_output.txt'])
+    files, executed = traced_files('preload-trace')
+    assert ('%s' % (tests / 'simple_input.txt'), FILE_READ) in files
+    assert ('%s' % (Path.cwd() / 'preload_output.txt'), FILE_WRITE) in files
+    assert executed == traced_files('ptrace-trace')[1]
+    # Statically-linked: the library can't be loaded, the tracer falls back
+    # to stopping on every syscall
+    build('preload_static', ['simple.c'], ['-static'])
+    for directory, flags in [('ptrace-trace', []),
+                             ('preload-trace', ['--preload'])]:
+        check_call(rpz + ['trace', '--overwrite', '-d', directory,
+                          '--dont-identify-packages'] + flags +
+                   ['./preload_static', (tests / 'simple_input.txt').path,
+                    'preload_output.txt'])
+    assert traced_files('preload-trace') == traced_files('ptrace-trace')
+
+    # ########################################
+    # 'simple' program: trace with fanotify
+    #
+
+    if os.getuid() == 0:
+        mount = Path.cwd() / 'fanotify-mount'
+        mount.mkdir()
+        check_call(['mount', '-t', 'tmpfs', 'none', mount.path])
+        try:
+            (Path.cwd() / 'preload_simple').copy(mount / 'simple')
+            (tests / 'simple_input.txt').copy(mount / 'input.txt')
+            check_call(rpz + ['trace', '--overwrite', '-d', 'fanotify-trace',
+                              '--dont-identify-packages',
+                              '--fanotify', mount.path,
+                              (mount / 'simple').path,
+                              (mount / 'input.txt').path,
+                              (mount / 'output.txt').path])
+            files, executed = traced_files('fanotify-trace')
+            assert ('%s' % (mount / 'input.txt'), FILE_READ) in files
+            assert ('%s' % (mount / 'output.txt'), FILE_WRITE) in files
+            assert ('%s' % (mount / 'simple'), FILE_READ) in files
+        finally:
+            check_call(['umount', mount.path])
+    else:
+        print("Can't try fanotify: not running as root")
+
+    # ########################################
+    # Trace several programs at once
+    #
+
+    with Path('parallel.txt').open('w') as fp:
+        fp.write('# Comments and empty lines are skipped\n\n')
+        for i in range(3):
+            fp.write('./preload_simple %s parallel_%d.txt\n' % (
+                     tests / 'simple_input.txt', i))
+    check_call(rpz + ['trace', '--overwrite', '-d', 'parallel-trace',
+                      '--dont-identify-packages', '--preload',
+                      '--parallel', 'parallel.txt', '-j', '2'])
+    for i in range(3):
+        files, executed = traced_files('parallel-trace/%d' % i)
+        assert ('%s' % (tests / 'simple_input.txt'), FILE_READ) in files
+        assert ('%s' % (Path.cwd() / ('parallel_%d.txt' % i)),
+                FILE_WRITE) in files
+        assert not any(n.startswith('%s' % (Path.cwd() / 'parallel_')) and
+                       n != '%s' % (Path.cwd() / ('parallel_%d.txt' % i))
+                       for n, m in files)
+        assert (Path.cwd() / ('parallel-trace/%d/config.yml' % i)).is_file()
+
+    # ########################################
+    # Sort out the files while the program runs
+    #
+
+    def load_trace_config(directory):
+        with Path(directory, 'config.yml').open(encoding='utf-8') as fp:
+            config = yaml.safe_load(fp)
+        for run in config['runs']:
+            del run['walltime']
+        return config
+
+    for directory, flags in [('batch-trace', []),
+                             ('live-trace', ['--live-processing'])]:
+        check_call(rpz + ['trace', '--overwrite', '-d', directory] + flags +
+                   ['./preload_simple', (tests / 'simple_input.txt').path,
+                    'live_output.txt'])
+    assert load_trace_config('live-trace') == load_trace_config('batch-trace')
+
+    # ########################################
+    # 'forkstorm' program: trace from several threads
+    #
+
+    def traced_processes(directory):
+        conn = open_trace(directory)
+        count, = conn.execute(
+            '''
+            SELECT COUNT(*) FROM processes WHERE exitcode = 0;
+            ''').fetchone()
+        conn.close()
+        return count
+
+    def syscall_stops(directory, syscall):
+        conn = open_trace(directory)
+        count, = conn.execute(
+            '''
+            SELECT sum(count) FROM tracer_stats
+            WHERE name = 'syscall_entry' AND syscall = ?;
+            ''',
+            (syscall,)).fetchone()
+        conn.close()
+        return count
+
+    def syscall_latencies(directory, syscall):
+        conn = open_trace(directory)
+        count, = conn.execute(
+            '''
+            SELECT sum(count) FROM syscall_latencies
+            WHERE syscall = ? AND path IS NULL;
+            ''',
+            (syscall,)).fetchone()
+        conn.close()
+        return count
+
+    def processes_with_usage(directory):
+        conn = open_trace(directory)
+        count, = conn.execute(
+            '''
+            SELECT count(*) FROM processes
+            WHERE system_time IS NOT NULL AND max_rss > 0
+                AND io_read IS NOT NULL;
+            ''').fetchone()
+        conn.close()
+        return count
+
+    build('forkstorm', ['forkstorm.c'])
+    for directory, flags in [('forkstorm-trace', []),
+                             ('shards-trace', ['--tracer-threads', '3',
+                                               '--stats'])]:
+        check_call(rpz + ['trace', '--overwrite', '-d', directory,
+                          '--dont-identify-packages'] + flags +
+                   ['./forkstorm', '3', '2', '20'])
+    assert traced_processes('forkstorm-trace') == 13
+    assert traced_processes('shards-trace') == 13
+    assert traced_events('shards-trace') == traced_events('forkstorm-trace')
+    # The tracer threads' counters are all recorded
+    assert syscall_stops('forkstorm-trace', 'open') >= 13 * 20
+    assert (syscall_stops('shards-trace', 'open') ==
+            syscall_stops('forkstorm-trace', 'open'))
+    # Every open() that was stopped on got its latency measured
+    assert (syscall_latencies('forkstorm-trace', 'open') ==
+            syscall_stops('forkstorm-trace', 'open'))
+    assert (syscall_latencies('shards-trace', 'open') ==
+            syscall_latencies('forkstorm-trace', 'open'))
+    check_call(rpuz + ['report', '-d', 'forkstorm-trace'])
+    # The resources used by each process are recorded when it exits
+    assert processes_with_usage('forkstorm-trace') == 13
+    assert processes_with_usage('shards-trace') == 13
+    # Processes are handed between tracer threads with a stop, which used to
+    # hang the trace now and then; do it many times
+    for i in range(10):
+        for flags in [[], ['--seccomp']]:
+            check_call_timeout(rpz + ['trace', '--overwrite', '-d',
+                                      'handoff-trace',
+                                      '--dont-identify-packages',
+                                      '--tracer-threads', '4'] + flags +
+                               ['./forkstorm', '4', '2', '5'],
+                               120)
+            assert traced_processes('handoff-trace') == 21
+
+    # ########################################
+    # 'copyfile' program: count the bytes read and written through each file
+    #
+
+    build('copyfile', ['copyfile.c'])
+
+    def file_io(directory, name):
+        conn = open_trace(directory)
+        rows = conn.execute(
+            '''
+            SELECT bytes_read, bytes_written FROM opened_files
+            WHERE name = ?;
+            ''',
+            (str(Path.cwd() / name),)).fetchall()
+        conn.close()
+        return rows
+
+    with Path('io_in.txt').open('wb') as fp:
+        fp.write(b'0123456789' * 26214 + b'0123')
+    for directory, flags in [('io-trace', ['--io-volume']),
+                             ('io-seccomp-trace', ['--io-volume',
+                                                   '--seccomp'])]:
+        # Every call moves 128 KiB, so --seccomp counts all of them
+        check_call(rpz + ['trace', '--overwrite', '-d', directory,
+                          '--dont-identify-packages'] + flags +
+                   ['./copyfile', 'io_in.txt', 'io_out.txt', '131072'])
+        assert file_io(directory, 'io_in.txt') == [(262144, 0)]
+        assert file_io(directory, 'io_out.txt') == [(0, 262144)]
+    # With --seccomp, calls under IO_VOLUME_MIN_SIZE are not counted
+    check_call(rpz + ['trace', '--overwrite', '-d', 'io-trace',
+                      '--dont-identify-packages', '--io-volume',
+                      './copyfile', 'io_in.txt', 'io_out.txt', '4096'])
+    assert file_io('io-trace', 'io_in.txt') == [(262144, 0)]
+    check_call(rpz + ['trace', '--overwrite', '-d', 'io-seccomp-trace',
+                      '--dont-identify-packages', '--io-volume', '--seccomp',
+                      './copyfile', 'io_in.txt', 'io_out.txt', '4096'])
+    assert file_io('io-seccomp-trace', 'io_in.txt') == [(0, 0)]
+    # Not counted without the flag
+    check_call(rpz + ['trace', '--overwrite', '-d', 'io-trace',
+                      '--dont-identify-packages',
+                      './copyfile', 'io_in.txt', 'io_out.txt'])
+    assert file_io('io-trace', 'io_in.txt') == [(None, None)]
+
     # ########################################
     # Test shebang corner-cases
     #
@@ -673,12 +1018,7 @@ def functional_tests(raise_warnings, interactive, run_vagrant, run_docker):
                       if f.startswith('%s/' % Path.cwd()))
 
     # Check database
-    database = Path.cwd() / 'shebang-trace/trace.sqlite3'
-    if PY3:
-        # On PY3, connect() only accepts unicode
-        conn = sqlite3.connect(str(database))
-    else:
-        conn = sqlite3.connect(database.path)
+    conn = open_trace('shebang-trace')
     conn.row_factory = sqlite3.Row
     rows = conn.execute(
         '''
@@ -0,0 +1,42 @@
+/* iostorm.c
+ *
+ * This does a lot of small reads and writes through a pipe, and opens a file
+ * every once in a while. Most of its syscalls are not recorded by the tracer.
+ *
+ * usage: ./iostorm [iterations]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+int main(int argc, char **argv)
+{
+    int fds[2];
+    long i, iterations = 100000;
+    char c = 'x';
+    if(argc == 2)
+        iterations = atol(argv[1]);
+    if(pipe(fds) == -1)
+    {
+        perror("pipe");
+        return 1;
+    }
+    for(i = 0; i < iterations; ++i)
+    {
+        if(write(fds[1], &c, 1) != 1 || read(fds[0], &c, 1) != 1)
+        {
+            perror("pipe I/O");
+            return 1;
+        }
+        if(i % 1000 == 0)
+        {
+            int fd = open(argv[0], O_RDONLY);
+            if(fd != -1)
+                close(fd);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,62 @@
+/* manythreads.c
+ *
+ * This starts a lot of threads that stay alive at the same time, then executes
+ * /bin/echo from one of them (replacing the whole thread group).
+ *
+ * usage: ./manythreads [nthreads]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static pthread_barrier_t barrier;
+
+void *func_wait(void *param)
+{
+    struct stat buf;
+    stat(".", &buf);
+    pthread_barrier_wait(&barrier);
+    for(;;)
+        pause();
+    return NULL;
+}
+
+void *func_exec(void *param)
+{
+    char *argv[3] = {"echo", "manythreads", NULL};
+    execvp("/bin/echo", argv);
+    perror("execvp");
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int i, nthreads = 10000;
+    pthread_attr_t attr;
+    pthread_t th;
+    if(argc == 2)
+        nthreads = atoi(argv[1]);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + 16384);
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for(i = 0; i < nthreads; ++i)
+    {
+        if(pthread_create(&th, &attr, func_wait, NULL) != 0)
+        {
+            fprintf(stderr, "Couldn't create thread %d\n", i);
+            return 1;
+        }
+    }
+    pthread_barrier_wait(&barrier);
+
+    pthread_create(&th, &attr, func_exec, NULL);
+    pthread_join(th, NULL);
+    /* Won't be reached */
+    return 2;
+}
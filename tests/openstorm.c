@@ -0,0 +1,55 @@
+/* openstorm.c
+ *
+ * This opens a lot of different files, so every syscall it makes is recorded
+ * by the tracer. It uses open() directly rather than the openat() libc emits,
+ * unless built with -DUSE_LIBC.
+ *
+ * usage: ./openstorm [iterations]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+#define NB_FILES 100
+
+
+int main(int argc, char **argv)
+{
+    long i, iterations = 100000;
+    char name[32];
+    if(argc == 2)
+        iterations = atol(argv[1]);
+    for(i = 0; i < NB_FILES; ++i)
+    {
+        FILE *fp;
+        sprintf(name, "openstorm_%ld.txt", i);
+        fp = fopen(name, "w");
+        if(fp == NULL)
+        {
+            perror("fopen");
+            return 1;
+        }
+        fclose(fp);
+    }
+    for(i = 0; i < iterations; ++i)
+    {
+        int fd;
+        sprintf(name, "openstorm_%ld.txt", i % NB_FILES);
+#if defined(SYS_open) && !defined(USE_LIBC)
+        fd = syscall(SYS_open, name, O_RDONLY);
+#else
+        fd = open(name, O_RDONLY);
+#endif
+        if(fd == -1)
+        {
+            perror("open");
+            return 1;
+        }
+        close(fd);
+    }
+    return 0;
+}
@@ -3,11 +3,16 @@
  * This is a very simple program that creates a file, renames it, and opens the
  * renamed files. It tests the handler for rename(2) & co: the renamed file
  * shouldn't be packed, but it would be if the handler didn't behave correctly.
+ * The *at() variants are called with AT_FDCWD, which the C library passes in
+ * a register without sign-extending it.
  *
  * usage: ./rename
  */
 
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 int main(int argc, char **argv)
@@ -35,5 +40,15 @@ int main(int argc, char **argv)
     if(symlink("dir1", "dir2/symlink") == -1)
         return 1;
 
+    /* *at() variants, relative to the working directory */
+    {
+        int fd = openat(AT_FDCWD, "dir1/atfile", O_WRONLY | O_CREAT, 0644);
+        if(fd == -1)
+            return 1;
+        close(fd);
+        if(linkat(AT_FDCWD, "dir1/atfile", AT_FDCWD, "dir2/atlink", 0) == -1)
+            return 1;
+    }
+
     return 0;
 }
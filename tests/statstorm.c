@@ -0,0 +1,57 @@
+/* statstorm.c
+ *
+ * This creates a lot of files, then stats each of them once with stat(), so
+ * that every one of these syscalls is a new access the tracer has to record.
+ * Files are created through openat(), which the tracer doesn't record. Build
+ * with -DUSE_LIBC to stat() through the C library rather than the raw syscall.
+ *
+ * usage: ./statstorm [files]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+int main(int argc, char **argv)
+{
+    long i, nb_files = 20000;
+    char name[32];
+    struct stat st;
+    if(argc == 2)
+        nb_files = atol(argv[1]);
+    for(i = 0; i < nb_files; ++i)
+    {
+        int fd;
+        sprintf(name, "statstorm_%ld.txt", i);
+        fd = openat(AT_FDCWD, name, O_WRONLY | O_CREAT, 0644);
+        if(fd == -1)
+        {
+            perror("openat");
+            return 1;
+        }
+        close(fd);
+    }
+    for(i = 0; i < nb_files; ++i)
+    {
+        sprintf(name, "statstorm_%ld.txt", i);
+#if defined(SYS_stat) && !defined(USE_LIBC)
+        if(syscall(SYS_stat, name, &st) != 0)
+#else
+        if(stat(name, &st) != 0)
+#endif
+        {
+            perror("stat");
+            return 1;
+        }
+    }
+    for(i = 0; i < nb_files; ++i)
+    {
+        sprintf(name, "statstorm_%ld.txt", i);
+        unlinkat(AT_FDCWD, name, 0);
+    }
+    return 0;
+}
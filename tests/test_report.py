@@ -0,0 +1,76 @@
+# Copyright (C) 2014-2016 New York University
+# This file is part of ReproZip which is released under the Revised BSD License
+# See file LICENSE for full license details.
+
+from __future__ import print_function, unicode_literals
+
+from rpaths import Path
+import unittest
+
+from reprounzip.unpackers import report
+
+from tests.common import make_database
+
+
+class TestReport(unittest.TestCase):
+    """Reads latencies from a fabricated trace database."""
+    @classmethod
+    def setUpClass(cls):
+        cls._trace = Path.tempdir(prefix='rpz_testdb_')
+        conn = make_database([
+            ('proc', 0, None, False),
+            ('proc', 1, 0, False),
+        ], cls._trace / 'trace.sqlite3')
+        conn.execute(
+            '''
+            CREATE TABLE syscall_latencies(
+                id INTEGER NOT NULL PRIMARY KEY,
+                run_id INTEGER NOT NULL,
+                process INTEGER NOT NULL,
+                syscall TEXT NULL,
+                path TEXT NULL,
+                count INTEGER NOT NULL,
+                time INTEGER NOT NULL,
+                histogram TEXT NULL
+                );
+            ''')
+        conn.executemany(
+            '''
+            INSERT INTO syscall_latencies(run_id, process, syscall, path,
+                                          count, time, histogram)
+            VALUES(0, ?, ?, ?, ?, ?, ?);
+            ''',
+            [(0, 'open', None, 3, 6000, '0:1 1024:1 4096:1'),
+             (1, 'open', None, 1, 40000, '32768:1'),
+             (0, 'read', None, 10, 10000, '0:10'),
+             (0, None, '/data', 3, 45000, '1024:2 32768:1'),
+             (1, None, '/etc', 1, 1000, '0:1'),
+             (0, 'open', '/data/big', 1, 40000, None),
+             (0, 'open', '/data/small', 1, 3000, None)])
+        conn.execute('PRAGMA user_version = 5;')
+        conn.commit()
+        conn.close()
+
+    @classmethod
+    def tearDownClass(cls):
+        cls._trace.rmtree()
+
+    def test_histogram(self):
+        buckets = report.parse_histogram('0:2 1024:1 4096:3 40960:1')
+        self.assertEqual(buckets, {0: 2, 1024: 1, 4096: 3, 40960: 1})
+        self.assertEqual([report.bucket_upper(b) for b in sorted(buckets)],
+                         [1024, 1280, 5120, 49152])
+        self.assertEqual(report.percentile(buckets, 0.5), 5120)
+        self.assertEqual(report.percentile(buckets, 1.0), 49152)
+
+    def test_read(self):
+        syscalls, directories, calls = report.read_latencies(
+            self._trace / 'trace.sqlite3')
+        self.assertEqual([(l.name, l.count, l.time) for l in syscalls],
+                         [('open', 4, 46000), ('read', 10, 10000)])
+        self.assertEqual(syscalls[0].buckets,
+                         {0: 1, 1024: 1, 4096: 1, 32768: 1})
+        self.assertEqual([(l.name, l.count, l.time) for l in directories],
+                         [('/data', 3, 45000), ('/etc', 1, 1000)])
+        self.assertEqual(calls, [(40000, 'open', '/data/big'),
+                                 (3000, 'open', '/data/small')])
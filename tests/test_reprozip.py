@@ -12,6 +12,7 @@ import sys
 import unittest
 
 from reprozip.common import FILE_READ, FILE_WRITE, FILE_WDIR, InputOutputFile
+from reprozip.tracer import trace
 from reprozip.tracer.trace import get_files, compile_inputs_outputs
 from reprozip import traceutils
 from reprozip.utils import PY3, unicode_, UniqueNames, make_dir_writable
@@ -67,6 +68,29 @@ class TestReprozip(unittest.TestCase):
             (tmp / 'some' / 'complete' / 'path').chmod(0o755)
             tmp.rmtree()
 
+    def test_prepare_directory(self):
+        """Tests prepare_directory with an existing trace."""
+        old_prompt = trace.tty_prompt
+        tmp = Path.tempdir()
+        try:
+            (tmp / 'trace' / '0').mkdir(parents=True)
+            self.assertTrue(trace.prepare_directory(tmp / 'trace', True))
+            self.assertTrue((tmp / 'trace' / '0').exists())
+            trace.tty_prompt = lambda prompt, chars: 'a'
+            self.assertTrue(trace.prepare_directory(tmp / 'trace', None))
+            self.assertTrue((tmp / 'trace' / '0').exists())
+            trace.tty_prompt = lambda prompt, chars: 'd'
+            self.assertFalse(trace.prepare_directory(tmp / 'trace', None))
+            self.assertFalse((tmp / 'trace' / '0').exists())
+            (tmp / 'trace' / '0').mkdir()
+            self.assertFalse(trace.prepare_directory(tmp / 'trace', False))
+            self.assertFalse((tmp / 'trace' / '0').exists())
+            self.assertFalse(trace.prepare_directory(tmp / 'new', True))
+            self.assertTrue((tmp / 'new').is_dir())
+        finally:
+            trace.tty_prompt = old_prompt
+            tmp.rmtree()
+
     @unittest.skipIf(sys.version_info < (2, 7, 3),
                      "Python version not supported by reprozip")
     def test_argparse(self):
@@ -323,7 +347,10 @@ INSERT INTO "executed_files" VALUES(1,'/bin/false',0,12345678903002,0,'false',
             '''))
         executed_files = list(conn.execute(
             '''
-            SELECT * FROM executed_files;
+            SELECT e.id, name, run_id, timestamp, process, argv, v.envp,
+                   workingdir
+            FROM executed_files e
+            INNER JOIN environments v ON v.id = e.environment;
             '''))
 
         self.assertEqual([processes, opened_files, executed_files], [